@@ -37,6 +37,15 @@ const char LO_RESULT_CODE[] = "any-uuid";
 const char LO_CODE_SYSTEM[] = "any-uuid";
 const char DEVICE_ID[] = "ACCOUNT:UUID";
 
+// Optional: observation batching (see src/main.cpp for the defaults)
+// #define OBSERVATION_BATCH_SIZE 10
+// #define OBSERVATION_BATCH_LINGER_MS 5000
+
+// Optional: observations awaiting a FHIRIngest reply, and their retries
+// #define FHIR_INGEST_WINDOW_SIZE 4
+// #define FHIR_INGEST_REPLY_TIMEOUT_MS 10000
+// #define FHIR_INGEST_MAX_ATTEMPTS 3
+
 // Device Certificate
 static const char LO_DEVICE_CERTIFICATE[] PROGMEM = R"KEY(
 -----BEGIN CERTIFICATE-----
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// A button event recorded for the diagnostic file.
+struct DiagnosticRecord
+{
+  uint32_t timestampMs;
+  char label[5]; // e.g. "BtnA"
+  bool success;
+};
+
+enum DiagnosticOverflowPolicy
+{
+  // Overwrite the oldest record; the log always holds the latest events.
+  DropOldest,
+  // Refuse new records; the log keeps the events that led up to the problem.
+  DropNewest
+};
+
+// Preallocated ring of diagnostic records. Records are only rendered to text
+// when the diagnostic file is uploaded, so memory use is fixed no matter how
+// long the device stays offline.
+template <size_t Capacity>
+class DiagnosticLog
+{
+public:
+  explicit DiagnosticLog(DiagnosticOverflowPolicy policy = DropOldest) : policy(policy) {}
+
+  void record(uint32_t timestampMs, const char *label, bool success)
+  {
+    if (count == Capacity)
+    {
+      dropped++;
+      if (policy == DropNewest)
+      {
+        return;
+      }
+      head = (head + 1) % Capacity;
+      count--;
+    }
+    DiagnosticRecord &r = records[(head + count) % Capacity];
+    r.timestampMs = timestampMs;
+    snprintf(r.label, sizeof(r.label), "%s", label);
+    r.success = success;
+    count++;
+  }
+
+  // Renders record `index` (0 = oldest) as one line of text. Returns the
+  // length of the line; with a NULL buffer only the length is computed.
+  size_t render(size_t index, char *buffer, size_t capacity) const
+  {
+    const DiagnosticRecord &r = records[(head + index) % Capacity];
+    int n = snprintf(buffer, capacity, "%lu Btn=%s;result=%s\n", (unsigned long)r.timestampMs, r.label,
+                     r.success ? "success" : "fail");
+    return n < 0 ? 0 : (size_t)n;
+  }
+
+  // Total length of the rendered log, used as the upload Content-Length.
+  size_t renderedLength(size_t records) const
+  {
+    size_t total = 0;
+    for (size_t i = 0; i < records; i++)
+    {
+      total += render(i, NULL, 0);
+    }
+    return total;
+  }
+
+  // Removes the `n` oldest records, e.g. after they were uploaded.
+  void discard(size_t n)
+  {
+    if (n > count)
+    {
+      n = count;
+    }
+    head = (head + n) % Capacity;
+    count -= n;
+  }
+
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  uint32_t droppedRecords() const { return dropped; }
+
+private:
+  DiagnosticRecord records[Capacity];
+  size_t head = 0;
+  size_t count = 0;
+  uint32_t dropped = 0;
+  DiagnosticOverflowPolicy policy;
+};
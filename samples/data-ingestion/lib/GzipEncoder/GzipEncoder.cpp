@@ -0,0 +1,238 @@
+#include "GzipEncoder.h"
+
+#include <string.h>
+
+static const uint16_t LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27,
+                                         31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                         2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t DISTANCE_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+                                           193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t DISTANCE_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+                                           6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t length)
+{
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++)
+  {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++)
+    {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+GzipEncoder::GzipEncoder(Sink sink, void *context) : sink(sink), context(context)
+{
+  reset();
+}
+
+void GzipEncoder::reset()
+{
+  memset(head, 0, sizeof(head));
+  fill = 0;
+  pos = 0;
+  bitBuffer = 0;
+  bitCount = 0;
+  outLength = 0;
+  crc = 0;
+  inputSize = 0;
+  outputSize = 0;
+
+  // gzip header: deflate, no flags, no mtime, unknown OS.
+  static const uint8_t header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff};
+  for (size_t i = 0; i < sizeof(header); i++)
+  {
+    emit(header[i]);
+  }
+  // The whole stream is one final block with the fixed Huffman codes.
+  bits(1, 1);
+  bits(1, 2);
+}
+
+void GzipEncoder::write(const uint8_t *data, size_t length)
+{
+  crc = crc32Update(crc, data, length);
+  inputSize += length;
+  while (length > 0)
+  {
+    if (fill == BUFFER_SIZE)
+    {
+      // Keep WINDOW bytes of history and slide the rest out.
+      size_t shift = pos - WINDOW;
+      memmove(buffer, buffer + shift, fill - shift);
+      fill -= shift;
+      pos -= shift;
+      for (size_t i = 0; i < (1 << HASH_BITS); i++)
+      {
+        head[i] = head[i] > shift ? head[i] - shift : 0;
+      }
+    }
+    size_t n = BUFFER_SIZE - fill < length ? BUFFER_SIZE - fill : length;
+    memcpy(buffer + fill, data, n);
+    fill += n;
+    data += n;
+    length -= n;
+    encode(false);
+  }
+  drain();
+}
+
+void GzipEncoder::finish()
+{
+  encode(true);
+  huffman(0, 7); // end of block (256)
+  flushBits();
+  for (int i = 0; i < 32; i += 8)
+  {
+    emit((crc >> i) & 0xFF);
+  }
+  for (int i = 0; i < 32; i += 8)
+  {
+    emit((inputSize >> i) & 0xFF);
+  }
+  drain();
+}
+
+// Greedy LZ77: at each position take the most recent earlier occurrence of
+// the next three bytes (if it is inside the window) and extend it.
+// Unless `final`, MAX_MATCH bytes of lookahead are kept for the next write().
+void GzipEncoder::encode(bool final)
+{
+  while (pos < fill && (final || fill - pos >= MAX_MATCH))
+  {
+    size_t available = fill - pos;
+    if (available < MIN_MATCH)
+    {
+      literal(buffer[pos++]);
+      continue;
+    }
+    uint32_t hash = ((buffer[pos] << 16) | (buffer[pos + 1] << 8) | buffer[pos + 2]) * 2654435761u >> (32 - HASH_BITS);
+    size_t candidate = head[hash];
+    head[hash] = pos + 1;
+
+    size_t best = 0;
+    if (candidate > 0 && pos - (candidate - 1) <= WINDOW)
+    {
+      const uint8_t *a = buffer + candidate - 1;
+      const uint8_t *b = buffer + pos;
+      size_t limit = available < MAX_MATCH ? available : MAX_MATCH;
+      while (best < limit && a[best] == b[best])
+      {
+        best++;
+      }
+    }
+
+    if (best >= MIN_MATCH)
+    {
+      match(best, pos - (candidate - 1));
+      // Index the positions inside the match so later data can refer to them.
+      for (size_t i = 1; i < best && pos + i + 2 < fill; i++)
+      {
+        size_t p = pos + i;
+        uint32_t h = ((buffer[p] << 16) | (buffer[p + 1] << 8) | buffer[p + 2]) * 2654435761u >> (32 - HASH_BITS);
+        head[h] = p + 1;
+      }
+      pos += best;
+    }
+    else
+    {
+      literal(buffer[pos++]);
+    }
+  }
+}
+
+void GzipEncoder::literal(uint8_t value)
+{
+  if (value < 144)
+  {
+    huffman(0x30 + value, 8);
+  }
+  else
+  {
+    huffman(0x190 + (value - 144), 9);
+  }
+}
+
+void GzipEncoder::match(size_t length, size_t distance)
+{
+  int code = 28;
+  while (LENGTH_BASE[code] > length)
+  {
+    code--;
+  }
+  uint32_t symbol = 257 + code;
+  if (symbol < 280)
+  {
+    huffman(symbol - 256, 7);
+  }
+  else
+  {
+    huffman(0xC0 + (symbol - 280), 8);
+  }
+  bits(length - LENGTH_BASE[code], LENGTH_EXTRA[code]);
+
+  code = 29;
+  while (DISTANCE_BASE[code] > distance)
+  {
+    code--;
+  }
+  huffman(code, 5);
+  bits(distance - DISTANCE_BASE[code], DISTANCE_EXTRA[code]);
+}
+
+// Deflate packs values LSB first...
+void GzipEncoder::bits(uint32_t value, uint32_t count)
+{
+  bitBuffer |= value << bitCount;
+  bitCount += count;
+  while (bitCount >= 8)
+  {
+    emit(bitBuffer & 0xFF);
+    bitBuffer >>= 8;
+    bitCount -= 8;
+  }
+}
+
+// ...but Huffman codes MSB first.
+void GzipEncoder::huffman(uint32_t code, uint32_t length)
+{
+  uint32_t reversed = 0;
+  for (uint32_t i = 0; i < length; i++)
+  {
+    reversed = (reversed << 1) | ((code >> i) & 1);
+  }
+  bits(reversed, length);
+}
+
+void GzipEncoder::flushBits()
+{
+  if (bitCount > 0)
+  {
+    emit(bitBuffer & 0xFF);
+  }
+  bitBuffer = 0;
+  bitCount = 0;
+}
+
+void GzipEncoder::emit(uint8_t value)
+{
+  out[outLength++] = value;
+  outputSize++;
+  if (outLength == sizeof(out))
+  {
+    drain();
+  }
+}
+
+void GzipEncoder::drain()
+{
+  if (outLength > 0)
+  {
+    sink(context, out, outLength);
+    outLength = 0;
+  }
+}
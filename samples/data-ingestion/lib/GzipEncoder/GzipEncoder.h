@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// LZ77 history kept by the encoder. Must be a power of two <= 16384; RAM use
+// is about 2 * GZIP_WINDOW_SIZE + 2.4 KB.
+#ifndef GZIP_WINDOW_SIZE
+#define GZIP_WINDOW_SIZE 1024
+#endif
+
+// Small streaming gzip (RFC 1952) encoder.
+//
+// It uses a single fixed-Huffman deflate block and greedy LZ77 matching over
+// a GZIP_WINDOW_SIZE window. That gives up some ratio compared with zlib, but
+// RAM use is fixed and small, and output is produced as input arrives, so it
+// can compress an upload while it is being sent.
+class GzipEncoder
+{
+public:
+  static const size_t MAX_MATCH = 258;
+
+  typedef void (*Sink)(void *context, const uint8_t *data, size_t length);
+
+  GzipEncoder(Sink sink, void *context);
+
+  // Starts a new gzip member; called by the constructor.
+  void reset();
+  void write(const uint8_t *data, size_t length);
+  // Flushes the remaining input and writes the gzip trailer.
+  void finish();
+
+  uint32_t bytesIn() const { return inputSize; }
+  uint32_t bytesOut() const { return outputSize; }
+
+  // The most output a single write() of `length` bytes (or finish()) can
+  // produce, used to size the buffer on the other side of the sink.
+  static constexpr size_t maxOutput(size_t length) { return (length + MAX_MATCH) * 11 / 8 + 32; }
+
+private:
+  static const size_t WINDOW = GZIP_WINDOW_SIZE;
+  static const size_t MIN_MATCH = 3;
+  static_assert((WINDOW & (WINDOW - 1)) == 0 && WINDOW <= 16384, "GZIP_WINDOW_SIZE must be a power of two <= 16384");
+  static const size_t HASH_BITS = 10;
+  static const size_t BUFFER_SIZE = 2 * WINDOW + MAX_MATCH;
+
+  void encode(bool final);
+  void literal(uint8_t value);
+  void match(size_t length, size_t distance);
+  void bits(uint32_t value, uint32_t count);
+  void huffman(uint32_t code, uint32_t length);
+  void flushBits();
+  void emit(uint8_t value);
+  void drain();
+
+  Sink sink;
+  void *context;
+
+  uint8_t buffer[BUFFER_SIZE];
+  uint16_t head[1 << HASH_BITS]; // last position + 1 for each hash, 0 = none
+  size_t fill = 0;
+  size_t pos = 0;
+
+  uint32_t bitBuffer = 0;
+  uint32_t bitCount = 0;
+  uint8_t out[64];
+  size_t outLength = 0;
+
+  uint32_t crc = 0;
+  uint32_t inputSize = 0;
+  uint32_t outputSize = 0;
+};
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Result of the last attempt of a payload that was given up on.
+enum InFlightOutcome
+{
+  InFlightRejected,
+  InFlightTimedOut
+};
+
+struct InFlightStats
+{
+  uint32_t sent;     // payloads handed to send()
+  uint32_t retries;  // extra attempts
+  uint32_t accepted;
+  uint32_t rejected; // rejection replies, retried or not
+  uint32_t timeouts;
+  uint32_t failed;       // payloads given up on after maxAttempts
+  uint32_t uncorrelated; // replies without a correlation id, dropped
+  // End-to-end latency of accepted payloads, from the first attempt to the reply.
+  uint32_t lastLatencyMs;
+  uint32_t maxLatencyMs;
+  uint32_t totalLatencyMs;
+};
+
+// Tracks payloads that were published but not answered yet.
+//
+// Up to `Slots` payloads are outstanding at once, each identified by a
+// correlation id that the reply carries back. A copy of every payload is
+// kept until its reply arrives, so rejected payloads and payloads whose reply
+// does not arrive within `timeoutMs` can be published again, up to
+// `maxAttempts` times. Nothing waits for a reply, which lets the caller keep
+// publishing while earlier payloads are still in flight.
+template <size_t Slots, size_t MaxPayload>
+class InFlightWindow
+{
+public:
+  // Hands a payload to the MQTT client; false if it could not be sent.
+  typedef bool (*Publish)(const char *payload, size_t length);
+  // Called once a payload runs out of attempts; `outcome` is what happened to
+  // the last of them.
+  typedef void (*GiveUp)(uint32_t id, const char *payload, size_t length, InFlightOutcome outcome, uint8_t attempts);
+
+  InFlightWindow(Publish publish, GiveUp giveUp, uint32_t timeoutMs, uint32_t retryDelayMs, uint8_t maxAttempts)
+      : publish(publish), giveUp(giveUp), timeoutMs(timeoutMs), retryDelayMs(retryDelayMs),
+        maxAttempts(maxAttempts == 0 ? 1 : maxAttempts)
+  {
+  }
+
+  // Publishes `payload` and keeps it until its reply arrives. Returns false
+  // (and keeps nothing) when the window is full, the payload is too large or
+  // the publish failed.
+  bool send(uint32_t id, const char *payload, size_t length, uint32_t now)
+  {
+    Entry *entry = freeEntry();
+    if (!entry || length > MaxPayload || !publish(payload, length))
+    {
+      return false;
+    }
+    memcpy(entry->payload, payload, length);
+    entry->length = length;
+    entry->id = id;
+    entry->attempts = 1;
+    entry->firstSentAt = now;
+    entry->lastEventAt = now;
+    entry->state = Waiting;
+    count++;
+    stats.sent++;
+    return true;
+  }
+
+  // Matches a reply to the outstanding payload with `id`. Returns false when
+  // nothing is waiting for the reply, e.g. a late reply to a payload that was
+  // already answered. Replies without a correlation id (id 0) are dropped and
+  // counted: with several payloads in flight there is no telling which one
+  // they answer, and guessing could retire the wrong one.
+  bool acknowledge(uint32_t id, bool accepted, uint32_t now)
+  {
+    if (id == 0)
+    {
+      stats.uncorrelated++;
+      return false;
+    }
+    Entry *entry = find(id);
+    if (!entry)
+    {
+      return false;
+    }
+    if (accepted)
+    {
+      uint32_t latency = now - entry->firstSentAt;
+      stats.accepted++;
+      stats.lastLatencyMs = latency;
+      stats.totalLatencyMs += latency;
+      if (latency > stats.maxLatencyMs)
+      {
+        stats.maxLatencyMs = latency;
+      }
+      release(*entry);
+      return true;
+    }
+    stats.rejected++;
+    if (!retire(*entry, InFlightRejected))
+    {
+      // Published again by poll() after retryDelayMs.
+      entry->state = Rejected;
+      entry->lastEventAt = now;
+    }
+    return true;
+  }
+
+  // Publishes again what was rejected or timed out. Call regularly while
+  // connected.
+  void poll(uint32_t now)
+  {
+    for (size_t i = 0; i < Slots; i++)
+    {
+      Entry &entry = entries[i];
+      if (entry.state == Waiting && now - entry.lastEventAt >= timeoutMs)
+      {
+        stats.timeouts++;
+        if (retire(entry, InFlightTimedOut))
+        {
+          continue;
+        }
+        resend(entry, now);
+      }
+      else if (entry.state == Rejected && now - entry.lastEventAt >= retryDelayMs)
+      {
+        resend(entry, now);
+      }
+    }
+  }
+
+  size_t size() const { return count; }
+  bool full() const { return count == Slots; }
+  bool empty() const { return count == 0; }
+  const InFlightStats &statistics() const { return stats; }
+
+private:
+  enum State
+  {
+    Free,
+    Waiting,  // published, waiting for the reply
+    Rejected  // waiting for retryDelayMs before the next attempt
+  };
+
+  struct Entry
+  {
+    State state;
+    uint32_t id;
+    uint8_t attempts;
+    uint32_t firstSentAt;
+    uint32_t lastEventAt;
+    size_t length;
+    char payload[MaxPayload];
+  };
+
+  void resend(Entry &entry, uint32_t now)
+  {
+    entry.lastEventAt = now;
+    if (!publish(entry.payload, entry.length))
+    {
+      // Not counted as an attempt; tried again after the next timeout.
+      entry.state = Waiting;
+      return;
+    }
+    entry.attempts++;
+    entry.state = Waiting;
+    stats.retries++;
+  }
+
+  // Gives up on `entry` if it has no attempts left.
+  bool retire(Entry &entry, InFlightOutcome outcome)
+  {
+    if (entry.attempts < maxAttempts)
+    {
+      return false;
+    }
+    stats.failed++;
+    giveUp(entry.id, entry.payload, entry.length, outcome, entry.attempts);
+    release(entry);
+    return true;
+  }
+
+  void release(Entry &entry)
+  {
+    entry.state = Free;
+    count--;
+  }
+
+  Entry *freeEntry()
+  {
+    for (size_t i = 0; i < Slots; i++)
+    {
+      if (entries[i].state == Free)
+      {
+        return &entries[i];
+      }
+    }
+    return NULL;
+  }
+
+  Entry *find(uint32_t id)
+  {
+    for (size_t i = 0; i < Slots; i++)
+    {
+      if (entries[i].state != Free && entries[i].id == id)
+      {
+        return &entries[i];
+      }
+    }
+    return NULL;
+  }
+
+  Publish publish;
+  GiveUp giveUp;
+  uint32_t timeoutMs;
+  uint32_t retryDelayMs;
+  uint8_t maxAttempts;
+  Entry entries[Slots] = {};
+  size_t count = 0;
+  InFlightStats stats = {};
+};
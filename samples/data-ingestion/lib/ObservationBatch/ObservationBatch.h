@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A single reading waiting to be sent to the FHIRIngest rule.
+// code/system/display point at constants from Config.h, so they are not copied.
+struct Observation
+{
+  int value;
+  const char *unit;
+  const char *code;
+  const char *system;
+  const char *display;
+  uint32_t recordedAt;
+};
+
+// Bounded queue of observations that are sent together as one payload.
+// The batch asks to be flushed when it holds `maxSize` observations or when
+// the oldest observation has waited `lingerMs`, whichever comes first.
+template <size_t Capacity>
+class ObservationBatch
+{
+public:
+  ObservationBatch(size_t maxSize, uint32_t lingerMs)
+      : maxSize(maxSize == 0 || maxSize > Capacity ? Capacity : maxSize),
+        lingerMs(lingerMs)
+  {
+  }
+
+  // Returns false when the batch is full; the caller must flush first.
+  bool add(const Observation &observation)
+  {
+    if (count >= maxSize)
+    {
+      return false;
+    }
+    items[count++] = observation;
+    return true;
+  }
+
+  bool shouldFlush(uint32_t now) const
+  {
+    if (count == 0)
+    {
+      return false;
+    }
+    return count >= maxSize || (uint32_t)(now - items[0].recordedAt) >= lingerMs;
+  }
+
+  const Observation &at(size_t index) const { return items[index]; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  bool full() const { return count >= maxSize; }
+  void clear() { count = 0; }
+
+private:
+  Observation items[Capacity];
+  size_t count = 0;
+  size_t maxSize;
+  uint32_t lingerMs;
+};
@@ -0,0 +1,503 @@
+#include "Outbox.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+static const uint8_t MAGIC_0 = 0xA5;
+static const uint8_t MAGIC_1 = 0x5A;
+static const size_t HEADER_SIZE = 8;
+
+static uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t length)
+{
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++)
+  {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++)
+    {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+static void writeU32(uint8_t *out, uint32_t value)
+{
+  out[0] = value & 0xFF;
+  out[1] = (value >> 8) & 0xFF;
+  out[2] = (value >> 16) & 0xFF;
+  out[3] = (value >> 24) & 0xFF;
+}
+
+static uint32_t readU32(const uint8_t *in)
+{
+  return (uint32_t)in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+// Reads and validates the frame at the current position of `file`.
+// Returns the payload length, or -1 for a missing/torn/corrupt frame.
+// When `payload` is NULL the payload is only checked, in small chunks.
+static long readFrame(FILE *file, char *payload, size_t capacity)
+{
+  uint8_t header[HEADER_SIZE];
+  if (fread(header, 1, HEADER_SIZE, file) != HEADER_SIZE)
+  {
+    return -1;
+  }
+  if (header[0] != MAGIC_0 || header[1] != MAGIC_1)
+  {
+    return -1;
+  }
+  size_t length = header[2] | (header[3] << 8);
+  uint32_t expectedCrc = readU32(header + 4);
+  if (length > Outbox::MAX_RECORD_SIZE || (payload != NULL && length > capacity))
+  {
+    return -1;
+  }
+
+  uint32_t crc = 0;
+  if (payload != NULL)
+  {
+    if (fread(payload, 1, length, file) != length)
+    {
+      return -1;
+    }
+    crc = crc32Update(0, (const uint8_t *)payload, length);
+  }
+  else
+  {
+    uint8_t chunk[128];
+    size_t remaining = length;
+    while (remaining > 0)
+    {
+      size_t n = remaining < sizeof(chunk) ? remaining : sizeof(chunk);
+      if (fread(chunk, 1, n, file) != n)
+      {
+        return -1;
+      }
+      crc = crc32Update(crc, chunk, n);
+      remaining -= n;
+    }
+  }
+  return crc == expectedCrc ? (long)length : -1;
+}
+
+// Returns the offset of the first magic byte pair in [from, end), or `end`.
+static size_t findMagic(FILE *file, size_t from, size_t end)
+{
+  uint8_t chunk[128];
+  while (from + 1 < end)
+  {
+    fseek(file, from, SEEK_SET);
+    size_t wanted = end - from < sizeof(chunk) ? end - from : sizeof(chunk);
+    size_t n = fread(chunk, 1, wanted, file);
+    if (n < 2)
+    {
+      break;
+    }
+    for (size_t i = 0; i + 1 < n; i++)
+    {
+      if (chunk[i] == MAGIC_0 && chunk[i + 1] == MAGIC_1)
+      {
+        return from + i;
+      }
+    }
+    from += n - 1; // the pair may straddle two chunks
+  }
+  return end;
+}
+
+// Finds the first intact frame that starts at or after `from` and ends by
+// `end`, so a corrupt record only costs itself. Returns its payload length and
+// sets `at`, or returns -1 when there is none.
+static long findFrame(FILE *file, size_t from, size_t end, size_t *at)
+{
+  size_t candidate = from;
+  while (candidate + HEADER_SIZE <= end)
+  {
+    fseek(file, candidate, SEEK_SET);
+    long length = readFrame(file, NULL, 0);
+    if (length >= 0 && candidate + HEADER_SIZE + length <= end)
+    {
+      *at = candidate;
+      return length;
+    }
+    candidate = findMagic(file, candidate + 1, end);
+  }
+  return -1;
+}
+
+Outbox::Outbox(const char *basePath, size_t maxBytes) : maxBytes(maxBytes)
+{
+  snprintf(dataPath, sizeof(dataPath), "%s.dat", basePath);
+  snprintf(indexPath, sizeof(indexPath), "%s.idx", basePath);
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", dataPath);
+}
+
+bool Outbox::begin()
+{
+  readOffset = 0;
+  writeOffset = 0;
+  dataInTmp = false;
+
+  FILE *index = fopen(indexPath, "rb");
+  if (index != NULL)
+  {
+    uint8_t raw[8];
+    // The offset is stored next to its complement so a torn write is ignored.
+    if (fread(raw, 1, sizeof(raw), index) == sizeof(raw) && readU32(raw) == ~readU32(raw + 4))
+    {
+      readOffset = readU32(raw);
+    }
+    fclose(index);
+  }
+
+  FILE *data = fopen(dataPath, "rb");
+  if (data == NULL && (data = fopen(tmpPath, "rb")) != NULL)
+  {
+    // Power was lost between the two steps of compact(), or its rename failed;
+    // the index already points into the compacted file.
+    fclose(data);
+    moveTmpToData();
+    data = fopen(currentPath(), "rb");
+  }
+  if (data == NULL)
+  {
+    readOffset = 0;
+    sendOffset = 0;
+    return true;
+  }
+  fseek(data, 0, SEEK_END);
+  size_t fileSize = ftell(data);
+  if (readOffset > fileSize)
+  {
+    readOffset = 0;
+  }
+
+  // Nothing to do if every record from the read offset on is intact.
+  size_t offset = readOffset;
+  long length;
+  fseek(data, offset, SEEK_SET);
+  while ((length = readFrame(data, NULL, 0)) >= 0)
+  {
+    offset += HEADER_SIZE + length;
+  }
+  fclose(data);
+  writeOffset = fileSize;
+  sendOffset = readOffset;
+  if (readOffset == 0 && offset == fileSize)
+  {
+    return true;
+  }
+  // Otherwise keep only the unsent, intact records. This drops a torn record
+  // left at the end of the file by a crash during append(), and a corrupt one
+  // in the middle without the records after it.
+  return compact();
+}
+
+bool Outbox::append(const char *payload, size_t length)
+{
+  size_t frameSize = HEADER_SIZE + length;
+  if (length <= MAX_RECORD_SIZE && writeOffset + frameSize > maxBytes && readOffset > 0 &&
+      pendingBytes() + frameSize <= maxBytes)
+  {
+    // The space in front of the read offset has been drained; reclaim it.
+    compact();
+  }
+  if (length > MAX_RECORD_SIZE || writeOffset + frameSize > maxBytes)
+  {
+    dropped++;
+    return false;
+  }
+
+  uint8_t header[HEADER_SIZE] = {MAGIC_0, MAGIC_1, (uint8_t)(length & 0xFF), (uint8_t)(length >> 8)};
+  writeU32(header + 4, crc32Update(0, (const uint8_t *)payload, length));
+
+  FILE *data = fopen(currentPath(), "ab");
+  if (data == NULL)
+  {
+    dropped++;
+    return false;
+  }
+  bool ok = fwrite(header, 1, HEADER_SIZE, data) == HEADER_SIZE &&
+            fwrite(payload, 1, length, data) == length;
+  ok = (fclose(data) == 0) && ok;
+  if (!ok)
+  {
+    // Whatever made it to the file is ignored by the CRC check on begin().
+    dropped++;
+    return false;
+  }
+  writeOffset += frameSize;
+  return true;
+}
+
+bool Outbox::peek(char *buffer, size_t capacity, size_t *length)
+{
+  peekedLength = 0;
+  if (empty())
+  {
+    return false;
+  }
+  FILE *data = fopen(currentPath(), "rb");
+  if (data == NULL)
+  {
+    return false;
+  }
+  fseek(data, readOffset, SEEK_SET);
+  long n = readFrame(data, buffer, capacity);
+  if (n < 0)
+  {
+    fseek(data, readOffset, SEEK_SET);
+    if (readFrame(data, NULL, 0) >= 0)
+    {
+      // Intact, only larger than `buffer`.
+      fclose(data);
+      return false;
+    }
+    // A corrupt record would block the outbox for good: skip to the next
+    // intact one.
+    size_t next;
+    corrupted++;
+    if (findFrame(data, readOffset + 1, writeOffset, &next) < 0)
+    {
+      fclose(data);
+      reset();
+      return false;
+    }
+    readOffset = next;
+    saveReadOffset();
+    fseek(data, readOffset, SEEK_SET);
+    n = readFrame(data, buffer, capacity);
+  }
+  fclose(data);
+  if (n < 0)
+  {
+    return false;
+  }
+  if (sendOffset < readOffset)
+  {
+    sendOffset = readOffset;
+  }
+  *length = n;
+  peekedLength = HEADER_SIZE + n;
+  return true;
+}
+
+bool Outbox::peekUnsent(char *buffer, size_t capacity, size_t *length)
+{
+  unsentLength = 0;
+  if (sendOffset < readOffset)
+  {
+    sendOffset = readOffset;
+  }
+  if (allSent())
+  {
+    return false;
+  }
+  FILE *data = fopen(currentPath(), "rb");
+  if (data == NULL)
+  {
+    return false;
+  }
+  fseek(data, sendOffset, SEEK_SET);
+  long n = readFrame(data, buffer, capacity);
+  if (n < 0)
+  {
+    fseek(data, sendOffset, SEEK_SET);
+    if (readFrame(data, NULL, 0) >= 0)
+    {
+      fclose(data);
+      return false;
+    }
+    // Skipped here only; pop() skips it again once the records handed out
+    // before it are removed.
+    size_t next;
+    corrupted++;
+    if (findFrame(data, sendOffset + 1, writeOffset, &next) < 0)
+    {
+      fclose(data);
+      sendOffset = writeOffset;
+      return false;
+    }
+    sendOffset = next;
+    fseek(data, sendOffset, SEEK_SET);
+    n = readFrame(data, buffer, capacity);
+  }
+  fclose(data);
+  if (n < 0)
+  {
+    return false;
+  }
+  *length = n;
+  unsentLength = HEADER_SIZE + n;
+  return true;
+}
+
+void Outbox::markSent()
+{
+  sendOffset += unsentLength;
+  unsentLength = 0;
+}
+
+bool Outbox::pop()
+{
+  if (empty())
+  {
+    return false;
+  }
+  if (peekedLength == 0)
+  {
+    // The oldest intact record, as peek() would have returned it.
+    FILE *data = fopen(currentPath(), "rb");
+    if (data == NULL)
+    {
+      return false;
+    }
+    size_t at;
+    long length = findFrame(data, readOffset, writeOffset, &at);
+    fclose(data);
+    if (length < 0)
+    {
+      corrupted++;
+      reset();
+      return false;
+    }
+    if (at != readOffset)
+    {
+      corrupted++;
+    }
+    peekedLength = at - readOffset + HEADER_SIZE + length;
+  }
+  readOffset += peekedLength;
+  peekedLength = 0;
+  if (sendOffset < readOffset)
+  {
+    sendOffset = readOffset;
+  }
+  if (empty())
+  {
+    reset();
+    return true;
+  }
+  return saveReadOffset();
+}
+
+bool Outbox::saveReadOffset()
+{
+  uint8_t raw[8];
+  writeU32(raw, readOffset);
+  writeU32(raw + 4, ~(uint32_t)readOffset);
+  FILE *index = fopen(indexPath, "wb");
+  if (index == NULL)
+  {
+    return false;
+  }
+  bool ok = fwrite(raw, 1, sizeof(raw), index) == sizeof(raw);
+  return (fclose(index) == 0) && ok;
+}
+
+// Rewrites the file with only the intact records between the read and write
+// offsets, so the read offset becomes 0. The index is set to 0 before the old
+// file is replaced: a power cut in between replays records already sent
+// rather than losing unsent ones.
+bool Outbox::compact()
+{
+  if (dataInTmp && !moveTmpToData())
+  {
+    // The records are in tmpPath, which this would overwrite.
+    return false;
+  }
+  FILE *data = fopen(dataPath, "rb");
+  if (data == NULL)
+  {
+    reset();
+    return true;
+  }
+  FILE *tmp = fopen(tmpPath, "wb");
+  if (tmp == NULL)
+  {
+    fclose(data);
+    return false;
+  }
+
+  size_t offset = readOffset;
+  size_t written = 0;
+  size_t newSendOffset = SIZE_MAX;
+  size_t at;
+  long length;
+  bool ok = true;
+  while (ok && (length = findFrame(data, offset, writeOffset, &at)) >= 0)
+  {
+    if (at != offset)
+    {
+      corrupted++;
+    }
+    if (newSendOffset == SIZE_MAX && at >= sendOffset)
+    {
+      newSendOffset = written;
+    }
+    fseek(data, at, SEEK_SET);
+    char chunk[128];
+    size_t remaining = HEADER_SIZE + length;
+    while (ok && remaining > 0)
+    {
+      size_t n = remaining < sizeof(chunk) ? remaining : sizeof(chunk);
+      ok = fread(chunk, 1, n, data) == n && fwrite(chunk, 1, n, tmp) == n;
+      remaining -= n;
+    }
+    offset = at + HEADER_SIZE + length;
+    written += HEADER_SIZE + length;
+  }
+  fclose(data);
+  ok = (fclose(tmp) == 0) && ok;
+  if (!ok)
+  {
+    remove(tmpPath);
+    return false;
+  }
+
+  size_t oldReadOffset = readOffset;
+  readOffset = 0;
+  if (!saveReadOffset())
+  {
+    readOffset = oldReadOffset;
+    remove(tmpPath);
+    return false;
+  }
+  // SPIFFS cannot rename over an existing file.
+  remove(dataPath);
+  writeOffset = written;
+  sendOffset = newSendOffset == SIZE_MAX ? written : newSendOffset;
+  moveTmpToData();
+  return true;
+}
+
+// Renames the compacted file to dataPath, with one retry. If that fails the
+// records stay in tmpPath, which begin() recovers while there is no data
+// file, and append() keeps writing there: a new data file would hide them.
+bool Outbox::moveTmpToData()
+{
+  for (int attempt = 0; attempt < 2; attempt++)
+  {
+    if (rename(tmpPath, dataPath) == 0)
+    {
+      dataInTmp = false;
+      return true;
+    }
+  }
+  dataInTmp = true;
+  return false;
+}
+
+void Outbox::reset()
+{
+  remove(dataPath);
+  remove(tmpPath);
+  remove(indexPath);
+  dataInTmp = false;
+  readOffset = 0;
+  sendOffset = 0;
+  writeOffset = 0;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Append-only, crash-safe queue of MQTT payloads kept in a file.
+//
+// Every record is framed as [magic:2][length:2][crc32:4][payload] so a record
+// that was only partly written when power was lost is detected and dropped. A
+// corrupt record is skipped, up to the next intact frame.
+// The offset of the oldest record not yet removed is kept in a second small
+// file, so records are replayed in order after a reboot. A record can be
+// handed out for sending (peekUnsent()) and stay in the file until its
+// delivery is confirmed (pop()). Only one record is held in RAM at a time
+// while draining.
+//
+// The implementation only uses stdio, so on the device it runs on the SPIFFS
+// VFS mount (e.g. "/spiffs/outbox") and on Linux on any directory.
+class Outbox
+{
+public:
+  static const size_t MAX_RECORD_SIZE = 2048;
+
+  // `basePath` is used as a prefix: "<basePath>.dat" and "<basePath>.idx".
+  Outbox(const char *basePath, size_t maxBytes);
+
+  // Recovers the read offset, and rewrites the file without sent, torn or
+  // corrupt records.
+  bool begin();
+
+  // Returns false (and counts a drop) when the record is too big or the
+  // outbox is full. Space already drained is reclaimed first.
+  bool append(const char *payload, size_t length);
+
+  // Copies the oldest intact record into `buffer` without removing it,
+  // skipping corrupt ones. Returns false when the outbox is empty or the
+  // record does not fit.
+  bool peek(char *buffer, size_t capacity, size_t *length);
+
+  // Like peek(), for the oldest record not handed out by markSent() yet.
+  // Returns false when every record has been handed out.
+  bool peekUnsent(char *buffer, size_t capacity, size_t *length);
+
+  // Hands out the record returned by the last successful peekUnsent(). It
+  // stays in the outbox, and is replayed after a reboot, until pop().
+  void markSent();
+
+  // Hands every record out again, from the oldest one.
+  void rewind() { sendOffset = readOffset; }
+
+  // Removes the oldest record: the one returned by the last successful
+  // peek(), or else the first one handed out by peekUnsent().
+  bool pop();
+
+  bool empty() const { return readOffset >= writeOffset; }
+  bool allSent() const { return sendOffset >= writeOffset; }
+  size_t pendingBytes() const { return writeOffset - readOffset; }
+  uint32_t droppedRecords() const { return dropped; }
+  // Corrupt stretches of the file skipped by begin(), append(), peek(),
+  // peekUnsent() or pop().
+  uint32_t corruptRecords() const { return corrupted; }
+
+private:
+  bool compact();
+  bool moveTmpToData();
+  bool saveReadOffset();
+  void reset();
+  // The file holding the records: tmpPath after compact() could not rename it.
+  const char *currentPath() const { return dataInTmp ? tmpPath : dataPath; }
+
+  char dataPath[64];
+  char indexPath[64];
+  char tmpPath[68];
+  bool dataInTmp = false;
+  size_t maxBytes;
+  size_t readOffset = 0;
+  size_t sendOffset = 0;
+  size_t writeOffset = 0;
+  size_t peekedLength = 0;
+  size_t unsentLength = 0;
+  uint32_t dropped = 0;
+  uint32_t corrupted = 0;
+};
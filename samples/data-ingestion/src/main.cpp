@@ -5,16 +5,164 @@
 #include <WiFiClientSecure.h>
 #include <ArduinoJson.h>
 #include <HTTPClient.h>
+#include <SPIFFS.h>
 #include "Config.h"
+#include <ObservationBatch.h>
+#include <Outbox.h>
+#include <ConnectionManager.h>
+#include <PayloadWriter.h>
+#include <DiagnosticLog.h>
+#include <GzipEncoder.h>
+#include <SpscQueue.h>
+#include <TopicRouter.h>
+#include <InFlightWindow.h>
+#include <LoopStats.h>
 
-WiFiClientSecure wifiClient = WiFiClientSecure();
+// Observations are published in batches; set OBSERVATION_BATCH_SIZE to 1 to
+// publish every observation on its own.
+#ifndef OBSERVATION_BATCH_SIZE
+#define OBSERVATION_BATCH_SIZE 10
+#endif
+// Maximum time (ms) an observation waits in the batch before it is published.
+// The batch is only in RAM: a power cut loses at most the observations of
+// this window (OBSERVATION_BATCH_SIZE of them, or OBSERVATION_BATCH_LINGER_MS).
+#ifndef OBSERVATION_BATCH_LINGER_MS
+#define OBSERVATION_BATCH_LINGER_MS 5000
+#endif
+// Every payload is written to the spiffs partition before it is published,
+// and removed once FHIRIngest accepts it (or rejects it for good). Anything
+// not answered is replayed, oldest first, after a reconnect or a reboot, so a
+// payload can be delivered twice; the copies share their correlationId.
+#ifndef OUTBOX_PATH
+#define OUTBOX_PATH "/spiffs/outbox"
+#endif
+#ifndef OUTBOX_MAX_BYTES
+#define OUTBOX_MAX_BYTES (512 * 1024)
+#endif
+#ifndef OUTBOX_DRAIN_PER_LOOP
+#define OUTBOX_DRAIN_PER_LOOP 4
+#endif
+// Number of button events kept for the diagnostic file; the oldest events are
+// overwritten once it is full.
+#ifndef DIAGNOSTIC_LOG_CAPACITY
+#define DIAGNOSTIC_LOG_CAPACITY 512
+#endif
+// Gzip the diagnostic file (Content-Encoding: gzip) while it is sent; it is
+// sent as text when that does not make it smaller.
+#ifndef DIAGNOSTIC_UPLOAD_GZIP
+#define DIAGNOSTIC_UPLOAD_GZIP 1
+#endif
+// Button events waiting for the network task; must be a power of two.
+#ifndef EVENT_QUEUE_CAPACITY
+#define EVENT_QUEUE_CAPACITY 32
+#endif
+// The network task (MQTT, HTTP, serialization) runs on the core used by the
+// Wi-Fi stack; loop() (buttons, display) keeps running on the other one.
+#ifndef NETWORK_TASK_CORE
+#define NETWORK_TASK_CORE 0
+#endif
+#ifndef NETWORK_TASK_STACK_SIZE
+#define NETWORK_TASK_STACK_SIZE 12288
+#endif
+// Observation payloads published but not yet answered on FHIRIngest/accepted or
+// /rejected. Each slot keeps a copy of its payload (up to 2 KB) for retries.
+#ifndef FHIR_INGEST_WINDOW_SIZE
+#define FHIR_INGEST_WINDOW_SIZE 4
+#endif
+// A payload without a reply after FHIR_INGEST_REPLY_TIMEOUT_MS, or rejected,
+// is published again (after FHIR_INGEST_RETRY_DELAY_MS) up to
+// FHIR_INGEST_MAX_ATTEMPTS times. Payloads that keep timing out go back to the
+// outbox; payloads that keep being rejected are dropped.
+#ifndef FHIR_INGEST_REPLY_TIMEOUT_MS
+#define FHIR_INGEST_REPLY_TIMEOUT_MS 10000
+#endif
+#ifndef FHIR_INGEST_RETRY_DELAY_MS
+#define FHIR_INGEST_RETRY_DELAY_MS 2000
+#endif
+#ifndef FHIR_INGEST_MAX_ATTEMPTS
+#define FHIR_INGEST_MAX_ATTEMPTS 3
+#endif
+// QoS of the FHIRIngest publishes. With 1 the broker acknowledges every
+// publish, and MQTTClient waits for that PUBACK (one round trip) before
+// publish() returns; the FHIRIngest replies are still awaited in the window,
+// several at once. 0 skips the PUBACK, and leaves the reply as the only
+// acknowledgement.
+#ifndef FHIR_INGEST_QOS
+#define FHIR_INGEST_QOS 1
+#endif
+// Loop period percentiles, publish rate and free heap are logged every
+// LOOP_STATS_INTERVAL_MS; 0 turns the report off.
+#ifndef LOOP_STATS_INTERVAL_MS
+#define LOOP_STATS_INTERVAL_MS 30000
+#endif
+// Upper bound (seconds) for the TLS handshake. It blocks the calling loop, as
+// the wait for MQTT CONNACK does.
+#ifndef TLS_HANDSHAKE_TIMEOUT_S
+#define TLS_HANDSHAKE_TIMEOUT_S 5
+#endif
+// 1 uses TlsClient instead of WiFiClientSecure, to resume TLS sessions on
+// MQTT reconnects and HTTPS requests.
+#ifndef TLS_SESSION_RESUMPTION
+#define TLS_SESSION_RESUMPTION 0
+#endif
+
+#if TLS_SESSION_RESUMPTION
+#include <TlsClient.h>
+typedef TlsClient SecureClient;
+#else
+typedef WiFiClientSecure SecureClient;
+#endif
+SecureClient wifiClient;  // MQTT
+SecureClient httpsClient; // diagnostic uploads
 MQTTClient mqttClient = MQTTClient(2048);
 
-String diagFileBuffer = "";
+// A button press captured by loop() and handled by the network task.
+struct ButtonEvent
+{
+  uint32_t timestampMs;
+  char label[5];
+  bool success;
+  bool uploadDiagnostics;
+};
+
+// The only state shared by the two tasks. Everything below it is owned by
+// the network task.
+SpscQueue<ButtonEvent, EVENT_QUEUE_CAPACITY> buttonEvents;
+
+ObservationBatch<OBSERVATION_BATCH_SIZE> observationBatch(OBSERVATION_BATCH_SIZE, OBSERVATION_BATCH_LINGER_MS);
+Outbox outbox(OUTBOX_PATH, OUTBOX_MAX_BYTES);
+char outboxRecord[Outbox::MAX_RECORD_SIZE];
+JsonWriter<Outbox::MAX_RECORD_SIZE> observationPayload;
+DiagnosticLog<DIAGNOSTIC_LOG_CAPACITY> diagnosticLog(DropOldest);
 std::string fhirIngestAcceptedTopic = DEVICE_ID + "/" + LO_FHIR_INGEST_TOPIC_NAME + "/accepted";
 std::string fhirIngestRejectedTopic = DEVICE_ID + "/" + LO_FHIR_INGEST_TOPIC_NAME + "/rejected";
 std::string fileUploadAcceptedTopic = DEVICE_ID + "/" + LO_FILE_UPLOAD_TOPIC_NAME + "/accepted";
 std::string fileUploadRejectedTopic = DEVICE_ID + "/" + LO_FILE_UPLOAD_TOPIC_NAME + "/rejected";
+// Four <DEVICE_ID>/<rule>/<result> topics, with room for a 128-character
+// DEVICE_ID, the longest client ID AWS IoT accepts.
+TopicRouter<4, 640> router;
+bool publishObservationPayload(const char *payload, size_t length);
+void observationGivenUp(uint32_t id, const char *payload, size_t length, InFlightOutcome outcome, uint8_t attempts);
+InFlightWindow<FHIR_INGEST_WINDOW_SIZE, Outbox::MAX_RECORD_SIZE> inFlight(publishObservationPayload, observationGivenUp,
+                                                                          FHIR_INGEST_REPLY_TIMEOUT_MS,
+                                                                          FHIR_INGEST_RETRY_DELAY_MS,
+                                                                          FHIR_INGEST_MAX_ATTEMPTS);
+// Ids of the outbox records handed to inFlight, oldest first. A record is
+// popped once it and every record before it is answered.
+struct StoredInFlight
+{
+  uint32_t id;
+  bool answered;
+};
+StoredInFlight storedInFlight[FHIR_INGEST_WINDOW_SIZE];
+size_t storedInFlightCount = 0;
+// A stored record timed out: the outbox is handed out again from its oldest
+// record once nothing is in flight.
+bool outboxRewindPending = false;
+// Seeded at boot so ids of payloads replayed from the outbox stay unique; 0 means "none".
+uint32_t nextCorrelationId = 0;
+// Measures the network task.
+LoopStats loopStats;
 
 // put function declarations here:
 void handleButton(Button btn);
@@ -22,94 +170,155 @@ void handleErrorButton(Button btn);
 void resetDisplay();
 void defaultDisplay();
 void setupWifi();
-void mqttConnect();
-void recordObservation(String val, String code, String system, String display);
-void updateDiagnostic(String val);
-void handleMessage(String &topic, String &payload);
+void onMqttConnected();
+void networkTask(void *parameter);
+void submitEvent(Button &btn, bool success, bool uploadDiagnostics);
+void processEvents();
+void recordObservation(bool success, uint32_t recordedAt, const char *code, const char *system, const char *display);
+void publishObservations();
+void publishOrStore(const char *payload, size_t length);
+void drainOutbox();
+bool settleStoredObservation(uint32_t id);
+void reportLoopStats();
+void reportTls(const char *label, const SecureClient &client);
+uint32_t correlationIdOf(const char *payload, size_t length);
+void fhirIngestAccepted(const char *topic, const TopicParams &params, char *payload, int length);
+void fhirIngestRejected(const char *topic, const TopicParams &params, char *payload, int length);
+void handleFhirIngestReply(char *payload, int length, bool accepted);
+void updateDiagnostic(const char *label, bool success, uint32_t timestampMs);
+void setupRoutes();
+void addRoute(const char *topic, TopicHandler handler);
+void handleMessage(MQTTClient *client, char topic[], char payload[], int length);
+void logMessage(const char *topic, const TopicParams &params, char *payload, int length);
+void fileUploadAccepted(const char *topic, const TopicParams &params, char *payload, int length);
 void startFileUpload();
 
+// Wi-Fi/TLS/MQTT connect is advanced a step at a time by the network task.
+ConnectionManager connection({
+    []() { WiFi.begin(WIFI_SSID, WIFI_PASSWORD); },
+    []() { return WiFi.status() == WL_CONNECTED; },
+    []() { return wifiClient.connect(LO_IOT_ENDPOINT.c_str(), 8883) == 1; },
+    []() { return mqttClient.connect(DEVICE_ID.c_str(), true); }, // true = reuse the open TLS socket
+    []() { return mqttClient.connected(); },
+    onMqttConnected,
+    []()
+    {
+      mqttClient.disconnect();
+      wifiClient.stop();
+    },
+    []() -> uint32_t { return millis(); },
+    [](uint32_t max) -> uint32_t { return esp_random() % max; },
+});
+
 void setup()
 {
   M5.begin();
+  if (!SPIFFS.begin(true) || !outbox.begin())
+  {
+    Serial.println("Failed to open outbox, offline observations will be lost");
+  }
+  else if (outbox.corruptRecords() > 0)
+  {
+    Serial.printf("Outbox: skipped %u corrupt records\n", outbox.corruptRecords());
+  }
+  nextCorrelationId = esp_random();
+  setupRoutes();
   setupWifi();
   defaultDisplay();
+  xTaskCreatePinnedToCore(networkTask, "network", NETWORK_TASK_STACK_SIZE, NULL, 1, NULL, NETWORK_TASK_CORE);
 }
 
+// UI task: buttons and display only. Anything slow is handed to the network
+// task through buttonEvents.
 void loop()
 {
-  mqttConnect();
-  mqttClient.loop();
+  static bool wifiWasConnected = true;
   M5.update();
-  if (WiFi.status() != WL_CONNECTED)
+  bool wifiConnected = WiFi.status() == WL_CONNECTED;
+  if (!wifiConnected && wifiWasConnected)
   {
     M5.Lcd.println("error, wifi not connected");
   }
+  wifiWasConnected = wifiConnected;
   handleButton(m5.BtnA);
   handleErrorButton(m5.BtnB);
   handleButton(m5.BtnC);
   resetDisplay();
 }
 
-// put function definitions here:
-void setupWifi()
+void networkTask(void *parameter)
 {
-  M5.Lcd.print("Connecting to WiFi");
-  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
-  while (WiFi.status() != WL_CONNECTED)
+  for (;;)
   {
-    delay(500);
-    M5.Lcd.print(".");
+    loopStats.tick(micros());
+    reportLoopStats();
+    connection.tick();
+    mqttClient.loop();
+    processEvents();
+    if (mqttClient.connected())
+    {
+      inFlight.poll(millis());
+    }
+    if (observationBatch.shouldFlush(millis()))
+    {
+      publishObservations();
+    }
+    drainOutbox();
+    vTaskDelay(1);
   }
-  M5.Lcd.println("");
-  M5.Lcd.println("Wifi Connected");
+}
 
+// put function definitions here:
+void setupWifi()
+{
+  M5.Lcd.println("Connecting to WiFi");
   wifiClient.setCACert(AWS_CERT_CA);
   wifiClient.setCertificate(LO_DEVICE_CERTIFICATE);
   wifiClient.setPrivateKey(LO_DEVICE_PRIVATE_KEY);
-  mqttConnect();
-  delay(2000);
+  wifiClient.setHandshakeTimeout(TLS_HANDSHAKE_TIMEOUT_S);
+  httpsClient.setCACert(AWS_CERT_CA);
+  httpsClient.setHandshakeTimeout(TLS_HANDSHAKE_TIMEOUT_S);
+
+  mqttClient.begin(LO_IOT_ENDPOINT.c_str(), 8883, wifiClient);
+  mqttClient.setCleanSession(false);
+  mqttClient.onMessageAdvanced(handleMessage);
 }
 
-void mqttConnect()
+// add() fails when the router is full; say which topic would go unhandled.
+void addRoute(const char *topic, TopicHandler handler)
 {
-  if (mqttClient.connected())
+  if (!router.add(topic, handler))
   {
-    return;
+    Serial.printf("Cannot route %s: router full (%u routes)\n", topic, router.size());
   }
-  Serial.print("Last MQTT Error: ");
-  Serial.println(mqttClient.lastError());
+}
 
-  Serial.println("Connecting to MQTT broker");
-  mqttClient.begin(LO_IOT_ENDPOINT.c_str(), 8883, wifiClient);
-  mqttClient.setCleanSession(false);
-  while (!mqttClient.connect(DEVICE_ID.c_str()))
-  {
-    Serial.print(".");
-    delay(100);
-  }
-  if (!mqttClient.connected())
-  {
-    Serial.println("");
-    Serial.println("Broker timeout!");
-  }
-  else
-  {
-    Serial.println("Connected to MQTT broker");
+void setupRoutes()
+{
+  addRoute(fhirIngestAcceptedTopic.c_str(), fhirIngestAccepted);
+  addRoute(fhirIngestRejectedTopic.c_str(), fhirIngestRejected);
+  addRoute(fileUploadAcceptedTopic.c_str(), fileUploadAccepted);
+  addRoute(fileUploadRejectedTopic.c_str(), logMessage);
+}
 
-    Serial.printf("Subscribing to topic %s\n", fhirIngestAcceptedTopic.c_str());
-    mqttClient.subscribe(fhirIngestAcceptedTopic.c_str());
+void onMqttConnected()
+{
+  const ConnectionMetrics &metrics = connection.metrics();
+  Serial.printf("Connected to MQTT broker (reconnect=%ums, max=%ums, failed attempts=%u, worst tick=%ums)\n",
+                metrics.lastReconnectMs, metrics.maxReconnectMs, metrics.failedAttempts, metrics.worstTickMs);
+  reportTls("MQTT", wifiClient);
 
-    Serial.printf("Subscribing to topic %s\n", fhirIngestRejectedTopic.c_str());
-    mqttClient.subscribe(fhirIngestRejectedTopic.c_str());
+  Serial.printf("Subscribing to topic %s\n", fhirIngestAcceptedTopic.c_str());
+  mqttClient.subscribe(fhirIngestAcceptedTopic.c_str());
 
-    Serial.printf("Subscribing to topic %s\n", fileUploadAcceptedTopic.c_str());
-    mqttClient.subscribe(fileUploadAcceptedTopic.c_str());
+  Serial.printf("Subscribing to topic %s\n", fhirIngestRejectedTopic.c_str());
+  mqttClient.subscribe(fhirIngestRejectedTopic.c_str());
 
-    Serial.printf("Subscribing to topic %s\n", fileUploadRejectedTopic.c_str());
-    mqttClient.subscribe(fileUploadRejectedTopic.c_str());
+  Serial.printf("Subscribing to topic %s\n", fileUploadAcceptedTopic.c_str());
+  mqttClient.subscribe(fileUploadAcceptedTopic.c_str());
 
-    mqttClient.onMessage(handleMessage);
-  }
+  Serial.printf("Subscribing to topic %s\n", fileUploadRejectedTopic.c_str());
+  mqttClient.subscribe(fileUploadRejectedTopic.c_str());
 }
 
 void defaultDisplay()
@@ -128,9 +337,8 @@ void handleButton(Button btn)
     delay(500);
 
     String result = "success";
-    recordObservation(result, LO_RESULT_CODE, LO_CODE_SYSTEM, "");
+    submitEvent(btn, true, false);
     M5.Lcd.printf("%s: %s\n", btn.label(), result.c_str());
-    updateDiagnostic("Btn=" + String(btn.label()) + ";result=" + result);
   }
 }
 
@@ -141,11 +349,8 @@ void handleErrorButton(Button btn)
     M5.Lcd.print("Calculating Results...");
     delay(500);
 
-    String result = "fail";
     M5.Lcd.println("error detected. Uploading diagnostic log file");
-    startFileUpload();
-    recordObservation(result, LO_RESULT_CODE, LO_CODE_SYSTEM, "");
-    updateDiagnostic("Btn=" + String(btn.label()) + ";result=" + result);
+    submitEvent(btn, false, true);
   }
 }
 
@@ -157,36 +362,388 @@ void resetDisplay()
   }
 }
 
-void recordObservation(String val, String code, String system, String display)
+void submitEvent(Button &btn, bool success, bool uploadDiagnostics)
 {
-  int value = 0;
-  if (val == "fail")
+  ButtonEvent event = {millis(), "", success, uploadDiagnostics};
+  snprintf(event.label, sizeof(event.label), "%s", btn.label());
+  if (!buttonEvents.push(event))
   {
-    value = 1;
+    Serial.printf("Event queue full, dropped %s (%u dropped)\n", event.label, buttonEvents.rejected());
+  }
+}
+
+void processEvents()
+{
+  static uint32_t maxQueueLatencyMs = 0;
+  ButtonEvent event;
+  while (buttonEvents.pop(event))
+  {
+    uint32_t latency = millis() - event.timestampMs;
+    if (latency > maxQueueLatencyMs)
+    {
+      maxQueueLatencyMs = latency;
+      Serial.printf("Event queue: max latency=%ums, high water=%u/%u, dropped=%u\n", latency,
+                    buttonEvents.highWater(), EVENT_QUEUE_CAPACITY, buttonEvents.rejected());
+    }
+    if (event.uploadDiagnostics)
+    {
+      startFileUpload();
+    }
+    recordObservation(event.success, event.timestampMs, LO_RESULT_CODE, LO_CODE_SYSTEM, "");
+    updateDiagnostic(event.label, event.success, event.timestampMs);
+  }
+}
+
+void recordObservation(bool success, uint32_t recordedAt, const char *code, const char *system, const char *display)
+{
+  int value = success ? 0 : 1;
+  if (observationBatch.full())
+  {
+    publishObservations();
   }
-  StaticJsonDocument<200> doc;
-  doc["value"] = value;
-  doc["unit"] = "status";
-  StaticJsonDocument<200> codeObj;
-  codeObj["code"] = code;
-  codeObj["system"] = system;
   // fn argument display variable results in null.
-  codeObj["display"] = "btn_press_event";
-  JsonArray coding = doc.createNestedArray("coding");
-  coding.add(codeObj);
-  char jsonBuffer[1024];
-  serializeJson(doc, jsonBuffer);
+  observationBatch.add({value, "status", code, system, "btn_press_event", recordedAt});
+}
+
+void publishObservations()
+{
+  if (observationBatch.empty())
+  {
+    return;
+  }
+  uint32_t id = nextCorrelationId++;
+  if (id == 0)
+  {
+    id = nextCorrelationId++;
+  }
+  char correlationId[9];
+  snprintf(correlationId, sizeof(correlationId), "%08x", id);
+
+  // A single observation is sent as a plain object, several as an array.
+  bool asArray = observationBatch.size() > 1;
+  observationPayload.clear();
+  if (asArray)
+  {
+    observationPayload.beginArray();
+  }
+  for (size_t i = 0; i < observationBatch.size(); i++)
+  {
+    const Observation &o = observationBatch.at(i);
+    writeObservation(observationPayload, o.value, o.unit, o.code, o.system, o.display, correlationId);
+  }
+  if (asArray)
+  {
+    observationPayload.endArray();
+  }
+  observationBatch.clear();
+  if (!observationPayload.ok())
+  {
+    Serial.println("Observation payload too large, dropped");
+    return;
+  }
+  Serial.printf("publishing %u bytes, correlationId=%s\n", observationPayload.length(), correlationId);
+  publishOrStore(observationPayload.c_str(), observationPayload.length());
+}
+
+void publishOrStore(const char *payload, size_t length)
+{
+  // Stored first and published by drainOutbox(), which keeps the order.
+  if (outbox.append(payload, length))
+  {
+    return;
+  }
+  // Without room in the outbox it is only kept in RAM while in flight.
+  if (mqttClient.connected() && inFlight.send(correlationIdOf(payload, length), payload, length, millis()))
+  {
+    Serial.printf("Outbox full, published observation without storing it (%u dropped)\n", outbox.droppedRecords());
+    return;
+  }
+  Serial.printf("Outbox full, dropped observation (%u dropped)\n", outbox.droppedRecords());
+}
+
+void drainOutbox()
+{
+  if (outboxRewindPending && inFlight.empty())
+  {
+    outbox.rewind();
+    storedInFlightCount = 0;
+    outboxRewindPending = false;
+  }
+  for (int i = 0; i < OUTBOX_DRAIN_PER_LOOP && !outboxRewindPending && !outbox.allSent() && !inFlight.full() &&
+                  storedInFlightCount < FHIR_INGEST_WINDOW_SIZE && mqttClient.connected();
+       i++)
+  {
+    size_t length;
+    if (!outbox.peekUnsent(outboxRecord, sizeof(outboxRecord), &length))
+    {
+      return;
+    }
+    uint32_t id = correlationIdOf(outboxRecord, length);
+    if (!inFlight.send(id, outboxRecord, length, millis()))
+    {
+      return;
+    }
+    outbox.markSent();
+    storedInFlight[storedInFlightCount++] = {id, false};
+  }
+}
+
+// Marks the stored record with `id` as answered and pops the answered records
+// at the head of the outbox. False when `id` is not a stored record in flight.
+bool settleStoredObservation(uint32_t id)
+{
+  size_t i = 0;
+  while (i < storedInFlightCount && storedInFlight[i].id != id)
+  {
+    i++;
+  }
+  if (i == storedInFlightCount)
+  {
+    return false;
+  }
+  storedInFlight[i].answered = true;
+  size_t settled = 0;
+  while (settled < storedInFlightCount && storedInFlight[settled].answered)
+  {
+    outbox.pop();
+    settled++;
+  }
+  if (settled > 0)
+  {
+    storedInFlightCount -= settled;
+    memmove(storedInFlight, storedInFlight + settled, storedInFlightCount * sizeof(StoredInFlight));
+    Serial.printf("delivered stored observation, %u bytes left in outbox (%u corrupt skipped)\n",
+                  outbox.pendingBytes(), outbox.corruptRecords());
+  }
+  return true;
+}
+
+bool publishObservationPayload(const char *payload, size_t length)
+{
   // retained and qos are required.
-  bool pubResp = mqttClient.publish(LO_FHIR_INGEST_RULES_TOPIC.c_str(), jsonBuffer, false, 1);
-  Serial.print("pub response ");
-  Serial.println(pubResp);
+  if (!mqttClient.publish(LO_FHIR_INGEST_RULES_TOPIC.c_str(), payload, length, false, FHIR_INGEST_QOS))
+  {
+    return false;
+  }
+  loopStats.countPublish();
+  return true;
+}
+
+void observationGivenUp(uint32_t id, const char *payload, size_t length, InFlightOutcome outcome, uint8_t attempts)
+{
+  const char *cause = outcome == InFlightTimedOut ? "no reply" : "rejected";
+  if (outcome == InFlightTimedOut)
+  {
+    // Most likely the broker or the rule is unreachable; keep it for later.
+    for (size_t i = 0; i < storedInFlightCount; i++)
+    {
+      if (storedInFlight[i].id == id)
+      {
+        Serial.printf("Observation %08x given up after %u attempts (%s), kept in the outbox\n", id, attempts, cause);
+        outboxRewindPending = true;
+        return;
+      }
+    }
+    Serial.printf("Observation %08x given up after %u attempts (%s), moved back to the outbox\n", id, attempts, cause);
+    if (!outbox.append(payload, length))
+    {
+      Serial.printf("Outbox full, dropped observation (%u dropped)\n", outbox.droppedRecords());
+    }
+    return;
+  }
+  settleStoredObservation(id);
+  Serial.printf("Observation %08x given up after %u attempts (%s), dropped (%u failed)\n", id, attempts, cause,
+                inFlight.statistics().failed);
 }
 
-void updateDiagnostic(String val)
+// Observation payloads start with {"correlationId":"<8 hex digits>" (inside
+// a [ for batches), see writeObservation(). Returns 0 when there is none.
+uint32_t correlationIdOf(const char *payload, size_t length)
 {
-  diagFileBuffer += val + "\n";
+  static const char prefix[] = "{\"correlationId\":\"";
+  const size_t prefixLength = sizeof(prefix) - 1;
+  size_t start = length > 0 && payload[0] == '[' ? 1 : 0;
+  if (length < start + prefixLength + 8 || memcmp(payload + start, prefix, prefixLength) != 0)
+  {
+    return 0;
+  }
+  char digits[9];
+  memcpy(digits, payload + start + prefixLength, 8);
+  digits[8] = '\0';
+  return strtoul(digits, NULL, 16);
 }
 
+void updateDiagnostic(const char *label, bool success, uint32_t timestampMs)
+{
+  diagnosticLog.record(timestampMs, label, success);
+}
+
+// Renders the diagnostic log one line at a time while HTTPClient sends it,
+// so the text of the whole file is never held in RAM.
+class DiagnosticStream : public Stream
+{
+public:
+  explicit DiagnosticStream(size_t records)
+      : records(records), remaining(diagnosticLog.renderedLength(records)), total(remaining) {}
+
+  size_t length() const { return total; }
+  int available() override { return remaining; }
+  int peek() override { return fill() ? line[linePos] : -1; }
+  int read() override
+  {
+    if (!fill())
+    {
+      return -1;
+    }
+    remaining--;
+    return line[linePos++];
+  }
+  size_t write(uint8_t) override { return 0; }
+
+private:
+  bool fill()
+  {
+    if (linePos < lineLength)
+    {
+      return true;
+    }
+    if (next >= records)
+    {
+      return false;
+    }
+    lineLength = diagnosticLog.render(next++, line, sizeof(line));
+    linePos = 0;
+    return lineLength > 0;
+  }
+
+  size_t records;
+  size_t remaining;
+  size_t total;
+  size_t next = 0;
+  char line[48];
+  size_t lineLength = 0;
+  size_t linePos = 0;
+};
+
+// Gzip-compresses a stream while HTTPClient reads it, INPUT_CHUNK bytes of
+// text at a time, so RAM use does not grow with the log. The upload URL needs
+// a Content-Length, so the text is compressed twice: measure() only counts
+// the compressed bytes, then begin() produces them again for the request.
+// The encoder itself is static (about 4.5 KB).
+class GzipStream : public Stream
+{
+public:
+  GzipStream() : encoder(collect, this) {}
+
+  // The compressed length of `source`, whose output is not kept.
+  size_t measure(Stream &source)
+  {
+    start(source, true);
+    while (pump())
+    {
+    }
+    return produced;
+  }
+
+  // Produces the compressed `source`, `length` bytes as measure() counted.
+  void begin(Stream &source, size_t length)
+  {
+    start(source, false);
+    remaining = length;
+  }
+
+  int available() override { return remaining; }
+  int peek() override { return fill() ? out[outPos] : -1; }
+  int read() override
+  {
+    if (!fill())
+    {
+      return -1;
+    }
+    remaining--;
+    return out[outPos++];
+  }
+  size_t write(uint8_t) override { return 0; }
+
+private:
+  static const size_t INPUT_CHUNK = 48;
+
+  void start(Stream &source, bool counting)
+  {
+    this->source = &source;
+    this->counting = counting;
+    produced = 0;
+    remaining = 0;
+    outLength = 0;
+    outPos = 0;
+    finished = false;
+    encoder.reset();
+  }
+
+  // Feeds the encoder one chunk of text; false once the trailer is out.
+  bool pump()
+  {
+    if (finished)
+    {
+      return false;
+    }
+    uint8_t chunk[INPUT_CHUNK];
+    size_t n = 0;
+    while (n < INPUT_CHUNK && source->available() > 0)
+    {
+      chunk[n++] = source->read();
+    }
+    if (n > 0)
+    {
+      encoder.write(chunk, n);
+    }
+    else
+    {
+      encoder.finish();
+      finished = true;
+    }
+    return true;
+  }
+
+  bool fill()
+  {
+    while (outPos == outLength)
+    {
+      outPos = 0;
+      outLength = 0;
+      if (!pump())
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static void collect(void *context, const uint8_t *bytes, size_t count)
+  {
+    GzipStream *self = (GzipStream *)context;
+    self->produced += count;
+    if (!self->counting)
+    {
+      memcpy(self->out + self->outLength, bytes, count);
+      self->outLength += count;
+    }
+  }
+
+  Stream *source = nullptr;
+  bool counting = false;
+  bool finished = false;
+  size_t produced = 0;
+  size_t remaining = 0;
+  // Output of one pump(), read before the next one.
+  uint8_t out[GzipEncoder::maxOutput(INPUT_CHUNK)];
+  size_t outLength = 0;
+  size_t outPos = 0;
+  GzipEncoder encoder;
+};
+
+GzipStream diagnosticGzip;
+
 void startFileUpload()
 {
   StaticJsonDocument<200> doc;
@@ -196,41 +753,155 @@ void startFileUpload()
   serializeJson(doc, jsonBuffer);
   Serial.println(jsonBuffer);
   bool pubResp = mqttClient.publish(LO_FILE_UPLOAD_RULES_TOPIC.c_str(), jsonBuffer, false, 1);
+  if (pubResp)
+  {
+    loopStats.countPublish();
+  }
   Serial.print("pub response ");
   Serial.println(pubResp);
 }
 
-void handleMessage(String &topic, String &payload)
+void handleMessage(MQTTClient *client, char topic[], char payload[], int length)
+{
+  if (!router.dispatch(topic, payload, length))
+  {
+    Serial.printf("Ignoring message on unexpected topic %s\n", topic);
+  }
+}
+
+void logMessage(const char *topic, const TopicParams &params, char *payload, int length)
 {
   Serial.print("Message received on topic: ");
   Serial.println(topic);
   Serial.print("Payload: ");
-  Serial.println(payload);
+  Serial.write((const uint8_t *)payload, length);
+  Serial.println();
+}
+
+void fhirIngestAccepted(const char *topic, const TopicParams &params, char *payload, int length)
+{
+  handleFhirIngestReply(payload, length, true);
+}
+
+void fhirIngestRejected(const char *topic, const TopicParams &params, char *payload, int length)
+{
+  logMessage(topic, params, payload, length);
+  handleFhirIngestReply(payload, length, false);
+}
 
-  // unmarshall payload, extract uploadUrl
-  DynamicJsonDocument doc(2048);
-  DeserializationError err = deserializeJson(doc, payload);
+void handleFhirIngestReply(char *payload, int length, bool accepted)
+{
+  // Only the correlation id is needed from the reply.
+  StaticJsonDocument<32> filter;
+  filter["correlationId"] = true;
+  StaticJsonDocument<64> doc;
+  uint32_t id = 0;
+  if (!deserializeJson(doc, payload, length, DeserializationOption::Filter(filter)))
+  {
+    id = strtoul(doc["correlationId"] | "0", NULL, 16);
+  }
+  if (!inFlight.acknowledge(id, accepted, millis()))
+  {
+    if (id == 0)
+    {
+      Serial.printf("Reply without a correlationId dropped (%u so far)\n", inFlight.statistics().uncorrelated);
+      return;
+    }
+    Serial.printf("Reply for observation %08x matches nothing in flight\n", id);
+    return;
+  }
+  if (accepted)
+  {
+    settleStoredObservation(id);
+  }
+  const InFlightStats &stats = inFlight.statistics();
+  Serial.printf("Observation %08x %s: latency=%ums (max=%ums, avg=%ums), in flight=%u, retries=%u, failed=%u\n", id,
+                accepted ? "accepted" : "rejected", stats.lastLatencyMs, stats.maxLatencyMs,
+                stats.accepted ? stats.totalLatencyMs / stats.accepted : 0, inFlight.size(), stats.retries, stats.failed);
+}
+
+void fileUploadAccepted(const char *topic, const TopicParams &params, char *payload, int length)
+{
+  logMessage(topic, params, payload, length);
+
+  // Only the uploadUrl is needed from the reply.
+  StaticJsonDocument<32> filter;
+  filter["uploadUrl"] = true;
+  StaticJsonDocument<64> doc;
+  DeserializationError err = deserializeJson(doc, payload, length, DeserializationOption::Filter(filter));
   if (err)
   {
     Serial.print("Deserialization Error: ");
     Serial.println(err.c_str());
   }
 
-
   if (!doc["uploadUrl"].isNull())
   {
     HTTPClient http;
-    http.begin(wifiClient, doc["uploadUrl"]);
+    http.begin(httpsClient, doc["uploadUrl"]);
     http.addHeader("Content-Type", "text/plain");
-    http.addHeader("Content-Length", String(diagFileBuffer.length()));
-    int response = http.PUT(diagFileBuffer);
+    // Records added after this point stay in the log for the next upload.
+    size_t records = diagnosticLog.size();
+    DiagnosticStream text(records);
+    size_t textLength = text.length();
+    size_t bodyLength = textLength;
+    uint32_t started = millis();
+    Stream *body = &text;
+#if DIAGNOSTIC_UPLOAD_GZIP
+    DiagnosticStream counted(records);
+    DiagnosticStream sent(records);
+    size_t gzipLength = records > 0 ? diagnosticGzip.measure(counted) : 0;
+    if (records > 0 && gzipLength < textLength)
+    {
+      bodyLength = gzipLength;
+      diagnosticGzip.begin(sent, gzipLength);
+      body = &diagnosticGzip;
+      http.addHeader("Content-Encoding", "gzip");
+    }
+#endif
+    int response = records > 0 ? http.sendRequest("PUT", body, bodyLength) : http.PUT("");
     if (response >= 200 && response < 300)
     {
-      diagFileBuffer = "";
+      diagnosticLog.discard(records);
+      Serial.printf("Uploaded %u diagnostic records: %u bytes sent for %u bytes of text in %lums (%u dropped so far)\n",
+                    records, bodyLength, textLength, millis() - started, diagnosticLog.droppedRecords());
     }
     else
     {
       Serial.printf("Error uploading diagnostic file: %d\n", response);
     }
+    http.end();
+    reportTls("HTTPS", httpsClient);
+  }
+}
+
+void reportLoopStats()
+{
+  static uint32_t windowStarted = 0;
+  uint32_t elapsed = millis() - windowStarted;
+  if (LOOP_STATS_INTERVAL_MS == 0 || elapsed < LOOP_STATS_INTERVAL_MS)
+  {
+    return;
+  }
+  Serial.printf("Loop: %u ticks, p50=%uus p95=%uus p99=%uus max=%uus, %u publishes (%.2f/s), free heap=%u (min %u)\n",
+                loopStats.ticks(), loopStats.percentileUs(50), loopStats.percentileUs(95), loopStats.percentileUs(99),
+                loopStats.maxUs(), loopStats.publishes(), loopStats.publishes() * 1000.0 / elapsed, ESP.getFreeHeap(),
+                ESP.getMinFreeHeap());
+  loopStats.reset();
+  windowStarted = millis();
+}
+
+void reportTls(const char *label, const SecureClient &client)
+{
+#if TLS_SESSION_RESUMPTION
+  const TlsStats &stats = client.stats();
+  uint32_t full = stats.handshakes - stats.resumed;
+  if (client.lastError() != 0)
+  {
+    Serial.printf("%s TLS handshake failed: -0x%04x\n", label, -client.lastError());
   }
+  Serial.printf("%s TLS: last handshake %ums, %u/%u resumed, avg full=%ums resumed=%ums, %u failed\n", label,
+                stats.lastHandshakeMs, stats.resumed, stats.handshakes, full ? stats.fullHandshakeMs / full : 0,
+                stats.resumed ? stats.resumedHandshakeMs / stats.resumed : 0, stats.failures);
+#endif
 }
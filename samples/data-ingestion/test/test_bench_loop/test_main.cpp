@@ -0,0 +1,130 @@
+#include <Arduino.h>
+#include <M5Core2.h>
+#include <WiFi.h>
+#include <MQTTClient.h>
+#include <HTTPClient.h>
+#include <LoopBench.h>
+#include <unity.h>
+
+// Runs the whole sketch (src/main.cpp, see [env:native_loop]) against the
+// fakes: setup() starts the network task, the test calls loop() as the UI
+// task would, presses the buttons and plays the broker and the upload server.
+// Each scenario reports the network task's "Loop:" windows.
+//
+//   pio test -e native_loop -v
+
+void setup();
+void loop();
+extern std::string fhirIngestAcceptedTopic;
+extern std::string fileUploadAcceptedTopic;
+
+// The broker answers like the LifeOmic rules do, after this long.
+const uint32_t REPLY_MS = 150;
+
+static uint32_t uploadedBytes = 0;
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+static std::string correlationIdOf(const std::string &payload)
+{
+  static const std::string key = "\"correlationId\":\"";
+  size_t at = payload.find(key);
+  return at == std::string::npos ? "" : payload.substr(at + key.size(), 8);
+}
+
+static void serveBroker()
+{
+  fakeBroker.respond("$aws/rules/FHIRIngest", [](FakeBroker &broker, const FakeMessage &message)
+                     { broker.send(fhirIngestAcceptedTopic, "{\"correlationId\":\"" + correlationIdOf(message.payload) + "\"}",
+                                   REPLY_MS); });
+  fakeBroker.respond("$aws/rules/CreateFileUploadLink", [](FakeBroker &broker, const FakeMessage &message)
+                     { broker.send(fileUploadAcceptedTopic, "{\"uploadUrl\":\"https://uploads.native/diagnostic.txt\"}",
+                                   REPLY_MS); });
+  fakeHttpServe([](const FakeHttpRequest &request)
+                {
+                  FakeHttpResponse response;
+                  response.status = request.method == "PUT" ? HTTP_CODE_OK : HTTP_CODE_BAD_REQUEST;
+                  uploadedBytes += request.body.size();
+                  return response; });
+}
+
+// The UI task. Each press costs loop() its 500 ms "Calculating Results...".
+static void uiTick()
+{
+  loop();
+  delay(1);
+}
+
+static void pressA()
+{
+  M5.BtnA.fakeRelease();
+  uiTick();
+}
+
+void test_idle_connected()
+{
+  LoopBench bench("data-ingestion/idle");
+  TEST_ASSERT_TRUE(bench.runUntil(10000, uiTick, []() { return fakeBroker.subscriptions().size() >= 4; }));
+  bench.run(5000, uiTick);
+  bench.report();
+  TEST_ASSERT_EQUAL(0, bench.publishes());
+}
+
+void test_button_presses()
+{
+  LoopBench bench("data-ingestion/buttons");
+  size_t before = fakeBroker.published("$aws/rules/FHIRIngest").size();
+  bench.run(8000, pressA);
+  bench.run(6000, uiTick); // the last batch lingers for up to 5 s
+  bench.report();
+  TEST_ASSERT_GREATER_THAN(before, fakeBroker.published("$aws/rules/FHIRIngest").size());
+  TEST_ASSERT_TRUE(bench.logged(" accepted: latency="));
+  TEST_ASSERT_FALSE(bench.logged("given up"));
+}
+
+void test_broker_outage()
+{
+  LoopBench bench("data-ingestion/outage");
+  fakeNetworkUp(false);
+  bench.run(8000, pressA);
+  bench.run(2000, uiTick);
+  TEST_ASSERT_TRUE(bench.logged("publishing "));
+  fakeNetworkUp(true);
+  TEST_ASSERT_TRUE(bench.runUntil(20000, uiTick, [&bench]() { return bench.logged("observation, 0 bytes left in outbox"); }));
+  bench.run(2000, uiTick);
+  bench.report();
+  TEST_ASSERT_FALSE(bench.logged("Outbox full"));
+}
+
+void test_diagnostic_upload()
+{
+  LoopBench bench("data-ingestion/diagnostic-upload");
+  uint32_t before = uploadedBytes;
+  M5.BtnB.fakeRelease();
+  TEST_ASSERT_TRUE(bench.runUntil(10000, uiTick, [&bench]() { return bench.logged("Uploaded "); }));
+  bench.run(2000, uiTick);
+  bench.report();
+  TEST_ASSERT_GREATER_THAN(before, uploadedBytes);
+}
+
+int main(int argc, char **argv)
+{
+  remove(OUTBOX_PATH ".dat");
+  remove(OUTBOX_PATH ".idx");
+  serveBroker();
+  setup();
+  UNITY_BEGIN();
+  RUN_TEST(test_idle_connected);
+  RUN_TEST(test_button_presses);
+  RUN_TEST(test_broker_outage);
+  RUN_TEST(test_diagnostic_upload);
+  int failures = UNITY_END();
+  fakeStopTasks();
+  return failures;
+}
@@ -0,0 +1,237 @@
+#include <Arduino.h>
+#include <WiFi.h>
+#include <WiFiClientSecure.h>
+#include <MQTTClient.h>
+#include <ConnectionManager.h>
+#include <unity.h>
+
+// ConnectionManager wired to the Wi-Fi, TLS socket and broker fakes the way
+// the sketches wire it, ticked every millisecond like loop(), connecting in
+// tick() or, as device-updates and device-provisioning do, in a task.
+//
+//   pio test -e native -f test_connection_manager -v
+
+const uint32_t JOIN_MS = 50;
+const uint32_t HANDSHAKE_MS = 100;
+const uint32_t CONNACK_MS = 20;
+
+static WiFiClientSecure net;
+static MQTTClient client(256);
+static uint32_t connectedCalls = 0;
+static uint32_t randomMax = 0; // the largest `max` asked for
+
+static const ConnectionHooks hooks = {
+    []() { WiFi.begin("native", "native"); },
+    []() { return WiFi.status() == WL_CONNECTED; },
+    []() { return net.connect("localhost", 8883) == 1; },
+    []() { return client.connect("device", true); },
+    []() { return client.connected(); },
+    []() { connectedCalls++; },
+    []()
+    {
+      client.disconnect();
+      net.stop();
+    },
+    []() -> uint32_t { return millis(); },
+    [](uint32_t max) -> uint32_t
+    {
+      randomMax = max > randomMax ? max : randomMax;
+      return esp_random() % max;
+    },
+};
+
+// The task that runs the handshake and CONNACK wait of `backgroundConnection`.
+static ConnectionManager *backgroundConnection = nullptr;
+static TaskHandle_t connectTask = nullptr;
+
+static void connectWorker(void *parameter)
+{
+  for (;;)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    backgroundConnection->runConnect();
+  }
+}
+
+static ConnectionHooks backgroundHooks()
+{
+  ConnectionHooks background = hooks;
+  background.connectInBackground = []() { xTaskNotifyGive(connectTask); };
+  return background;
+}
+
+static ConnectionSettings settings()
+{
+  ConnectionSettings settings;
+  settings.wifiTimeoutMs = 1000;
+  settings.backoffBaseMs = 100;
+  settings.backoffMaxMs = 800;
+  return settings;
+}
+
+// Ticks every millisecond until `done` or `ms` have passed.
+template <typename Done>
+static bool tickUntil(ConnectionManager &connection, uint32_t ms, Done done)
+{
+  unsigned long until = millis() + ms;
+  while (!done() && (long)(millis() - until) < 0)
+  {
+    connection.tick();
+    if (!connection.connecting())
+    {
+      client.loop();
+    }
+    delay(1);
+  }
+  return done();
+}
+
+void setUp()
+{
+  FakeNetworkSettings network;
+  network.joinMs = JOIN_MS;
+  network.tlsHandshakeMs = HANDSHAKE_MS;
+  fakeNetworkConfigure(network);
+  fakeNetworkUp(true);
+  WiFi.disconnect();
+  fakeBroker.reset();
+  FakeBrokerSettings broker;
+  broker.connackMs = CONNACK_MS;
+  fakeBroker.configure(broker);
+  net.stop();
+  connectedCalls = 0;
+  randomMax = 0;
+}
+
+void tearDown()
+{
+}
+
+static void test_first_connection_is_timed_from_the_first_tick()
+{
+  // The manager is built at boot and first ticked once setup() is done.
+  ConnectionManager connection(hooks, settings());
+  delay(500);
+  TEST_ASSERT_TRUE(tickUntil(connection, 2000, [&]() { return connection.connected(); }));
+
+  const ConnectionMetrics &metrics = connection.metrics();
+  TEST_ASSERT_EQUAL(1, metrics.connects);
+  TEST_ASSERT_EQUAL(1, connectedCalls);
+  TEST_ASSERT_EQUAL(0, metrics.failedAttempts);
+  // Join, handshake and CONNACK, not the 500 ms before the first tick().
+  TEST_ASSERT_UINT32_WITHIN(60, JOIN_MS + HANDSHAKE_MS + CONNACK_MS + 30, metrics.lastReconnectMs);
+  printf("BENCH first connection: %u ms (join %u, handshake %u, CONNACK %u), worst tick %u ms\n",
+         metrics.lastReconnectMs, JOIN_MS, HANDSHAKE_MS, CONNACK_MS, metrics.worstTickMs);
+}
+
+static void test_only_handshake_and_connack_block()
+{
+  ConnectionManager connection(hooks, settings());
+  // Wi-Fi down for a while: ticks return at once.
+  fakeNetworkUp(false);
+  tickUntil(connection, 1500, []() { return false; });
+  TEST_ASSERT_FALSE(connection.connected());
+  TEST_ASSERT_TRUE(connection.metrics().failedAttempts > 0);
+  TEST_ASSERT_LESS_OR_EQUAL(5, connection.metrics().worstTickMs);
+
+  fakeNetworkUp(true);
+  TEST_ASSERT_TRUE(tickUntil(connection, 3000, [&]() { return connection.connected(); }));
+  // The longest tick is the handshake (or CONNACK), not the join.
+  TEST_ASSERT_UINT32_WITHIN(15, HANDSHAKE_MS + 5, connection.metrics().worstTickMs);
+}
+
+static void test_broker_outage_backs_off_and_reconnects()
+{
+  ConnectionManager connection(hooks, settings());
+  TEST_ASSERT_TRUE(tickUntil(connection, 2000, [&]() { return connection.connected(); }));
+
+  FakeBrokerSettings refusing;
+  refusing.connackMs = CONNACK_MS;
+  refusing.accepting = false;
+  fakeBroker.configure(refusing);
+  fakeBroker.dropConnections();
+  unsigned long droppedAt = millis();
+  uint32_t handshakesBefore = WiFiClientSecure::handshakes();
+  tickUntil(connection, 3000, []() { return false; });
+
+  // Base 100 ms doubling to the 800 ms cap, full jitter: at most
+  // 100 + 200 + 400 + 800 + 800 ms of waiting plus 120 ms per attempt in 3 s,
+  // and never the tight loop a fixed delay(100) retry would be.
+  uint32_t attempts = WiFiClientSecure::handshakes() - handshakesBefore;
+  TEST_ASSERT_TRUE(attempts >= 3);
+  TEST_ASSERT_TRUE(attempts <= 20);
+  TEST_ASSERT_EQUAL(settings().backoffMaxMs + 1, randomMax);
+  // The last handshake may still be waiting for its CONNACK step.
+  TEST_ASSERT_UINT32_WITHIN(1, attempts, connection.metrics().failedAttempts + 1);
+
+  fakeBroker.configure(FakeBrokerSettings());
+  TEST_ASSERT_TRUE(tickUntil(connection, 3000, [&]() { return connection.connected(); }));
+  const ConnectionMetrics &metrics = connection.metrics();
+  TEST_ASSERT_EQUAL(2, metrics.connects);
+  TEST_ASSERT_EQUAL(2, connectedCalls);
+  TEST_ASSERT_LESS_OR_EQUAL(millis() - droppedAt, metrics.lastReconnectMs);
+  TEST_ASSERT_TRUE(metrics.lastReconnectMs >= 3000);
+  printf("BENCH broker outage of 3 s: %u attempts, reconnected %u ms after the drop, worst tick %u ms\n", attempts,
+         metrics.lastReconnectMs, metrics.worstTickMs);
+}
+
+static void test_background_connect_never_blocks_a_tick()
+{
+  ConnectionManager connection(backgroundHooks(), settings());
+  backgroundConnection = &connection;
+  TEST_ASSERT_TRUE(tickUntil(connection, 2000, [&]() { return connection.connected(); }));
+  TEST_ASSERT_EQUAL(1, connectedCalls);
+
+  // Broker down, then a reconnect() asked for while an attempt is running.
+  FakeBrokerSettings refusing;
+  refusing.connackMs = CONNACK_MS;
+  refusing.accepting = false;
+  fakeBroker.configure(refusing);
+  fakeBroker.dropConnections();
+  tickUntil(connection, 2000, []() { return false; });
+  TEST_ASSERT_TRUE(connection.metrics().failedAttempts > 0);
+  TEST_ASSERT_TRUE(tickUntil(connection, 2000, [&]() { return connection.connecting(); }));
+  connection.reconnect();
+  fakeBroker.configure(FakeBrokerSettings());
+  TEST_ASSERT_TRUE(tickUntil(connection, 3000, [&]() { return connection.connected(); }));
+
+  const ConnectionMetrics &metrics = connection.metrics();
+  TEST_ASSERT_EQUAL(2, connectedCalls);
+  TEST_ASSERT_LESS_OR_EQUAL(5, metrics.worstTickMs);
+  printf("BENCH background connect: %u failed attempts, worst tick %u ms (handshake %u ms, CONNACK %u ms)\n",
+         metrics.failedAttempts, metrics.worstTickMs, HANDSHAKE_MS, CONNACK_MS);
+}
+
+static void test_fleet_retries_are_spread()
+{
+  // 200 devices dropped by the same outage: the first retry of each.
+  ConnectionManager connection(hooks, settings());
+  const int devices = 200;
+  uint32_t buckets[4] = {};
+  for (int i = 0; i < devices; i++)
+  {
+    uint32_t delayMs = connection.backoffDelay(0);
+    TEST_ASSERT_LESS_OR_EQUAL(settings().backoffBaseMs, delayMs);
+    buckets[delayMs * 4 / (settings().backoffBaseMs + 1)]++;
+  }
+  for (uint32_t bucket : buckets)
+  {
+    TEST_ASSERT_UINT32_WITHIN(devices / 8, devices / 4, bucket);
+  }
+  TEST_ASSERT_LESS_OR_EQUAL(settings().backoffMaxMs, connection.backoffDelay(30));
+}
+
+int main(int argc, char **argv)
+{
+  client.begin("localhost", 8883, net);
+  xTaskCreate(connectWorker, "connect", 8192, NULL, 1, &connectTask);
+  UNITY_BEGIN();
+  RUN_TEST(test_first_connection_is_timed_from_the_first_tick);
+  RUN_TEST(test_only_handshake_and_connack_block);
+  RUN_TEST(test_broker_outage_backs_off_and_reconnects);
+  RUN_TEST(test_background_connect_never_blocks_a_tick);
+  RUN_TEST(test_fleet_retries_are_spread);
+  int failures = UNITY_END();
+  fakeStopTasks();
+  return failures;
+}
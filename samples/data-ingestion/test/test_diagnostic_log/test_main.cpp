@@ -0,0 +1,160 @@
+#include <Arduino.h>
+#include <DiagnosticLog.h>
+#include <string>
+#include <unity.h>
+
+// DiagnosticLog overflow policies and rendering, and a soak of millions of
+// records against the String the sketch used to append to.
+//
+//   pio test -e native -f test_diagnostic_log -v
+
+const uint32_t SOAK_RECORDS = 5000000;
+// An upload every this many button presses; the rest of the time the device
+// is offline.
+const uint32_t UPLOAD_EVERY = 20000;
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+static std::string rendered(const DiagnosticLog<4> &log)
+{
+  std::string text;
+  char line[48];
+  for (size_t i = 0; i < log.size(); i++)
+  {
+    log.render(i, line, sizeof(line));
+    text += line;
+  }
+  return text;
+}
+
+static void test_drop_oldest_keeps_the_latest()
+{
+  DiagnosticLog<4> log(DropOldest);
+  for (uint32_t t = 1; t <= 6; t++)
+  {
+    log.record(t, "BtnA", t % 2 == 0);
+  }
+  TEST_ASSERT_EQUAL(4, log.size());
+  TEST_ASSERT_EQUAL(2, log.droppedRecords());
+  std::string text = rendered(log);
+  TEST_ASSERT_EQUAL_STRING("3 Btn=BtnA;result=fail\n4 Btn=BtnA;result=success\n"
+                           "5 Btn=BtnA;result=fail\n6 Btn=BtnA;result=success\n",
+                           text.c_str());
+  TEST_ASSERT_EQUAL(text.size(), log.renderedLength(log.size()));
+}
+
+static void test_drop_newest_keeps_the_first()
+{
+  DiagnosticLog<4> log(DropNewest);
+  for (uint32_t t = 1; t <= 6; t++)
+  {
+    log.record(t, "BtnB", false);
+  }
+  TEST_ASSERT_EQUAL(4, log.size());
+  TEST_ASSERT_EQUAL(2, log.droppedRecords());
+  std::string text = rendered(log);
+  TEST_ASSERT_EQUAL_STRING("1 Btn=BtnB;result=fail\n2 Btn=BtnB;result=fail\n"
+                           "3 Btn=BtnB;result=fail\n4 Btn=BtnB;result=fail\n",
+                           text.c_str());
+}
+
+static void test_discard_after_upload_and_long_labels()
+{
+  DiagnosticLog<4> log;
+  log.record(1, "BtnA", true);
+  log.record(2, "BtnC", true);
+  // Uploaded while a third press came in: only the first two are removed.
+  // The long label arrives at run time, as Button::label() does.
+  std::string longLabel = "LongLabel";
+  log.record(3, longLabel.c_str(), false);
+  log.discard(2);
+  std::string text = rendered(log);
+  TEST_ASSERT_EQUAL_STRING("3 Btn=Long;result=fail\n", text.c_str());
+  log.discard(10);
+  TEST_ASSERT_TRUE(log.empty());
+}
+
+// The text an upload sends, as DiagnosticStream renders it.
+static size_t upload(DiagnosticLog<512> &log)
+{
+  size_t records = log.size();
+  size_t length = log.renderedLength(records);
+  size_t sent = 0;
+  char line[48];
+  for (size_t i = 0; i < records; i++)
+  {
+    sent += log.render(i, line, sizeof(line));
+  }
+  TEST_ASSERT_EQUAL(length, sent);
+  log.discard(records);
+  return sent;
+}
+
+static void test_soak()
+{
+  static DiagnosticLog<512> log(DropOldest);
+  const char *labels[] = {"BtnA", "BtnB", "BtnC"};
+  uint64_t allocations = fakeHeapAllocations();
+  size_t heapBefore = fakeHeapInUse();
+  uint64_t uploadedBytes = 0;
+  unsigned long started = micros();
+  for (uint32_t i = 1; i <= SOAK_RECORDS; i++)
+  {
+    log.record(i * 37, labels[i % 3], i % 5 != 0);
+    if (i % UPLOAD_EVERY == 0)
+    {
+      uploadedBytes += upload(log);
+    }
+  }
+  unsigned long elapsed = micros() - started;
+  TEST_ASSERT_EQUAL(0, fakeHeapAllocations() - allocations);
+  TEST_ASSERT_EQUAL(heapBefore, fakeHeapInUse());
+  TEST_ASSERT_EQUAL(SOAK_RECORDS / UPLOAD_EVERY * (UPLOAD_EVERY - 512), log.droppedRecords());
+  printf("BENCH DiagnosticLog<512>: %u records in %.2f s (%.1f M records/s, uploads rendered), "
+         "%u dropped, %.1f MB uploaded, %u bytes fixed, 0 heap allocations\n",
+         SOAK_RECORDS, elapsed / 1e6, SOAK_RECORDS / (double)elapsed, log.droppedRecords(), uploadedBytes / 1e6,
+         (unsigned)sizeof(log));
+
+  // The String the sketch appended to, for the same presses. It grows until
+  // an upload; an offline device runs out of heap.
+  String diagFileBuffer;
+  allocations = fakeHeapAllocations();
+  fakeResetMinFreeHeap();
+  uint32_t outOfHeapAt = 0;
+  started = micros();
+  for (uint32_t i = 1; i <= SOAK_RECORDS; i++)
+  {
+    String val = String(i * 37) + " Btn=" + labels[i % 3] + ";result=" + (i % 5 != 0 ? "success" : "fail");
+    diagFileBuffer += val + "\n";
+    if (outOfHeapAt == 0 && ESP.getMinFreeHeap() == 0)
+    {
+      outOfHeapAt = i;
+    }
+    if (i % UPLOAD_EVERY == 0)
+    {
+      diagFileBuffer = String();
+    }
+  }
+  elapsed = micros() - started;
+  printf("BENCH String +=:            %u records in %.2f s, %.1f heap allocations per record, "
+         "peak %u bytes in use, device heap (%u) exhausted after %u records\n",
+         SOAK_RECORDS, elapsed / 1e6, (double)(fakeHeapAllocations() - allocations) / SOAK_RECORDS,
+         ESP.getHeapSize() - ESP.getMinFreeHeap(), ESP.getHeapSize(), outOfHeapAt);
+  TEST_ASSERT_NOT_EQUAL(0, outOfHeapAt);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_drop_oldest_keeps_the_latest);
+  RUN_TEST(test_drop_newest_keeps_the_first);
+  RUN_TEST(test_discard_after_upload_and_long_labels);
+  RUN_TEST(test_soak);
+  return UNITY_END();
+}
@@ -0,0 +1,179 @@
+#include <Arduino.h>
+#include <WiFi.h>
+#include <WiFiClientSecure.h>
+#include <HTTPClient.h>
+#include <TopicRouter.h>
+#include <string>
+#include <zlib.h>
+#include <unity.h>
+
+// The sketch's diagnostic upload (src/main.cpp, see [env:native_loop]) against
+// the HTTP stand-in on a slow uplink: the body must gunzip to the log text,
+// peak heap must not grow with the log, and each log size reports the bytes
+// saved, upload time and peak heap.
+//
+//   pio test -e native_loop -f test_diagnostic_upload -v
+
+void updateDiagnostic(const char *label, bool success, uint32_t timestampMs);
+void fileUploadAccepted(const char *topic, const TopicParams &params, char *payload, int length);
+
+// About 256 kbit/s, a weak Wi-Fi link.
+const uint32_t UPLINK_BYTES_PER_SECOND = 32 * 1024;
+
+static FakeHttpRequest lastRequest;
+static uint32_t requests = 0;
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+static std::string gunzip(const std::string &body)
+{
+  z_stream z = {};
+  TEST_ASSERT_EQUAL(Z_OK, inflateInit2(&z, 16 + MAX_WBITS));
+  std::string text;
+  char out[4096];
+  z.next_in = (Bytef *)body.data();
+  z.avail_in = body.size();
+  int status;
+  do
+  {
+    z.next_out = (Bytef *)out;
+    z.avail_out = sizeof(out);
+    status = inflate(&z, Z_NO_FLUSH);
+    text.append(out, sizeof(out) - z.avail_out);
+  } while (status == Z_OK);
+  inflateEnd(&z);
+  TEST_ASSERT_EQUAL(Z_STREAM_END, status);
+  return text;
+}
+
+// Records `count` button presses and returns the text they render to.
+static std::string recordPresses(uint32_t count)
+{
+  const char *labels[] = {"BtnA", "BtnB", "BtnC"};
+  std::string text;
+  for (uint32_t i = 1; i <= count; i++)
+  {
+    uint32_t timestamp = 1000 + i * 1337;
+    bool success = i % 5 != 0;
+    updateDiagnostic(labels[i % 3], success, timestamp);
+    text += std::to_string(timestamp) + " Btn=" + labels[i % 3] + ";result=" + (success ? "success" : "fail") + "\n";
+  }
+  return text;
+}
+
+// Delivers the upload link as the broker would; returns the milliseconds the
+// handler took.
+static unsigned long upload()
+{
+  char payload[] = "{\"uploadUrl\":\"https://uploads.native/diagnostic.txt\"}";
+  TopicParams params;
+  params.count = 0;
+  uint32_t before = requests;
+  unsigned long started = millis();
+  fileUploadAccepted("upload/accepted", params, payload, sizeof(payload) - 1);
+  unsigned long elapsed = millis() - started;
+  TEST_ASSERT_EQUAL(before + 1, requests);
+  return elapsed;
+}
+
+static unsigned long putPlain(const std::string &text)
+{
+  HTTPClient http;
+  WiFiClientSecure net;
+  http.begin(net, "https://uploads.native/diagnostic.txt");
+  unsigned long started = millis();
+  TEST_ASSERT_EQUAL(HTTP_CODE_OK, http.PUT(String(text)));
+  return millis() - started;
+}
+
+static void test_upload_is_gzip_of_the_log()
+{
+  const uint32_t sizes[] = {32, 128, 512};
+  size_t peakHeaps[3];
+  for (size_t i = 0; i < 3; i++)
+  {
+    uint32_t records = sizes[i];
+    std::string text = recordPresses(records);
+    uint32_t freeBefore = ESP.getFreeHeap();
+    fakeResetMinFreeHeap();
+    unsigned long compressedMs = upload();
+    size_t peakHeap = freeBefore - ESP.getMinFreeHeap();
+    size_t sent = lastRequest.body.size();
+
+    TEST_ASSERT_EQUAL_STRING("gzip", lastRequest.headers["Content-Encoding"].c_str());
+    std::string received = gunzip(lastRequest.body);
+    TEST_ASSERT_EQUAL(text.size(), received.size());
+    TEST_ASSERT_TRUE(text == received);
+    TEST_ASSERT_LESS_THAN(text.size(), sent);
+    peakHeaps[i] = peakHeap;
+
+    unsigned long plainMs = putPlain(text);
+    printf("BENCH %3u records: %5u bytes of text sent as %5u (%2.0f%% saved), upload %4lu ms against %4lu ms "
+           "as text at %u KB/s, peak heap +%u bytes\n",
+           records, (unsigned)text.size(), (unsigned)sent, 100.0 * (text.size() - sent) / text.size(), compressedMs, plainMs,
+           UPLINK_BYTES_PER_SECOND / 1024, (unsigned)peakHeap);
+  }
+  // Compressed while it is sent: the same RAM for 32 records as for 512.
+  TEST_ASSERT_EQUAL(peakHeaps[0], peakHeaps[2]);
+}
+
+static void test_text_that_does_not_shrink_is_sent_as_is()
+{
+  // One line is shorter than the gzip header and trailer.
+  std::string text = recordPresses(1);
+  upload();
+  TEST_ASSERT_EQUAL(0, lastRequest.headers.count("Content-Encoding"));
+  TEST_ASSERT_EQUAL_STRING(text.c_str(), lastRequest.body.c_str());
+}
+
+static void test_records_stay_until_the_upload_succeeds()
+{
+  std::string text = recordPresses(10);
+  fakeHttpServe([](const FakeHttpRequest &request)
+                {
+                  lastRequest = request;
+                  requests++;
+                  FakeHttpResponse response;
+                  response.status = HTTP_CODE_INTERNAL_SERVER_ERROR;
+                  return response; });
+  upload();
+  fakeHttpServe([](const FakeHttpRequest &request)
+                {
+                  lastRequest = request;
+                  requests++;
+                  return FakeHttpResponse(); });
+  upload();
+  std::string received = gunzip(lastRequest.body);
+  TEST_ASSERT_EQUAL_STRING(text.c_str(), received.c_str());
+}
+
+int main(int argc, char **argv)
+{
+  FakeNetworkSettings network;
+  network.joinMs = 0;
+  network.tlsHandshakeMs = 0;
+  network.uplinkBytesPerSecond = UPLINK_BYTES_PER_SECOND;
+  fakeNetworkConfigure(network);
+  fakeNetworkUp(true);
+  WiFi.begin("native", "native");
+  while (WiFi.status() != WL_CONNECTED)
+  {
+    delay(1);
+  }
+  fakeHttpServe([](const FakeHttpRequest &request)
+                {
+                  lastRequest = request;
+                  requests++;
+                  return FakeHttpResponse(); });
+  UNITY_BEGIN();
+  RUN_TEST(test_upload_is_gzip_of_the_log);
+  RUN_TEST(test_text_that_does_not_shrink_is_sent_as_is);
+  RUN_TEST(test_records_stay_until_the_upload_succeeds);
+  return UNITY_END();
+}
@@ -0,0 +1,295 @@
+#include <map>
+#include <Arduino.h>
+#include <WiFiClientSecure.h>
+#include <MQTTClient.h>
+#include <InFlightWindow.h>
+#include <unity.h>
+
+// InFlightWindow against the broker stand-in: replies are correlated, late,
+// rejected, missing or without a correlation id, and QoS 1 publishes block
+// for their PUBACK like lwmqtt's do.
+
+const char *INGEST_TOPIC = "ingest";
+const char *ACCEPTED_TOPIC = "device/ingest/accepted";
+const char *REJECTED_TOPIC = "device/ingest/rejected";
+
+enum Reply
+{
+  Accept,
+  Reject,
+  NoReply,
+  Uncorrelated
+};
+
+static WiFiClientSecure net;
+static MQTTClient client(1024);
+static Reply (*decide)(uint32_t id, uint8_t attempt) = nullptr;
+static uint32_t replyMs = 50;
+static std::map<uint32_t, uint8_t> attemptsById;
+static uint32_t givenUpId;
+static InFlightOutcome givenUpOutcome;
+static uint8_t givenUpAttempts;
+static uint32_t givenUpCount;
+static void (*acknowledge)(uint32_t id, bool accepted) = nullptr;
+
+static bool publishPayload(const char *payload, size_t length)
+{
+  return client.publish(INGEST_TOPIC, payload, length, false, 1);
+}
+
+static void givenUp(uint32_t id, const char *payload, size_t length, InFlightOutcome outcome, uint8_t attempts)
+{
+  givenUpId = id;
+  givenUpOutcome = outcome;
+  givenUpAttempts = attempts;
+  givenUpCount++;
+}
+
+static void handleReply(MQTTClient *client, char topic[], char payload[], int length)
+{
+  uint32_t id = 0;
+  sscanf(payload, "{\"correlationId\":\"%8x\"", &id);
+  acknowledge(id, strcmp(topic, ACCEPTED_TOPIC) == 0);
+}
+
+static void broker(FakeBroker &broker, const FakeMessage &message)
+{
+  uint32_t id = 0;
+  sscanf(message.payload.c_str(), "{\"correlationId\":\"%8x\"", &id);
+  char reply[64];
+  snprintf(reply, sizeof(reply), "{\"correlationId\":\"%08x\"}", id);
+  switch (decide ? decide(id, ++attemptsById[id]) : Accept)
+  {
+  case Accept:
+    broker.send(ACCEPTED_TOPIC, reply, replyMs);
+    break;
+  case Reject:
+    broker.send(REJECTED_TOPIC, reply, replyMs);
+    break;
+  case NoReply:
+    break;
+  case Uncorrelated:
+    broker.send(ACCEPTED_TOPIC, "{\"status\":\"ok\"}", replyMs);
+    break;
+  }
+}
+
+template <size_t Slots>
+struct Fixture
+{
+  static InFlightWindow<Slots, 256> *window;
+
+  explicit Fixture(uint32_t timeoutMs = 500, uint32_t retryDelayMs = 50, uint8_t maxAttempts = 3)
+  {
+    window = new InFlightWindow<Slots, 256>(publishPayload, givenUp, timeoutMs, retryDelayMs, maxAttempts);
+    acknowledge = [](uint32_t id, bool accepted) { window->acknowledge(id, accepted, millis()); };
+  }
+  ~Fixture()
+  {
+    delete window;
+    window = nullptr;
+  }
+
+  bool send(uint32_t id)
+  {
+    char payload[64];
+    int length = snprintf(payload, sizeof(payload), "{\"correlationId\":\"%08x\",\"value\":1}", id);
+    return window->send(id, payload, length, millis());
+  }
+
+  // Runs the network side until the window is empty or `ms` have passed.
+  bool drain(uint32_t ms)
+  {
+    unsigned long until = millis() + ms;
+    while (!window->empty() && (long)(millis() - until) < 0)
+    {
+      pump();
+    }
+    return window->empty();
+  }
+
+  void pump()
+  {
+    client.loop();
+    window->poll(millis());
+    delay(1);
+  }
+};
+
+template <size_t Slots>
+InFlightWindow<Slots, 256> *Fixture<Slots>::window = nullptr;
+
+void setUp()
+{
+  fakeBroker.reset();
+  fakeBroker.respond(INGEST_TOPIC, broker);
+  decide = nullptr;
+  replyMs = 50;
+  attemptsById.clear();
+  givenUpCount = 0;
+  givenUpAttempts = 0;
+  TEST_ASSERT_TRUE(client.connect("device"));
+  client.subscribe(ACCEPTED_TOPIC);
+  client.subscribe(REJECTED_TOPIC);
+}
+
+void tearDown()
+{
+  client.disconnect();
+}
+
+void test_accepted_replies_retire_their_payloads()
+{
+  Fixture<4> f;
+  for (uint32_t id = 1; id <= 4; id++)
+  {
+    TEST_ASSERT_TRUE(f.send(id));
+  }
+  TEST_ASSERT_TRUE(f.window->full());
+  TEST_ASSERT_FALSE(f.send(5));
+  TEST_ASSERT_TRUE(f.drain(2000));
+  const InFlightStats &stats = f.window->statistics();
+  TEST_ASSERT_EQUAL(4, stats.accepted);
+  TEST_ASSERT_EQUAL(0, stats.retries);
+  TEST_ASSERT_GREATER_OR_EQUAL(replyMs, stats.maxLatencyMs);
+  TEST_ASSERT_EQUAL(0, givenUpCount);
+}
+
+void test_rejected_payload_is_retried_then_given_up()
+{
+  decide = [](uint32_t id, uint8_t attempt) { return id == 2 ? Reject : Accept; };
+  Fixture<4> f;
+  f.send(1);
+  f.send(2);
+  TEST_ASSERT_TRUE(f.drain(3000));
+  const InFlightStats &stats = f.window->statistics();
+  TEST_ASSERT_EQUAL(1, stats.accepted);
+  TEST_ASSERT_EQUAL(3, stats.rejected);
+  TEST_ASSERT_EQUAL(2, stats.retries);
+  TEST_ASSERT_EQUAL(1, givenUpCount);
+  TEST_ASSERT_EQUAL_HEX32(2, givenUpId);
+  TEST_ASSERT_EQUAL(InFlightRejected, givenUpOutcome);
+  TEST_ASSERT_EQUAL(3, givenUpAttempts);
+}
+
+void test_rejection_then_acceptance_is_one_success()
+{
+  decide = [](uint32_t id, uint8_t attempt) { return attempt == 1 ? Reject : Accept; };
+  Fixture<4> f;
+  f.send(7);
+  TEST_ASSERT_TRUE(f.drain(3000));
+  TEST_ASSERT_EQUAL(1, f.window->statistics().accepted);
+  TEST_ASSERT_EQUAL(1, f.window->statistics().retries);
+  TEST_ASSERT_EQUAL(0, givenUpCount);
+}
+
+void test_missing_reply_times_out_with_the_real_attempt_count()
+{
+  decide = [](uint32_t id, uint8_t attempt) { return NoReply; };
+  Fixture<4> f(200, 50, 2);
+  f.send(3);
+  TEST_ASSERT_TRUE(f.drain(3000));
+  TEST_ASSERT_EQUAL(2, f.window->statistics().timeouts);
+  TEST_ASSERT_EQUAL(1, givenUpCount);
+  TEST_ASSERT_EQUAL(InFlightTimedOut, givenUpOutcome);
+  TEST_ASSERT_EQUAL(2, givenUpAttempts);
+}
+
+void test_late_reply_after_a_retry_is_ignored()
+{
+  // The first reply arrives after the timeout; the retry is answered too.
+  decide = [](uint32_t id, uint8_t attempt)
+  {
+    replyMs = attempt == 1 ? 300 : 20;
+    return Accept;
+  };
+  Fixture<4> f(200, 50, 3);
+  f.send(9);
+  TEST_ASSERT_TRUE(f.drain(3000));
+  unsigned long until = millis() + 400;
+  while ((long)(millis() - until) < 0)
+  {
+    f.pump();
+  }
+  TEST_ASSERT_EQUAL(1, f.window->statistics().accepted);
+  TEST_ASSERT_EQUAL(1, f.window->statistics().retries);
+  TEST_ASSERT_EQUAL(0, givenUpCount);
+}
+
+void test_reply_without_correlation_id_is_dropped_and_counted()
+{
+  decide = [](uint32_t id, uint8_t attempt) { return attempt == 1 ? Uncorrelated : Accept; };
+  Fixture<4> f(300, 50, 3);
+  f.send(4);
+  f.send(5);
+  unsigned long until = millis() + 150;
+  while ((long)(millis() - until) < 0)
+  {
+    f.pump();
+  }
+  // Neither payload was retired by the replies that named none of them.
+  TEST_ASSERT_EQUAL(2, f.window->size());
+  TEST_ASSERT_EQUAL(2, f.window->statistics().uncorrelated);
+  TEST_ASSERT_TRUE(f.drain(3000));
+  TEST_ASSERT_EQUAL(2, f.window->statistics().accepted);
+}
+
+// Observations per second through the window, with the broker answering
+// after replyMs and each QoS 1 publish waiting pubackMs for its PUBACK.
+template <size_t Slots>
+double throughput(uint32_t count)
+{
+  Fixture<Slots> f(2000, 50, 3);
+  uint32_t next = 1;
+  unsigned long started = millis();
+  while (next <= count || !f.window->empty())
+  {
+    while (next <= count && !f.window->full())
+    {
+      TEST_ASSERT_TRUE(f.send(next++));
+    }
+    f.pump();
+  }
+  double seconds = (millis() - started) / 1000.0;
+  const InFlightStats &stats = f.window->statistics();
+  TEST_ASSERT_EQUAL(count, stats.accepted);
+  printf("window=%u: %u observations in %.2fs, %.1f/s, latency avg=%ums max=%ums\n", (unsigned)Slots, count, seconds,
+         count / seconds, stats.totalLatencyMs / stats.accepted, stats.maxLatencyMs);
+  return count / seconds;
+}
+
+void test_pipelining_throughput()
+{
+  FakeBrokerSettings settings;
+  settings.pubackMs = 5;
+  fakeBroker.configure(settings);
+  replyMs = 100;
+  double one = throughput<1>(20);
+  double eight = throughput<8>(160);
+  printf("window of 8 vs 1: %.1fx\n", eight / one);
+  TEST_ASSERT_GREATER_THAN(4 * one, eight);
+}
+
+int main(int argc, char **argv)
+{
+  FakeNetworkSettings network;
+  network.joinMs = 0;
+  network.tlsHandshakeMs = 0;
+  fakeNetworkConfigure(network);
+  WiFi.begin("native", "native");
+  while (WiFi.status() != WL_CONNECTED)
+  {
+    delay(1);
+  }
+  client.begin("localhost", 8883, net);
+  client.onMessageAdvanced(handleReply);
+  UNITY_BEGIN();
+  RUN_TEST(test_accepted_replies_retire_their_payloads);
+  RUN_TEST(test_rejected_payload_is_retried_then_given_up);
+  RUN_TEST(test_rejection_then_acceptance_is_one_success);
+  RUN_TEST(test_missing_reply_times_out_with_the_real_attempt_count);
+  RUN_TEST(test_late_reply_after_a_retry_is_ignored);
+  RUN_TEST(test_reply_without_correlation_id_is_dropped_and_counted);
+  RUN_TEST(test_pipelining_throughput);
+  return UNITY_END();
+}
@@ -0,0 +1,195 @@
+#include <Arduino.h>
+#include <WiFiClientSecure.h>
+#include <MQTTClient.h>
+#include <ObservationBatch.h>
+#include <PayloadWriter.h>
+#include "Config.h"
+#include <unity.h>
+
+// ObservationBatch flush rules, and batched against unbatched publishing
+// through the broker stand-in, where every QoS 1 publish waits for its PUBACK
+// as it does with lwmqtt.
+//
+//   pio test -e native -f test_observation_batch -v
+
+const size_t OBSERVATIONS = 200;
+// Roughly the PUBACK round trip to AWS IoT from a home network.
+const uint32_t PUBACK_MS = 20;
+
+static WiFiClientSecure net;
+static MQTTClient client(4096);
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+static Observation observation(uint32_t recordedAt)
+{
+  return {0, "status", LO_RESULT_CODE, LO_CODE_SYSTEM, "btn_press_event", recordedAt};
+}
+
+static void test_flushes_when_full()
+{
+  ObservationBatch<10> batch(3, 5000);
+  TEST_ASSERT_TRUE(batch.add(observation(0)));
+  TEST_ASSERT_TRUE(batch.add(observation(0)));
+  TEST_ASSERT_FALSE(batch.shouldFlush(0));
+  TEST_ASSERT_TRUE(batch.add(observation(0)));
+  TEST_ASSERT_TRUE(batch.full());
+  TEST_ASSERT_TRUE(batch.shouldFlush(0));
+  TEST_ASSERT_FALSE(batch.add(observation(0)));
+  batch.clear();
+  TEST_ASSERT_FALSE(batch.shouldFlush(0));
+}
+
+static void test_flushes_after_linger()
+{
+  ObservationBatch<10> batch(10, 5000);
+  TEST_ASSERT_FALSE(batch.shouldFlush(0));
+  batch.add(observation(1000));
+  batch.add(observation(5000));
+  TEST_ASSERT_FALSE(batch.shouldFlush(5999));
+  // The oldest observation decides.
+  TEST_ASSERT_TRUE(batch.shouldFlush(6000));
+  // Across the millis() wrap.
+  ObservationBatch<10> wrapped(10, 5000);
+  wrapped.add(observation(0xfffff000));
+  TEST_ASSERT_FALSE(wrapped.shouldFlush(0xfffff000 + 4999));
+  TEST_ASSERT_TRUE(wrapped.shouldFlush(0x00000388));
+}
+
+static void test_size_is_clamped_to_capacity()
+{
+  ObservationBatch<4> batch(0, 5000);
+  for (int i = 0; i < 4; i++)
+  {
+    TEST_ASSERT_TRUE(batch.add(observation(0)));
+  }
+  TEST_ASSERT_FALSE(batch.add(observation(0)));
+  ObservationBatch<4> larger(100, 5000);
+  for (int i = 0; i < 4; i++)
+  {
+    larger.add(observation(0));
+  }
+  TEST_ASSERT_TRUE(larger.full());
+}
+
+// A PUBLISH with its PUBACK as they cross the network: fixed header,
+// remaining length, topic, packet ID and payload, then 4 bytes back.
+static size_t wireBytes(const FakeMessage &message)
+{
+  size_t remaining = 2 + message.topic.size() + 2 + message.payload.size();
+  size_t lengthBytes = remaining < 128 ? 1 : remaining < 16384 ? 2 : 3;
+  return 1 + lengthBytes + remaining + 4;
+}
+
+// Publishes OBSERVATIONS back-to-back readings the way publishObservations()
+// does, and returns the elapsed milliseconds.
+static unsigned long publishAll(size_t batchSize)
+{
+  ObservationBatch<32> batch(batchSize, 5000);
+  JsonWriter<4096> payload;
+  uint32_t id = 1;
+  auto flush = [&]()
+  {
+    char correlationId[9];
+    snprintf(correlationId, sizeof(correlationId), "%08x", id++);
+    payload.clear();
+    if (batch.size() > 1)
+    {
+      payload.beginArray();
+    }
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+      const Observation &o = batch.at(i);
+      writeObservation(payload, o.value, o.unit, o.code, o.system, o.display, correlationId);
+    }
+    if (batch.size() > 1)
+    {
+      payload.endArray();
+    }
+    batch.clear();
+    TEST_ASSERT_TRUE(payload.ok());
+    TEST_ASSERT_TRUE(client.publish(LO_FHIR_INGEST_RULES_TOPIC.c_str(), payload.c_str(), payload.length(), false, 1));
+  };
+
+  unsigned long started = millis();
+  for (size_t i = 0; i < OBSERVATIONS; i++)
+  {
+    batch.add(observation(millis()));
+    if (batch.shouldFlush(millis()))
+    {
+      flush();
+    }
+  }
+  if (!batch.empty())
+  {
+    flush();
+  }
+  return millis() - started;
+}
+
+static void test_batched_against_unbatched()
+{
+  FakeBrokerSettings settings;
+  settings.pubackMs = PUBACK_MS;
+  const size_t sizes[] = {1, 5, 10, 20};
+  double unbatchedRate = 0;
+  size_t unbatchedBytes = 0;
+  for (size_t batchSize : sizes)
+  {
+    fakeBroker.reset();
+    fakeBroker.configure(settings);
+    TEST_ASSERT_TRUE(client.connect("bench"));
+    unsigned long elapsed = publishAll(batchSize);
+    client.disconnect();
+
+    std::vector<FakeMessage> published = fakeBroker.published();
+    size_t bytes = 0;
+    for (const FakeMessage &message : published)
+    {
+      bytes += wireBytes(message);
+    }
+    double rate = OBSERVATIONS * 1000.0 / (elapsed ? elapsed : 1);
+    printf("BENCH batch size %2u: %u observations in %3u publishes, %5lu ms, %7.1f observations/s, "
+           "%6u bytes on the wire (%.0f per observation)\n",
+           (unsigned)batchSize, (unsigned)OBSERVATIONS, (unsigned)published.size(), elapsed, rate, (unsigned)bytes,
+           (double)bytes / OBSERVATIONS);
+    if (batchSize == 1)
+    {
+      unbatchedRate = rate;
+      unbatchedBytes = bytes;
+      TEST_ASSERT_EQUAL(OBSERVATIONS, published.size());
+    }
+    else
+    {
+      TEST_ASSERT_EQUAL((OBSERVATIONS + batchSize - 1) / batchSize, published.size());
+      TEST_ASSERT_TRUE(rate > unbatchedRate * batchSize / 2);
+      TEST_ASSERT_LESS_THAN(unbatchedBytes, bytes);
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  FakeNetworkSettings network;
+  network.joinMs = 0;
+  network.tlsHandshakeMs = 0;
+  fakeNetworkConfigure(network);
+  WiFi.begin("native", "native");
+  while (WiFi.status() != WL_CONNECTED)
+  {
+    delay(1);
+  }
+  client.begin("localhost", 8883, net);
+  UNITY_BEGIN();
+  RUN_TEST(test_flushes_when_full);
+  RUN_TEST(test_flushes_after_linger);
+  RUN_TEST(test_size_is_clamped_to_capacity);
+  RUN_TEST(test_batched_against_unbatched);
+  return UNITY_END();
+}
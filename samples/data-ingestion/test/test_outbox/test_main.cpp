@@ -0,0 +1,405 @@
+#include <Arduino.h>
+#include <Outbox.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string>
+#include <unistd.h>
+#include <unity.h>
+
+// Outbox on a plain directory: order across reboots, torn and corrupt
+// records, records handed out until they are popped, reclaiming drained
+// space, a failed rename, and replay throughput.
+//
+//   pio test -e native -f test_outbox -v
+
+const size_t HEADER_SIZE = 8;
+const size_t RECORD_SIZE = 100;
+const size_t FRAME_SIZE = HEADER_SIZE + RECORD_SIZE;
+
+static char basePath[64];
+static char dataPath[72];
+static char indexPath[72];
+static char tmpPath[76];
+// The next this many rename() calls fail, as SPIFFS's can.
+static int failingRenames = 0;
+
+extern "C" int rename(const char *from, const char *to) noexcept
+{
+  if (failingRenames > 0)
+  {
+    failingRenames--;
+    errno = EIO;
+    return -1;
+  }
+  return renameat(AT_FDCWD, from, AT_FDCWD, to);
+}
+
+static std::string record(unsigned number, size_t size = RECORD_SIZE)
+{
+  char text[16];
+  snprintf(text, sizeof(text), "record %04u", number);
+  std::string payload(text);
+  payload.resize(size, '.');
+  return payload;
+}
+
+static void appendRecords(Outbox &outbox, unsigned first, unsigned last)
+{
+  for (unsigned i = first; i <= last; i++)
+  {
+    std::string payload = record(i);
+    TEST_ASSERT_TRUE(outbox.append(payload.data(), payload.size()));
+  }
+}
+
+// Peeks and pops the next record, which must be `number`.
+static void expectNext(Outbox &outbox, unsigned number)
+{
+  char buffer[Outbox::MAX_RECORD_SIZE];
+  size_t length;
+  TEST_ASSERT_TRUE(outbox.peek(buffer, sizeof(buffer), &length));
+  TEST_ASSERT_EQUAL_STRING(record(number).c_str(), std::string(buffer, length).c_str());
+  TEST_ASSERT_TRUE(outbox.pop());
+}
+
+// Hands out the next unsent record, which must be `number`.
+static void expectUnsent(Outbox &outbox, unsigned number)
+{
+  char buffer[Outbox::MAX_RECORD_SIZE];
+  size_t length;
+  TEST_ASSERT_TRUE(outbox.peekUnsent(buffer, sizeof(buffer), &length));
+  TEST_ASSERT_EQUAL_STRING(record(number).c_str(), std::string(buffer, length).c_str());
+  outbox.markSent();
+}
+
+static bool exists(const char *path)
+{
+  return access(path, F_OK) == 0;
+}
+
+// Flips a payload byte of the record at `index` (0 based) in the file.
+static void corrupt(size_t index)
+{
+  FILE *file = fopen(dataPath, "r+b");
+  TEST_ASSERT_NOT_NULL(file);
+  fseek(file, index * FRAME_SIZE + HEADER_SIZE + 20, SEEK_SET);
+  int c = fgetc(file);
+  fseek(file, index * FRAME_SIZE + HEADER_SIZE + 20, SEEK_SET);
+  fputc(c ^ 0xff, file);
+  fclose(file);
+}
+
+void setUp()
+{
+  remove(dataPath);
+  remove(indexPath);
+  remove(tmpPath);
+  failingRenames = 0;
+}
+
+void tearDown()
+{
+}
+
+static void test_replays_in_order_across_reboots()
+{
+  {
+    Outbox outbox(basePath, 64 * 1024);
+    TEST_ASSERT_TRUE(outbox.begin());
+    TEST_ASSERT_TRUE(outbox.empty());
+    appendRecords(outbox, 1, 5);
+    expectNext(outbox, 1);
+    expectNext(outbox, 2);
+  }
+  Outbox outbox(basePath, 64 * 1024);
+  TEST_ASSERT_TRUE(outbox.begin());
+  TEST_ASSERT_EQUAL(3 * FRAME_SIZE, outbox.pendingBytes());
+  expectNext(outbox, 3);
+  expectNext(outbox, 4);
+  expectNext(outbox, 5);
+  TEST_ASSERT_TRUE(outbox.empty());
+  TEST_ASSERT_EQUAL(0, outbox.corruptRecords());
+}
+
+static void test_torn_record_at_the_end_is_dropped()
+{
+  {
+    Outbox outbox(basePath, 64 * 1024);
+    outbox.begin();
+    appendRecords(outbox, 1, 3);
+  }
+  // Power lost halfway through a fourth append().
+  std::string torn = record(4);
+  FILE *file = fopen(dataPath, "ab");
+  const uint8_t header[HEADER_SIZE] = {0xA5, 0x5A, (uint8_t)torn.size(), 0, 1, 2, 3, 4};
+  fwrite(header, 1, sizeof(header), file);
+  fwrite(torn.data(), 1, torn.size() / 2, file);
+  fclose(file);
+
+  Outbox outbox(basePath, 64 * 1024);
+  TEST_ASSERT_TRUE(outbox.begin());
+  TEST_ASSERT_EQUAL(3 * FRAME_SIZE, outbox.pendingBytes());
+  appendRecords(outbox, 5, 5);
+  expectNext(outbox, 1);
+  expectNext(outbox, 2);
+  expectNext(outbox, 3);
+  expectNext(outbox, 5);
+  TEST_ASSERT_TRUE(outbox.empty());
+}
+
+static void test_corrupt_record_in_the_middle_keeps_the_later_ones()
+{
+  {
+    Outbox outbox(basePath, 64 * 1024);
+    outbox.begin();
+    appendRecords(outbox, 1, 5);
+  }
+  corrupt(1);
+
+  Outbox outbox(basePath, 64 * 1024);
+  TEST_ASSERT_TRUE(outbox.begin());
+  TEST_ASSERT_EQUAL(1, outbox.corruptRecords());
+  TEST_ASSERT_EQUAL(4 * FRAME_SIZE, outbox.pendingBytes());
+  expectNext(outbox, 1);
+  expectNext(outbox, 3);
+  expectNext(outbox, 4);
+  expectNext(outbox, 5);
+  TEST_ASSERT_TRUE(outbox.empty());
+}
+
+static void test_corrupt_record_at_the_read_offset_is_skipped()
+{
+  Outbox outbox(basePath, 64 * 1024);
+  outbox.begin();
+  appendRecords(outbox, 1, 4);
+  expectNext(outbox, 1);
+  corrupt(1);
+  expectNext(outbox, 3);
+  TEST_ASSERT_EQUAL(1, outbox.corruptRecords());
+  expectNext(outbox, 4);
+
+  // The last record corrupt: the outbox ends up empty instead of stuck.
+  appendRecords(outbox, 5, 5);
+  corrupt(0);
+  char buffer[Outbox::MAX_RECORD_SIZE];
+  size_t length;
+  TEST_ASSERT_FALSE(outbox.peek(buffer, sizeof(buffer), &length));
+  TEST_ASSERT_TRUE(outbox.empty());
+  TEST_ASSERT_EQUAL(2, outbox.corruptRecords());
+}
+
+static void test_small_buffer_is_not_corruption()
+{
+  Outbox outbox(basePath, 64 * 1024);
+  outbox.begin();
+  appendRecords(outbox, 1, 1);
+  char buffer[RECORD_SIZE / 2];
+  size_t length;
+  TEST_ASSERT_FALSE(outbox.peek(buffer, sizeof(buffer), &length));
+  TEST_ASSERT_EQUAL(0, outbox.corruptRecords());
+  expectNext(outbox, 1);
+}
+
+static void test_append_reclaims_drained_space()
+{
+  Outbox outbox(basePath, 10 * FRAME_SIZE);
+  outbox.begin();
+  appendRecords(outbox, 1, 10);
+  std::string payload = record(11);
+  TEST_ASSERT_FALSE(outbox.append(payload.data(), payload.size()));
+  TEST_ASSERT_EQUAL(1, outbox.droppedRecords());
+
+  for (unsigned i = 1; i <= 5; i++)
+  {
+    expectNext(outbox, i);
+  }
+  appendRecords(outbox, 12, 16);
+  TEST_ASSERT_EQUAL(10 * FRAME_SIZE, outbox.pendingBytes());
+  TEST_ASSERT_FALSE(outbox.append(payload.data(), payload.size()));
+
+  // The compacted file survives a reboot.
+  Outbox rebooted(basePath, 10 * FRAME_SIZE);
+  TEST_ASSERT_TRUE(rebooted.begin());
+  for (unsigned i = 6; i <= 10; i++)
+  {
+    expectNext(rebooted, i);
+  }
+  for (unsigned i = 12; i <= 16; i++)
+  {
+    expectNext(rebooted, i);
+  }
+  TEST_ASSERT_TRUE(rebooted.empty());
+}
+
+static void test_power_cut_during_compaction()
+{
+  {
+    Outbox outbox(basePath, 64 * 1024);
+    outbox.begin();
+    appendRecords(outbox, 1, 3);
+  }
+  // compact() had written the index and removed the old file, but not yet
+  // renamed the new one.
+  rename(dataPath, tmpPath);
+  remove(indexPath);
+
+  Outbox outbox(basePath, 64 * 1024);
+  TEST_ASSERT_TRUE(outbox.begin());
+  expectNext(outbox, 1);
+  expectNext(outbox, 2);
+  expectNext(outbox, 3);
+}
+
+static void test_handed_out_records_stay_until_popped()
+{
+  {
+    Outbox outbox(basePath, 10 * FRAME_SIZE);
+    outbox.begin();
+    appendRecords(outbox, 1, 10);
+    for (unsigned i = 1; i <= 6; i++)
+    {
+      expectUnsent(outbox, i);
+    }
+    for (unsigned i = 1; i <= 4; i++)
+    {
+      TEST_ASSERT_TRUE(outbox.pop());
+    }
+    // Compacts; the records handed out keep their place.
+    appendRecords(outbox, 11, 11);
+    expectUnsent(outbox, 7);
+    outbox.rewind();
+    expectUnsent(outbox, 5);
+  }
+
+  // Handed out but not popped: replayed after a reboot.
+  Outbox rebooted(basePath, 10 * FRAME_SIZE);
+  TEST_ASSERT_TRUE(rebooted.begin());
+  for (unsigned i = 5; i <= 11; i++)
+  {
+    expectUnsent(rebooted, i);
+  }
+  TEST_ASSERT_TRUE(rebooted.allSent());
+  TEST_ASSERT_FALSE(rebooted.empty());
+  for (unsigned i = 5; i <= 11; i++)
+  {
+    TEST_ASSERT_TRUE(rebooted.pop());
+  }
+  TEST_ASSERT_TRUE(rebooted.empty());
+}
+
+static void test_failed_rename_after_compaction()
+{
+  {
+    Outbox outbox(basePath, 10 * FRAME_SIZE);
+    outbox.begin();
+    appendRecords(outbox, 1, 10);
+    for (unsigned i = 1; i <= 4; i++)
+    {
+      expectNext(outbox, i);
+    }
+    // Compacts, but the compacted file cannot be renamed: it stays the
+    // outbox's file, and no new data file is started.
+    failingRenames = 2;
+    appendRecords(outbox, 11, 12);
+    TEST_ASSERT_FALSE(exists(dataPath));
+    TEST_ASSERT_TRUE(exists(tmpPath));
+    expectNext(outbox, 5);
+  }
+
+  Outbox rebooted(basePath, 10 * FRAME_SIZE);
+  TEST_ASSERT_TRUE(rebooted.begin());
+  TEST_ASSERT_TRUE(exists(dataPath));
+  TEST_ASSERT_FALSE(exists(tmpPath));
+  for (unsigned i = 6; i <= 12; i++)
+  {
+    expectNext(rebooted, i);
+  }
+  TEST_ASSERT_TRUE(rebooted.empty());
+  TEST_ASSERT_EQUAL(0, rebooted.droppedRecords());
+
+  // A rename that fails once is retried.
+  appendRecords(rebooted, 1, 10);
+  for (unsigned i = 1; i <= 4; i++)
+  {
+    expectNext(rebooted, i);
+  }
+  failingRenames = 1;
+  appendRecords(rebooted, 11, 11);
+  TEST_ASSERT_TRUE(exists(dataPath));
+  TEST_ASSERT_FALSE(exists(tmpPath));
+}
+
+static void test_replay_throughput()
+{
+  const size_t maxBytes = 512 * 1024; // OUTBOX_MAX_BYTES
+  const size_t sizes[] = {200, 1000, 2000};
+  for (size_t size : sizes)
+  {
+    setUp();
+    Outbox outbox(basePath, maxBytes);
+    outbox.begin();
+    std::string payload = record(0, size);
+    unsigned long started = micros();
+    unsigned count = 0;
+    while (outbox.append(payload.data(), payload.size()))
+    {
+      count++;
+    }
+    unsigned long appendUs = micros() - started;
+
+    char buffer[Outbox::MAX_RECORD_SIZE];
+    size_t length;
+    started = micros();
+    unsigned replayed = 0;
+    while (outbox.peek(buffer, sizeof(buffer), &length) && outbox.pop())
+    {
+      replayed++;
+    }
+    unsigned long replayUs = micros() - started;
+    TEST_ASSERT_EQUAL(count, replayed);
+    TEST_ASSERT_TRUE(outbox.empty());
+
+    // Steady state with a full outbox: every append needs the space of the
+    // record just drained, so it compacts.
+    while (outbox.append(payload.data(), payload.size()))
+    {
+    }
+    started = micros();
+    const unsigned rounds = 50;
+    for (unsigned i = 0; i < rounds; i++)
+    {
+      TEST_ASSERT_TRUE(outbox.peek(buffer, sizeof(buffer), &length));
+      outbox.pop();
+      TEST_ASSERT_TRUE(outbox.append(payload.data(), payload.size()));
+    }
+    unsigned long steadyUs = micros() - started;
+
+    double megabytes = (double)count * size / (1024 * 1024);
+    printf("BENCH %4u-byte records: %u fill the outbox; append %.0f records/s (%.1f MB/s), "
+           "replay %.0f records/s (%.1f MB/s), full outbox pop+append with compaction %.2f ms\n",
+           (unsigned)size, count, count * 1e6 / appendUs, megabytes * 1e6 / appendUs, replayed * 1e6 / replayUs,
+           megabytes * 1e6 / replayUs, steadyUs / 1000.0 / rounds);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  snprintf(basePath, sizeof(basePath), "/tmp/test-outbox-%d", (int)getpid());
+  snprintf(dataPath, sizeof(dataPath), "%s.dat", basePath);
+  snprintf(indexPath, sizeof(indexPath), "%s.idx", basePath);
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", dataPath);
+  UNITY_BEGIN();
+  RUN_TEST(test_replays_in_order_across_reboots);
+  RUN_TEST(test_torn_record_at_the_end_is_dropped);
+  RUN_TEST(test_corrupt_record_in_the_middle_keeps_the_later_ones);
+  RUN_TEST(test_corrupt_record_at_the_read_offset_is_skipped);
+  RUN_TEST(test_small_buffer_is_not_corruption);
+  RUN_TEST(test_append_reclaims_drained_space);
+  RUN_TEST(test_power_cut_during_compaction);
+  RUN_TEST(test_handed_out_records_stay_until_popped);
+  RUN_TEST(test_failed_rename_after_compaction);
+  RUN_TEST(test_replay_throughput);
+  setUp();
+  return UNITY_END();
+}
@@ -0,0 +1,199 @@
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <PayloadWriter.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include "Config.h"
+#include <unity.h>
+
+// JsonWriter output against what the sketches used to send, and a benchmark
+// of both: time per payload, heap allocations and stack high-water.
+//
+//   pio test -e native -f test_payload_writer -v
+
+const int ITERATIONS = 100000;
+const char JOB_ID[] = "ota-3f2c9a7e-5b1d-4e8f-9c6a-0d7b2e4f1a93";
+
+static volatile size_t sink;
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+// recordObservation() before JsonWriter.
+static size_t arduinoJsonObservation(char *out, size_t capacity)
+{
+  StaticJsonDocument<200> doc;
+  doc["value"] = 0;
+  doc["unit"] = "status";
+  StaticJsonDocument<200> codeObj;
+  codeObj["code"] = LO_RESULT_CODE;
+  codeObj["system"] = LO_CODE_SYSTEM;
+  codeObj["display"] = "btn_press_event";
+  JsonArray coding = doc.createNestedArray("coding");
+  coding.add(codeObj);
+  char jsonBuffer[1024];
+  size_t n = serializeJson(doc, jsonBuffer);
+  memcpy(out, jsonBuffer, n + 1 < capacity ? n + 1 : capacity);
+  return n;
+}
+
+static size_t writerObservation(char *out, size_t capacity)
+{
+  JsonWriter<512> w;
+  writeObservation(w, 0, "status", LO_RESULT_CODE, LO_CODE_SYSTEM, "btn_press_event");
+  memcpy(out, w.c_str(), w.length() + 1 < capacity ? w.length() + 1 : capacity);
+  return w.length();
+}
+
+// publishUpdateExecution() in device-updates before JsonWriter.
+static size_t stringJobStatus(char *out, size_t capacity)
+{
+  String jobId = JOB_ID;
+  String status = "IN_PROGRESS";
+  String payload = "{\"jobId\":\"" + jobId + "\",\"status\":\"" + status + "\"}";
+  memcpy(out, payload.c_str(), payload.length() + 1 < capacity ? payload.length() + 1 : capacity);
+  return payload.length();
+}
+
+static size_t writerJobStatus(char *out, size_t capacity)
+{
+  JsonWriter<256> w;
+  writeJobStatus(w, JOB_ID, "IN_PROGRESS");
+  memcpy(out, w.c_str(), w.length() + 1 < capacity ? w.length() + 1 : capacity);
+  return w.length();
+}
+
+typedef size_t (*Serializer)(char *out, size_t capacity);
+
+// Runs `serializer` once on a thread whose stack is painted beforehand, and
+// returns how deep it went, less what an empty run of the thread uses.
+static size_t stackOf(Serializer serializer)
+{
+  const size_t size = 256 * 1024;
+  const uint8_t paint = 0xA5;
+  auto deepest = [&](Serializer run) -> size_t
+  {
+    uint8_t *stack = (uint8_t *)aligned_alloc(4096, size);
+    memset(stack, paint, size);
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setstack(&attributes, stack, size);
+    pthread_t thread;
+    pthread_create(
+        &thread, &attributes,
+        [](void *argument) -> void *
+        {
+          Serializer run = (Serializer)argument;
+          if (run)
+          {
+            char out[1024];
+            sink = run(out, sizeof(out));
+          }
+          return nullptr;
+        },
+        (void *)run);
+    pthread_join(thread, nullptr);
+    pthread_attr_destroy(&attributes);
+    size_t untouched = 0;
+    while (untouched < size && stack[untouched] == paint)
+    {
+      untouched++;
+    }
+    free(stack);
+    return size - untouched;
+  };
+  return deepest(serializer) - deepest(nullptr);
+}
+
+static void bench(const char *name, Serializer serializer)
+{
+  char out[1024];
+  uint64_t allocations = fakeHeapAllocations();
+  unsigned long started = micros();
+  for (int i = 0; i < ITERATIONS; i++)
+  {
+    sink = serializer(out, sizeof(out));
+  }
+  unsigned long elapsed = micros() - started;
+  double allocationsPerPayload = (double)(fakeHeapAllocations() - allocations) / ITERATIONS;
+  printf("BENCH %-28s %5.0f ns/payload, %4.1f heap allocations/payload, stack high-water %5u bytes, %u bytes\n",
+         name, elapsed * 1000.0 / ITERATIONS, allocationsPerPayload, (unsigned)stackOf(serializer),
+         (unsigned)sink);
+}
+
+static void test_observation_matches_the_arduino_json_payload()
+{
+  char expected[1024];
+  char actual[1024];
+  arduinoJsonObservation(expected, sizeof(expected));
+  writerObservation(actual, sizeof(actual));
+  TEST_ASSERT_EQUAL_STRING(expected, actual);
+}
+
+static void test_job_status_matches_the_string_payload()
+{
+  char expected[1024];
+  char actual[1024];
+  stringJobStatus(expected, sizeof(expected));
+  writerJobStatus(actual, sizeof(actual));
+  TEST_ASSERT_EQUAL_STRING(expected, actual);
+}
+
+static void test_escapes_and_overflow()
+{
+  JsonWriter<64> w;
+  w.beginObject().value("text", "a\"b\\c\n\x01").value("n", -42L).endObject();
+  TEST_ASSERT_TRUE(w.ok());
+  TEST_ASSERT_EQUAL_STRING("{\"text\":\"a\\\"b\\\\c\\n\\u0001\",\"n\":-42}", w.c_str());
+
+  JsonWriter<16> small;
+  writeJobStatus(small, JOB_ID, "SUCCEEDED");
+  TEST_ASSERT_FALSE(small.ok());
+  TEST_ASSERT_TRUE(small.length() < 16);
+}
+
+static void test_long_limits()
+{
+  char expected[64];
+  snprintf(expected, sizeof(expected), "[%ld,%ld,0]", LONG_MIN, LONG_MAX);
+  JsonWriter<64> w;
+  w.beginArray().value(LONG_MIN).value(LONG_MAX).value(0L).endArray();
+  TEST_ASSERT_TRUE(w.ok());
+  TEST_ASSERT_EQUAL_STRING(expected, w.c_str());
+}
+
+static void test_no_heap_use()
+{
+  char out[1024];
+  uint64_t allocations = fakeHeapAllocations();
+  writerObservation(out, sizeof(out));
+  writerJobStatus(out, sizeof(out));
+  TEST_ASSERT_EQUAL(0, fakeHeapAllocations() - allocations);
+}
+
+static void test_benchmark()
+{
+  bench("observation, ArduinoJson", arduinoJsonObservation);
+  bench("observation, JsonWriter", writerObservation);
+  bench("job status, String +", stringJobStatus);
+  bench("job status, JsonWriter", writerJobStatus);
+  TEST_ASSERT_TRUE(stackOf(writerObservation) < stackOf(arduinoJsonObservation));
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_observation_matches_the_arduino_json_payload);
+  RUN_TEST(test_job_status_matches_the_string_payload);
+  RUN_TEST(test_escapes_and_overflow);
+  RUN_TEST(test_long_limits);
+  RUN_TEST(test_no_heap_use);
+  RUN_TEST(test_benchmark);
+  return UNITY_END();
+}
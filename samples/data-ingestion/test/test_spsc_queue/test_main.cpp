@@ -0,0 +1,278 @@
+#include <Arduino.h>
+#include <SpscQueue.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <sched.h>
+#include <thread>
+#include <vector>
+#include <unity.h>
+
+// SpscQueue between two std::threads: every item arrives once, in order and
+// untorn, and a benchmark of throughput and push-to-pop latency against the
+// same ring behind a std::mutex. Run it under ThreadSanitizer too, which
+// leaves the benchmark out:
+//
+//   pio test -e native -f test_spsc_queue -v
+//   pio test -e native_tsan -v
+
+#if defined(__SANITIZE_THREAD__)
+const uint32_t STRESS_ITEMS = 200000;
+#else
+const uint32_t STRESS_ITEMS = 2000000;
+#endif
+const uint32_t BENCH_ITEMS = 20000000;
+const uint32_t LATENCY_ITEMS = 200000;
+// One push every this many nanoseconds in the latency run, well below what
+// the consumer can take, so the ring is mostly empty as on the device.
+const uint64_t LATENCY_PACE_NS = 2000;
+
+// The size of the sketch's ButtonEvent, with a check on every field.
+struct Item
+{
+  uint32_t sequence;
+  uint32_t inverse;
+  uint64_t pushedNs;
+};
+
+// CPUs this process may run on, which in a container can be fewer than
+// std::thread::hardware_concurrency() says.
+static int cpus()
+{
+  cpu_set_t set;
+  return sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set) : 1;
+}
+
+// Lets the other side run. On a single CPU sched_yield() mostly returns at
+// once, so the waiting side sleeps instead of spinning out its time slice.
+static void wait()
+{
+  static const bool oneCpu = cpus() < 2;
+  if (!oneCpu)
+  {
+    std::this_thread::yield();
+  }
+  else
+  {
+    std::this_thread::sleep_for(std::chrono::microseconds(1));
+  }
+}
+
+static uint64_t nowNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// The same ring and counters as SpscQueue, one lock around each call.
+template <typename T, size_t Capacity>
+class MutexQueue
+{
+public:
+  bool push(const T &item)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (writeIndex - readIndex == Capacity)
+    {
+      rejectedCount++;
+      return false;
+    }
+    items[writeIndex++ & (Capacity - 1)] = item;
+    return true;
+  }
+
+  bool pop(T &item)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (readIndex == writeIndex)
+    {
+      return false;
+    }
+    item = items[readIndex++ & (Capacity - 1)];
+    return true;
+  }
+
+  uint32_t rejected() const { return rejectedCount; }
+
+private:
+  std::mutex lock;
+  T items[Capacity];
+  size_t writeIndex = 0;
+  size_t readIndex = 0;
+  uint32_t rejectedCount = 0;
+};
+
+struct RunResult
+{
+  double itemsPerSecond;
+  uint32_t rejected;
+  uint64_t p50Ns;
+  uint64_t p99Ns;
+  uint64_t maxNs;
+};
+
+// Pushes `count` items from one thread and pops them on another. A full ring
+// makes the producer retry, as the sketch would after counting the drop.
+// With `paceNs` the producer waits that long between pushes and the
+// push-to-pop latency of every item is kept.
+template <typename Queue>
+static RunResult run(Queue &queue, uint32_t count, uint64_t paceNs)
+{
+  std::vector<uint32_t> latencies;
+  if (paceNs > 0)
+  {
+    latencies.reserve(count);
+  }
+  bool ordered = true;
+  uint64_t started = nowNs();
+  std::thread consumer(
+      [&]()
+      {
+        Item item;
+        uint32_t expected = 0;
+        while (expected < count)
+        {
+          if (!queue.pop(item))
+          {
+            wait();
+            continue;
+          }
+          if (item.sequence != expected || item.inverse != ~expected)
+          {
+            ordered = false;
+          }
+          if (paceNs > 0)
+          {
+            latencies.push_back(nowNs() - item.pushedNs);
+          }
+          expected++;
+        }
+      });
+  uint64_t next = nowNs();
+  for (uint32_t i = 0; i < count; i++)
+  {
+    if (paceNs > 0)
+    {
+      while (nowNs() < next)
+      {
+      }
+      next += paceNs;
+    }
+    Item item = {i, ~i, nowNs()};
+    while (!queue.push(item))
+    {
+      wait();
+    }
+  }
+  consumer.join();
+  uint64_t elapsed = nowNs() - started;
+  TEST_ASSERT_TRUE(ordered);
+
+  RunResult result = {count * 1e9 / elapsed, queue.rejected(), 0, 0, 0};
+  if (!latencies.empty())
+  {
+    std::sort(latencies.begin(), latencies.end());
+    result.p50Ns = latencies[latencies.size() / 2];
+    result.p99Ns = latencies[latencies.size() * 99 / 100];
+    result.maxNs = latencies.back();
+  }
+  return result;
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+static void test_full_ring_rejects_and_counts()
+{
+  SpscQueue<Item, 4> queue;
+  for (uint32_t i = 0; i < 4; i++)
+  {
+    TEST_ASSERT_TRUE(queue.push({i, ~i, 0}));
+  }
+  TEST_ASSERT_FALSE(queue.push({4, ~4u, 0}));
+  TEST_ASSERT_EQUAL(1, queue.rejected());
+  TEST_ASSERT_EQUAL(4, queue.highWater());
+  Item item;
+  TEST_ASSERT_TRUE(queue.pop(item));
+  TEST_ASSERT_EQUAL(0, item.sequence);
+  TEST_ASSERT_TRUE(queue.push({4, ~4u, 0}));
+  for (uint32_t i = 1; i <= 4; i++)
+  {
+    TEST_ASSERT_TRUE(queue.pop(item));
+    TEST_ASSERT_EQUAL(i, item.sequence);
+  }
+  TEST_ASSERT_FALSE(queue.pop(item));
+  TEST_ASSERT_EQUAL(0, queue.size());
+}
+
+static void test_two_threads_lose_nothing()
+{
+  // The sketch's EVENT_QUEUE_CAPACITY, and the smallest ring, which is full
+  // most of the time.
+  static SpscQueue<Item, 32> queue;
+  run(queue, STRESS_ITEMS, 0);
+  TEST_ASSERT_EQUAL(0, queue.size());
+  TEST_ASSERT_EQUAL(32, queue.highWater());
+  static SpscQueue<Item, 2> tiny;
+  run(tiny, STRESS_ITEMS / 20, 0);
+  TEST_ASSERT_EQUAL(0, tiny.size());
+}
+
+// Push and pop on one thread: the cost of the calls themselves, without the
+// other core's cache traffic.
+template <typename Queue>
+static double callNs()
+{
+  static Queue queue;
+  Item item = {0, ~0u, 0};
+  uint64_t started = nowNs();
+  for (uint32_t i = 0; i < BENCH_ITEMS; i++)
+  {
+    item.sequence = i;
+    queue.push(item);
+    queue.pop(item);
+  }
+  return (double)(nowNs() - started) / BENCH_ITEMS;
+}
+
+template <typename Queue>
+static void bench(const char *name)
+{
+  printf("BENCH %-22s push+pop on one thread %5.1f ns", name, callNs<Queue>());
+  if (cpus() < 2)
+  {
+    printf(", one CPU: no two-thread figures\n");
+    return;
+  }
+  static Queue throughputQueue;
+  RunResult throughput = run(throughputQueue, BENCH_ITEMS, 0);
+  static Queue latencyQueue;
+  RunResult latency = run(latencyQueue, LATENCY_ITEMS, LATENCY_PACE_NS);
+  printf(", two threads %6.1f M items/s (%u pushes found it full), push-to-pop p50=%lluns p99=%lluns max=%lluns\n",
+         throughput.itemsPerSecond / 1e6, throughput.rejected, (unsigned long long)latency.p50Ns,
+         (unsigned long long)latency.p99Ns, (unsigned long long)latency.maxNs);
+}
+
+static void test_benchmark()
+{
+  bench<SpscQueue<Item, 32>>("SpscQueue<32>");
+  bench<MutexQueue<Item, 32>>("std::mutex ring<32>");
+  bench<SpscQueue<Item, 1024>>("SpscQueue<1024>");
+  bench<MutexQueue<Item, 1024>>("std::mutex ring<1024>");
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_full_ring_rejects_and_counts);
+  RUN_TEST(test_two_threads_lose_nothing);
+#if !defined(__SANITIZE_THREAD__)
+  RUN_TEST(test_benchmark);
+#endif
+  return UNITY_END();
+}
@@ -0,0 +1,137 @@
+#include <Arduino.h>
+#include <M5Core2.h>
+#include <MQTTClient.h>
+#include <LoopBench.h>
+#include <Outbox.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <unity.h>
+
+// What a power cut would leave in the outbox of the whole sketch (src/main.cpp,
+// see [env:native_loop]) while an observation waits in the batch, waits for
+// FHIRIngest to accept it, and once it is accepted. The outbox files are
+// copied at each step and opened the way setup() would after a reboot.
+//
+//   pio test -e native_loop -f test_store_and_forward -v
+
+void setup();
+void loop();
+extern std::string fhirIngestAcceptedTopic;
+
+static const char snapshotPath[] = OUTBOX_PATH "-snapshot";
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+static void copyFile(const std::string &from, const std::string &to)
+{
+  remove(to.c_str());
+  FILE *in = fopen(from.c_str(), "rb");
+  if (!in)
+  {
+    return;
+  }
+  FILE *out = fopen(to.c_str(), "wb");
+  TEST_ASSERT_NOT_NULL(out);
+  char buffer[512];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+  {
+    fwrite(buffer, 1, n, out);
+  }
+  fclose(out);
+  fclose(in);
+}
+
+// The records a reboot right now would replay.
+static std::vector<std::string> afterPowerCut()
+{
+  copyFile(OUTBOX_PATH ".dat", std::string(snapshotPath) + ".dat");
+  copyFile(OUTBOX_PATH ".idx", std::string(snapshotPath) + ".idx");
+  Outbox rebooted(snapshotPath, 512 * 1024);
+  TEST_ASSERT_TRUE(rebooted.begin());
+  std::vector<std::string> records;
+  char buffer[Outbox::MAX_RECORD_SIZE];
+  size_t length;
+  while (rebooted.peek(buffer, sizeof(buffer), &length))
+  {
+    records.push_back(std::string(buffer, length));
+    rebooted.pop();
+  }
+  return records;
+}
+
+static std::string correlationIdOf(const std::string &payload)
+{
+  static const std::string key = "\"correlationId\":\"";
+  size_t at = payload.find(key);
+  return at == std::string::npos ? "" : payload.substr(at + key.size(), 8);
+}
+
+static void uiTick()
+{
+  loop();
+  delay(1);
+}
+
+static void test_connects()
+{
+  LoopBench bench("data-ingestion/store-and-forward-connect");
+  TEST_ASSERT_TRUE(bench.runUntil(10000, uiTick, []() { return fakeBroker.subscriptions().size() >= 4; }));
+}
+
+// The one window left unprotected: the observation only lives in the RAM
+// batch until it is flushed.
+static void test_batched_observation_is_not_stored()
+{
+  M5.BtnA.fakeRelease();
+  LoopBench bench("data-ingestion/store-and-forward-batch");
+  bench.run(1000, uiTick);
+  TEST_ASSERT_FALSE(bench.logged("publishing "));
+  TEST_ASSERT_EQUAL(0, afterPowerCut().size());
+}
+
+static void test_observation_in_flight_is_stored()
+{
+  LoopBench bench("data-ingestion/store-and-forward-in-flight");
+  TEST_ASSERT_TRUE(bench.runUntil(6000, uiTick, [&bench]() { return bench.logged("publishing "); }));
+  bench.run(200, uiTick);
+  std::vector<FakeMessage> published = fakeBroker.published("$aws/rules/FHIRIngest");
+  TEST_ASSERT_EQUAL(1, published.size());
+  std::vector<std::string> stored = afterPowerCut();
+  TEST_ASSERT_EQUAL(1, stored.size());
+  TEST_ASSERT_EQUAL_STRING(published[0].payload.c_str(), stored[0].c_str());
+}
+
+static void test_accepted_observation_is_removed()
+{
+  std::string id = correlationIdOf(fakeBroker.published("$aws/rules/FHIRIngest")[0].payload);
+  fakeBroker.send(fhirIngestAcceptedTopic, "{\"correlationId\":\"" + id + "\"}");
+  LoopBench bench("data-ingestion/store-and-forward-accepted");
+  TEST_ASSERT_TRUE(bench.runUntil(2000, uiTick,
+                                  [&bench]() { return bench.logged("observation, 0 bytes left in outbox"); }));
+  TEST_ASSERT_EQUAL(0, afterPowerCut().size());
+}
+
+int main(int argc, char **argv)
+{
+  remove(OUTBOX_PATH ".dat");
+  remove(OUTBOX_PATH ".idx");
+  // FHIRIngest only answers when a test says so.
+  fakeBroker.respond("$aws/rules/FHIRIngest", [](FakeBroker &, const FakeMessage &) {});
+  setup();
+  UNITY_BEGIN();
+  RUN_TEST(test_connects);
+  RUN_TEST(test_batched_observation_is_not_stored);
+  RUN_TEST(test_observation_in_flight_is_stored);
+  RUN_TEST(test_accepted_observation_is_removed);
+  int failures = UNITY_END();
+  fakeStopTasks();
+  return failures;
+}
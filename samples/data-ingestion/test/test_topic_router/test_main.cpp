@@ -0,0 +1,161 @@
+#include <Arduino.h>
+#include <TopicRouter.h>
+#include <string>
+#include "Config.h"
+#include <unity.h>
+
+// TopicRouter with the sketches' topics and arena sizes, and dispatch against
+// the String == chains the sketches used before it.
+//
+//   pio test -e native -f test_topic_router -v
+
+const int ITERATIONS = 1000000;
+
+static std::string acceptedTopic = DEVICE_ID + "/" + LO_FHIR_INGEST_TOPIC_NAME + "/accepted";
+static std::string rejectedTopic = DEVICE_ID + "/" + LO_FHIR_INGEST_TOPIC_NAME + "/rejected";
+static std::string uploadAcceptedTopic = DEVICE_ID + "/" + LO_FILE_UPLOAD_TOPIC_NAME + "/accepted";
+static std::string uploadRejectedTopic = DEVICE_ID + "/" + LO_FILE_UPLOAD_TOPIC_NAME + "/rejected";
+
+static int handled[4];
+static TopicParams lastParams;
+
+static void onAccepted(const char *, const TopicParams &, char *, int) { handled[0]++; }
+static void onRejected(const char *, const TopicParams &, char *, int) { handled[1]++; }
+static void onUploadAccepted(const char *, const TopicParams &, char *, int) { handled[2]++; }
+static void onUploadRejected(const char *, const TopicParams &params, char *, int)
+{
+  handled[3]++;
+  lastParams = params;
+}
+
+void setUp()
+{
+  memset(handled, 0, sizeof(handled));
+}
+
+void tearDown()
+{
+}
+
+// data-ingestion's routes, as setupRoutes() adds them.
+template <typename Router>
+static bool addSketchRoutes(Router &router, const std::string &deviceId)
+{
+  bool ok = router.add((deviceId + "/" + LO_FHIR_INGEST_TOPIC_NAME + "/accepted").c_str(), onAccepted);
+  ok = router.add((deviceId + "/" + LO_FHIR_INGEST_TOPIC_NAME + "/rejected").c_str(), onRejected) && ok;
+  ok = router.add((deviceId + "/" + LO_FILE_UPLOAD_TOPIC_NAME + "/accepted").c_str(), onUploadAccepted) && ok;
+  return router.add((deviceId + "/" + LO_FILE_UPLOAD_TOPIC_NAME + "/rejected").c_str(), onUploadRejected) && ok;
+}
+
+static void test_sketch_topics_fit_the_longest_device_id()
+{
+  TopicRouter<4, 640> router;
+  TEST_ASSERT_TRUE(addSketchRoutes(router, std::string(128, 'd')));
+  TopicRouter<4, 640> configured;
+  TEST_ASSERT_TRUE(addSketchRoutes(configured, DEVICE_ID));
+  char payload[] = "{}";
+  TEST_ASSERT_TRUE(configured.dispatch(uploadAcceptedTopic.c_str(), payload, 2));
+  TEST_ASSERT_TRUE(configured.dispatch(rejectedTopic.c_str(), payload, 2));
+  TEST_ASSERT_FALSE(configured.dispatch((DEVICE_ID + "/other").c_str(), payload, 2));
+  TEST_ASSERT_EQUAL(1, handled[2]);
+  TEST_ASSERT_EQUAL(1, handled[1]);
+}
+
+static void test_full_arena_rejects_the_route()
+{
+  // The old default of 64 bytes a route, with an account:UUID DEVICE_ID.
+  TopicRouter<4, 4 * 64> router;
+  TEST_ASSERT_FALSE(addSketchRoutes(router, DEVICE_ID));
+  TEST_ASSERT_EQUAL(3, router.size());
+  // The routes that fit still work.
+  char payload[] = "{}";
+  TEST_ASSERT_TRUE(router.dispatch(acceptedTopic.c_str(), payload, 2));
+  TEST_ASSERT_FALSE(router.dispatch(uploadRejectedTopic.c_str(), payload, 2));
+  TEST_ASSERT_EQUAL(1, handled[0]);
+}
+
+static void test_wildcards()
+{
+  TopicRouter<4, 256> router;
+  TEST_ASSERT_TRUE(router.add("$aws/things/thing/jobs/notify-next", onAccepted));
+  TEST_ASSERT_TRUE(router.add("$aws/things/thing/jobs/+/update/accepted", onUploadRejected));
+  TEST_ASSERT_TRUE(router.add("$aws/things/thing/shadow/#", onRejected));
+  char payload[] = "{}";
+  TEST_ASSERT_TRUE(router.dispatch("$aws/things/thing/jobs/job-42/update/accepted", payload, 2));
+  TEST_ASSERT_EQUAL(1, lastParams.count);
+  std::string jobId(lastParams.values[0], lastParams.lengths[0]);
+  TEST_ASSERT_EQUAL_STRING("job-42", jobId.c_str());
+  TEST_ASSERT_TRUE(router.dispatch("$aws/things/thing/shadow/update/delta", payload, 2));
+  TEST_ASSERT_TRUE(router.dispatch("$aws/things/thing/shadow", payload, 2));
+  TEST_ASSERT_FALSE(router.dispatch("$aws/things/thing/jobs/job-42/update", payload, 2));
+  TEST_ASSERT_FALSE(router.dispatch("$aws/things/other/jobs/notify-next", payload, 2));
+  TEST_ASSERT_EQUAL(1, handled[3]);
+  TEST_ASSERT_EQUAL(2, handled[1]);
+}
+
+// handleMessage() before TopicRouter: lwmqtt's topic as a String, compared
+// with each topic in turn.
+static void stringDispatch(const char *received)
+{
+  String topic = received;
+  if (topic == acceptedTopic.c_str())
+  {
+    handled[0]++;
+  }
+  else if (topic == rejectedTopic.c_str())
+  {
+    handled[1]++;
+  }
+  else if (topic == uploadAcceptedTopic.c_str())
+  {
+    handled[2]++;
+  }
+  else if (topic == uploadRejectedTopic.c_str())
+  {
+    handled[3]++;
+  }
+}
+
+static void test_benchmark()
+{
+  TopicRouter<4, 640> router;
+  TEST_ASSERT_TRUE(addSketchRoutes(router, DEVICE_ID));
+  std::string unrouted = DEVICE_ID + "/" + LO_FHIR_INGEST_TOPIC_NAME + "/deferred";
+  const std::string *topics[] = {&acceptedTopic, &uploadRejectedTopic, &uploadAcceptedTopic, &unrouted};
+  const char *names[] = {"first route", "last route", "file upload", "no route"};
+  char payload[] = "{}";
+  for (int t = 0; t < 4; t++)
+  {
+    const char *topic = topics[t]->c_str();
+    uint64_t allocations = fakeHeapAllocations();
+    unsigned long started = micros();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+      stringDispatch(topic);
+    }
+    unsigned long stringUs = micros() - started;
+    double stringAllocations = (double)(fakeHeapAllocations() - allocations) / ITERATIONS;
+
+    allocations = fakeHeapAllocations();
+    started = micros();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+      router.dispatch(topic, payload, 2);
+    }
+    unsigned long routerUs = micros() - started;
+    TEST_ASSERT_EQUAL(0, fakeHeapAllocations() - allocations);
+    printf("BENCH %-12s (%u-byte topic): String == %5.1f ns, %.1f allocations; TopicRouter %5.1f ns, 0 allocations\n",
+           names[t], (unsigned)strlen(topic), stringUs * 1000.0 / ITERATIONS, stringAllocations,
+           routerUs * 1000.0 / ITERATIONS);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_sketch_topics_fit_the_longest_device_id);
+  RUN_TEST(test_full_arena_rejects_the_route);
+  RUN_TEST(test_wildcards);
+  RUN_TEST(test_benchmark);
+  return UNITY_END();
+}
@@ -0,0 +1,336 @@
+#include "ConfigStore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *MARKER_KEY = "txn";
+static const char *RESERVE_KEY = "txn.r";
+
+static void journalKey(char *name, size_t position)
+{
+  snprintf(name, 16, "txn.%u", (unsigned)position);
+}
+
+ConfigStore::ConfigStore(const ConfigKey *keys, size_t count, const ConfigBackend &backend)
+    : keys(keys), keyCount(count < MAX_KEYS ? count : MAX_KEYS), backend(backend)
+{
+}
+
+ConfigStore::~ConfigStore()
+{
+  free(arena);
+}
+
+bool ConfigStore::begin()
+{
+  if (arena != nullptr)
+  {
+    return true;
+  }
+  uint32_t size = 0;
+  for (size_t i = 0; i < keyCount; i++)
+  {
+    offsets[i] = size;
+    size += keys[i].capacity;
+  }
+  arena = (char *)malloc(size > 0 ? size : 1);
+  invalidate();
+  if (arena == nullptr)
+  {
+    return false;
+  }
+
+  // A commit record means the journal is complete: finish the transaction.
+  // Without one, the journal (if any) is from a transaction that never
+  // committed, and the keys still hold the old values.
+  char marker[MARKER_SIZE];
+  counters.flashReads++;
+  if (backend.read(backend.context, MARKER_KEY, marker, sizeof(marker)) == ConfigFound)
+  {
+    applyJournal(marker);
+  }
+  else if (eraseJournal() > 0)
+  {
+    commit();
+  }
+  return true;
+}
+
+const char *ConfigStore::get(size_t key)
+{
+  if (!valid(key))
+  {
+    return nullptr;
+  }
+  if (states[key] != Unloaded)
+  {
+    counters.hits++;
+    return states[key] == Loaded ? slot(key) : nullptr;
+  }
+
+  counters.misses++;
+  counters.flashReads++;
+  ConfigReadResult result = backend.read(backend.context, keys[key].name, slot(key), keys[key].capacity);
+  if (result == ConfigFound)
+  {
+    states[key] = Loaded;
+    return slot(key);
+  }
+  if (result == ConfigReadError)
+  {
+    // Not retried: an unreadable value stays unreadable until it is set.
+    counters.readErrors++;
+  }
+  states[key] = Absent;
+  return nullptr;
+}
+
+bool ConfigStore::getBool(size_t key, bool fallback)
+{
+  const char *value = get(key);
+  if (value == nullptr)
+  {
+    return fallback;
+  }
+  if (strcmp(value, "true") == 0)
+  {
+    return true;
+  }
+  if (strcmp(value, "false") == 0)
+  {
+    return false;
+  }
+  return fallback;
+}
+
+bool ConfigStore::set(size_t key, const char *value)
+{
+  if (inTransaction)
+  {
+    transactionFailed = transactionFailed || !stage(key, value);
+    return !transactionFailed;
+  }
+  if (!valid(key) || value == nullptr || strlen(value) >= keys[key].capacity)
+  {
+    return false;
+  }
+  if (isStored(key, value))
+  {
+    counters.unchanged++;
+    return true;
+  }
+  if (!write(keys[key].name, value) || !commit())
+  {
+    // What is stored now is unknown; read it again next time.
+    states[key] = Unloaded;
+    return false;
+  }
+  memmove(slot(key), value, strlen(value) + 1);
+  states[key] = Loaded;
+  return true;
+}
+
+void ConfigStore::beginTransaction()
+{
+  if (inTransaction)
+  {
+    abortTransaction();
+  }
+  inTransaction = true;
+  transactionFailed = false;
+  stagedCount = 0;
+}
+
+bool ConfigStore::commitTransaction()
+{
+  if (!inTransaction)
+  {
+    return false;
+  }
+  inTransaction = false;
+  if (transactionFailed)
+  {
+    eraseJournal();
+    commit();
+    return false;
+  }
+  if (stagedCount == 0)
+  {
+    return true;
+  }
+
+  char marker[MARKER_SIZE];
+  size_t used = 0;
+  for (size_t i = 0; i < stagedCount; i++)
+  {
+    used += snprintf(marker + used, sizeof(marker) - used, i ? ",%s" : "%s", keys[staged[i]].name);
+  }
+  // The commit point: once this write is in flash the transaction happens.
+  if (!writeReserve() || !write(MARKER_KEY, marker))
+  {
+    eraseJournal();
+    commit();
+    return false;
+  }
+  return applyJournal(marker);
+}
+
+void ConfigStore::abortTransaction()
+{
+  if (!inTransaction)
+  {
+    return;
+  }
+  inTransaction = false;
+  eraseJournal();
+  commit();
+}
+
+void ConfigStore::invalidate()
+{
+  for (size_t i = 0; i < keyCount; i++)
+  {
+    states[i] = Unloaded;
+  }
+}
+
+bool ConfigStore::isStored(size_t key, const char *value)
+{
+  const char *current = get(key);
+  return current != nullptr && strcmp(current, value) == 0;
+}
+
+bool ConfigStore::stage(size_t key, const char *value)
+{
+  if (transactionFailed || !valid(key) || value == nullptr || strlen(value) >= keys[key].capacity)
+  {
+    return false;
+  }
+  size_t position = 0;
+  while (position < stagedCount && staged[position] != key)
+  {
+    position++;
+  }
+  if (position == stagedCount)
+  {
+    // A key staged earlier is always written again, or the earlier value
+    // would still be applied.
+    if (isStored(key, value))
+    {
+      counters.unchanged++;
+      return true;
+    }
+    staged[stagedCount++] = key;
+  }
+  stagedLengths[position] = strlen(value);
+  char name[16];
+  journalKey(name, position);
+  return write(name, value);
+}
+
+bool ConfigStore::writeReserve()
+{
+  size_t longest = 0;
+  for (size_t i = 1; i < stagedCount; i++)
+  {
+    if (stagedLengths[i] > stagedLengths[longest])
+    {
+      longest = i;
+    }
+  }
+  // Only the length counts; the key's slot has room for it.
+  size_t key = staged[longest];
+  states[key] = Unloaded;
+  memset(slot(key), '-', stagedLengths[longest]);
+  slot(key)[stagedLengths[longest]] = '\0';
+  return write(RESERVE_KEY, slot(key));
+}
+
+bool ConfigStore::applyJournal(const char *marker)
+{
+  erase(RESERVE_KEY);
+  bool applied = true;
+  size_t position = 0;
+  for (const char *name = marker; *name != '\0'; position++)
+  {
+    const char *end = strchr(name, ',');
+    size_t length = end ? end - name : strlen(name);
+    size_t key = 0;
+    while (key < keyCount && !(strlen(keys[key].name) == length && strncmp(keys[key].name, name, length) == 0))
+    {
+      key++;
+    }
+    name += end ? length + 1 : length;
+    char journalName[16];
+    journalKey(journalName, position);
+    if (key == keyCount)
+    {
+      erase(journalName); // no longer in the key table
+      continue;
+    }
+
+    // The journal item goes through the key's slot on its way to the key.
+    counters.flashReads++;
+    states[key] = Unloaded;
+    ConfigReadResult result = backend.read(backend.context, journalName, slot(key), keys[key].capacity);
+    if (result == ConfigNotFound)
+    {
+      continue; // applied before a restart
+    }
+    if (result != ConfigFound || !write(keys[key].name, slot(key)))
+    {
+      applied = false;
+      continue;
+    }
+    states[key] = Loaded;
+    erase(journalName);
+  }
+  if (!applied)
+  {
+    // The commit record stays, so begin() tries again.
+    commit();
+    return false;
+  }
+  erase(MARKER_KEY);
+  return commit();
+}
+
+size_t ConfigStore::eraseJournal()
+{
+  // Journal items are written in order, so the first missing one ends it.
+  char name[16];
+  size_t position = 0;
+  while (position < MAX_KEYS)
+  {
+    journalKey(name, position);
+    if (!erase(name))
+    {
+      break;
+    }
+    position++;
+  }
+  return erase(RESERVE_KEY) ? position + 1 : position;
+}
+
+bool ConfigStore::write(const char *name, const char *value)
+{
+  counters.flashWrites++;
+  return backend.write(backend.context, name, value);
+}
+
+bool ConfigStore::erase(const char *name)
+{
+  if (!backend.erase(backend.context, name))
+  {
+    return false;
+  }
+  counters.flashErases++;
+  return true;
+}
+
+bool ConfigStore::commit()
+{
+  counters.commits++;
+  return backend.commit(backend.context);
+}
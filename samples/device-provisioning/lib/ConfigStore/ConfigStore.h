@@ -0,0 +1,148 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum ConfigReadResult
+{
+  ConfigFound,
+  ConfigNotFound,
+  ConfigReadError // including a value longer than the key's capacity
+};
+
+// Storage under the cache, e.g. an open NVS namespace.
+struct ConfigBackend
+{
+  // Reads the string value of `key` into `buffer` (NUL terminated) in one go.
+  ConfigReadResult (*read)(void *context, const char *key, char *buffer, size_t capacity);
+  // Stores `value` under `key`. Each write must be atomic on its own (after a
+  // crash the key holds either the old or the new value) and reach storage in
+  // the order it was made. NVS writes each item to flash as it is set.
+  bool (*write)(void *context, const char *key, const char *value);
+  // Returns false when there was nothing to erase, or it failed.
+  bool (*erase)(void *context, const char *key);
+  // Makes the writes and erases so far durable.
+  bool (*commit)(void *context);
+  void *context;
+};
+
+struct ConfigKey
+{
+  const char *name;
+  // Room for the longest value, including the terminating NUL.
+  uint16_t capacity;
+};
+
+struct ConfigStats
+{
+  uint32_t hits = 0;   // served from RAM
+  uint32_t misses = 0; // first access, loaded from the backend
+  uint32_t flashReads = 0;
+  uint32_t flashWrites = 0;
+  uint32_t flashErases = 0;
+  uint32_t commits = 0;
+  uint32_t unchanged = 0; // set()s skipped because the value was already stored
+  uint32_t readErrors = 0;
+};
+
+// String settings (Wi-Fi credentials, certificates, provisioning state) cached
+// in RAM in front of their storage.
+//
+// begin() allocates one arena with room for every key's capacity; nothing is
+// allocated after that. A key is read from the backend on first access, with
+// a single read, and later gets are served from the arena, including "not
+// stored". set() writes through to the backend and then updates the arena;
+// setting the stored value again writes nothing.
+//
+// Several set()s can be grouped in a transaction that is committed once and
+// survives a crash all or nothing. Staged values go to journal items
+// ("txn.0", "txn.1", ...) first, and the commit record ("txn", listing the
+// keys in journal order) is written last; only then are the keys themselves
+// written, each journal item being erased once its key holds the value.
+// begin() finishes a transaction whose commit record exists and drops the
+// journal of one that never got that far. The "txn" key names are reserved.
+//
+// A transaction needs room for each staged value twice at once: in its
+// journal item, and in its key while the key's old value is still there
+// (NVS writes the new item before it erases the old one). So that running
+// out of room can only fail a transaction before its commit record, a
+// reserve item ("txn.r") as long as the longest staged value is written just
+// before it and erased first thing after: from then on each key written is
+// covered by the reserve, or by the journal items already erased.
+//
+// Keys are addressed by their index in the table given to the constructor, so
+// the sketch can name them with an enum. The table must outlive the store.
+// Only uses the C library, so it builds on Linux too.
+class ConfigStore
+{
+public:
+  static const size_t MAX_KEYS = 16;
+
+  ConfigStore(const ConfigKey *keys, size_t count, const ConfigBackend &backend);
+  ~ConfigStore();
+
+  // Allocates the arena and recovers an interrupted transaction.
+  bool begin();
+
+  // The stored value, or nullptr when there is none. The pointer stays valid,
+  // and shows later set()s of the same key.
+  const char *get(size_t key);
+  // "true" and "false"; anything else, or no value, is `fallback`.
+  bool getBool(size_t key, bool fallback = false);
+  // Fails, leaving the cached value as it was, when the value does not fit the
+  // key's capacity or the backend write fails.
+  bool set(size_t key, const char *value);
+  bool setBool(size_t key, bool value) { return set(key, value ? "true" : "false"); }
+
+  // Until commitTransaction(), set() only stages values and get() returns the
+  // committed ones. A set() that fails fails the whole transaction.
+  void beginTransaction();
+  // Writes the staged values, or none of them. Returns false when nothing
+  // was written, or when the transaction was recorded but applying it failed
+  // (begin() retries it after a restart).
+  bool commitTransaction();
+  void abortTransaction();
+  // Reloads every key on its next access, e.g. after writing the backend
+  // behind the store's back.
+  void invalidate();
+
+  const ConfigStats &stats() const { return counters; }
+
+private:
+  enum SlotState : uint8_t
+  {
+    Unloaded,
+    Absent,
+    Loaded
+  };
+
+  static const size_t MARKER_SIZE = MAX_KEYS * 16;
+
+  bool valid(size_t key) const { return arena != nullptr && key < keyCount; }
+  bool isStored(size_t key, const char *value);
+  bool stage(size_t key, const char *value);
+  // Writes the reserve item, as long as the longest staged value.
+  bool writeReserve();
+  // Moves journal items to their keys, as listed in `marker`, then removes
+  // the commit record. A journal item already gone was applied before.
+  bool applyJournal(const char *marker);
+  // Returns the number of items erased, the reserve included.
+  size_t eraseJournal();
+  bool write(const char *name, const char *value);
+  bool erase(const char *name);
+  bool commit();
+  char *slot(size_t key) const { return arena + offsets[key]; }
+
+  const ConfigKey *keys;
+  size_t keyCount;
+  ConfigBackend backend;
+  char *arena = nullptr;
+  uint32_t offsets[MAX_KEYS];
+  SlotState states[MAX_KEYS];
+  bool inTransaction = false;
+  bool transactionFailed = false;
+  uint8_t staged[MAX_KEYS]; // key indexes, in journal order
+  uint16_t stagedLengths[MAX_KEYS];
+  size_t stagedCount = 0;
+  ConfigStats counters;
+};
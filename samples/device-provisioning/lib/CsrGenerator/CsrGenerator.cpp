@@ -0,0 +1,45 @@
+#include "CsrGenerator.h"
+
+#include <string.h>
+#include <mbedtls/ecp.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/x509_csr.h>
+
+int generateKeyAndCsr(const char *subject, char *keyPem, size_t keyCapacity, char *csrPem, size_t csrCapacity,
+                      int (*random)(void *context, unsigned char *output, size_t length), void *context)
+{
+  mbedtls_pk_context key;
+  mbedtls_x509write_csr csr;
+  mbedtls_pk_init(&key);
+  mbedtls_x509write_csr_init(&csr);
+
+  int err = mbedtls_pk_setup(&key, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY));
+  if (err == 0)
+  {
+    err = mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, mbedtls_pk_ec(key), random, context);
+  }
+  if (err == 0)
+  {
+    err = mbedtls_pk_write_key_pem(&key, (unsigned char *)keyPem, keyCapacity);
+  }
+  if (err == 0)
+  {
+    mbedtls_x509write_csr_set_md_alg(&csr, MBEDTLS_MD_SHA256);
+    mbedtls_x509write_csr_set_key(&csr, &key);
+    err = mbedtls_x509write_csr_set_subject_name(&csr, subject);
+  }
+  if (err == 0)
+  {
+    err = mbedtls_x509write_csr_pem(&csr, (unsigned char *)csrPem, csrCapacity, random, context);
+  }
+
+  mbedtls_x509write_csr_free(&csr);
+  mbedtls_pk_free(&key);
+  if (err != 0)
+  {
+    // Do not leave part of a private key behind.
+    memset(keyPem, 0, keyCapacity);
+    memset(csrPem, 0, csrCapacity);
+  }
+  return err;
+}
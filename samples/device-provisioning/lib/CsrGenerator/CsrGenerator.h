@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+
+// Room for the PEM output, including the terminating NUL. A P-256 private
+// key is about 230 characters and its CSR about 500 with a short subject.
+#define CSR_KEY_PEM_SIZE 256
+#define CSR_PEM_SIZE 1024
+
+// Makes a new ECDSA P-256 key pair and a certificate signing request for it,
+// signed with SHA-256, both PEM encoded, e.g. for the CreateCertificateFromCsr
+// API. That is two elliptic curve multiplications, too slow for the provisioning
+// flow itself, so the sketch runs this ahead of time in a background task.
+//
+// `subject` is a distinguished name such as "CN=device-1". `random` fills
+// `output` with cryptographically secure bytes and returns 0. Returns 0, or
+// the mbedtls error code with both buffers cleared.
+// Only uses mbedtls, so it builds on Linux too.
+int generateKeyAndCsr(const char *subject, char *keyPem, size_t keyCapacity, char *csrPem, size_t csrCapacity,
+                      int (*random)(void *context, unsigned char *output, size_t length), void *context);
@@ -2,18 +2,69 @@
 #include "sdkconfig.h"
 #include <Arduino.h>
 #include <cstdio>
-#include <WifiClientSecure.h>
+#include <WiFiClientSecure.h>
 #include <M5Core2.h>
 #include <MQTTClient.h>
-#include <ArduinoJSON.h>
+#include <ArduinoJson.h>
 #include <nvs.h>
 #include <nvs_flash.h>
+#include <ConnectionManager.h>
+#include <TopicRouter.h>
+#include <LoopStats.h>
+#include <ConfigStore.h>
+#include <CsrGenerator.h>
+#include <atomic>
+
+// Loop period percentiles, publish rate and free heap are logged every
+// LOOP_STATS_INTERVAL_MS; 0 turns the report off.
+#ifndef LOOP_STATS_INTERVAL_MS
+#define LOOP_STATS_INTERVAL_MS 30000
+#endif
+// Upper bound (seconds) for the TLS handshake. The handshake and the wait for
+// MQTT CONNACK run in a connect task, so loop() keeps ticking through a broker
+// or TLS outage.
+#ifndef TLS_HANDSHAKE_TIMEOUT_S
+#define TLS_HANDSHAKE_TIMEOUT_S 5
+#endif
+#ifndef CONNECT_TASK_CORE
+#define CONNECT_TASK_CORE 0
+#endif
+#ifndef CONNECT_TASK_STACK_SIZE
+#define CONNECT_TASK_STACK_SIZE 8192
+#endif
+// 1 provisions with CreateCertificateFromCsr: the key pair is made on the
+// device, in a background task after the first connection, and only a CSR is
+// sent when provisioning starts. 0 uses CreateKeysAndCertificate, where AWS
+// makes the key pair and sends the private key back.
+#ifndef PROVISION_WITH_CSR
+#define PROVISION_WITH_CSR 1
+#endif
+// Stack (bytes) of the key generation task.
+#ifndef KEYGEN_TASK_STACK_SIZE
+#define KEYGEN_TASK_STACK_SIZE 8192
+#endif
+// MQTT message buffers (bytes). A CreateKeysAndCertificate reply carries an
+// RSA private key as well as the certificate and ownership token.
+#ifndef MQTT_READ_BUFFER_SIZE
+#if PROVISION_WITH_CSR
+#define MQTT_READ_BUFFER_SIZE 3072
+#else
+#define MQTT_READ_BUFFER_SIZE 5120
+#endif
+#endif
+#ifndef MQTT_WRITE_BUFFER_SIZE
+#define MQTT_WRITE_BUFFER_SIZE 2048
+#endif
 
 // Types and shared state:
 WiFiClientSecure wifiClient = WiFiClientSecure();
-MQTTClient mqttClient = MQTTClient(5120);
+MQTTClient mqttClient = MQTTClient(MQTT_READ_BUFFER_SIZE, MQTT_WRITE_BUFFER_SIZE);
 bool shouldReconnect = false;
 bool shouldRegisterThing = false;
+// BtnA was pressed; provisioning starts once connected and, in CSR mode, once
+// the CSR is stored.
+bool provisioningRequested = false;
+LoopStats loopStats;
 
 const char AWS_IOT_ENDPOINT[] = "data.iot.us.lifeomic.com";
 // Amazon Root CA 1
@@ -56,58 +107,190 @@ String REGISTER_THING_TOPIC = "$aws/provisioning-templates/" + TEMPLATE_NAME + "
 String REGISTER_THING_ACCEPTED = REGISTER_THING_TOPIC + "/accepted";
 String REGISTER_THING_REJECTED = REGISTER_THING_TOPIC + "/rejected";
 
+String CREATE_CERTIFICATE_FROM_CSR_TOPIC = "$aws/certificates/create-from-csr/json";
+String CREATE_CERTIFICATE_FROM_CSR_ACCEPTED = CREATE_CERTIFICATE_FROM_CSR_TOPIC + "/accepted";
+String CREATE_CERTIFICATE_FROM_CSR_REJECTED = CREATE_CERTIFICATE_FROM_CSR_TOPIC + "/rejected";
+
 // Function Declarations
 
 // Setup
-void setupWifi(bool forceReconnect);
-void setupMqtt(String deviceId, bool forceReconnect);
+void setupWifi();
+void loadCredentials();
+void setupMqtt();
+void onMqttConnected();
 bool isProvisioned();
 
 // Storage
 nvs_handle secrets_nvs_handle;
-char *nvs_read_value(nvs_handle handle, const char *key);
-bool nvs_write_value(nvs_handle handle, const char *key, const char *value);
+ConfigReadResult nvs_read_value(void *context, const char *key, char *value, size_t capacity);
+bool nvs_write_value(void *context, const char *key, const char *value);
+bool nvs_erase_value(void *context, const char *key);
+bool nvs_commit_values(void *context);
 esp_err_t nvs_secure_initialize();
 void init_secrets_storage(void);
 
+// Keys of the secrets namespace, cached in RAM by `config` after their first
+// read. Capacities include the terminating NUL; the PEM ones fit RSA-2048.
+// pending_key and csr hold the key pair made for CSR provisioning until the
+// device is registered.
+enum ConfigKeyId
+{
+  WifiSsidKey,
+  WifiPasswordKey,
+  CertKey,
+  PrivateKeyKey,
+  ClaimCertKey,
+  ClaimKeyKey,
+  OwnershipTokenKey,
+  DeviceIdKey,
+  IsProvisionedKey,
+  PendingKeyKey,
+  CsrKey
+};
+const ConfigKey CONFIG_KEYS[] = {
+    {"wifi_ssid", 33},
+    {"wifi_password", 65},
+    {"cert", 2048},
+    {"private_key", 2048},
+    {"claim_cert", 2048},
+    {"claim_key", 2048},
+    {"crt_ownrshp_tkn", 1024},
+    {"device_id", 129},
+    {"is_provisioned", 8},
+    {"pending_key", CSR_KEY_PEM_SIZE},
+    {"csr", CSR_PEM_SIZE},
+};
+ConfigStore config(CONFIG_KEYS, sizeof(CONFIG_KEYS) / sizeof(CONFIG_KEYS[0]),
+                   {nvs_read_value, nvs_write_value, nvs_erase_value, nvs_commit_values, &secrets_nvs_handle});
+
+// Background key generation for CSR provisioning. The task fills
+// `generatedKey` and then sets `keyGeneration` to KeyGenerationDone; loop()
+// stores the result, so `config` is only ever used from loop().
+enum KeyGenerationState
+{
+  KeyGenerationIdle,
+  KeyGenerationRunning,
+  KeyGenerationDone
+};
+struct GeneratedKey
+{
+  char subject[136];
+  char key[CSR_KEY_PEM_SIZE];
+  char csr[CSR_PEM_SIZE];
+  int error;
+  uint32_t elapsedMs;
+};
+std::atomic<KeyGenerationState> keyGeneration(KeyGenerationIdle);
+GeneratedKey generatedKey;
+bool hasPendingCsr();
+void startKeyGeneration();
+void keyGenerationTask(void *parameter);
+void storeGeneratedKey();
+
+// Time-to-provisioned and heap use of the provisioning attempt in progress,
+// from BtnA to the connection with the new certificate. The heap is sampled
+// every loop() and wherever the flow holds a parsed or serialized message.
+struct ProvisioningRun
+{
+  bool active = false;
+  uint32_t startedMs = 0;
+  uint32_t freeHeapAtStart = 0;
+  uint32_t minFreeHeap = 0;
+};
+ProvisioningRun provisioningRun;
+void startProvisioningRun();
+void sampleProvisioningHeap();
+void reportProvisioned();
+
 // Topic Handlers
-void handleMessages(String topic, String payload);
-void handleError(String topic, String payload);
-void createKeysAndCertificateAccepted(String payload);
-void registerThingAccepted(String payload);
+// Six $aws/certificates/... and $aws/provisioning-templates/<template>/...
+// topics; template names are at most 36 characters.
+TopicRouter<6, 512> router;
+void setupRoutes();
+void addRoute(const char *topic, TopicHandler handler);
+void reportLoopStats();
+void reportConfigWrite(const char *what, uint32_t started);
+void handleMessages(MQTTClient *client, char topic[], char payload[], int length);
+void handleError(const char *topic, const TopicParams &params, char *payload, int length);
+void createKeysAndCertificateAccepted(const char *topic, const TopicParams &params, char *payload, int length);
+void createCertificateFromCsrAccepted(const char *topic, const TopicParams &params, char *payload, int length);
+void registerThingAccepted(const char *topic, const TopicParams &params, char *payload, int length);
+void registerThingRejected(const char *topic, const TopicParams &params, char *payload, int length);
 
 // Topic Publishers
 void createKeysAndCertificate();
+void createCertificateFromCsr();
 void registerThing();
+bool subscribeProvisioningReplies();
+void connectTask(void *parameter);
+
+// Wi-Fi/TLS/MQTT connect is advanced a step at a time from loop(); the TLS
+// connect and MQTT CONNECT run in connectTask.
+TaskHandle_t connectTaskHandle = NULL;
+ConnectionManager connection({
+    setupWifi,
+    []() { return WiFi.status() == WL_CONNECTED; },
+    []() { return wifiClient.connect(AWS_IOT_ENDPOINT, 8883) == 1; },
+    // true = reuse the open TLS socket
+    []() { return mqttClient.connect(deviceId.c_str(), true) && subscribeProvisioningReplies(); },
+    []() { return mqttClient.connected(); },
+    onMqttConnected,
+    []()
+    {
+      mqttClient.disconnect();
+      wifiClient.stop();
+    },
+    []() -> uint32_t { return millis(); },
+    [](uint32_t max) -> uint32_t { return esp_random() % max; },
+    []() { xTaskNotifyGive(connectTaskHandle); },
+});
 
 void setup()
 {
   M5.begin();
+  setupRoutes();
   init_secrets_storage();
-
-  setupWifi(false);
+  if (!config.begin())
+  {
+    Serial.println("Failed to allocate the config cache");
+  }
+  loadCredentials();
 
   // Initialize provisioning state.
-  String isProvisioned = nvs_read_value(secrets_nvs_handle, "is_provisioned");
-  isProvisioned = (isProvisioned != nullptr) ? isProvisioned : "false";
-  nvs_write_value(secrets_nvs_handle, "is_provisioned", isProvisioned.c_str());
+  if (config.get(IsProvisionedKey) == nullptr)
+  {
+    config.setBool(IsProvisionedKey, false);
+  }
 
   // Use the device ID that's in NVS or if not use the initialDeviceId.
-  char *existingDeviceId = nvs_read_value(secrets_nvs_handle, "device_id");
-  deviceId = (existingDeviceId != nullptr) ? existingDeviceId : deviceId;
-  nvs_write_value(secrets_nvs_handle, "device_id", deviceId.c_str());
-  setupMqtt(deviceId, false);
+  const char *existingDeviceId = config.get(DeviceIdKey);
+  if (existingDeviceId != nullptr)
+  {
+    deviceId = existingDeviceId;
+  }
+  else
+  {
+    config.set(DeviceIdKey, deviceId.c_str());
+  }
+  setupMqtt();
+  xTaskCreatePinnedToCore(connectTask, "connect", CONNECT_TASK_STACK_SIZE, NULL, 1, &connectTaskHandle,
+                          CONNECT_TASK_CORE);
 }
 
 void loop()
 {
-  mqttClient.loop();
+  loopStats.tick(micros());
+  reportLoopStats();
+  sampleProvisioningHeap();
+  // The MQTT client and its socket are the connect task's while it connects.
+  if (!connection.connecting())
+  {
+    mqttClient.loop();
+  }
   // mqttClient recommends calling this on esp32
   delay(10);
   M5.update();
-
-  setupWifi(false);
-  setupMqtt(deviceId, false);
+  connection.tick();
 
   if (M5.BtnA.wasReleased() || M5.BtnA.pressedFor(1000, 200))
   {
@@ -116,20 +299,36 @@ void loop()
 
     if (!isProvisioned())
     {
-      createKeysAndCertificate();
-      return;
+      startProvisioningRun();
+      provisioningRequested = true;
     }
   }
 
-  if (shouldReconnect)
+#if PROVISION_WITH_CSR
+  storeGeneratedKey();
+  if (provisioningRequested && hasPendingCsr() && connection.connected())
+  {
+    provisioningRequested = false;
+    createCertificateFromCsr();
+  }
+#else
+  if (provisioningRequested && connection.connected())
+  {
+    provisioningRequested = false;
+    createKeysAndCertificate();
+  }
+#endif
+
+  // Not while the connect task is using the credentials.
+  if (shouldReconnect && !connection.connecting())
   {
     M5.Lcd.println("Reconnecting...");
-    setupWifi(true);
-    setupMqtt(deviceId, true);
+    loadCredentials();
+    connection.reconnect();
     shouldReconnect = false;
   }
 
-  if (shouldRegisterThing)
+  if (shouldRegisterThing && connection.connected())
   {
     registerThing();
     shouldRegisterThing = false;
@@ -137,109 +336,114 @@ void loop()
 }
 
 // function definitions:
-void setupWifi(bool forceReconnect)
+void setupWifi()
 {
-  if (WiFi.status() == WL_CONNECTED && forceReconnect == false)
-  {
-    return;
-  }
-
-  if (forceReconnect)
-  {
-    WiFi.disconnect();
-  }
-
   M5.Lcd.print("\nConnecting to WiFi");
 
-  char *wifiSsid = nvs_read_value(secrets_nvs_handle, "wifi_ssid");
-  char *wifiPassword = nvs_read_value(secrets_nvs_handle, "wifi_password");
-  WiFi.begin(wifiSsid, wifiPassword);
-  free(wifiSsid);
-  free(wifiPassword);
-
-  while (WiFi.status() != WL_CONNECTED)
-  {
-    delay(500);
-    M5.Lcd.print(".");
-  }
+  WiFi.begin(config.get(WifiSsidKey), config.get(WifiPasswordKey));
+}
 
-  M5.Lcd.println("\nWiFi Connected");
+void loadCredentials()
+{
+  // wifiClient keeps these pointers; they point into the config cache, which
+  // also holds any certificate set later.
   wifiClient.setCACert(AWS_CERT_CA);
-  char *cert = nvs_read_value(secrets_nvs_handle, "cert");
-  char *privateKey = nvs_read_value(secrets_nvs_handle, "private_key");
-  wifiClient.setCertificate(cert);
-  wifiClient.setPrivateKey(privateKey);
+  wifiClient.setCertificate(config.get(CertKey));
+  wifiClient.setPrivateKey(config.get(PrivateKeyKey));
+  wifiClient.setHandshakeTimeout(TLS_HANDSHAKE_TIMEOUT_S);
 }
 
-void setupMqtt(String deviceId, bool forceReconnect)
+void setupMqtt()
 {
-  if (mqttClient.connected() == true)
-  {
-    return;
-  }
-
-  Serial.printf("mqttError=%d\n", mqttClient.lastError());
-  Serial.printf("mqttConnected=%s\n\n", String(mqttClient.connected()).c_str());
-  Serial.printf("Connecting to MQTT broker with clientId=%s\n", deviceId.c_str());
   mqttClient.begin(AWS_IOT_ENDPOINT, 8883, wifiClient);
   mqttClient.setCleanSession(false);
+  mqttClient.onMessageAdvanced(handleMessages);
+}
 
-  mqttClient.subscribe(CREATE_KEYS_AND_CERTIFICATE_ACCEPTED.c_str());
-  mqttClient.subscribe(CREATE_KEYS_AND_CERTIFICATE_REJECTED.c_str());
-  mqttClient.subscribe(REGISTER_THING_ACCEPTED.c_str());
-  mqttClient.subscribe(REGISTER_THING_REJECTED.c_str());
+// Runs the blocking part of each connection attempt, see connection.
+void connectTask(void *parameter)
+{
+  for (;;)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    connection.runConnect();
+  }
+}
 
-  while (!mqttClient.connect(deviceId.c_str()))
+// add() fails when the router is full; say which topic would go unhandled.
+void addRoute(const char *topic, TopicHandler handler)
+{
+  if (!router.add(topic, handler))
   {
-    Serial.print(".");
-    delay(1000);
+    Serial.printf("Cannot route %s: router full (%u routes)\n", topic, router.size());
   }
+}
+
+void setupRoutes()
+{
+  addRoute(CREATE_KEYS_AND_CERTIFICATE_ACCEPTED.c_str(), createKeysAndCertificateAccepted);
+  addRoute(CREATE_KEYS_AND_CERTIFICATE_REJECTED.c_str(), handleError);
+  addRoute(CREATE_CERTIFICATE_FROM_CSR_ACCEPTED.c_str(), createCertificateFromCsrAccepted);
+  addRoute(CREATE_CERTIFICATE_FROM_CSR_REJECTED.c_str(), handleError);
+  addRoute(REGISTER_THING_ACCEPTED.c_str(), registerThingAccepted);
+  addRoute(REGISTER_THING_REJECTED.c_str(), registerThingRejected);
+}
 
-  Serial.println("");
+// Part of every connection attempt, in connectTask.
+bool subscribeProvisioningReplies()
+{
+  return mqttClient.subscribe(CREATE_KEYS_AND_CERTIFICATE_ACCEPTED.c_str()) &&
+         mqttClient.subscribe(CREATE_KEYS_AND_CERTIFICATE_REJECTED.c_str()) &&
+         mqttClient.subscribe(CREATE_CERTIFICATE_FROM_CSR_ACCEPTED.c_str()) &&
+         mqttClient.subscribe(CREATE_CERTIFICATE_FROM_CSR_REJECTED.c_str()) &&
+         mqttClient.subscribe(REGISTER_THING_ACCEPTED.c_str()) && mqttClient.subscribe(REGISTER_THING_REJECTED.c_str());
+}
 
-  if (!mqttClient.connected())
+void onMqttConnected()
+{
+  const ConnectionMetrics &metrics = connection.metrics();
+  Serial.printf("Connected to MQTT broker with clientId=%s (reconnect=%ums, max=%ums, failed attempts=%u, worst tick=%ums)\n",
+                deviceId.c_str(), metrics.lastReconnectMs, metrics.maxReconnectMs, metrics.failedAttempts, metrics.worstTickMs);
+
+  reportConfigWrite(nullptr, 0);
+  reportProvisioned();
+#if PROVISION_WITH_CSR
+  // The hardware RNG is only a true RNG with the radio on, as it is now.
+  if (!isProvisioned() && !hasPendingCsr())
   {
-    Serial.println("Broker timeout!");
-    return;
+    startKeyGeneration();
   }
-
-  Serial.println("Connected to MQTT broker");
-  mqttClient.onMessage(handleMessages);
+#endif
 }
 
 bool isProvisioned()
 {
-  // Read is_provisioned from NVS and return false if it is not equal to "true".
-  char *isProvisioned = nvs_read_value(secrets_nvs_handle, "is_provisioned");
-  bool _isProvisioned = (isProvisioned != nullptr) ? strcmp(isProvisioned, "true") == 0 : false;
-  free(isProvisioned);
-
-  return _isProvisioned;
+  // False unless is_provisioned is "true".
+  return config.getBool(IsProvisionedKey);
 }
 
-char *nvs_read_value(nvs_handle handle, const char *key)
+ConfigReadResult nvs_read_value(void *context, const char *key, char *value, size_t capacity)
 {
-  // Try to get the size of the item
-  size_t value_size;
-  if (nvs_get_str(handle, key, NULL, &value_size) != ESP_OK)
+  nvs_handle handle = *(nvs_handle *)context;
+  size_t value_size = capacity;
+  esp_err_t err = nvs_get_str(handle, key, value, &value_size);
+  if (err == ESP_ERR_NVS_NOT_FOUND)
   {
-    Serial.printf("Failed to get NVS size for %s\n", key);
-    return nullptr;
+    Serial.printf("No NVS value for %s\n", key);
+    return ConfigNotFound;
   }
-
-  char *value = new char[value_size];
-  if (nvs_get_str(handle, key, value, &value_size) != ESP_OK)
+  if (err != ESP_OK)
   {
-    delete[] value;
-    Serial.printf("Failed to initialize NVS for %s\n", key);
-    return nullptr;
+    Serial.printf("Failed to read NVS value for %s (rc=0x%x)\n", key, err);
+    return ConfigReadError;
   }
 
-  return value;
+  return ConfigFound;
 }
 
-bool nvs_write_value(nvs_handle handle, const char *key, const char *value)
+bool nvs_write_value(void *context, const char *key, const char *value)
 {
+  nvs_handle handle = *(nvs_handle *)context;
   esp_err_t write_result = nvs_set_str(handle, key, value);
   if (write_result != ESP_OK)
   {
@@ -247,10 +451,28 @@ bool nvs_write_value(nvs_handle handle, const char *key, const char *value)
     return false;
   }
 
+  return true;
+}
+
+bool nvs_erase_value(void *context, const char *key)
+{
+  nvs_handle handle = *(nvs_handle *)context;
+  esp_err_t erase_result = nvs_erase_key(handle, key);
+  if (erase_result != ESP_OK && erase_result != ESP_ERR_NVS_NOT_FOUND)
+  {
+    Serial.printf("Failed to erase NVS value for %s\n", key);
+  }
+
+  return erase_result == ESP_OK;
+}
+
+bool nvs_commit_values(void *context)
+{
+  nvs_handle handle = *(nvs_handle *)context;
   esp_err_t commit_result = nvs_commit(handle);
   if (commit_result != ESP_OK)
   {
-    Serial.printf("Failed to commit NVS changes for %s\n", key);
+    Serial.printf("Failed to commit NVS changes (rc=0x%x)\n", commit_result);
     return false;
   }
 
@@ -314,39 +536,114 @@ void createKeysAndCertificate()
   Serial.println("Registering keys and certificate");
   // This payload is intentially empty and doesn't require any parameters.
   String payload = "{}";
-  mqttClient.publish(CREATE_KEYS_AND_CERTIFICATE_TOPIC, payload, false, 1);
+  if (mqttClient.publish(CREATE_KEYS_AND_CERTIFICATE_TOPIC, payload, false, 1))
+  {
+    loopStats.countPublish();
+  }
 }
 
-void createKeysAndCertificateAccepted(String payload)
+void createKeysAndCertificateAccepted(const char *topic, const TopicParams &params, char *payload, int length)
 {
   Serial.println("Received keys and certificate");
 
   DynamicJsonDocument doc(4096);
-  DeserializationError err = deserializeJson(doc, payload);
+  DeserializationError err = deserializeJson(doc, payload, length);
   if (err)
   {
     Serial.print("Deserialization Error: ");
     Serial.println(err.f_str());
   }
-
+  sampleProvisioningHeap();
+
+  // All five values are stored, or none: a restart in between must not leave
+  // the new certificate without its key, or lose the claim certificate. With
+  // an RSA key this takes 265 free NVS entries at its worst, beyond the page
+  // NVS keeps empty (test_config_store); with less it fails and changes
+  // nothing.
+  uint32_t started = millis();
+  config.beginTransaction();
   // Remember original values.
-  char *claim_cert = nvs_read_value(secrets_nvs_handle, "cert");
-  char *claim_key = nvs_read_value(secrets_nvs_handle, "private_key");
-  nvs_write_value(secrets_nvs_handle, "claim_cert", claim_cert);
-  nvs_write_value(secrets_nvs_handle, "claim_key", claim_key);
-  free(claim_cert);
-  free(claim_key);
+  config.set(ClaimCertKey, config.get(CertKey));
+  config.set(ClaimKeyKey, config.get(PrivateKeyKey));
 
   // Set new values.
-  nvs_write_value(secrets_nvs_handle, "cert", doc["certificatePem"]);
-  nvs_write_value(secrets_nvs_handle, "private_key", doc["privateKey"]);
-  nvs_write_value(secrets_nvs_handle, "crt_ownrshp_tkn", doc["certificateOwnershipToken"]);
+  config.set(CertKey, doc["certificatePem"]);
+  config.set(PrivateKeyKey, doc["privateKey"]);
+  config.set(OwnershipTokenKey, doc["certificateOwnershipToken"]);
+  if (!config.commitTransaction())
+  {
+    Serial.println("Failed to store the new keys and certificate");
+    return;
+  }
+  reportConfigWrite("keys and certificate", started);
 
   // The mqtt client advises against calling publish in a topic handler,
   // so we'll set this variable and call registerThing in the next loop.
   shouldRegisterThing = true;
 }
 
+// See https://docs.aws.amazon.com/iot/latest/developerguide/fleet-provision-api.html#create-cert-csr
+void createCertificateFromCsr()
+{
+  Serial.println("Requesting a certificate for the CSR");
+  StaticJsonDocument<64> doc;
+  doc["certificateSigningRequest"] = config.get(CsrKey);
+
+  String payload;
+  serializeJson(doc, payload);
+  sampleProvisioningHeap();
+  if (mqttClient.publish(CREATE_CERTIFICATE_FROM_CSR_TOPIC, payload, false, 1))
+  {
+    loopStats.countPublish();
+  }
+}
+
+void createCertificateFromCsrAccepted(const char *topic, const TopicParams &params, char *payload, int length)
+{
+  Serial.println("Received certificate");
+
+  // The values stay in `payload` (zero-copy), so the document only needs room
+  // for the two members.
+  StaticJsonDocument<64> filter;
+  filter["certificatePem"] = true;
+  filter["certificateOwnershipToken"] = true;
+  StaticJsonDocument<128> doc;
+  DeserializationError err = deserializeJson(doc, payload, length, DeserializationOption::Filter(filter));
+  if (err)
+  {
+    Serial.print("Deserialization Error: ");
+    Serial.println(err.f_str());
+    return;
+  }
+  sampleProvisioningHeap();
+  const char *certificatePem = doc["certificatePem"];
+  const char *ownershipToken = doc["certificateOwnershipToken"];
+  if (certificatePem == nullptr || ownershipToken == nullptr)
+  {
+    // Nothing is stored: the CSR and its key stay pending for the next try.
+    Serial.printf("CreateCertificateFromCsr reply without %s\n",
+                  certificatePem == nullptr ? "certificatePem" : "certificateOwnershipToken");
+    return;
+  }
+
+  // Same as createKeysAndCertificateAccepted(), with the key made on the device.
+  uint32_t started = millis();
+  config.beginTransaction();
+  config.set(ClaimCertKey, config.get(CertKey));
+  config.set(ClaimKeyKey, config.get(PrivateKeyKey));
+  config.set(CertKey, certificatePem);
+  config.set(PrivateKeyKey, config.get(PendingKeyKey));
+  config.set(OwnershipTokenKey, ownershipToken);
+  if (!config.commitTransaction())
+  {
+    Serial.println("Failed to store the new certificate");
+    return;
+  }
+  reportConfigWrite("certificate", started);
+
+  shouldRegisterThing = true;
+}
+
 // See: https://docs.aws.amazon.com/iot/latest/developerguide/fleet-provision-api.html#register-thing
 void registerThing()
 {
@@ -362,77 +659,224 @@ void registerThing()
   DynamicJsonDocument doc(1024);
   doc["templateName"] = TEMPLATE_NAME;
   doc["parameters"] = parameters;
-  char *ownershipToken = nvs_read_value(secrets_nvs_handle, "crt_ownrshp_tkn");
-  doc["certificateOwnershipToken"] = ownershipToken;
+  doc["certificateOwnershipToken"] = config.get(OwnershipTokenKey);
 
   String payload;
   serializeJson(doc, payload);
-  mqttClient.publish(REGISTER_THING_TOPIC, payload, false, 1);
-  free(ownershipToken);
+  sampleProvisioningHeap();
+  if (mqttClient.publish(REGISTER_THING_TOPIC, payload, false, 1))
+  {
+    loopStats.countPublish();
+  }
 }
 
-void registerThingAccepted(String payload)
+void registerThingAccepted(const char *topic, const TopicParams &params, char *payload, int length)
 {
   Serial.println("Register Thing accepted");
 
   DynamicJsonDocument doc(2048);
-  DeserializationError err = deserializeJson(doc, payload);
+  DeserializationError err = deserializeJson(doc, payload, length);
   if (err)
   {
     Serial.print("Deserialization Error: ");
     Serial.println(err.f_str());
     return;
   }
+  sampleProvisioningHeap();
 
   String thingName = doc["thingName"];
 
   deviceId = thingName;
-  nvs_write_value(secrets_nvs_handle, "device_id", thingName.c_str());
-  nvs_write_value(secrets_nvs_handle, "is_provisioned", "true");
+  uint32_t started = millis();
+  config.beginTransaction();
+  config.set(DeviceIdKey, thingName.c_str());
+  config.setBool(IsProvisionedKey, true);
+#if PROVISION_WITH_CSR
+  // The key pair is in private_key now.
+  config.set(PendingKeyKey, "");
+  config.set(CsrKey, "");
+#endif
+  if (!config.commitTransaction())
+  {
+    Serial.println("Failed to store the provisioning state");
+    return;
+  }
+  reportConfigWrite("provisioning state", started);
 
   // The mqtt client advises against calling subscribe and connecting in a
   // topic handler, so we'll set this variable and reconnect in the next loop.
   shouldReconnect = true;
 }
 
-void handleError(String topic, String payload)
+void handleError(const char *topic, const TopicParams &params, char *payload, int length)
 {
   Serial.println("error from topic.");
   Serial.print("Topic: ");
   Serial.println(topic);
   Serial.print("Payload: ");
-  Serial.println(payload);
+  Serial.write((const uint8_t *)payload, length);
+  Serial.println();
   M5.Lcd.print("Failed to provision device. Error=");
-  M5.Lcd.println(payload);
+  M5.Lcd.write((const uint8_t *)payload, length);
+  M5.Lcd.println();
 };
 
-void handleMessages(String topic, String payload)
+void registerThingRejected(const char *topic, const TopicParams &params, char *payload, int length)
 {
-  if (topic == CREATE_KEYS_AND_CERTIFICATE_ACCEPTED)
+  // Restore claim cert values so the device can try again.
+  config.beginTransaction();
+  config.set(CertKey, config.get(ClaimCertKey));
+  config.set(PrivateKeyKey, config.get(ClaimKeyKey));
+  config.commitTransaction();
+  handleError(topic, params, payload, length);
+}
+
+void handleMessages(MQTTClient *client, char topic[], char payload[], int length)
+{
+  router.dispatch(topic, payload, length);
+}
+
+void reportLoopStats()
+{
+  static uint32_t windowStarted = 0;
+  uint32_t elapsed = millis() - windowStarted;
+  if (LOOP_STATS_INTERVAL_MS == 0 || elapsed < LOOP_STATS_INTERVAL_MS)
   {
-    createKeysAndCertificateAccepted(payload);
     return;
   }
-  else if (topic == CREATE_KEYS_AND_CERTIFICATE_REJECTED)
+  Serial.printf("Loop: %u ticks, p50=%uus p95=%uus p99=%uus max=%uus, %u publishes (%.2f/s), free heap=%u (min %u)\n",
+                loopStats.ticks(), loopStats.percentileUs(50), loopStats.percentileUs(95), loopStats.percentileUs(99),
+                loopStats.maxUs(), loopStats.publishes(), loopStats.publishes() * 1000.0 / elapsed, ESP.getFreeHeap(),
+                ESP.getMinFreeHeap());
+  loopStats.reset();
+  windowStarted = millis();
+}
+
+// Logs the config cache counters, and how long storing `what` took.
+void reportConfigWrite(const char *what, uint32_t started)
+{
+  if (what != nullptr)
+  {
+    Serial.printf("Stored %s in %lums\n", what, millis() - started);
+  }
+  const ConfigStats &stats = config.stats();
+  Serial.printf("Config cache: %u hits, %u misses, %u flash reads, %u flash writes (%u unchanged skipped), %u erases, "
+                "%u commits, %u read errors\n",
+                stats.hits, stats.misses, stats.flashReads, stats.flashWrites, stats.unchanged, stats.flashErases,
+                stats.commits, stats.readErrors);
+  nvs_stats_t nvsStats;
+  if (nvs_get_stats(NULL, &nvsStats) == ESP_OK)
+  {
+    Serial.printf("NVS: %u of %u entries free\n", (unsigned)nvsStats.free_entries, (unsigned)nvsStats.total_entries);
+  }
+}
+
+bool hasPendingCsr()
+{
+  const char *csr = config.get(CsrKey);
+  return csr != nullptr && csr[0] != '\0';
+}
+
+// The hardware RNG, for mbedtls.
+int hardwareRandom(void *context, unsigned char *output, size_t length)
+{
+  esp_fill_random(output, length);
+  return 0;
+}
+
+void startKeyGeneration()
+{
+  if (keyGeneration != KeyGenerationIdle)
   {
-    handleError(topic, payload);
     return;
   }
-  else if (topic == REGISTER_THING_ACCEPTED)
+  snprintf(generatedKey.subject, sizeof(generatedKey.subject), "CN=%s", deviceId.c_str());
+  keyGeneration = KeyGenerationRunning;
+  // Core 0, at the lowest priority above idle: the Wi-Fi and TCP/IP tasks
+  // there preempt it, and loop() and MQTT keep core 1 to themselves.
+  if (xTaskCreatePinnedToCore(keyGenerationTask, "keygen", KEYGEN_TASK_STACK_SIZE, nullptr, tskIDLE_PRIORITY + 1,
+                              nullptr, 0) != pdPASS)
+  {
+    Serial.println("Failed to start the key generation task");
+    keyGeneration = KeyGenerationIdle;
+  }
+}
+
+void keyGenerationTask(void *parameter)
+{
+  uint32_t started = millis();
+  generatedKey.error = generateKeyAndCsr(generatedKey.subject, generatedKey.key, sizeof(generatedKey.key),
+                                         generatedKey.csr, sizeof(generatedKey.csr), hardwareRandom, nullptr);
+  generatedKey.elapsedMs = millis() - started;
+  keyGeneration = KeyGenerationDone;
+  vTaskDelete(nullptr);
+}
+
+// Stores a key pair the task has finished, all or nothing, so a restart
+// never leaves a CSR without its key.
+void storeGeneratedKey()
+{
+  if (keyGeneration != KeyGenerationDone)
   {
-    registerThingAccepted(payload);
     return;
   }
-  else if (topic == REGISTER_THING_REJECTED)
+  if (generatedKey.error != 0)
+  {
+    // Tried again on the next connection.
+    Serial.printf("Failed to generate a key pair and CSR (rc=-0x%x)\n", -generatedKey.error);
+  }
+  else
+  {
+    uint32_t started = millis();
+    config.beginTransaction();
+    config.set(PendingKeyKey, generatedKey.key);
+    config.set(CsrKey, generatedKey.csr);
+    if (config.commitTransaction())
+    {
+      Serial.printf("Generated a key pair and CSR in %ums in the background\n", generatedKey.elapsedMs);
+      reportConfigWrite("key pair and CSR", started);
+    }
+    else
+    {
+      Serial.println("Failed to store the key pair and CSR");
+    }
+  }
+  memset(generatedKey.key, 0, sizeof(generatedKey.key));
+  keyGeneration = KeyGenerationIdle;
+}
+
+void startProvisioningRun()
+{
+  provisioningRun.active = true;
+  provisioningRun.startedMs = millis();
+  provisioningRun.freeHeapAtStart = ESP.getFreeHeap();
+  provisioningRun.minFreeHeap = provisioningRun.freeHeapAtStart;
+}
+
+void sampleProvisioningHeap()
+{
+  if (provisioningRun.active)
+  {
+    uint32_t freeHeap = ESP.getFreeHeap();
+    if (freeHeap < provisioningRun.minFreeHeap)
+    {
+      provisioningRun.minFreeHeap = freeHeap;
+    }
+  }
+}
+
+// Logs time-to-provisioned and peak heap use once connected with the new
+// certificate.
+void reportProvisioned()
+{
+  if (!provisioningRun.active || !isProvisioned())
   {
-    // Restore claim cert values so the device can try again.
-    char *claim_cert = nvs_read_value(secrets_nvs_handle, "claim_cert");
-    char *claim_key = nvs_read_value(secrets_nvs_handle, "claim_key");
-    nvs_write_value(secrets_nvs_handle, "cert", claim_cert);
-    nvs_write_value(secrets_nvs_handle, "private_key", claim_key);
-    handleError(topic, payload);
-    free(claim_cert);
-    free(claim_key);
     return;
   }
-}
\ No newline at end of file
+  sampleProvisioningHeap();
+  Serial.printf("Provisioned with %s in %lums, peak heap use %u bytes (free heap %u, lowest %u)\n",
+                PROVISION_WITH_CSR ? "CreateCertificateFromCsr" : "CreateKeysAndCertificate",
+                millis() - provisioningRun.startedMs, provisioningRun.freeHeapAtStart - provisioningRun.minFreeHeap,
+                provisioningRun.freeHeapAtStart, provisioningRun.minFreeHeap);
+  provisioningRun.active = false;
+}
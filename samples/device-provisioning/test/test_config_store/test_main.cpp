@@ -0,0 +1,448 @@
+#include <Arduino.h>
+#include <ConfigStore.h>
+#include <nvs.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unity.h>
+
+// ConfigStore on the NVS stand-in kept in a file, through the same backend
+// calls as the sketch: the RAM cache, values across restarts, transactions,
+// and the process killed before each write and erase of a transaction (and
+// of its recovery) with the store checked after the restart. Also the free
+// NVS entries a certificate swap needs at its worst, and a partition too full
+// for it failing the swap before its commit point.
+//
+//   pio test -e native -f test_config_store -v
+
+enum TestKey
+{
+  SsidKey,
+  CertKey,
+  PrivateKeyKey,
+  TokenKey,
+  ProvisionedKey,
+  ClaimCertKey,
+  ClaimKeyKey
+};
+const ConfigKey KEYS[] = {
+    {"wifi_ssid", 33},     {"cert", 2048},       {"private_key", 2048}, {"crt_ownrshp_tkn", 1024},
+    {"is_provisioned", 8}, {"claim_cert", 2048}, {"claim_key", 2048},
+};
+const size_t KEY_COUNT = sizeof(KEYS) / sizeof(KEYS[0]);
+
+static char nvsPath[64];
+static nvs_handle_t handle;
+
+// Writes and erases left before the process is killed; -1 never.
+static int killAfter = -1;
+const int KILLED = 3; // exit status of a killed child
+
+static void killPoint()
+{
+  if (killAfter >= 0 && killAfter-- == 0)
+  {
+    _exit(KILLED); // the power goes before this write or erase
+  }
+}
+
+// The sketch's nvs_read_value() and friends, less their logging.
+static ConfigReadResult nvsRead(void *context, const char *key, char *value, size_t capacity)
+{
+  size_t length = capacity;
+  esp_err_t err = nvs_get_str(*(nvs_handle_t *)context, key, value, &length);
+  return err == ESP_OK ? ConfigFound : err == ESP_ERR_NVS_NOT_FOUND ? ConfigNotFound : ConfigReadError;
+}
+
+static bool nvsWrite(void *context, const char *key, const char *value)
+{
+  killPoint();
+  return nvs_set_str(*(nvs_handle_t *)context, key, value) == ESP_OK;
+}
+
+static bool nvsErase(void *context, const char *key)
+{
+  // Erasing what is not there writes nothing, so it is no kill point.
+  char value[2048];
+  size_t length = sizeof(value);
+  if (nvs_get_str(*(nvs_handle_t *)context, key, value, &length) == ESP_ERR_NVS_NOT_FOUND)
+  {
+    return false;
+  }
+  killPoint();
+  return nvs_erase_key(*(nvs_handle_t *)context, key) == ESP_OK;
+}
+
+static bool nvsCommit(void *context)
+{
+  return nvs_commit(*(nvs_handle_t *)context) == ESP_OK;
+}
+
+const ConfigBackend BACKEND = {nvsRead, nvsWrite, nvsErase, nvsCommit, &handle};
+
+// Power on: the store is what reached the file.
+static void boot()
+{
+  fakeNvsReboot();
+  TEST_ASSERT_EQUAL(ESP_OK, nvs_open("secrets", NVS_READWRITE, &handle));
+}
+
+static std::string stored(const char *key)
+{
+  char value[2048];
+  size_t length = sizeof(value);
+  return nvs_get_str(handle, key, value, &length) == ESP_OK ? std::string(value) : std::string("<none>");
+}
+
+// Leftovers of a transaction: the commit record, a journal item or the
+// reserve.
+static bool journalLeft()
+{
+  return stored("txn") != "<none>" || stored("txn.0") != "<none>" || stored("txn.r") != "<none>";
+}
+
+void setUp()
+{
+  snprintf(nvsPath, sizeof(nvsPath), "/tmp/test_config_store-%d.nvs", (int)getpid());
+  fakeNvsUseFile(nvsPath);
+  fakeNvsReset();
+  killAfter = -1;
+  boot();
+}
+
+void tearDown()
+{
+  remove(nvsPath);
+}
+
+static void test_cache_in_front_of_the_file()
+{
+  {
+    ConfigStore store(KEYS, KEY_COUNT, BACKEND);
+    TEST_ASSERT_TRUE(store.begin());
+    TEST_ASSERT_NULL(store.get(SsidKey));
+    TEST_ASSERT_NULL(store.get(SsidKey)); // "not stored" is cached too
+    TEST_ASSERT_TRUE(store.set(SsidKey, "native"));
+    TEST_ASSERT_TRUE(store.set(SsidKey, "native"));
+    TEST_ASSERT_TRUE(store.setBool(ProvisionedKey, true));
+    TEST_ASSERT_FALSE(store.set(SsidKey, "a Wi-Fi network name longer than 32 bytes"));
+    TEST_ASSERT_EQUAL_STRING("native", store.get(SsidKey));
+    TEST_ASSERT_EQUAL(2, store.stats().flashWrites);
+    TEST_ASSERT_EQUAL(1, store.stats().unchanged);
+    TEST_ASSERT_EQUAL(2, store.stats().misses);
+  }
+
+  boot();
+  ConfigStore store(KEYS, KEY_COUNT, BACKEND);
+  TEST_ASSERT_TRUE(store.begin());
+  uint32_t readsAfterBegin = store.stats().flashReads;
+  for (int i = 0; i < 10; i++)
+  {
+    TEST_ASSERT_EQUAL_STRING("native", store.get(SsidKey));
+    TEST_ASSERT_TRUE(store.getBool(ProvisionedKey));
+  }
+  TEST_ASSERT_EQUAL(readsAfterBegin + 2, store.stats().flashReads);
+  TEST_ASSERT_EQUAL(18, store.stats().hits);
+}
+
+// The claim identity, then the one a provisioning transaction replaces it with.
+static void storeClaimIdentity()
+{
+  nvs_set_str(handle, "cert", "claim certificate");
+  nvs_set_str(handle, "private_key", "claim key");
+  nvs_erase_key(handle, "crt_ownrshp_tkn");
+  nvs_set_str(handle, "is_provisioned", "false");
+}
+
+static bool provision(ConfigStore &store)
+{
+  store.beginTransaction();
+  store.set(CertKey, "device certificate");
+  store.set(PrivateKeyKey, "device key");
+  store.set(TokenKey, "ownership token");
+  store.setBool(ProvisionedKey, true);
+  return store.commitTransaction();
+}
+
+enum Identity
+{
+  Claim,
+  Device,
+  Mixed
+};
+
+static Identity identityAfterBoot()
+{
+  boot();
+  ConfigStore store(KEYS, KEY_COUNT, BACKEND);
+  TEST_ASSERT_TRUE(store.begin());
+  const char *cert = store.get(CertKey);
+  const char *key = store.get(PrivateKeyKey);
+  const char *token = store.get(TokenKey);
+  bool provisioned = store.getBool(ProvisionedKey);
+  TEST_ASSERT_FALSE(journalLeft());
+  if (cert && strcmp(cert, "claim certificate") == 0 && key && strcmp(key, "claim key") == 0 && token == nullptr &&
+      !provisioned)
+  {
+    return Claim;
+  }
+  if (cert && strcmp(cert, "device certificate") == 0 && key && strcmp(key, "device key") == 0 && token &&
+      strcmp(token, "ownership token") == 0 && provisioned)
+  {
+    return Device;
+  }
+  return Mixed;
+}
+
+static void test_transactions()
+{
+  storeClaimIdentity();
+  ConfigStore store(KEYS, KEY_COUNT, BACKEND);
+  TEST_ASSERT_TRUE(store.begin());
+
+  store.beginTransaction();
+  store.set(CertKey, "device certificate");
+  TEST_ASSERT_EQUAL_STRING("claim certificate", store.get(CertKey)); // staged only
+  store.abortTransaction();
+  TEST_ASSERT_FALSE(journalLeft());
+  TEST_ASSERT_EQUAL_STRING("claim certificate", store.get(CertKey));
+
+  // One value that does not fit fails them all.
+  store.beginTransaction();
+  store.set(CertKey, "device certificate");
+  store.set(ProvisionedKey, "certainly");
+  TEST_ASSERT_FALSE(store.commitTransaction());
+  TEST_ASSERT_FALSE(journalLeft());
+  TEST_ASSERT_EQUAL(Claim, identityAfterBoot());
+
+  ConfigStore again(KEYS, KEY_COUNT, BACKEND);
+  TEST_ASSERT_TRUE(again.begin());
+  TEST_ASSERT_TRUE(provision(again));
+  TEST_ASSERT_EQUAL_STRING("device certificate", again.get(CertKey));
+  TEST_ASSERT_EQUAL(Device, identityAfterBoot());
+}
+
+// Runs `work` in a child process that is killed before its `writes`+1-th
+// write or erase. False when it finished first.
+template <typename Work>
+static bool runUntilKilled(int writes, Work work)
+{
+  fflush(stdout);
+  pid_t child = fork();
+  TEST_ASSERT_TRUE(child >= 0);
+  if (child == 0)
+  {
+    killAfter = writes;
+    work();
+    _exit(0);
+  }
+  int status;
+  TEST_ASSERT_EQUAL(child, waitpid(child, &status, 0));
+  TEST_ASSERT_TRUE(WIFEXITED(status));
+  return WEXITSTATUS(status) == KILLED;
+}
+
+static void provisionUntilKilled(int writes)
+{
+  fakeNvsReset();
+  boot();
+  storeClaimIdentity();
+  TEST_ASSERT_TRUE(runUntilKilled(writes,
+                                  []()
+                                  {
+                                    ConfigStore store(KEYS, KEY_COUNT, BACKEND);
+                                    store.begin();
+                                    provision(store);
+                                  }));
+  boot();
+}
+
+// Writes and erases of one provisioning transaction, counted on a clean run.
+static uint32_t provisioningWrites()
+{
+  storeClaimIdentity();
+  ConfigStore store(KEYS, KEY_COUNT, BACKEND);
+  TEST_ASSERT_TRUE(store.begin());
+  TEST_ASSERT_TRUE(provision(store));
+  return store.stats().flashWrites + store.stats().flashErases;
+}
+
+static void test_killed_during_a_transaction()
+{
+  const int journalWrites = 5; // one item per staged key and the reserve, then the commit record
+  int writes = (int)provisioningWrites();
+  // 4 journal items, the reserve, the commit record, 4 keys, and the reserve,
+  // 4 items and the record erased again.
+  TEST_ASSERT_EQUAL(journalWrites + 1 + 4 + 6, writes);
+  int claims = 0, devices = 0;
+  for (int cut = 0; cut < writes; cut++)
+  {
+    provisionUntilKilled(cut);
+    Identity identity = identityAfterBoot();
+    TEST_ASSERT_NOT_EQUAL(Mixed, identity);
+    // All or nothing, decided by whether the commit record reached flash.
+    TEST_ASSERT_EQUAL(cut > journalWrites ? Device : Claim, identity);
+    (identity == Device ? devices : claims)++;
+  }
+  printf("Killed before each of %d writes and erases: %d came back with the claim identity, %d with the device "
+         "identity, none mixed\n",
+         writes, claims, devices);
+}
+
+// Killed once the commit record is in flash, then killed again at every
+// point of the recovery begin() makes on the next boot.
+static void test_killed_during_recovery()
+{
+  const int journalWrites = 5;
+  int writes = (int)provisioningWrites();
+  int recoveries = 0;
+  for (int cut = journalWrites + 1; cut < writes; cut++)
+  {
+    for (int recoveryCut = 0;; recoveryCut++)
+    {
+      provisionUntilKilled(cut);
+      bool killed = runUntilKilled(recoveryCut,
+                                   []()
+                                   {
+                                     ConfigStore store(KEYS, KEY_COUNT, BACKEND);
+                                     store.begin();
+                                   });
+      TEST_ASSERT_EQUAL(Device, identityAfterBoot());
+      if (!killed)
+      {
+        break;
+      }
+      recoveries++;
+    }
+  }
+  printf("Recovery killed at %d points, each finished on the next boot\n", recoveries);
+  TEST_ASSERT_TRUE(recoveries > 0);
+}
+
+// PEM sizes of an AWS IoT certificate and of the RSA 2048 private key
+// CreateKeysAndCertificate sends with it (the claim identity is the same
+// kind), and an ownership token, as in test_provisioning_modes.
+const size_t CERTIFICATE_PEM_SIZE = 1224;
+const size_t PRIVATE_KEY_PEM_SIZE = 1675;
+const size_t OWNERSHIP_TOKEN_SIZE = 600;
+// NVS keeps one page empty for garbage collection.
+const uint32_t RESERVED_ENTRIES = 126;
+
+// The entries NVS takes for a string of `length` characters.
+static uint32_t entriesOf(size_t length)
+{
+  return 1 + (length + 1 + 31) / 32;
+}
+
+static void storeFullSizeClaimIdentity()
+{
+  nvs_set_str(handle, "wifi_ssid", "native");
+  nvs_set_str(handle, "cert", std::string(CERTIFICATE_PEM_SIZE, 'c').c_str());
+  nvs_set_str(handle, "private_key", std::string(PRIVATE_KEY_PEM_SIZE, 'k').c_str());
+}
+
+// createKeysAndCertificateAccepted(), the sketch's largest transaction.
+static bool swapCertificate(ConfigStore &store)
+{
+  std::string certificate(CERTIFICATE_PEM_SIZE, 'C');
+  std::string privateKey(PRIVATE_KEY_PEM_SIZE, 'K');
+  std::string token(OWNERSHIP_TOKEN_SIZE, 'T');
+  store.beginTransaction();
+  store.set(ClaimCertKey, store.get(CertKey));
+  store.set(ClaimKeyKey, store.get(PrivateKeyKey));
+  store.set(CertKey, certificate.c_str());
+  store.set(PrivateKeyKey, privateKey.c_str());
+  store.set(TokenKey, token.c_str());
+  return store.commitTransaction();
+}
+
+static uint32_t freeEntries()
+{
+  nvs_stats_t stats;
+  TEST_ASSERT_EQUAL(ESP_OK, nvs_get_stats(nullptr, &stats));
+  return stats.free_entries;
+}
+
+// Fills another namespace until `left` entries are free beyond the reserved
+// page.
+static void fillPartition(uint32_t left)
+{
+  nvs_handle_t filler;
+  TEST_ASSERT_EQUAL(ESP_OK, nvs_open("filler", NVS_READWRITE, &filler));
+  TEST_ASSERT_EQUAL(ESP_OK, nvs_set_u8(filler, "first", 0)); // and the namespace
+  for (int i = 0; freeEntries() > RESERVED_ENTRIES + left; i++)
+  {
+    uint32_t entries = freeEntries() - RESERVED_ENTRIES - left;
+    entries = entries < RESERVED_ENTRIES ? entries : RESERVED_ENTRIES;
+    char key[16];
+    snprintf(key, sizeof(key), "f%d", i);
+    if (entries == 1)
+    {
+      TEST_ASSERT_EQUAL(ESP_OK, nvs_set_u8(filler, key, 0));
+    }
+    else
+    {
+      TEST_ASSERT_EQUAL(ESP_OK, nvs_set_str(filler, key, std::string((entries - 1) * 32 - 1, 'f').c_str()));
+    }
+  }
+  nvs_close(filler);
+  TEST_ASSERT_EQUAL(RESERVED_ENTRIES + left, freeEntries());
+}
+
+static void test_certificate_swap_on_a_nearly_full_partition()
+{
+  storeFullSizeClaimIdentity();
+  uint32_t before = freeEntries();
+  fakeNvsResetMinFreeEntries();
+  {
+    ConfigStore store(KEYS, KEY_COUNT, BACKEND);
+    TEST_ASSERT_TRUE(store.begin());
+    TEST_ASSERT_TRUE(swapCertificate(store));
+  }
+  uint32_t worst = before - fakeNvsStats().minFreeEntries;
+  // The most is taken just before the commit record: every journal item, the
+  // reserve and the record itself. Writing the keys never takes more.
+  uint32_t journal = entriesOf(CERTIFICATE_PEM_SIZE) * 2 + entriesOf(PRIVATE_KEY_PEM_SIZE) * 2 +
+                     entriesOf(OWNERSHIP_TOKEN_SIZE);
+  uint32_t record = entriesOf(strlen("claim_cert,claim_key,cert,private_key,crt_ownrshp_tkn"));
+  TEST_ASSERT_EQUAL(journal + entriesOf(PRIVATE_KEY_PEM_SIZE) + record, worst);
+  printf("Certificate swap: %u free NVS entries needed at its worst, beyond the %u of the page kept for garbage "
+         "collection (%u entries free before it on an empty 0x6000 partition)\n",
+         worst, RESERVED_ENTRIES, before);
+
+  // With any less room the swap fails before its commit record, and the
+  // claim identity stays.
+  for (uint32_t left = 0; left <= worst; left++)
+  {
+    fakeNvsReset();
+    boot();
+    storeFullSizeClaimIdentity();
+    fillPartition(left);
+    ConfigStore store(KEYS, KEY_COUNT, BACKEND);
+    TEST_ASSERT_TRUE(store.begin());
+    bool swapped = swapCertificate(store);
+    TEST_ASSERT_EQUAL(left == worst, swapped);
+    TEST_ASSERT_FALSE(journalLeft());
+    boot();
+    ConfigStore rebooted(KEYS, KEY_COUNT, BACKEND);
+    TEST_ASSERT_TRUE(rebooted.begin());
+    std::string certificate(CERTIFICATE_PEM_SIZE, swapped ? 'C' : 'c');
+    std::string privateKey(PRIVATE_KEY_PEM_SIZE, swapped ? 'K' : 'k');
+    TEST_ASSERT_EQUAL_STRING(certificate.c_str(), rebooted.get(CertKey));
+    TEST_ASSERT_EQUAL_STRING(privateKey.c_str(), rebooted.get(PrivateKeyKey));
+    TEST_ASSERT_EQUAL(swapped, rebooted.get(TokenKey) != nullptr);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_cache_in_front_of_the_file);
+  RUN_TEST(test_transactions);
+  RUN_TEST(test_killed_during_a_transaction);
+  RUN_TEST(test_killed_during_recovery);
+  RUN_TEST(test_certificate_swap_on_a_nearly_full_partition);
+  return UNITY_END();
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Writes nvs.bin, the image test_nvs_images compares `yarn nvsImages` with
+# byte for byte: src/nvs.csv encrypted with the fixed nvs_key partition
+# nvs_keys.bin, by nvs_partition_gen.py as scripts/generate-nvs-data.sh runs
+# it, with --inputkey in place of --keygen.
+#
+# The nvs.bin committed with the fixture was not written by this script:
+# nvs_partition_gen.py was not available, so it is the output of
+#
+#   yarn nvsImages --template=src/nvs.csv --manifest=devices.csv \
+#     --out=<directory> --keys=nvs_keys.bin
+#
+# (<directory>/golden/encrypted_nvs.bin). Until this script has been run
+# with ESP-IDF and the result committed, the test only pins nvsImages.ts to
+# that output; after it, any difference from nvs_partition_gen.py fails it.
+cd "$(dirname "$0")" || exit 1
+$IDF_PATH/components/nvs_flash/nvs_partition_generator/nvs_partition_gen.py \
+  encrypt src/nvs.csv nvs.bin 0x6000 --inputkey nvs_keys.bin --outdir .
@@ -0,0 +1,518 @@
+#include <Arduino.h>
+#include <mbedtls/aes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <unity.h>
+
+// Runs `yarn nvsImages` (samples/nvsImages.ts) on an nvs.csv like
+// src/nvs.csv and a manifest of devices, and reads every image back as
+// nvs_flash_secure_init() does: the nvs_key partition and its CRC, page
+// states, sequence numbers and header CRCs, the entry bitmap, every entry
+// decrypted with AES-XTS and its CRC, and the strings with their data CRCs.
+// The image of golden/src/nvs.csv with golden/nvs_keys.bin is compared byte
+// for byte with golden/nvs.bin, and with IDF_PATH set every image also with
+// what nvs_partition_gen.py writes for the same CSV and keys (see
+// golden/generate.sh for how nvs.bin was made). And the throughput in
+// images/s. Needs Node and `yarn install` at the repository root.
+//
+//   pio test -e native -f test_nvs_images -v
+
+// Run from the project directory, as `pio test` does.
+#ifndef NVS_IMAGES_COMMAND
+#define NVS_IMAGES_COMMAND "yarn --silent --cwd ../.. nvsImages"
+#endif
+
+#ifndef GOLDEN_DIR
+#define GOLDEN_DIR "test/test_nvs_images/golden"
+#endif
+
+// What scripts/generate-nvs-data.sh runs.
+#ifndef NVS_PARTITION_GEN_COMMAND
+#define NVS_PARTITION_GEN_COMMAND "$IDF_PATH/components/nvs_flash/nvs_partition_generator/nvs_partition_gen.py"
+#endif
+
+const int DEVICES = 8;
+const int BENCH_DEVICES = 200;
+const size_t PARTITION_SIZE = 0x6000; // the nvs partition in custom_partitions.csv
+// A certificate chain and a key long enough to need a second page.
+const size_t CERT_SIZE = 2600;
+const size_t KEY_SIZE_PEM = 1700;
+
+// Layout of an NVS page, see components/nvs_flash in ESP-IDF.
+const size_t PAGE_SIZE = 4096;
+const size_t ENTRY_SIZE = 32;
+const size_t ENTRY_COUNT = 126;
+const size_t BITMAP_OFFSET = 32;
+const size_t FIRST_ENTRY_OFFSET = 64;
+const uint32_t PAGE_FULL = 0xfffffffc;
+const uint8_t PAGE_VERSION2 = 0xfe;
+const uint8_t ENTRY_EMPTY = 0x3;
+const uint8_t ENTRY_WRITTEN = 0x2;
+const uint8_t TYPE_U8 = 0x01;
+const uint8_t TYPE_SZ = 0x21;
+const uint8_t CHUNK_ANY = 0xff;
+const size_t XTS_KEY_SIZE = 32;
+
+static char workDir[64];
+
+void setUp()
+{
+  snprintf(workDir, sizeof(workDir), "/tmp/test_nvs_images-XXXXXX");
+  TEST_ASSERT_NOT_NULL(mkdtemp(workDir));
+}
+
+void tearDown()
+{
+  std::string command = std::string("rm -rf ") + workDir;
+  system(command.c_str());
+}
+
+// esp_rom_crc32_le(), which nvs_flash calls with 0xffffffff to start.
+static uint32_t crc32Le(uint32_t crc, const uint8_t *data, size_t length)
+{
+  crc = ~crc;
+  while (length--)
+  {
+    crc ^= *data++;
+    for (int bit = 0; bit < 8; bit++)
+    {
+      crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+    }
+  }
+  return ~crc;
+}
+
+static uint32_t read32(const uint8_t *data)
+{
+  return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static std::string path(const std::string &name)
+{
+  return std::string(workDir) + "/" + name;
+}
+
+static void writeFile(const std::string &name, const std::string &contents)
+{
+  std::string file = path(name);
+  for (size_t slash = file.find('/', 1); slash != std::string::npos; slash = file.find('/', slash + 1))
+  {
+    mkdir(file.substr(0, slash).c_str(), 0755);
+  }
+  FILE *out = fopen(file.c_str(), "wb");
+  TEST_ASSERT_NOT_NULL(out);
+  fwrite(contents.data(), 1, contents.size(), out);
+  fclose(out);
+}
+
+static std::string readFile(const std::string &name)
+{
+  FILE *in = fopen(path(name).c_str(), "rb");
+  TEST_ASSERT_NOT_NULL_MESSAGE(in, name.c_str());
+  std::string contents;
+  char buffer[4096];
+  size_t read;
+  while ((read = fread(buffer, 1, sizeof(buffer), in)) > 0)
+  {
+    contents.append(buffer, read);
+  }
+  fclose(in);
+  return contents;
+}
+
+// PEM-looking text, different for every seed.
+static std::string pem(const char *label, unsigned seed, size_t size)
+{
+  static const char BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string head = std::string("-----BEGIN ") + label + "-----\n";
+  std::string tail = std::string("-----END ") + label + "-----\n";
+  std::string text = head;
+  uint32_t state = seed * 2654435761u + 1;
+  while (text.size() + tail.size() < size)
+  {
+    state = state * 1103515245 + 12345;
+    text += (text.size() - head.size()) % 65 == 64 ? '\n' : BASE64[(state >> 16) % 64];
+  }
+  return text + tail;
+}
+
+// namespace/key to value, for one device.
+typedef std::map<std::string, std::string> Values;
+
+static std::string deviceName(int device)
+{
+  char name[16];
+  snprintf(name, sizeof(name), "core2-%04d", device);
+  return name;
+}
+
+// src/nvs.csv with a second namespace, its shared files, and a manifest of
+// `devices` with their own certificate and key.
+static std::vector<Values> makeManifest(int devices)
+{
+  writeFile("src/nvs.csv", "key,type,encoding,value\n"
+                           "secrets,namespace,,\n"
+                           "cert,file,string,src/secrets/claim-cert.pem\n"
+                           "private_key,file,string,src/secrets/private.key\n"
+                           "wifi_ssid,file,string,src/secrets/wifi-ssid.txt\n"
+                           "wifi_password,file,string,src/secrets/wifi-password.txt\n"
+                           "settings,namespace,,\n"
+                           "region,data,string,eu-west-1\n");
+  writeFile("src/secrets/claim-cert.pem", pem("CERTIFICATE", 0, CERT_SIZE));
+  writeFile("src/secrets/private.key", pem("RSA PRIVATE KEY", 0, KEY_SIZE_PEM));
+  writeFile("src/secrets/wifi-ssid.txt", "factory-line");
+  writeFile("src/secrets/wifi-password.txt", "correct horse battery staple");
+
+  std::vector<Values> expected;
+  std::string manifest = "device,cert,private_key\n";
+  for (int device = 0; device < devices; device++)
+  {
+    std::string name = deviceName(device);
+    Values values;
+    values["secrets/cert"] = pem("CERTIFICATE", device + 1, CERT_SIZE);
+    values["secrets/private_key"] = pem("RSA PRIVATE KEY", device + 1, KEY_SIZE_PEM);
+    values["secrets/wifi_ssid"] = "factory-line";
+    values["secrets/wifi_password"] = "correct horse battery staple";
+    values["settings/region"] = "eu-west-1";
+    writeFile("secrets/" + name + "/cert.pem", values["secrets/cert"]);
+    writeFile("secrets/" + name + "/private.key", values["secrets/private_key"]);
+    manifest += name + "," + name + "/cert.pem," + name + "/private.key\n";
+    expected.push_back(values);
+  }
+  writeFile("secrets/devices.csv", manifest);
+  return expected;
+}
+
+struct Run
+{
+  int images = -1;
+  int workers = -1;
+  float seconds = 0;
+  float imagesPerSecond = 0;
+  float megabytesPerSecond = 0;
+};
+
+static Run runNvsImages(const std::string &arguments)
+{
+  std::string command = std::string(NVS_IMAGES_COMMAND) + arguments + " 2>&1";
+  FILE *tool = popen(command.c_str(), "r");
+  TEST_ASSERT_NOT_NULL(tool);
+  Run run;
+  std::string text;
+  char line[1024];
+  while (fgets(line, sizeof(line), tool) != NULL)
+  {
+    text += line;
+    // 8 images (verified) in 0.12s on 2 workers: 66.7 images/s, 1.9 MB/s
+    const char *in = strstr(line, " in ");
+    if (sscanf(line, "%d images", &run.images) == 1 && in != NULL)
+    {
+      sscanf(in, " in %fs on %d workers: %f images/s, %f MB/s", &run.seconds, &run.workers, &run.imagesPerSecond,
+             &run.megabytesPerSecond);
+    }
+  }
+  if (pclose(tool) != 0 || run.images < 0 || run.workers < 0)
+  {
+    printf("%s", text.c_str());
+    TEST_FAIL_MESSAGE("`" NVS_IMAGES_COMMAND "` failed; run `yarn install` at the repository root");
+  }
+  return run;
+}
+
+// `flags` after --template, --manifest and --out.
+static Run nvsImages(const std::string &out, const std::string &flags)
+{
+  return runNvsImages(" --template=" + path("src/nvs.csv") + " --manifest=" + path("secrets/devices.csv") +
+                      " --out=" + path(out) + flags);
+}
+
+// The nvs_key partition: eky and tky, then the CRC of both.
+static std::string keyPartition(uint8_t fill)
+{
+  std::string partition(PAGE_SIZE, (char)0xff);
+  for (size_t i = 0; i < 2 * XTS_KEY_SIZE; i++)
+  {
+    partition[i] = (char)(fill + i * (i < XTS_KEY_SIZE ? 3 : 7));
+  }
+  uint32_t crc = crc32Le(0xffffffff, (const uint8_t *)partition.data(), 2 * XTS_KEY_SIZE);
+  memcpy(&partition[2 * XTS_KEY_SIZE], &crc, sizeof(crc));
+  return partition;
+}
+
+struct Image
+{
+  Values values;
+  int pagesUsed = 0;
+};
+
+// As nvs_flash_secure_init() reads the partition. Entries are decrypted one
+// at a time, the XTS data unit being the entry's offset in the partition.
+static Image readImage(const std::string &imageFile, const std::string &keysFile)
+{
+  std::string keys = readFile(keysFile);
+  std::string image = readFile(imageFile);
+  const uint8_t *key = (const uint8_t *)keys.data();
+  TEST_ASSERT_TRUE(keys.size() >= 2 * XTS_KEY_SIZE + 4);
+  uint32_t keysCrc = crc32Le(crc32Le(0xffffffff, key, XTS_KEY_SIZE), key + XTS_KEY_SIZE, XTS_KEY_SIZE);
+  TEST_ASSERT_EQUAL_HEX32_MESSAGE(keysCrc, read32(key + 2 * XTS_KEY_SIZE), "nvs_key partition CRC");
+  TEST_ASSERT_EQUAL(PARTITION_SIZE, image.size());
+
+  mbedtls_aes_xts_context xts;
+  mbedtls_aes_xts_init(&xts);
+  TEST_ASSERT_EQUAL(0, mbedtls_aes_xts_setkey_dec(&xts, key, 2 * XTS_KEY_SIZE * 8));
+  Image read;
+  std::map<uint8_t, std::string> namespaces;
+  size_t pages = image.size() / PAGE_SIZE;
+  for (size_t p = 0; p < pages; p++)
+  {
+    const uint8_t *page = (const uint8_t *)image.data() + p * PAGE_SIZE;
+    if (p == pages - 1)
+    {
+      // Left erased, for nvs_flash to move entries into.
+      for (size_t i = 0; i < PAGE_SIZE; i++)
+      {
+        TEST_ASSERT_EQUAL_HEX8_MESSAGE(0xff, page[i], "last page erased");
+      }
+      continue;
+    }
+    // nvs_partition_gen.py marks every other page full.
+    TEST_ASSERT_EQUAL_HEX32_MESSAGE(PAGE_FULL, read32(page), "page state");
+    TEST_ASSERT_EQUAL_MESSAGE(p, read32(page + 4), "page sequence number");
+    TEST_ASSERT_EQUAL_HEX8_MESSAGE(PAGE_VERSION2, page[8], "page version");
+    TEST_ASSERT_EQUAL_HEX32_MESSAGE(crc32Le(0xffffffff, page + 4, 24), read32(page + 28), "page header CRC");
+
+    auto state = [page](size_t index) { return (page[BITMAP_OFFSET + index / 4] >> (index % 4 * 2)) & 3; };
+    auto entry = [&](size_t index, uint8_t *plain)
+    {
+      uint32_t offset = p * PAGE_SIZE + FIRST_ENTRY_OFFSET + index * ENTRY_SIZE;
+      uint8_t dataUnit[16] = {};
+      memcpy(dataUnit, &offset, sizeof(offset));
+      TEST_ASSERT_EQUAL(0, mbedtls_aes_crypt_xts(&xts, MBEDTLS_AES_DECRYPT, ENTRY_SIZE, dataUnit,
+                                                 (const uint8_t *)image.data() + offset, plain));
+    };
+    read.pagesUsed += state(0) == ENTRY_WRITTEN ? 1 : 0;
+    for (size_t index = 0; index < ENTRY_COUNT;)
+    {
+      if (state(index) == ENTRY_EMPTY)
+      {
+        const uint8_t *raw = page + FIRST_ENTRY_OFFSET + index * ENTRY_SIZE;
+        for (size_t i = 0; i < ENTRY_SIZE; i++)
+        {
+          TEST_ASSERT_EQUAL_HEX8_MESSAGE(0xff, raw[i], "empty entry erased");
+        }
+        index++;
+        continue;
+      }
+      TEST_ASSERT_EQUAL_MESSAGE(ENTRY_WRITTEN, state(index), "entry state");
+      uint8_t item[ENTRY_SIZE];
+      entry(index, item);
+      uint32_t crc = crc32Le(crc32Le(0xffffffff, item, 4), item + 8, 24);
+      TEST_ASSERT_EQUAL_HEX32_MESSAGE(crc, read32(item + 4), "entry CRC");
+      TEST_ASSERT_TRUE_MESSAGE(memchr(item + 8, 0, 16) != NULL, "key NUL terminated");
+      std::string name = (const char *)item + 8;
+      uint8_t namespaceIndex = item[0], type = item[1], span = item[2];
+      TEST_ASSERT_EQUAL_HEX8(CHUNK_ANY, item[3]);
+      if (namespaceIndex == 0 && type == TYPE_U8)
+      {
+        TEST_ASSERT_EQUAL(1, span);
+        namespaces[item[24]] = name;
+        index++;
+        continue;
+      }
+      TEST_ASSERT_EQUAL_HEX8_MESSAGE(TYPE_SZ, type, name.c_str());
+      TEST_ASSERT_TRUE_MESSAGE(namespaces.count(namespaceIndex) > 0, name.c_str());
+      size_t size = item[24] | item[25] << 8;
+      TEST_ASSERT_EQUAL_MESSAGE(1 + (size + ENTRY_SIZE - 1) / ENTRY_SIZE, span, name.c_str());
+      TEST_ASSERT_TRUE_MESSAGE(index + span <= ENTRY_COUNT, "a string does not span pages");
+      std::string data;
+      for (size_t i = 1; i < span; i++)
+      {
+        TEST_ASSERT_EQUAL_MESSAGE(ENTRY_WRITTEN, state(index + i), "data entry state");
+        uint8_t chunk[ENTRY_SIZE];
+        entry(index + i, chunk);
+        data.append((const char *)chunk, ENTRY_SIZE);
+      }
+      data.resize(size);
+      TEST_ASSERT_EQUAL_HEX32_MESSAGE(crc32Le(0xffffffff, (const uint8_t *)data.data(), size), read32(item + 28),
+                                      name.c_str());
+      TEST_ASSERT_EQUAL_MESSAGE('\0', data.back(), name.c_str());
+      read.values[namespaces[namespaceIndex] + "/" + name] = data.substr(0, size - 1);
+      index += span;
+    }
+  }
+  mbedtls_aes_xts_free(&xts);
+  return read;
+}
+
+static void checkDevice(const std::string &out, int device, const Values &expected, const char *keys)
+{
+  std::string directory = out + "/" + deviceName(device);
+  Image image = readImage(directory + "/encrypted_nvs.bin", keys != NULL ? keys : directory + "/keys/nvs_keys.bin");
+  TEST_ASSERT_EQUAL(expected.size(), image.values.size());
+  for (const auto &value : expected)
+  {
+    TEST_ASSERT_TRUE_MESSAGE(image.values.count(value.first) > 0, value.first.c_str());
+    TEST_ASSERT_TRUE_MESSAGE(image.values.at(value.first) == value.second, value.first.c_str());
+  }
+  TEST_ASSERT_EQUAL(2, image.pagesUsed);
+}
+
+static void test_images_read_back()
+{
+  std::vector<Values> expected = makeManifest(DEVICES);
+  Run run = nvsImages("out", " --workers=2");
+  TEST_ASSERT_EQUAL(DEVICES, run.images);
+  std::set<std::string> keys;
+  for (int device = 0; device < DEVICES; device++)
+  {
+    checkDevice("out", device, expected[device], NULL);
+    keys.insert(readFile("out/" + deviceName(device) + "/keys/nvs_keys.bin"));
+  }
+  TEST_ASSERT_EQUAL_MESSAGE(DEVICES, keys.size(), "every device has its own keys");
+}
+
+static void test_given_keys()
+{
+  std::vector<Values> expected = makeManifest(DEVICES);
+  writeFile("nvs_keys.bin", keyPartition(0x11));
+  nvsImages("first", " --workers=2 --keys=" + path("nvs_keys.bin"));
+  nvsImages("second", " --workers=1 --keys=" + path("nvs_keys.bin"));
+  for (int device = 0; device < DEVICES; device++)
+  {
+    std::string directory = deviceName(device);
+    checkDevice("first", device, expected[device], "nvs_keys.bin");
+    TEST_ASSERT_TRUE(readFile("first/" + directory + "/keys/nvs_keys.bin") == readFile("nvs_keys.bin"));
+    // Same keys, same bytes, whichever worker built it.
+    TEST_ASSERT_TRUE(readFile("first/" + directory + "/encrypted_nvs.bin") ==
+                     readFile("second/" + directory + "/encrypted_nvs.bin"));
+  }
+
+  // A key partition whose CRC does not match is refused.
+  std::string broken = keyPartition(0x11);
+  broken[0] ^= 1;
+  writeFile("broken_keys.bin", broken);
+  std::string command = std::string(NVS_IMAGES_COMMAND) + " --template=" + path("src/nvs.csv") +
+                        " --manifest=" + path("secrets/devices.csv") + " --out=" + path("broken") +
+                        " --keys=" + path("broken_keys.bin") + " >/dev/null 2>&1";
+  TEST_ASSERT_NOT_EQUAL(0, system(command.c_str()));
+}
+
+// golden/nvs.bin: a fixed CSV and nvs_key partition, so any change to the
+// bytes nvsImages writes shows, without ESP-IDF.
+static void test_same_bytes_as_golden_image()
+{
+  std::string copy = std::string("cp -r " GOLDEN_DIR " ") + path("golden");
+  TEST_ASSERT_EQUAL_MESSAGE(0, system(copy.c_str()), GOLDEN_DIR);
+  Values expected;
+  expected["secrets/cert"] = readFile("golden/src/values/claim-cert.pem");
+  expected["secrets/private_key"] = readFile("golden/src/values/private.key");
+  expected["secrets/wifi_ssid"] = readFile("golden/src/values/wifi-ssid.txt");
+  expected["secrets/wifi_password"] = readFile("golden/src/values/wifi-password.txt");
+  expected["settings/region"] = "eu-west-1";
+  Image golden = readImage("golden/nvs.bin", "golden/nvs_keys.bin");
+  TEST_ASSERT_TRUE(golden.values == expected);
+  TEST_ASSERT_EQUAL(2, golden.pagesUsed);
+
+  runNvsImages(" --template=" + path("golden/src/nvs.csv") + " --manifest=" + path("golden/devices.csv") +
+               " --out=" + path("out") + " --keys=" + path("golden/nvs_keys.bin"));
+  std::string want = readFile("golden/nvs.bin");
+  std::string got = readFile("out/golden/encrypted_nvs.bin");
+  TEST_ASSERT_EQUAL(want.size(), got.size());
+  size_t at = 0;
+  while (at < want.size() && want[at] == got[at])
+  {
+    at++;
+  }
+  if (at < want.size())
+  {
+    char message[96];
+    snprintf(message, sizeof(message), "differs from golden/nvs.bin at 0x%x (page %u, byte %u)", (unsigned)at,
+             (unsigned)(at / PAGE_SIZE), (unsigned)(at % PAGE_SIZE));
+    TEST_FAIL_MESSAGE(message);
+  }
+}
+
+// nvs_partition_gen.py on each device's CSV with the same nvs_key partition.
+static void test_same_bytes_as_nvs_partition_gen()
+{
+  if (getenv("IDF_PATH") == NULL)
+  {
+    TEST_IGNORE_MESSAGE("IDF_PATH is not set: no nvs_partition_gen.py to compare with");
+  }
+  std::vector<Values> expected = makeManifest(DEVICES);
+  writeFile("nvs_keys.bin", keyPartition(0x5a));
+  nvsImages("out", " --keys=" + path("nvs_keys.bin"));
+  for (int device = 0; device < DEVICES; device++)
+  {
+    std::string name = deviceName(device);
+    std::string secrets = path("secrets/" + name);
+    writeFile("idf/" + name + "/nvs.csv", "key,type,encoding,value\n"
+                                          "secrets,namespace,,\n"
+                                          "cert,file,string," + secrets + "/cert.pem\n"
+                                          "private_key,file,string," + secrets + "/private.key\n"
+                                          "wifi_ssid,file,string," + path("src/secrets/wifi-ssid.txt") + "\n"
+                                          "wifi_password,file,string," + path("src/secrets/wifi-password.txt") + "\n"
+                                          "settings,namespace,,\n"
+                                          "region,data,string,eu-west-1\n");
+    char size[16];
+    snprintf(size, sizeof(size), "0x%x", (unsigned)PARTITION_SIZE);
+    std::string command = std::string(NVS_PARTITION_GEN_COMMAND) + " encrypt " + path("idf/" + name + "/nvs.csv") +
+                          " encrypted_nvs.bin " + size + " --inputkey " + path("nvs_keys.bin") + " --outdir " +
+                          path("idf/" + name) + " >/dev/null";
+    TEST_ASSERT_EQUAL_MESSAGE(0, system(command.c_str()), NVS_PARTITION_GEN_COMMAND " failed");
+    TEST_ASSERT_TRUE_MESSAGE(readFile("idf/" + name + "/encrypted_nvs.bin") ==
+                                 readFile("out/" + name + "/encrypted_nvs.bin"),
+                             name.c_str());
+  }
+}
+
+static void test_throughput()
+{
+  makeManifest(BENCH_DEVICES);
+  Run one = nvsImages("one", " --workers=1");
+  Run all = nvsImages("all", "");
+  Run verified = nvsImages("verified", " --verify");
+  printf("BENCH %d images of 0x%x bytes and their nvs_key partitions:\n", BENCH_DEVICES, (unsigned)PARTITION_SIZE);
+  printf("BENCH   --workers=1:                     %6.1f images/s, %5.1f MB/s\n", one.imagesPerSecond,
+         one.megabytesPerSecond);
+  printf("BENCH   one worker per CPU (%d):              %6.1f images/s, %5.1f MB/s\n", all.workers,
+         all.imagesPerSecond, all.megabytesPerSecond);
+  printf("BENCH   one worker per CPU (%d), --verify:    %6.1f images/s, %5.1f MB/s\n", verified.workers,
+         verified.imagesPerSecond, verified.megabytesPerSecond);
+  TEST_ASSERT_EQUAL(BENCH_DEVICES, one.images);
+  TEST_ASSERT_EQUAL(BENCH_DEVICES, all.images);
+  TEST_ASSERT_EQUAL(BENCH_DEVICES, verified.images);
+
+  if (getenv("IDF_PATH") != NULL)
+  {
+    // scripts/generate-nvs-data.sh, one device at a time.
+    const int runs = 10;
+    unsigned long started = millis();
+    for (int run = 0; run < runs; run++)
+    {
+      std::string command = std::string("cd ") + path("") + " && " + NVS_PARTITION_GEN_COMMAND +
+                            " encrypt src/nvs.csv encrypted_nvs.bin 0x6000 --keygen --keyfile nvs_keys.bin"
+                            " --outdir " + path("idf") + " >/dev/null";
+      TEST_ASSERT_EQUAL(0, system(command.c_str()));
+    }
+    printf("BENCH   nvs_partition_gen.py, one run per image: %6.1f images/s\n",
+           runs * 1000.0 / (millis() - started));
+  }
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_images_read_back);
+  RUN_TEST(test_given_keys);
+  RUN_TEST(test_same_bytes_as_golden_image);
+  RUN_TEST(test_same_bytes_as_nvs_partition_gen);
+  RUN_TEST(test_throughput);
+  return UNITY_END();
+}
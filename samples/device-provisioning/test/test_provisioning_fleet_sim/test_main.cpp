@@ -0,0 +1,227 @@
+#include <Arduino.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <unity.h>
+
+// Runs `yarn provisioningFleetSim` (samples/provisioningFleetSim.ts) with
+// small fleets and checks its report: every device provisioned, broker
+// traffic that matches the CreateKeysAndCertificate/RegisterThing flow
+// message for message, every throttled request retried, connect attempts
+// that add up, and the reconnect storm after an outage. Needs Node and
+// `yarn install` at the repository root.
+//
+//   pio test -e native -f test_provisioning_fleet_sim -v
+
+// Run from the project directory, as `pio test` does.
+#ifndef PROVISIONING_FLEET_SIM_COMMAND
+#define PROVISIONING_FLEET_SIM_COMMAND "yarn --silent --cwd ../.. provisioningFleetSim"
+#endif
+
+const int DEVICES = 50;
+// A fast network and service, so a run takes seconds.
+const char *SMALL_FLEET = " --devices=50 --handshakeMs=50 --brokerLatencyMs=5 --serviceLatencyMs=20 --storeMs=10"
+                          " --backoffBaseMs=50 --backoffMaxMs=1000";
+const char *PHASES[] = {"connect", "createKeys", "storeKeys", "registerThing", "storeState", "reconnect", "total"};
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+struct Percentiles
+{
+  float p50 = -1;
+  float p90 = -1;
+  float p99 = -1;
+  float max = -1;
+};
+
+struct SimReport
+{
+  int provisioned = -1;
+  std::map<std::string, Percentiles> phases;
+  int messages = -1;
+  std::map<std::string, int> kinds; // broker messages by kind
+  int throttled = -1;
+  int attempts = -1;
+  int refused = -1;
+  int retried = -1;
+  int restarts = -1;
+  int dropped = -1;
+  int recovered = -1;
+  int concurrencyPeak = -1;
+  int sustained = -1;
+  int connectedAtEnd = -1;
+  std::string text;
+
+  int kind(const char *name) const
+  {
+    auto found = kinds.find(name);
+    return found == kinds.end() ? 0 : found->second;
+  }
+};
+
+static SimReport simulate(const std::string &flags)
+{
+  SimReport report;
+  std::string command = std::string(PROVISIONING_FLEET_SIM_COMMAND) + flags;
+  FILE *sim = popen(command.c_str(), "r");
+  TEST_ASSERT_NOT_NULL(sim);
+  char line[1024];
+  while (fgets(line, sizeof(line), sim) != NULL)
+  {
+    report.text += line;
+    float mean;
+    int peak, limit, at, ms;
+    char phase[32];
+    Percentiles percentiles;
+    sscanf(line, "Provisioned: %d devices", &report.provisioned);
+    if (sscanf(line, " %31s p50=%fs p90=%fs p99=%fs max=%fs", phase, &percentiles.p50, &percentiles.p90,
+               &percentiles.p99, &percentiles.max) == 5)
+    {
+      report.phases[phase] = percentiles;
+    }
+    if (sscanf(line, "Broker: %d messages", &report.messages) == 1)
+    {
+      // ... (create-keys=133 create-keys-accepted=50 ...), 83 throttled
+      const char *counts = strchr(line, '(');
+      char name[32];
+      int count, used;
+      while (counts != NULL && sscanf(counts + 1, "%31[a-z-]=%d%n", name, &count, &used) == 2)
+      {
+        report.kinds[name] = count;
+        counts += used + 1;
+      }
+      const char *throttled = strrchr(line, ')');
+      if (throttled != NULL)
+      {
+        sscanf(throttled, "), %d throttled", &report.throttled);
+      }
+    }
+    sscanf(line, "Connects: %d attempts, %f/s mean, %d/s peak, %d refused (limit %d/s)", &report.attempts, &mean,
+           &peak, &report.refused, &limit);
+    sscanf(line, "Retries: %d rejected requests retried, %d flows restarted after a drop", &report.retried,
+           &report.restarts);
+    sscanf(line, "Outage: %d connections dropped at %dms for %dms, %d provisioned devices back", &report.dropped, &at,
+           &ms, &report.recovered);
+    sscanf(line, "Concurrency: %d devices mid-flow at peak, %d without refusals or throttling, %d connected at the end",
+           &report.concurrencyPeak, &report.sustained, &report.connectedAtEnd);
+  }
+  if (pclose(sim) != 0 || report.provisioned < 0 || report.kinds.empty() || report.connectedAtEnd < 0)
+  {
+    printf("%s", report.text.c_str());
+    TEST_FAIL_MESSAGE("`" PROVISIONING_FLEET_SIM_COMMAND "` failed; run `yarn install` at the repository root");
+  }
+  return report;
+}
+
+// What holds for any run: every device provisioned and connected again with
+// its own certificate, the only rejections are throttling, and the figures
+// are in order.
+static void checkAccounting(const SimReport &report)
+{
+  TEST_ASSERT_EQUAL(DEVICES, report.provisioned);
+  TEST_ASSERT_EQUAL(DEVICES, report.connectedAtEnd);
+  int total = 0;
+  for (const auto &kind : report.kinds)
+  {
+    total += kind.second;
+  }
+  TEST_ASSERT_EQUAL(report.messages, total);
+  // The ownership token always matches, so RegisterThing only turns
+  // devices away when throttled.
+  TEST_ASSERT_EQUAL(report.throttled, report.kind("create-keys-rejected") + report.kind("register-thing-rejected"));
+  TEST_ASSERT_TRUE(report.kind("register-thing-accepted") >= DEVICES);
+  TEST_ASSERT_TRUE(report.retried <= report.throttled);
+  for (const char *name : PHASES)
+  {
+    TEST_ASSERT_TRUE_MESSAGE(report.phases.count(name) > 0, name);
+    const Percentiles &phase = report.phases.at(name);
+    TEST_ASSERT_TRUE_MESSAGE(0 <= phase.p50 && phase.p50 <= phase.p90 && phase.p90 <= phase.p99 &&
+                                 phase.p99 <= phase.max,
+                             name);
+  }
+  TEST_ASSERT_TRUE(report.sustained <= report.concurrencyPeak);
+  TEST_ASSERT_TRUE(report.concurrencyPeak <= DEVICES);
+}
+
+// With room to spare: two connects and four messages per device.
+static void test_unthrottled_flow()
+{
+  SimReport report =
+      simulate(std::string(SMALL_FLEET) + " --connectSpreadMs=200 --connectsPerSecond=1000 --provisioningTps=1000");
+  checkAccounting(report);
+  TEST_ASSERT_EQUAL(0, report.throttled);
+  TEST_ASSERT_EQUAL(0, report.refused);
+  TEST_ASSERT_EQUAL(0, report.retried);
+  TEST_ASSERT_EQUAL(0, report.restarts);
+  TEST_ASSERT_EQUAL(2 * DEVICES, report.attempts);
+  TEST_ASSERT_EQUAL(DEVICES, report.kind("create-keys"));
+  TEST_ASSERT_EQUAL(DEVICES, report.kind("create-keys-accepted"));
+  TEST_ASSERT_EQUAL(DEVICES, report.kind("register-thing"));
+  TEST_ASSERT_EQUAL(DEVICES, report.kind("register-thing-accepted"));
+  TEST_ASSERT_EQUAL(4 * DEVICES, report.messages);
+}
+
+// Fifty devices at once against 20 requests/s: each throttled request is
+// answered on /rejected and retried, and nothing else is lost.
+static void test_throttled_requests_are_retried()
+{
+  SimReport report =
+      simulate(std::string(SMALL_FLEET) + " --connectSpreadMs=200 --connectsPerSecond=1000 --provisioningTps=20");
+  checkAccounting(report);
+  TEST_ASSERT_TRUE(report.throttled > 0);
+  TEST_ASSERT_EQUAL(report.throttled, report.retried);
+  TEST_ASSERT_EQUAL(report.kind("create-keys"),
+                    report.kind("create-keys-accepted") + report.kind("create-keys-rejected"));
+  TEST_ASSERT_EQUAL(report.kind("register-thing"),
+                    report.kind("register-thing-accepted") + report.kind("register-thing-rejected"));
+  TEST_ASSERT_EQUAL(DEVICES, report.kind("register-thing-accepted"));
+  TEST_ASSERT_EQUAL(2 * DEVICES, report.attempts);
+  const Percentiles &createKeys = report.phases.at("createKeys");
+  const Percentiles &total = report.phases.at("total");
+  printf("BENCH %d devices at once, 20 requests/s per API: %d throttled and retried, createKeys p50 %.2fs p99 "
+         "%.2fs, total p50 %.2fs p99 %.2fs, %d mid-flow at peak, %d without throttling\n",
+         DEVICES, report.throttled, createKeys.p50, createKeys.p99, total.p50, total.p99, report.concurrencyPeak,
+         report.sustained);
+}
+
+// The broker drops everyone half way through the rollout and refuses
+// connections for half a second; with 20 connects/s the storm is refused
+// too. Devices mid-flow start again from CreateKeysAndCertificate, the
+// provisioned ones reconnect.
+static void test_outage_reconnect_storm()
+{
+  SimReport report = simulate(std::string(SMALL_FLEET) +
+                              " --connectSpreadMs=2000 --connectsPerSecond=20 --provisioningTps=1000"
+                              " --outageAtMs=1000 --outageMs=500");
+  checkAccounting(report);
+  TEST_ASSERT_TRUE(report.dropped > 0);
+  TEST_ASSERT_TRUE(report.refused > 0);
+  TEST_ASSERT_TRUE(report.recovered > 0);
+  // Devices that had stored their new identity when dropped do neither.
+  TEST_ASSERT_TRUE(report.restarts + report.recovered <= report.dropped);
+  // Every successful connect is a first one, a reconnect with the new
+  // certificate, a restarted flow or a provisioned device back; a CONNACK
+  // lost to the outage is the only other failure.
+  TEST_ASSERT_TRUE(report.attempts >= 2 * DEVICES + report.restarts + report.recovered + report.refused);
+  TEST_ASSERT_TRUE(report.kind("create-keys-accepted") >= DEVICES);
+  printf("BENCH %d devices over 2 s, outage at 1 s for 0.5 s, 20 connects/s: %d dropped, %d flows restarted, %d "
+         "provisioned devices back, %d connects for %d devices (%d refused), total p50 %.2fs p99 %.2fs\n",
+         DEVICES, report.dropped, report.restarts, report.recovered, report.attempts, DEVICES, report.refused,
+         report.phases.at("total").p50, report.phases.at("total").p99);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_unthrottled_flow);
+  RUN_TEST(test_throttled_requests_are_retried);
+  RUN_TEST(test_outage_reconnect_storm);
+  return UNITY_END();
+}
@@ -33,6 +33,13 @@ const char WIFI_PASSWORD[] = "";
 // TODO: Replace with your device Id
 const char LO_DEVICE_ID[] = "";
 
+// Optional: public key (PEM, EC or RSA) for the firmwareSignature of update
+// jobs. Sign the SHA-256 of the .bin, e.g.
+//   openssl dgst -sha256 -sign signing.key firmware.bin | base64 -w0
+// #define FIRMWARE_SIGNING_PUBLIC_KEY "-----BEGIN PUBLIC KEY-----\n" \
+//                                     "...\n"                        \
+//                                     "-----END PUBLIC KEY-----\n"
+// #define OTA_REQUIRE_SIGNATURE 1
 // TODO: Replace with your claim cert public key (.pem file)
 static const char LO_DEVICE_CERTIFICATE[] PROGMEM = R"KEY(
 -----BEGIN CERTIFICATE-----
@@ -0,0 +1,206 @@
+#include "DeltaPatch.h"
+
+#include <string.h>
+
+static const uint8_t OP_END = 0x00;
+static const uint8_t OP_COPY = 0x01;
+static const uint8_t OP_INSERT = 0x02;
+static const uint8_t VERSION = 1;
+
+static uint32_t readU32(const uint8_t *in)
+{
+  return (uint32_t)in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+DeltaPatch::DeltaPatch(HeaderCallback onHeader, ReadSource readSource, WriteTarget writeTarget, void *context)
+    : onHeader(onHeader), readSource(readSource), writeTarget(writeTarget), context(context)
+{
+  reset();
+}
+
+void DeltaPatch::reset()
+{
+  state = ReadingHeader;
+  lastError = DeltaOk;
+  memset(&patchHeader, 0, sizeof(patchHeader));
+  headerFill = 0;
+  varint = 0;
+  varintShift = 0;
+  copyOffset = 0;
+  remaining = 0;
+  produced = 0;
+}
+
+bool DeltaPatch::write(const uint8_t *data, size_t length)
+{
+  while (length > 0)
+  {
+    switch (state)
+    {
+    case ReadingHeader:
+    {
+      size_t n = HEADER_SIZE - headerFill < length ? HEADER_SIZE - headerFill : length;
+      memcpy(headerBytes + headerFill, data, n);
+      headerFill += n;
+      data += n;
+      length -= n;
+      if (headerFill == HEADER_SIZE && !parseHeader())
+      {
+        return false;
+      }
+      break;
+    }
+    case ReadingOperation:
+    {
+      uint8_t op = *data++;
+      length--;
+      if (op == OP_END)
+      {
+        if (produced != patchHeader.targetSize)
+        {
+          return fail(DeltaOutOfRange);
+        }
+        state = Done;
+      }
+      else if (op == OP_COPY)
+      {
+        state = ReadingCopyOffset;
+      }
+      else if (op == OP_INSERT)
+      {
+        state = ReadingInsertLength;
+      }
+      else
+      {
+        return fail(DeltaBadOperation);
+      }
+      break;
+    }
+    case ReadingCopyOffset:
+    case ReadingCopyLength:
+    case ReadingInsertLength:
+    {
+      bool complete = false;
+      if (!readVarint(*data++, complete))
+      {
+        return false;
+      }
+      length--;
+      if (!complete)
+      {
+        break;
+      }
+      uint32_t value = varint;
+      varint = 0;
+      varintShift = 0;
+      if (state == ReadingCopyOffset)
+      {
+        copyOffset = value;
+        state = ReadingCopyLength;
+      }
+      else if (state == ReadingCopyLength)
+      {
+        if (!copy(copyOffset, value))
+        {
+          return false;
+        }
+        state = ReadingOperation;
+      }
+      else
+      {
+        if (value > patchHeader.targetSize - produced)
+        {
+          return fail(DeltaOutOfRange);
+        }
+        remaining = value;
+        state = remaining > 0 ? InsertingData : ReadingOperation;
+      }
+      break;
+    }
+    case InsertingData:
+    {
+      // Literal bytes go straight from the caller's buffer to the target.
+      size_t n = remaining < length ? remaining : length;
+      if (!writeTarget(context, data, n))
+      {
+        return fail(DeltaTargetError);
+      }
+      produced += n;
+      remaining -= n;
+      data += n;
+      length -= n;
+      if (remaining == 0)
+      {
+        state = ReadingOperation;
+      }
+      break;
+    }
+    case Done:
+      return fail(DeltaTrailingData);
+    case Failed:
+      return false;
+    }
+  }
+  return state != Failed;
+}
+
+bool DeltaPatch::fail(DeltaError error)
+{
+  lastError = error;
+  state = Failed;
+  return false;
+}
+
+bool DeltaPatch::parseHeader()
+{
+  if (memcmp(headerBytes, "LODP", 4) != 0 || headerBytes[4] != VERSION)
+  {
+    return fail(DeltaBadHeader);
+  }
+  patchHeader.sourceSize = readU32(headerBytes + 8);
+  patchHeader.targetSize = readU32(headerBytes + 12);
+  memcpy(patchHeader.sourceSha256, headerBytes + 16, sizeof(patchHeader.sourceSha256));
+  if (!onHeader(context, patchHeader))
+  {
+    return fail(DeltaRejected);
+  }
+  state = ReadingOperation;
+  return true;
+}
+
+bool DeltaPatch::readVarint(uint8_t byte, bool &complete)
+{
+  if (varintShift > 28 || (varintShift == 28 && (byte & 0x70) != 0))
+  {
+    return fail(DeltaBadOperation);
+  }
+  varint |= (uint32_t)(byte & 0x7F) << varintShift;
+  varintShift += 7;
+  complete = (byte & 0x80) == 0;
+  return true;
+}
+
+bool DeltaPatch::copy(uint32_t offset, uint32_t length)
+{
+  if (offset > patchHeader.sourceSize || length > patchHeader.sourceSize - offset ||
+      length > patchHeader.targetSize - produced)
+  {
+    return fail(DeltaOutOfRange);
+  }
+  while (length > 0)
+  {
+    size_t n = length < sizeof(copyBuffer) ? length : sizeof(copyBuffer);
+    if (!readSource(context, offset, copyBuffer, n))
+    {
+      return fail(DeltaSourceError);
+    }
+    if (!writeTarget(context, copyBuffer, n))
+    {
+      return fail(DeltaTargetError);
+    }
+    offset += n;
+    length -= n;
+    produced += n;
+  }
+  return true;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Patch header, as produced by `yarn firmwareDelta`:
+//   "LODP" | version (1) | 3 reserved bytes | source size (u32 LE)
+//   | target size (u32 LE) | SHA-256 of the source image (32 bytes)
+// followed by operations:
+//   0x01 COPY   <varint source offset> <varint length>
+//   0x02 INSERT <varint length> <length bytes>
+//   0x00 END
+// Varints are unsigned LEB128.
+struct DeltaHeader
+{
+  uint32_t sourceSize;
+  uint32_t targetSize;
+  uint8_t sourceSha256[32];
+};
+
+enum DeltaError
+{
+  DeltaOk,
+  DeltaBadHeader,
+  DeltaBadOperation,
+  DeltaOutOfRange, // COPY outside the source, or more output than targetSize
+  DeltaSourceError,
+  DeltaTargetError,
+  DeltaRejected,   // by the header callback
+  DeltaTrailingData
+};
+
+// Rebuilds a target image from a source image and a patch that arrives in
+// pieces, e.g. while it is downloaded.
+//
+// RAM use is fixed (a small copy buffer); the source is read and the target
+// written through callbacks, so on the device the source is the running app
+// partition and the target goes to the inactive one. Only uses the C library,
+// so it builds on Linux too.
+class DeltaPatch
+{
+public:
+  // Called once the header is read; returning false stops the patch.
+  typedef bool (*HeaderCallback)(void *context, const DeltaHeader &header);
+  typedef bool (*ReadSource)(void *context, uint32_t offset, uint8_t *buffer, size_t length);
+  typedef bool (*WriteTarget)(void *context, const uint8_t *data, size_t length);
+
+  static const size_t HEADER_SIZE = 48;
+
+  DeltaPatch(HeaderCallback onHeader, ReadSource readSource, WriteTarget writeTarget, void *context);
+
+  void reset();
+  // Consumes the next piece of the patch. Returns false once the patch is
+  // malformed or a callback failed; see error().
+  bool write(const uint8_t *data, size_t length);
+  // True after END, with exactly targetSize bytes written.
+  bool finished() const { return state == Done; }
+
+  const DeltaHeader &header() const { return patchHeader; }
+  uint32_t written() const { return produced; }
+  DeltaError error() const { return lastError; }
+
+private:
+  enum State
+  {
+    ReadingHeader,
+    ReadingOperation,
+    ReadingCopyOffset,
+    ReadingCopyLength,
+    ReadingInsertLength,
+    InsertingData,
+    Done,
+    Failed
+  };
+
+  bool fail(DeltaError error);
+  bool parseHeader();
+  // Adds one byte to the varint being read; true when it is complete.
+  bool readVarint(uint8_t byte, bool &complete);
+  bool copy(uint32_t offset, uint32_t length);
+
+  HeaderCallback onHeader;
+  ReadSource readSource;
+  WriteTarget writeTarget;
+  void *context;
+
+  State state;
+  DeltaError lastError;
+  DeltaHeader patchHeader;
+  uint8_t headerBytes[HEADER_SIZE];
+  size_t headerFill;
+  uint32_t varint;
+  uint32_t varintShift;
+  uint32_t copyOffset;
+  uint32_t remaining; // bytes left in the current INSERT
+  uint32_t produced;
+  uint8_t copyBuffer[512];
+};
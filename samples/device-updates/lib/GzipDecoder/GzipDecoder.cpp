@@ -0,0 +1,663 @@
+#include "GzipDecoder.h"
+
+#include <string.h>
+
+static const uint16_t LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27,
+                                         31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                         2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t DISTANCE_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+                                           193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t DISTANCE_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+                                           6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+// Order of the code length code lengths in a dynamic block header.
+static const uint8_t CODE_LENGTH_ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+static const uint8_t FLAG_HCRC = 0x02;
+static const uint8_t FLAG_EXTRA = 0x04;
+static const uint8_t FLAG_NAME = 0x08;
+static const uint8_t FLAG_COMMENT = 0x10;
+static const uint8_t FLAG_RESERVED = 0xE0;
+
+// Half-byte table: two lookups per byte, 64 bytes of table.
+static uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t length)
+{
+  static const uint32_t table[16] = {0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4,
+                                     0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+                                     0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++)
+  {
+    crc ^= data[i];
+    crc = (crc >> 4) ^ table[crc & 15];
+    crc = (crc >> 4) ^ table[crc & 15];
+  }
+  return ~crc;
+}
+
+GzipDecoder::GzipDecoder(Sink sink, void *context) : sink(sink), context(context)
+{
+  reset();
+}
+
+void GzipDecoder::reset()
+{
+  state = Header;
+  lastError = GzipOk;
+  flags = 0;
+  headerCount = 0;
+  extraLength = 0;
+  finalBlock = false;
+  storedRemaining = 0;
+  inputLength = 0;
+  inputPos = 0;
+  bitBuffer = 0;
+  bitCount = 0;
+  outputSize = 0;
+  flushed = 0;
+  crc = 0;
+  inputSize = 0;
+}
+
+bool GzipDecoder::write(const uint8_t *data, size_t length)
+{
+  if (state == Failed)
+  {
+    return false;
+  }
+  inputSize += length;
+  while (length > 0)
+  {
+    if (state == Done)
+    {
+      return fail(GzipTrailingData);
+    }
+    if (state < BlockHeader)
+    {
+      // The gzip header is read a byte at a time, straight from the caller.
+      if (!readHeader(*data++))
+      {
+        return false;
+      }
+      length--;
+      continue;
+    }
+
+    if (inputPos > 0)
+    {
+      memmove(input, input + inputPos, inputLength - inputPos);
+      inputLength -= inputPos;
+      inputPos = 0;
+    }
+    size_t n = INPUT_BUFFER - inputLength < length ? INPUT_BUFFER - inputLength : length;
+    if (n == 0)
+    {
+      // A full buffer that decodes to nothing: no valid stream does that.
+      return fail(GzipBadCode);
+    }
+    memcpy(input + inputLength, data, n);
+    inputLength += n;
+    data += n;
+    length -= n;
+    if (!inflate())
+    {
+      return false;
+    }
+  }
+  if (state == Done && (inputPos < inputLength || bitCount > 0))
+  {
+    return fail(GzipTrailingData);
+  }
+  return flush();
+}
+
+bool GzipDecoder::fail(GzipError error)
+{
+  lastError = error;
+  state = Failed;
+  return false;
+}
+
+bool GzipDecoder::readHeader(uint8_t byte)
+{
+  switch (state)
+  {
+  case Header:
+    // ID1 ID2 CM FLG MTIME(4) XFL OS
+    if ((headerCount == 0 && byte != 0x1f) || (headerCount == 1 && byte != 0x8b) || (headerCount == 2 && byte != 8) ||
+        (headerCount == 3 && (byte & FLAG_RESERVED) != 0))
+    {
+      return fail(GzipBadHeader);
+    }
+    if (headerCount == 3)
+    {
+      flags = byte;
+    }
+    if (++headerCount < 10)
+    {
+      return true;
+    }
+    break;
+  case HeaderExtraLength:
+    extraLength |= (uint32_t)byte << (8 * headerCount);
+    if (++headerCount < 2)
+    {
+      return true;
+    }
+    state = HeaderExtra;
+    headerCount = 0;
+    if (extraLength > 0)
+    {
+      return true;
+    }
+    break;
+  case HeaderExtra:
+    if (++headerCount < extraLength)
+    {
+      return true;
+    }
+    break;
+  case HeaderName:
+  case HeaderComment:
+    if (byte != 0)
+    {
+      return true;
+    }
+    break;
+  case HeaderCrc:
+    if (++headerCount < 2)
+    {
+      return true;
+    }
+    break;
+  default:
+    return true;
+  }
+
+  // Moves on to the next field that is present.
+  headerCount = 0;
+  if (state < HeaderExtraLength && (flags & FLAG_EXTRA))
+  {
+    state = HeaderExtraLength;
+  }
+  else if (state < HeaderName && (flags & FLAG_NAME))
+  {
+    state = HeaderName;
+  }
+  else if (state < HeaderComment && (flags & FLAG_COMMENT))
+  {
+    state = HeaderComment;
+  }
+  else if (state < HeaderCrc && (flags & FLAG_HCRC))
+  {
+    state = HeaderCrc;
+  }
+  else
+  {
+    state = BlockHeader;
+  }
+  return true;
+}
+
+bool GzipDecoder::inflate()
+{
+  while (state != Done)
+  {
+    // Block headers and the trailer are decoded in one go: on a short read,
+    // the bit position goes back to where it started.
+    size_t markPos = inputPos;
+    uint32_t markBuffer = bitBuffer;
+    uint32_t markCount = bitCount;
+    int result = 0;
+    switch (state)
+    {
+    case BlockHeader:
+      result = blockHeader();
+      break;
+    case Stored:
+      result = stored();
+      break;
+    case Codes:
+      result = symbols();
+      break;
+    case Trailer:
+      result = trailer();
+      break;
+    default:
+      return false;
+    }
+    if (result < 0)
+    {
+      return false;
+    }
+    if (result == 0)
+    {
+      if (state == BlockHeader || state == Trailer)
+      {
+        inputPos = markPos;
+        bitBuffer = markBuffer;
+        bitCount = markCount;
+      }
+      return true;
+    }
+  }
+  return true;
+}
+
+int GzipDecoder::blockHeader()
+{
+  if (!need(3))
+  {
+    return 0;
+  }
+  finalBlock = bits(1) != 0;
+  uint32_t type = bits(2);
+  if (type == 0)
+  {
+    bits(bitCount & 7);
+    if (!need(16))
+    {
+      return 0;
+    }
+    uint32_t length = bits(16);
+    if (!need(16))
+    {
+      return 0;
+    }
+    if (bits(16) != (~length & 0xFFFF))
+    {
+      fail(GzipBadBlock);
+      return -1;
+    }
+    storedRemaining = length;
+    state = Stored;
+    return 1;
+  }
+  if (type == 1)
+  {
+    uint8_t lengths[288 + 30];
+    memset(lengths, 8, 144);
+    memset(lengths + 144, 9, 112);
+    memset(lengths + 256, 7, 24);
+    memset(lengths + 280, 8, 8);
+    memset(lengths + 288, 5, 30);
+    buildHuffman(literals, lengths, 288);
+    buildHuffman(distances, lengths + 288, 30);
+    state = Codes;
+    return 1;
+  }
+  if (type == 2)
+  {
+    return dynamicTables();
+  }
+  fail(GzipBadBlock);
+  return -1;
+}
+
+int GzipDecoder::dynamicTables()
+{
+  if (!need(14))
+  {
+    return 0;
+  }
+  int literalCount = bits(5) + 257;
+  int distanceCount = bits(5) + 1;
+  int codeCount = bits(4) + 4;
+  if (literalCount > 286 || distanceCount > 30)
+  {
+    fail(GzipBadCode);
+    return -1;
+  }
+
+  uint8_t lengths[286 + 30];
+  memset(lengths, 0, 19);
+  for (int i = 0; i < codeCount; i++)
+  {
+    if (!need(3))
+    {
+      return 0;
+    }
+    lengths[CODE_LENGTH_ORDER[i]] = bits(3);
+  }
+  // The code length code goes in `literals` until the real tables are read.
+  if (!buildHuffman(literals, lengths, 19))
+  {
+    fail(GzipBadCode);
+    return -1;
+  }
+
+  int total = literalCount + distanceCount;
+  int index = 0;
+  while (index < total)
+  {
+    int symbol = decode(literals);
+    if (symbol == -1)
+    {
+      return 0;
+    }
+    if (symbol < 0 || symbol > 18)
+    {
+      fail(GzipBadCode);
+      return -1;
+    }
+    if (symbol < 16)
+    {
+      lengths[index++] = symbol;
+      continue;
+    }
+    uint8_t length = 0;
+    uint32_t repeat;
+    if (symbol == 16)
+    {
+      if (index == 0)
+      {
+        fail(GzipBadCode);
+        return -1;
+      }
+      length = lengths[index - 1];
+      if (!need(2))
+      {
+        return 0;
+      }
+      repeat = 3 + bits(2);
+    }
+    else if (symbol == 17)
+    {
+      if (!need(3))
+      {
+        return 0;
+      }
+      repeat = 3 + bits(3);
+    }
+    else
+    {
+      if (!need(7))
+      {
+        return 0;
+      }
+      repeat = 11 + bits(7);
+    }
+    if (index + repeat > (uint32_t)total)
+    {
+      fail(GzipBadCode);
+      return -1;
+    }
+    memset(lengths + index, length, repeat);
+    index += repeat;
+  }
+
+  if (lengths[256] == 0 || !buildHuffman(literals, lengths, literalCount) ||
+      !buildHuffman(distances, lengths + literalCount, distanceCount))
+  {
+    fail(GzipBadCode);
+    return -1;
+  }
+  state = Codes;
+  return 1;
+}
+
+int GzipDecoder::stored()
+{
+  while (storedRemaining > 0)
+  {
+    if (outputSize - flushed == WINDOW && !flush())
+    {
+      return -1;
+    }
+    // Whole bytes may still be in the bit buffer after the block header.
+    uint8_t value;
+    if (bitCount >= 8)
+    {
+      value = bits(8);
+    }
+    else if (inputPos < inputLength)
+    {
+      value = input[inputPos++];
+    }
+    else
+    {
+      return 0;
+    }
+    window[outputSize++ & (WINDOW - 1)] = value;
+    storedRemaining--;
+  }
+  state = finalBlock ? Trailer : BlockHeader;
+  return 1;
+}
+
+int GzipDecoder::symbols()
+{
+  for (;;)
+  {
+    // Room for the longest match without overwriting unflushed output.
+    if (outputSize - flushed > WINDOW - 258 && !flush())
+    {
+      return -1;
+    }
+    size_t markPos = inputPos;
+    uint32_t markBuffer = bitBuffer;
+    uint32_t markCount = bitCount;
+
+    int symbol = decode(literals);
+    if (symbol < 256)
+    {
+      if (symbol == -1)
+      {
+        return 0;
+      }
+      if (symbol < 0)
+      {
+        fail(GzipBadCode);
+        return -1;
+      }
+      window[outputSize++ & (WINDOW - 1)] = symbol;
+      continue;
+    }
+    if (symbol == 256)
+    {
+      state = finalBlock ? Trailer : BlockHeader;
+      return 1;
+    }
+    symbol -= 257;
+    if (symbol >= 29)
+    {
+      fail(GzipBadCode);
+      return -1;
+    }
+    if (!need(LENGTH_EXTRA[symbol]))
+    {
+      inputPos = markPos;
+      bitBuffer = markBuffer;
+      bitCount = markCount;
+      return 0;
+    }
+    uint32_t length = LENGTH_BASE[symbol] + bits(LENGTH_EXTRA[symbol]);
+
+    int code = decode(distances);
+    if (code == -1 || (code >= 0 && code < 30 && !need(DISTANCE_EXTRA[code])))
+    {
+      inputPos = markPos;
+      bitBuffer = markBuffer;
+      bitCount = markCount;
+      return 0;
+    }
+    if (code < 0 || code >= 30)
+    {
+      fail(GzipBadCode);
+      return -1;
+    }
+    uint32_t distance = DISTANCE_BASE[code] + bits(DISTANCE_EXTRA[code]);
+    if (distance > outputSize)
+    {
+      fail(GzipBadCode);
+      return -1;
+    }
+    if (distance > WINDOW)
+    {
+      fail(GzipWindowTooSmall);
+      return -1;
+    }
+    for (; length > 0; length--, outputSize++)
+    {
+      window[outputSize & (WINDOW - 1)] = window[(outputSize - distance) & (WINDOW - 1)];
+    }
+  }
+}
+
+int GzipDecoder::trailer()
+{
+  bits(bitCount & 7);
+  uint32_t values[2] = {0, 0}; // CRC-32, size mod 2^32
+  for (int i = 0; i < 8; i++)
+  {
+    if (!need(8))
+    {
+      return 0;
+    }
+    values[i / 4] |= bits(8) << (8 * (i % 4));
+  }
+  if (!flush())
+  {
+    return -1;
+  }
+  if (values[0] != crc || values[1] != outputSize)
+  {
+    fail(GzipBadTrailer);
+    return -1;
+  }
+  state = Done;
+  return 1;
+}
+
+bool GzipDecoder::buildHuffman(Huffman &huffman, const uint8_t *lengths, int count)
+{
+  memset(huffman.count, 0, sizeof(huffman.count));
+  for (int i = 0; i < count; i++)
+  {
+    huffman.count[lengths[i]]++;
+  }
+  huffman.count[0] = 0;
+
+  // Over-subscribed sets of lengths are rejected; incomplete ones are allowed
+  // (e.g. a single distance code) and fail on the unused codes.
+  int left = 1;
+  uint16_t offsets[MAX_BITS + 2];
+  uint16_t nextCode[MAX_BITS + 1];
+  offsets[1] = 0;
+  int code = 0;
+  for (int length = 1; length <= MAX_BITS; length++)
+  {
+    left = (left << 1) - huffman.count[length];
+    if (left < 0)
+    {
+      return false;
+    }
+    offsets[length + 1] = offsets[length] + huffman.count[length];
+    code = (code + huffman.count[length - 1]) << 1;
+    nextCode[length] = code;
+  }
+
+  memset(huffman.fast, 0, sizeof(huffman.fast));
+  for (int symbol = 0; symbol < count; symbol++)
+  {
+    int length = lengths[symbol];
+    if (length == 0)
+    {
+      continue;
+    }
+    huffman.symbol[offsets[length]++] = symbol;
+    if (length > FAST_BITS)
+    {
+      continue;
+    }
+    // Codes are sent most significant bit first, so the table is indexed by
+    // the reversed code.
+    uint32_t value = nextCode[length]++;
+    uint32_t reversed = 0;
+    for (int i = 0; i < length; i++)
+    {
+      reversed = (reversed << 1) | ((value >> i) & 1);
+    }
+    for (uint32_t index = reversed; index < (1u << FAST_BITS); index += 1u << length)
+    {
+      huffman.fast[index] = (symbol << 4) | length;
+    }
+  }
+  return true;
+}
+
+int GzipDecoder::decode(const Huffman &huffman)
+{
+  while (bitCount < MAX_BITS && inputPos < inputLength)
+  {
+    bitBuffer |= (uint32_t)input[inputPos++] << bitCount;
+    bitCount += 8;
+  }
+  uint16_t entry = huffman.fast[bitBuffer & ((1u << FAST_BITS) - 1)];
+  if (entry != 0 && (entry & 15) <= bitCount)
+  {
+    bits(entry & 15);
+    return entry >> 4;
+  }
+
+  // Canonical decoding a bit at a time, as in zlib's puff.c.
+  int code = 0;
+  int first = 0;
+  int index = 0;
+  for (uint32_t length = 1; length <= MAX_BITS; length++)
+  {
+    if (length > bitCount)
+    {
+      return -1;
+    }
+    code |= (bitBuffer >> (length - 1)) & 1;
+    int count = huffman.count[length];
+    if (code - count < first)
+    {
+      bits(length);
+      return huffman.symbol[index + (code - first)];
+    }
+    index += count;
+    first = (first + count) << 1;
+    code <<= 1;
+  }
+  return -2;
+}
+
+bool GzipDecoder::need(uint32_t count)
+{
+  while (bitCount < count)
+  {
+    if (inputPos == inputLength)
+    {
+      return false;
+    }
+    bitBuffer |= (uint32_t)input[inputPos++] << bitCount;
+    bitCount += 8;
+  }
+  return true;
+}
+
+uint32_t GzipDecoder::bits(uint32_t count)
+{
+  uint32_t value = bitBuffer & ((1u << count) - 1);
+  bitBuffer = count < 32 ? bitBuffer >> count : 0;
+  bitCount -= count;
+  return value;
+}
+
+bool GzipDecoder::flush()
+{
+  while (flushed != outputSize)
+  {
+    size_t start = flushed & (WINDOW - 1);
+    size_t n = WINDOW - start < outputSize - flushed ? WINDOW - start : outputSize - flushed;
+    crc = crc32Update(crc, window + start, n);
+    if (!sink(context, window + start, n))
+    {
+      return fail(GzipSinkError);
+    }
+    flushed += n;
+  }
+  return true;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// LZ77 history kept by the decoder. Must be a power of two <= 32768, and at
+// least the window the stream was compressed with (`yarn firmwareCompress`
+// uses the same default). RAM use is about GZIP_INFLATE_WINDOW + 4 KB.
+#ifndef GZIP_INFLATE_WINDOW
+#define GZIP_INFLATE_WINDOW 8192
+#endif
+
+enum GzipError
+{
+  GzipOk,
+  GzipBadHeader,
+  GzipBadBlock,      // reserved block type, or a stored block with a bad length
+  GzipBadCode,       // invalid Huffman table or symbol
+  GzipWindowTooSmall, // a match reaches back further than GZIP_INFLATE_WINDOW
+  GzipBadTrailer,    // CRC-32 or size mismatch
+  GzipSinkError,
+  GzipTrailingData
+};
+
+// Streaming gzip (RFC 1952) decoder.
+//
+// Compressed data is pushed in pieces of any size, e.g. as it is downloaded,
+// and the inflated bytes go to a sink as they are produced. Input is decoded a
+// symbol at a time from a small buffer, so nothing is held back beyond one
+// dynamic Huffman block header. Only uses the C library, so it builds on Linux
+// too.
+class GzipDecoder
+{
+public:
+  typedef bool (*Sink)(void *context, const uint8_t *data, size_t length);
+
+  GzipDecoder(Sink sink, void *context);
+
+  void reset();
+  // Consumes the next piece of the stream. Returns false once the stream is
+  // malformed or the sink failed; see error().
+  bool write(const uint8_t *data, size_t length);
+  // True after the trailer, with the CRC-32 and size checked.
+  bool finished() const { return state == Done; }
+
+  uint32_t bytesIn() const { return inputSize; }
+  uint32_t bytesOut() const { return outputSize; }
+  GzipError error() const { return lastError; }
+
+private:
+  static const size_t WINDOW = GZIP_INFLATE_WINDOW;
+  static_assert((WINDOW & (WINDOW - 1)) == 0 && WINDOW >= 256 && WINDOW <= 32768,
+                "GZIP_INFLATE_WINDOW must be a power of two between 256 and 32768");
+  // Large enough for the longest dynamic block header (about 570 bytes).
+  static const size_t INPUT_BUFFER = 1024;
+  static const int FAST_BITS = 9;
+  static const int MAX_BITS = 15;
+
+  struct Huffman
+  {
+    uint16_t count[MAX_BITS + 1];
+    uint16_t symbol[288];
+    uint16_t fast[1 << FAST_BITS]; // symbol << 4 | length, 0 = use the slow path
+  };
+
+  enum State
+  {
+    Header,
+    HeaderExtraLength,
+    HeaderExtra,
+    HeaderName,
+    HeaderComment,
+    HeaderCrc,
+    BlockHeader,
+    Stored,
+    Codes,
+    Trailer,
+    Done,
+    Failed
+  };
+
+  bool fail(GzipError error);
+  bool readHeader(uint8_t byte);
+  // Decodes from the input buffer until it runs out or the stream ends.
+  bool inflate();
+  // Returns 1 when the unit was decoded, 0 when more input is needed, and
+  // -1 on error.
+  int blockHeader();
+  int dynamicTables();
+  int stored();
+  int symbols();
+  int trailer();
+  bool buildHuffman(Huffman &huffman, const uint8_t *lengths, int count);
+  // Returns the symbol, -1 when more input is needed, -2 for an invalid code.
+  int decode(const Huffman &huffman);
+  bool need(uint32_t count);
+  uint32_t bits(uint32_t count);
+  bool flush();
+
+  Sink sink;
+  void *context;
+
+  State state;
+  GzipError lastError;
+  uint8_t flags;
+  uint32_t headerCount; // bytes read in the current header field
+  uint32_t extraLength;
+  bool finalBlock;
+  uint32_t storedRemaining;
+
+  uint8_t input[INPUT_BUFFER];
+  size_t inputLength;
+  size_t inputPos;
+  uint32_t bitBuffer;
+  uint32_t bitCount;
+
+  Huffman literals;
+  Huffman distances;
+
+  uint8_t window[WINDOW];
+  uint32_t outputSize; // also the write position in window
+  uint32_t flushed;
+  uint32_t crc;
+  uint32_t inputSize;
+};
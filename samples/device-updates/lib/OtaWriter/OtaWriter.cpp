@@ -0,0 +1,144 @@
+#include "OtaWriter.h"
+
+#include <string.h>
+#include <esp_ota_ops.h>
+
+OtaWriter::~OtaWriter()
+{
+  if (hashing)
+  {
+    mbedtls_sha256_free(&sha);
+  }
+}
+
+bool OtaWriter::begin(size_t size, size_t resumeOffset)
+{
+  partition = esp_ota_get_next_update_partition(nullptr);
+  if (partition == nullptr)
+  {
+    lastError = ESP_ERR_NOT_FOUND;
+    return false;
+  }
+  if (size == 0 || size > partition->size || resumeOffset % SECTOR_SIZE != 0 || resumeOffset > size)
+  {
+    lastError = ESP_ERR_INVALID_SIZE;
+    return false;
+  }
+  // Same image, same boundary (a dropped connection): the hash goes on.
+  bool continuing = hashing && !completed && size == imageSize && resumeOffset == flushed && resumeOffset > 0;
+  imageSize = size;
+  fill = 0;
+  completed = false;
+  lastError = ESP_OK;
+  if (continuing)
+  {
+    return true;
+  }
+
+  startHash();
+  for (flushed = 0; flushed < resumeOffset; flushed += SECTOR_SIZE)
+  {
+    lastError = esp_partition_read(partition, flushed, sector, SECTOR_SIZE);
+    if (lastError != ESP_OK)
+    {
+      return false;
+    }
+    mbedtls_sha256_update(&sha, sector, SECTOR_SIZE);
+  }
+  return true;
+}
+
+bool OtaWriter::write(const uint8_t *data, size_t length)
+{
+  if (partition == nullptr || lastError != ESP_OK || received() + length > imageSize)
+  {
+    if (lastError == ESP_OK)
+    {
+      lastError = ESP_ERR_INVALID_SIZE;
+    }
+    return false;
+  }
+  while (length > 0)
+  {
+    size_t n = SECTOR_SIZE - fill < length ? SECTOR_SIZE - fill : length;
+    memcpy(sector + fill, data, n);
+    fill += n;
+    data += n;
+    length -= n;
+    if (fill == SECTOR_SIZE && !flushSector())
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool OtaWriter::complete(uint8_t sha256[32])
+{
+  if (partition == nullptr || lastError != ESP_OK || received() != imageSize)
+  {
+    if (lastError == ESP_OK)
+    {
+      lastError = ESP_ERR_INVALID_SIZE;
+    }
+    return false;
+  }
+  if (fill > 0 && !flushSector())
+  {
+    return false;
+  }
+  mbedtls_sha256_finish(&sha, sha256);
+  mbedtls_sha256_free(&sha);
+  hashing = false;
+  completed = true;
+  return true;
+}
+
+bool OtaWriter::activate()
+{
+  if (!completed)
+  {
+    lastError = ESP_ERR_INVALID_STATE;
+    return false;
+  }
+  // Verifies the image (header, segments, checksum) before switching.
+  lastError = esp_ota_set_boot_partition(partition);
+  return lastError == ESP_OK;
+}
+
+uint32_t OtaWriter::partitionAddress() const
+{
+  const esp_partition_t *target = partition ? partition : esp_ota_get_next_update_partition(nullptr);
+  return target ? target->address : 0;
+}
+
+bool OtaWriter::flushSector()
+{
+  lastError = esp_partition_erase_range(partition, flushed, SECTOR_SIZE);
+  if (lastError == ESP_OK)
+  {
+    // Flash writes are done in 16-byte units when flash encryption is on.
+    size_t length = (fill + 15) & ~(size_t)15;
+    memset(sector + fill, 0xFF, length - fill);
+    lastError = esp_partition_write(partition, flushed, sector, length);
+  }
+  if (lastError != ESP_OK)
+  {
+    return false;
+  }
+  mbedtls_sha256_update(&sha, sector, fill);
+  flushed += fill;
+  fill = 0;
+  return true;
+}
+
+void OtaWriter::startHash()
+{
+  if (hashing)
+  {
+    mbedtls_sha256_free(&sha);
+  }
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  hashing = true;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <esp_err.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+
+// Writes a firmware image into the next OTA partition one flash sector at a
+// time, so an interrupted download can continue at a sector boundary (after a
+// dropped connection or a reboot) instead of starting again at byte zero.
+//
+// Unlike the Update library nothing is erased up front: each sector is erased
+// right before it is written. Each sector is also hashed (SHA-256) as it goes
+// to flash, so the digest of the image is known as soon as the last byte is
+// written, without reading the partition back. The boot partition only
+// changes in activate(), so a partly written or unverified image never boots.
+class OtaWriter
+{
+public:
+  static const size_t SECTOR_SIZE = 4096;
+
+  ~OtaWriter();
+
+  // Starts (resumeOffset 0) or continues an image of `imageSize` bytes.
+  // `resumeOffset` must be a value returned by committed() for the same image.
+  // When continuing after a reboot, the hash of the bytes already in flash
+  // is rebuilt from the partition once.
+  bool begin(size_t imageSize, size_t resumeOffset);
+  bool write(const uint8_t *data, size_t length);
+  // Writes the last partial sector and returns the SHA-256 of the image.
+  bool complete(uint8_t sha256[32]);
+  // Selects the completed image for the next boot, after the bootloader's
+  // own image checks.
+  bool activate();
+
+  // Bytes that are in flash; a download can be resumed from here.
+  size_t committed() const { return flushed; }
+  // Bytes passed to write() so far, including the partial sector in RAM.
+  size_t received() const { return flushed + fill; }
+  size_t size() const { return imageSize; }
+  // Address of the target partition, to check that a checkpoint still applies.
+  uint32_t partitionAddress() const;
+  esp_err_t error() const { return lastError; }
+
+private:
+  bool flushSector();
+  void startHash();
+
+  const esp_partition_t *partition = nullptr;
+  size_t imageSize = 0;
+  size_t flushed = 0;
+  size_t fill = 0;
+  esp_err_t lastError = ESP_OK;
+  mbedtls_sha256_context sha;
+  bool hashing = false;
+  bool completed = false;
+  uint8_t sector[SECTOR_SIZE];
+};
@@ -1,19 +1,119 @@
 #include <Arduino.h>
+#include <atomic>
 #include <cstdio>
-#include <WifiClientSecure.h>
+#include <WiFi.h>
+#include <WiFiClientSecure.h>
 #include <HTTPClient.h>
-#include <Update.h>
+#include <Preferences.h>
+#include <mbedtls/base64.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/sha256.h>
+#include <esp_ota_ops.h>
 
 // See lib_deps in platformio.ini more details about these:
 #include <M5Core2.h>
 #include <MQTTClient.h>
-#include <ArduinoJSON.h>
+#include <ArduinoJson.h>
+#include <ConnectionManager.h>
+#include <PayloadWriter.h>
+#include <TopicRouter.h>
+#include <LoopStats.h>
+#include <OtaWriter.h>
+#include <ChunkPipeline.h>
+#include <DeltaPatch.h>
+#include <GzipDecoder.h>
 
 #include "Config.h"
 
+// Loop period percentiles, publish rate and free heap are logged every
+// LOOP_STATS_INTERVAL_MS; 0 turns the report off.
+#ifndef LOOP_STATS_INTERVAL_MS
+#define LOOP_STATS_INTERVAL_MS 30000
+#endif
+// Firmware downloads continue with HTTP Range requests after a dropped
+// connection (up to OTA_MAX_REQUESTS requests per attempt) or a reboot.
+// Progress is saved to NVS every OTA_CHECKPOINT_BYTES.
+#ifndef OTA_MAX_REQUESTS
+#define OTA_MAX_REQUESTS 10
+#endif
+#ifndef OTA_CHECKPOINT_BYTES
+#define OTA_CHECKPOINT_BYTES (64 * 1024)
+#endif
+#ifndef OTA_READ_TIMEOUT_MS
+#define OTA_READ_TIMEOUT_MS 10000
+#endif
+// After interrupted request n of an attempt, the next one waits
+// n * OTA_RETRY_DELAY_MS, at most ten times OTA_RETRY_DELAY_MS.
+#ifndef OTA_RETRY_DELAY_MS
+#define OTA_RETRY_DELAY_MS 1000
+#endif
+// The loop task reads the firmware into OTA_BUFFER_COUNT buffers of
+// OTA_BUFFER_SIZE bytes while a writer task programs the earlier ones to flash.
+#ifndef OTA_BUFFER_COUNT
+#define OTA_BUFFER_COUNT 2
+#endif
+#ifndef OTA_BUFFER_SIZE
+#define OTA_BUFFER_SIZE 4096
+#endif
+#ifndef OTA_WRITER_CORE
+#define OTA_WRITER_CORE 0
+#endif
+#ifndef OTA_WRITER_STACK_SIZE
+#define OTA_WRITER_STACK_SIZE 6144
+#endif
+// The SHA-256 of the downloaded image is checked against the job document's
+// firmwareSha256, and its firmwareSignature (base64, over the SHA-256) against
+// FIRMWARE_SIGNING_PUBLIC_KEY, before the image may boot. With
+// OTA_REQUIRE_SIGNATURE set, images without a valid signature are rejected.
+#ifndef OTA_REQUIRE_SIGNATURE
+#define OTA_REQUIRE_SIGNATURE 0
+#endif
+#if OTA_REQUIRE_SIGNATURE && !defined(FIRMWARE_SIGNING_PUBLIC_KEY)
+#error "OTA_REQUIRE_SIGNATURE needs FIRMWARE_SIGNING_PUBLIC_KEY (see include/SampleConfig.h)"
+#endif
+// Download progress goes to the job's statusDetails at most every
+// JOB_PROGRESS_INTERVAL_MS; progress in between is folded into the next
+// report. 0 turns progress reports off.
+#ifndef JOB_PROGRESS_INTERVAL_MS
+#define JOB_PROGRESS_INTERVAL_MS 5000
+#endif
+// Upper bound (seconds) for the TLS handshake. The MQTT connection's
+// handshake and CONNACK wait run in a connect task, so loop() keeps ticking
+// through a broker or TLS outage; the download's handshake blocks loop().
+#ifndef TLS_HANDSHAKE_TIMEOUT_S
+#define TLS_HANDSHAKE_TIMEOUT_S 5
+#endif
+#ifndef CONNECT_TASK_CORE
+#define CONNECT_TASK_CORE 0
+#endif
+#ifndef CONNECT_TASK_STACK_SIZE
+#define CONNECT_TASK_STACK_SIZE 8192
+#endif
+// 1 uses TlsClient instead of WiFiClientSecure, to resume TLS sessions on
+// MQTT reconnects and HTTPS requests.
+#ifndef TLS_SESSION_RESUMPTION
+#define TLS_SESSION_RESUMPTION 0
+#endif
+// MQTTClient buffers. A message larger than the read buffer drops the
+// connection; the largest one is a job execution with its document (a
+// presigned firmwareUrl can be 2 KB). Publishes are at most a job update.
+#ifndef MQTT_READ_BUFFER_SIZE
+#define MQTT_READ_BUFFER_SIZE 4096
+#endif
+#ifndef MQTT_WRITE_BUFFER_SIZE
+#define MQTT_WRITE_BUFFER_SIZE 512
+#endif
+
 // types and shared state:
-WiFiClientSecure wifiClient = WiFiClientSecure();
-MQTTClient mqttClient = MQTTClient(5120); // 5120 = buffer size; we need something big enough to handle the mqtt messages for a single loop execution
+#if TLS_SESSION_RESUMPTION
+#include <TlsClient.h>
+typedef TlsClient SecureClient;
+#else
+typedef WiFiClientSecure SecureClient;
+#endif
+SecureClient wifiClient;  // MQTT
+SecureClient httpsClient; // firmware downloads
+MQTTClient mqttClient = MQTTClient(MQTT_READ_BUFFER_SIZE, MQTT_WRITE_BUFFER_SIZE);
 
 // For demo: change this value, build the project, and upload binary. Then revert this value.
 const char *version = "v1.0.0";
@@ -37,6 +137,11 @@ UpdateState updateState = Idle;
 
 String firmwareUrl = "";
 String firmwareId = "";
+String firmwareSha256 = "";
+String firmwareSignature = "";
+bool firmwareIsDelta = false; // jobDocument.firmwareFormat == "delta"
+bool firmwareCompressed = false; // jobDocument.firmwareCompression == "gzip"
+uint32_t firmwareSize = 0;       // size of a compressed full image once inflated
 String updatePayload = "";
 String jobId = "";
 
@@ -49,43 +154,141 @@ String JOBS_DESCRIBE_EXECUTION_NEXT = JOBS_TOPIC + "/$next/get";
 String JOBS_DESCRIBE_EXECUTION_NEXT_ACCEPTED = JOBS_DESCRIBE_EXECUTION_NEXT + "/accepted";
 String JOBS_DESCRIBE_EXECUTION_NEXT_REJECTED = JOBS_DESCRIBE_EXECUTION_NEXT + "/rejected";
 String currentJobTopic = "";
+String subscribedJobTopic = ""; // currentJobTopic once its /accepted and /rejected replies are subscribed
+uint32_t jobReceivedAt = 0;     // millis() when the job document arrived
+uint32_t progressReportedAt = 0;
+uint32_t progressReported = 0;
+
+// Progress of a firmware download, kept in NVS so it survives a reboot.
+struct OtaCheckpoint
+{
+  String jobId;
+  String etag;       // the image the bytes came from, sent back as If-Range
+  uint32_t partition; // address of the OTA partition being written
+  uint32_t size;
+  uint32_t written;  // bytes in flash, always a sector boundary
+};
+
+enum DownloadResult
+{
+  DownloadComplete,
+  DownloadInterrupted, // resume from the checkpoint
+  DownloadFailed
+};
+
+OtaWriter otaWriter;
+
+// Delta images are rebuilt from the running app partition and the patch.
+bool deltaHeader(void *context, const DeltaHeader &header);
+bool readRunningImage(void *context, uint32_t offset, uint8_t *buffer, size_t length);
+bool writeDeltaOutput(void *context, const uint8_t *data, size_t length);
+DeltaPatch deltaPatch(deltaHeader, readRunningImage, writeDeltaOutput, NULL);
+
+// Compressed downloads are inflated on the way to writeFirmware().
+bool writeFirmware(void *context, const uint8_t *data, size_t length);
+GzipDecoder gzipDecoder(writeFirmware, NULL);
+
+// Firmware chunks travel from downloadFirmware() (loop task) to otaWriteTask.
+typedef ChunkPipeline<OTA_BUFFER_COUNT, OTA_BUFFER_SIZE> OtaPipeline;
+OtaPipeline otaPipeline;
+TaskHandle_t otaReaderTask = NULL;
+TaskHandle_t otaWriterTask = NULL;
+std::atomic<bool> otaWriteFailed(false);
+std::atomic<bool> otaWriterFinished(false);
+// Owned by the writer task while it runs.
+uint32_t otaSavedProgress = 0;
+uint32_t otaWriterStallMs = 0;
+
+LoopStats loopStats;
 
 // functions declarations:
-void setupWifi(const char *certificate, const char *privateKey, bool forceReconnect);
-void setupMqtt(String deviceId, bool forceReconnect);
+void setupWifi(const char *certificate, const char *privateKey);
+void setupMqtt();
+void onMqttConnected();
+bool subscribeJobNotifications();
+bool subscribeJobTopic();
 int downloadAndApply(String url);
+DownloadResult downloadFirmware(const String &url, OtaCheckpoint &checkpoint, uint32_t &transferred);
+OtaCheckpoint loadOtaCheckpoint();
+void saveOtaCheckpoint(const OtaCheckpoint &checkpoint);
+void saveOtaProgress(uint32_t written);
+void clearOtaCheckpoint();
+void otaWriteTask(void *parameter);
+bool verifyFirmware(const uint8_t digest[32]);
+bool writeDownload(const uint8_t *data, size_t length);
+bool downloadFinished();
+bool otaResumable();
+void reportLoopStats();
+void reportTls(const char *label, const SecureClient &client);
+void connectTask(void *parameter);
 
 // - topic handlers
-void handleNotifyNext(String payload);
-void handleJobDescribeJobExecution(String payload);
+// Five $aws/things/<thing>/jobs/... topics, with room for a 128-character
+// thing name, the longest AWS IoT accepts.
+TopicRouter<8, 1024> router;
+void setupRoutes();
+void addRoute(const char *topic, TopicHandler handler);
+void handleNotifyNext(const char *topic, const TopicParams &params, char *payload, int length);
+void handleDescribeJobExecution(const char *topic, const TopicParams &params, char *payload, int length);
+void handleJobUpdateAccepted(const char *topic, const TopicParams &params, char *payload, int length);
+void scheduleJob(const char *source, char *payload, int length);
 
 // -- generic helpers
-void handleMessages(String topic, String payload);
-void handleError(String topic, String payload);
+void handleMessages(MQTTClient *client, char topic[], char payload[], int length);
+void handleError(const char *topic, const TopicParams &params, char *payload, int length);
 
 // - topic publishers
 void publishDescribeExecution();
 void publishUpdateExecution(String jobTopic, String jobId, String status);
+void reportJobProgress(uint32_t downloaded, uint32_t total);
+
+// Wi-Fi/TLS/MQTT connect is advanced a step at a time from loop(); the TLS
+// connect and MQTT CONNECT run in connectTask.
+TaskHandle_t connectTaskHandle = NULL;
+ConnectionManager connection({
+    []() { WiFi.begin(WIFI_SSID, WIFI_PASSWORD); },
+    []() { return WiFi.status() == WL_CONNECTED; },
+    []() { return wifiClient.connect(IOT_ENDPOINT, 8883) == 1; },
+    // true = reuse the open TLS socket
+    []() { return mqttClient.connect(deviceId, true) && subscribeJobNotifications(); },
+    []() { return mqttClient.connected(); },
+    onMqttConnected,
+    []()
+    {
+      mqttClient.disconnect();
+      wifiClient.stop();
+    },
+    []() -> uint32_t { return millis(); },
+    [](uint32_t max) -> uint32_t { return esp_random() % max; },
+    []() { xTaskNotifyGive(connectTaskHandle); },
+});
 
 void setup()
 {
   M5.begin();
-  setupWifi(certificate, privateKey, false);
-  setupMqtt(deviceId, false);
+  setupRoutes();
+  setupWifi(certificate, privateKey);
+  setupMqtt();
+  xTaskCreatePinnedToCore(connectTask, "connect", CONNECT_TASK_STACK_SIZE, NULL, 1, &connectTaskHandle,
+                          CONNECT_TASK_CORE);
   M5.Lcd.printf("Current version is: %s", version);
   Serial.printf("Current version is: %s", version);
 }
 
 void loop()
 {
-  mqttClient.loop();
+  loopStats.tick(micros());
+  reportLoopStats();
+  // The MQTT client and its socket are the connect task's while it connects.
+  if (!connection.connecting())
+  {
+    mqttClient.loop();
+  }
   delay(10); // mqttClient recommends calling this on esp32
   M5.update();
+  connection.tick();
 
-  setupWifi(certificate, privateKey, false);
-  setupMqtt(deviceId, false);
-
-  if (M5.BtnA.wasReleased() || M5.BtnA.pressedFor(1000, 200))
+  if ((M5.BtnA.wasReleased() || M5.BtnA.pressedFor(1000, 200)) && connection.connected())
   {
     publishDescribeExecution(); // If there is an update available, handleDescribeJobExecution will change updateState to StartUpdate
   }
@@ -93,16 +296,35 @@ void loop()
   switch (updateState)
   {
   case StartUpdate:
+  {
     currentJobTopic = JOBS_TOPIC + "/" + jobId + "/update";
-    Serial.printf("Current job topic %s\n", currentJobTopic.c_str());
-    setupMqtt(deviceId, true); // Force reconnect mqtt to subscribe to the currentJobTopic
+    if (!connection.connected())
+    {
+      break; // onMqttConnected() subscribes once the session is back
+    }
+    uint32_t started = millis();
+    if (subscribeJobTopic())
+    {
+      Serial.printf("Subscribed to %s in %ums\n", currentJobTopic.c_str(), millis() - started);
+    }
+    else
+    {
+      Serial.printf("Subscribe to %s failed, reconnecting\n", currentJobTopic.c_str());
+      connection.reconnect();
+    }
     updateState = UpdateStatusInProgress;
     break;
+  }
   case UpdateStatusInProgress:
+    if (!connection.connected())
+    {
+      break; // Wait for the reconnect
+    }
     publishUpdateExecution(currentJobTopic, jobId, "IN_PROGRESS");
     updateState = DownloadAndApplyUpdate;
     break;
   case DownloadAndApplyUpdate:
+  {
     int result = downloadAndApply(firmwareUrl);
     if (result != 0)
     {
@@ -113,11 +335,20 @@ void loop()
       updateState = Success;
     }
     break;
+  }
   case Success:
+    if (connection.connecting())
+    {
+      break;
+    }
     publishUpdateExecution(currentJobTopic, jobId, "SUCCEEDED");
     updateState = Restart;
     break;
   case Failure:
+    if (connection.connecting())
+    {
+      break;
+    }
     publishUpdateExecution(currentJobTopic, jobId, "FAILED");
     updateState = Idle;
     break;
@@ -129,111 +360,195 @@ void loop()
 }
 
 // function definitions:
-void setupWifi(const char *certificate, const char *privateKey, bool forceReconnect)
+void setupWifi(const char *certificate, const char *privateKey)
 {
-  if (WiFi.status() == WL_CONNECTED && forceReconnect == false)
-  {
-    return;
-  }
-  if (forceReconnect)
-  {
-    WiFi.disconnect();
-  }
   M5.Lcd.print("\nConnecting to WiFi");
-  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
-  while (WiFi.status() != WL_CONNECTED)
-  {
-    delay(500);
-    M5.Lcd.print(".");
-  }
-  M5.Lcd.println("\nWiFi Connected");
   wifiClient.setCACert(AWS_CERT_CA);
   wifiClient.setCertificate(certificate);
   wifiClient.setPrivateKey(privateKey);
+  wifiClient.setHandshakeTimeout(TLS_HANDSHAKE_TIMEOUT_S);
+  httpsClient.setCACert(AWS_CERT_CA);
+  httpsClient.setHandshakeTimeout(TLS_HANDSHAKE_TIMEOUT_S);
 }
 
-void setupMqtt(String deviceId, bool forceReconnect)
+void setupMqtt()
 {
-  if (!forceReconnect && mqttClient.connected() == true)
+  Serial.printf("Connecting to MQTT broker with clientId=%s\n", deviceId);
+  mqttClient.begin(IOT_ENDPOINT, 8883, wifiClient);
+  mqttClient.setCleanSession(false);
+  mqttClient.onMessageAdvanced(handleMessages);
+}
+
+// Runs the blocking part of each connection attempt, see connection.
+void connectTask(void *parameter)
+{
+  for (;;)
   {
-    return;
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    connection.runConnect();
   }
-  Serial.printf("mqttError=%d\n", mqttClient.lastError());
-  Serial.printf("mqttConnected=%s\n\n", String(mqttClient.connected()));
+}
 
-  Serial.printf("Connecting to MQTT broker with clientId=%s\n", deviceId.c_str());
-  mqttClient.begin(IOT_ENDPOINT, 8883, wifiClient);
-  mqttClient.setCleanSession(false);
+// add() fails when the router is full; say which topic would go unhandled.
+void addRoute(const char *topic, TopicHandler handler)
+{
+  if (!router.add(topic, handler))
+  {
+    Serial.printf("Cannot route %s: router full (%u routes)\n", topic, router.size());
+  }
+}
+
+void setupRoutes()
+{
+  addRoute(JOBS_NOTIFY_NEXT.c_str(), handleNotifyNext);
+  addRoute(JOBS_DESCRIBE_EXECUTION_NEXT_ACCEPTED.c_str(), handleDescribeJobExecution);
+  addRoute(JOBS_DESCRIBE_EXECUTION_NEXT_REJECTED.c_str(), handleError);
+  // Per-job topics: $aws/things/<thing>/jobs/<jobId>/update/...
+  addRoute((JOBS_TOPIC + "/+/update/accepted").c_str(), handleJobUpdateAccepted);
+  addRoute((JOBS_TOPIC + "/+/update/rejected").c_str(), handleError);
+}
 
-  // Subscribe to topics
-  mqttClient.subscribe(JOBS_NOTIFY_NEXT);
-  mqttClient.subscribe(JOBS_DESCRIBE_EXECUTION_NEXT_ACCEPTED);
-  mqttClient.subscribe(JOBS_DESCRIBE_EXECUTION_NEXT_REJECTED);
+void onMqttConnected()
+{
+  const ConnectionMetrics &metrics = connection.metrics();
+  Serial.printf("Connected to MQTT broker (reconnect=%ums, max=%ums, failed attempts=%u, worst tick=%ums)\n",
+                metrics.lastReconnectMs, metrics.maxReconnectMs, metrics.failedAttempts, metrics.worstTickMs);
+  reportTls("MQTT", wifiClient);
+
+  // The jobs topics were subscribed to by the connect task.
+  subscribedJobTopic = "";
   if (currentJobTopic != "")
   {
-    mqttClient.subscribe(currentJobTopic + "/accepted");
-    mqttClient.subscribe(currentJobTopic + "/rejected");
+    subscribeJobTopic();
+  }
+  // notify-next only reports changes, so ask for jobs queued while offline.
+  if (updateState == Idle)
+  {
+    publishDescribeExecution();
   }
+}
+
+// Moves the per-job reply subscriptions to currentJobTopic on the open
+// session. MQTTClient waits for each SUBACK, so the job can go on as soon as
+// this returns true.
+// Part of every connection attempt, in connectTask.
+bool subscribeJobNotifications()
+{
+  return mqttClient.subscribe(JOBS_NOTIFY_NEXT) && mqttClient.subscribe(JOBS_DESCRIBE_EXECUTION_NEXT_ACCEPTED) &&
+         mqttClient.subscribe(JOBS_DESCRIBE_EXECUTION_NEXT_REJECTED);
+}
 
-  while (!mqttClient.connect(deviceId.c_str()))
+bool subscribeJobTopic()
+{
+  if (subscribedJobTopic == currentJobTopic)
   {
-    Serial.print(".");
-    delay(1000);
+    return true;
   }
-  Serial.println("");
-  if (!mqttClient.connected())
+  if (subscribedJobTopic != "")
   {
-    Serial.println("Broker timeout!");
-    return;
+    mqttClient.unsubscribe(subscribedJobTopic + "/accepted");
+    mqttClient.unsubscribe(subscribedJobTopic + "/rejected");
+    subscribedJobTopic = "";
   }
-  Serial.println("Connected to MQTT broker");
-
-  mqttClient.onMessage(handleMessages);
+  if (!mqttClient.subscribe(currentJobTopic + "/accepted") || !mqttClient.subscribe(currentJobTopic + "/rejected"))
+  {
+    return false;
+  }
+  subscribedJobTopic = currentJobTopic;
+  return true;
 }
 
 // Handlers
-void handleError(String topic, String payload)
+void handleError(const char *topic, const TopicParams &params, char *payload, int length)
 {
   Serial.println("error from topic.");
   Serial.print("Topic: ");
   Serial.println(topic);
   Serial.print("Payload: ");
-  Serial.println(payload);
+  Serial.write((const uint8_t *)payload, length);
+  Serial.println();
   M5.Lcd.print("\nError=");
-  M5.Lcd.println(payload);
+  M5.Lcd.write((const uint8_t *)payload, length);
+  M5.Lcd.println();
 };
 
-void handleNotifyNext(String payload)
+// notify-next carries the same execution (job document included) as a
+// describe reply, so the update starts without another round trip.
+void handleNotifyNext(const char *topic, const TopicParams &params, char *payload, int length)
 {
-  Serial.println("Message from notify-next:");
-  Serial.println(payload);
+  scheduleJob("notify-next", payload, length);
 }
 
-void handleDescribeJobExecution(String payload)
+void handleJobUpdateAccepted(const char *topic, const TopicParams &params, char *payload, int length)
 {
-  DynamicJsonDocument doc(2048);
-  DeserializationError err = deserializeJson(doc, payload);
+  Serial.printf("Job update accepted for jobId=%.*s\n", (int)params.lengths[0], params.values[0]);
+}
+
+void handleDescribeJobExecution(const char *topic, const TopicParams &params, char *payload, int length)
+{
+  scheduleJob("describe", payload, length);
+}
+
+void scheduleJob(const char *source, char *payload, int length)
+{
+  // Only the fields below are kept: the rest of the execution and of the job
+  // document is skipped while parsing, so extra fields cost no memory.
+  // Strings stay in the MQTT buffer (zero-copy).
+  StaticJsonDocument<256> filter;
+  JsonObject filterExecution = filter.createNestedObject("execution");
+  filterExecution["jobId"] = true;
+  filterExecution["status"] = true;
+  JsonObject filterDocument = filterExecution.createNestedObject("jobDocument");
+  for (const char *field : {"operation", "firmwareId", "firmwareUrl", "firmwareSha256", "firmwareSignature",
+                            "firmwareFormat", "firmwareCompression", "firmwareSize"})
+  {
+    filterDocument[field] = true;
+  }
+
+  uint32_t started = micros();
+  StaticJsonDocument<256> doc;
+  DeserializationError err = deserializeJson(doc, payload, length, DeserializationOption::Filter(filter));
   if (err)
   {
     Serial.print("Deserialization Error: ");
     Serial.println(err.f_str());
     return;
   }
-  const char *_jobId = doc["execution"]["jobId"];
-  const char *status = doc["execution"]["status"];
-  const char *operation = doc["execution"]["jobDocument"]["operation"];
-  const char *_firmwareId = doc["execution"]["jobDocument"]["firmwareId"];
-  const char *_firmwareUrl = doc["execution"]["jobDocument"]["firmwareUrl"];
-  Serial.println(_firmwareId);
-  Serial.println(_firmwareUrl);
-  Serial.println(_jobId);
-  if (_firmwareUrl != NULL && _jobId != NULL)
-  {
-    Serial.println("scheduling update");
+  Serial.printf("Parsed %d byte %s message in %luus (%u bytes of JSON memory)\n", length, source, micros() - started,
+                doc.memoryUsage());
+  JsonObject execution = doc["execution"];
+  JsonObject jobDocument = execution["jobDocument"];
+  const char *_jobId = execution["jobId"];
+  const char *status = execution["status"] | "";
+  const char *operation = jobDocument["operation"] | "";
+  const char *_firmwareId = jobDocument["firmwareId"] | "";
+  const char *_firmwareUrl = jobDocument["firmwareUrl"];
+  const char *_firmwareSha256 = jobDocument["firmwareSha256"] | "";
+  const char *_firmwareSignature = jobDocument["firmwareSignature"] | "";
+  const char *_firmwareFormat = jobDocument["firmwareFormat"] | "full";
+  const char *_firmwareCompression = jobDocument["firmwareCompression"] | "none";
+  uint32_t _firmwareSize = jobDocument["firmwareSize"] | 0;
+  Serial.printf("jobId=%s status=%s operation=%s firmwareId=%s firmwareUrl=%s\n", _jobId ? _jobId : "", status,
+                operation, _firmwareId, _firmwareUrl ? _firmwareUrl : "");
+  if (_firmwareUrl != NULL && _jobId != NULL && updateState != Idle)
+  {
+    // Both a push and a describe reply can announce the same job.
+    Serial.printf("Update of jobId=%s in progress, ignoring jobId=%s from %s\n", jobId.c_str(), _jobId, source);
+  }
+  else if (_firmwareUrl != NULL && _jobId != NULL)
+  {
+    Serial.printf("scheduling update from %s\n", source);
     firmwareId = String(_firmwareId);
     firmwareUrl = String(_firmwareUrl);
+    firmwareSha256 = String(_firmwareSha256);
+    firmwareSignature = String(_firmwareSignature);
+    firmwareIsDelta = strcmp(_firmwareFormat, "delta") == 0;
+    firmwareCompressed = strcmp(_firmwareCompression, "gzip") == 0;
+    firmwareSize = _firmwareSize;
     jobId = _jobId;
-    Serial.printf("firmwareId=%s;jobId=%s\n", firmwareId.c_str(), jobId.c_str());
+    jobReceivedAt = millis();
+    Serial.printf("firmwareId=%s;jobId=%s;firmwareFormat=%s;firmwareCompression=%s\n", firmwareId.c_str(),
+                  jobId.c_str(), _firmwareFormat, _firmwareCompression);
     updateState = StartUpdate;
   }
   else
@@ -242,82 +557,576 @@ void handleDescribeJobExecution(String payload)
   }
 }
 
-void handleMessages(String topic, String payload)
+void handleMessages(MQTTClient *client, char topic[], char payload[], int length)
 {
-  Serial.printf("Received message from topic=%s\n", topic.c_str());
-  if (topic == JOBS_NOTIFY_NEXT)
+  Serial.printf("Received message from topic=%s\n", topic);
+  if (!router.dispatch(topic, payload, length))
   {
-    handleNotifyNext(payload);
-    return;
+    TopicParams none = {};
+    handleError(topic, none, payload, length);
   }
-  else if (topic == JOBS_DESCRIBE_EXECUTION_NEXT_ACCEPTED)
+}
+
+// Publishers
+void publishDescribeExecution()
+{
+  JsonWriter<128> payload;
+  writeDescribeExecution(payload, deviceId);
+  if (mqttClient.publish(JOBS_DESCRIBE_EXECUTION_NEXT.c_str(), payload.c_str(), payload.length(), false, 1))
   {
-    handleDescribeJobExecution(payload);
+    loopStats.countPublish();
   }
-  else
-  {
+}
 
-    handleError(topic, payload);
+void reportJobProgress(uint32_t downloaded, uint32_t total)
+{
+  uint32_t now = millis();
+  if (JOB_PROGRESS_INTERVAL_MS == 0 || now - progressReportedAt < JOB_PROGRESS_INTERVAL_MS ||
+      downloaded == progressReported)
+  {
     return;
   }
+  progressReportedAt = now;
+  progressReported = downloaded;
+  JsonWriter<256> payload;
+  writeJobProgress(payload, jobId.c_str(), "IN_PROGRESS", downloaded, total);
+  // QoS 0: the download does not wait for a PUBACK, and a lost report is
+  // superseded by the next one.
+  if (payload.ok() && mqttClient.publish(currentJobTopic.c_str(), payload.c_str(), payload.length(), false, 0))
+  {
+    loopStats.countPublish();
+  }
 }
 
-// Publishers
-void publishDescribeExecution()
+void publishUpdateExecution(String jobTopic, String jobId, String status)
 {
-  String payload = "{\"jobId\": \"$next\", \"thingName\": \"" + String(deviceId) + "\"}";
-  mqttClient.publish(JOBS_DESCRIBE_EXECUTION_NEXT, payload, false, 1);
+  JsonWriter<192> payload;
+  writeJobStatus(payload, jobId.c_str(), status.c_str());
+  Serial.printf("Updating job execution. Status=%s\n", status.c_str());
+  if (mqttClient.publish(jobTopic.c_str(), payload.c_str(), payload.length(), false, 1))
+  {
+    loopStats.countPublish();
+  }
 }
 
-void publishUpdateExecution(String jobTopic, String jobId, String status)
+int downloadAndApply(String url)
 {
-  String payload = "{\"jobId\": \"" + jobId + "\", \"status\": \"" + status + "\"}";
-  Serial.printf("Updating job execution. Status=%s\n", status);
-  mqttClient.publish(jobTopic, payload, false, 1);
+  // A compressed image is written as it is inflated, so the OtaWriter needs
+  // its inflated size up front. A delta patch names its own.
+  if (firmwareCompressed && !firmwareIsDelta && firmwareSize == 0)
+  {
+    Serial.println("Job rejected: firmwareCompression \"gzip\" needs firmwareSize (the size of the inflated image)");
+    return 1;
+  }
+  Serial.printf("starting file download, %ums after the job arrived\n", millis() - jobReceivedAt);
+  progressReportedAt = millis();
+  progressReported = 0;
+  OtaCheckpoint checkpoint = loadOtaCheckpoint();
+  if (checkpoint.jobId != jobId || checkpoint.partition != otaWriter.partitionAddress() || checkpoint.etag.isEmpty() ||
+      !otaResumable())
+  {
+    checkpoint = {jobId, "", otaWriter.partitionAddress(), 0, 0};
+  }
+  else
+  {
+    Serial.printf("Resuming firmware download at %u/%u bytes\n", checkpoint.written, checkpoint.size);
+  }
+
+  uint32_t transferred = 0;
+  for (int request = 1; request <= OTA_MAX_REQUESTS; request++)
+  {
+    DownloadResult result = downloadFirmware(url, checkpoint, transferred);
+    reportTls("HTTPS", httpsClient);
+    if (result == DownloadComplete)
+    {
+      Serial.printf("Downloaded %u byte %s%s, %u bytes transferred in %d requests\n", checkpoint.size,
+                    firmwareCompressed ? "gzip " : "", firmwareIsDelta ? "patch" : "image", transferred, request);
+      if (firmwareCompressed)
+      {
+        Serial.printf("Inflated to %u bytes (%.1f%%)\n", gzipDecoder.bytesOut(),
+                      100.0 * checkpoint.size / (gzipDecoder.bytesOut() ? gzipDecoder.bytesOut() : 1));
+      }
+      clearOtaCheckpoint();
+      uint8_t digest[32];
+      if (!otaWriter.complete(digest))
+      {
+        Serial.printf("Flash write failed: %s\n", esp_err_to_name(otaWriter.error()));
+        return 1;
+      }
+      if (!verifyFirmware(digest))
+      {
+        return 1;
+      }
+      if (!otaWriter.activate())
+      {
+        Serial.printf("Firmware image rejected: %s\n", esp_err_to_name(otaWriter.error()));
+        return 1;
+      }
+      Serial.println("Update is finished");
+      return 0;
+    }
+    if (result == DownloadFailed)
+    {
+      clearOtaCheckpoint();
+      return 1;
+    }
+    Serial.printf("Firmware download interrupted at %u/%u bytes\n", checkpoint.written, checkpoint.size);
+    delay(request < 10 ? request * OTA_RETRY_DELAY_MS : 10 * OTA_RETRY_DELAY_MS);
+  }
+  // The checkpoint is kept: if the job is picked up again the download
+  // continues where this attempt stopped.
+  return 1;
 }
 
-int downloadAndApply(String url)
+// One GET of the firmware image, starting at checkpoint.written when resuming.
+DownloadResult downloadFirmware(const String &url, OtaCheckpoint &checkpoint, uint32_t &transferred)
 {
-  Serial.println("starting file download");
   HTTPClient https;
-  if (https.begin(wifiClient, url))
+  if (!https.begin(httpsClient, url))
+  {
+    return DownloadInterrupted;
+  }
+  https.setTimeout(OTA_READ_TIMEOUT_MS);
+  const char *headers[] = {"ETag", "Content-Range"};
+  https.collectHeaders(headers, 2);
+  bool resuming = checkpoint.written > 0 && !checkpoint.etag.isEmpty();
+  if (resuming)
   {
-    https.setTimeout(10000); // miliseconds
-    int httpCode = https.GET();
-    if (httpCode <= 0 || httpCode != HTTP_CODE_OK)
+    // If-Range: the whole image comes back (200) if it changed in the meantime.
+    https.addHeader("Range", "bytes=" + String(checkpoint.written) + "-");
+    https.addHeader("If-Range", checkpoint.etag);
+  }
+  int httpCode = https.GET();
+  size_t offset = 0;
+  if (httpCode == HTTP_CODE_PARTIAL_CONTENT && resuming)
+  {
+    // Content-Range: bytes <first>-<last>/<size>
+    unsigned long first = 0, last = 0, size = 0;
+    if (sscanf(https.header("Content-Range").c_str(), "bytes %lu-%lu/%lu", &first, &last, &size) != 3 ||
+        first != checkpoint.written || size != checkpoint.size)
     {
-      Serial.printf("HTTP error %d\n", httpCode);
+      Serial.println("Unexpected Content-Range, restarting download");
+      checkpoint.written = 0;
       https.end();
-      return 1;
+      return DownloadInterrupted;
     }
-
-    Serial.println("Writing update");
-    // See https://github.com/espressif/arduino-esp32/tree/master/libraries/Update
-    // for details about the Update library.
-    bool canBegin = Update.begin(https.getSize());
-    if (!canBegin)
+    offset = first;
+  }
+  else if (httpCode == HTTP_CODE_OK)
+  {
+    // The image is written, checkpointed and resumed by its size; a chunked
+    // or connection-delimited body does not give one.
+    if (https.getSize() <= 0)
     {
+      Serial.println("Firmware response without Content-Length, cannot download it");
       https.end();
-      return 1;
+      return DownloadFailed;
+    }
+    checkpoint.etag = https.header("ETag");
+    checkpoint.size = https.getSize();
+    checkpoint.written = 0;
+    saveOtaCheckpoint(checkpoint);
+  }
+  else if (httpCode <= 0 || httpCode == HTTP_CODE_REQUESTED_RANGE_NOT_SATISFIABLE)
+  {
+    // Connection problem, or a checkpoint the server does not agree with.
+    Serial.printf("HTTP error %d\n", httpCode);
+    if (httpCode > 0)
+    {
+      checkpoint.written = 0;
     }
-    size_t written = Update.writeStream(https.getStream());
-    if (written == https.getSize())
+    https.end();
+    return DownloadInterrupted;
+  }
+  else
+  {
+    Serial.printf("HTTP error %d\n", httpCode);
+    https.end();
+    return DownloadFailed;
+  }
+
+  uint32_t imageSize = firmwareCompressed ? firmwareSize : checkpoint.size;
+  if (firmwareCompressed)
+  {
+    gzipDecoder.reset();
+  }
+  if (firmwareIsDelta)
+  {
+    // deltaHeader() starts the OtaWriter once the patch names the image size.
+    deltaPatch.reset();
+  }
+  else if (!otaWriter.begin(imageSize, offset))
+  {
+    Serial.printf("Cannot write a %u byte image: %s\n", imageSize, esp_err_to_name(otaWriter.error()));
+    https.end();
+    return DownloadFailed;
+  }
+
+  Serial.println("Writing update");
+  otaReaderTask = xTaskGetCurrentTaskHandle();
+  otaSavedProgress = checkpoint.written;
+  otaWriteFailed = false;
+  otaWriterFinished = false;
+  xTaskCreatePinnedToCore(otaWriteTask, "ota-write", OTA_WRITER_STACK_SIZE, NULL, 1, &otaWriterTask, OTA_WRITER_CORE);
+
+  WiFiClient *stream = https.getStreamPtr();
+  size_t received = offset;
+  uint32_t started = millis();
+  uint32_t lastData = started;
+  uint32_t readerStallMs = 0;
+  bool streaming = received < checkpoint.size;
+  OtaPipeline::Chunk *chunk = NULL;
+  while (streaming && !otaWriteFailed)
+  {
+    if (chunk == NULL)
     {
-      Serial.println("Written : " + String(written) + " successfully");
+      chunk = otaPipeline.acquire();
+      if (chunk == NULL)
+      {
+        // Every buffer is waiting for flash.
+        uint32_t waitStarted = millis();
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+        readerStallMs += millis() - waitStarted;
+        continue;
+      }
+      chunk->length = 0;
     }
-    else
+    size_t room = OTA_BUFFER_SIZE - chunk->length;
+    if (room > checkpoint.size - received)
     {
-      Serial.println("Written only : " + String(written) + "/" + String(https.getSize()) + ". Retry?");
+      room = checkpoint.size - received;
     }
-    if (Update.end())
+    int available = stream->available();
+    if (available > 0)
     {
-      Serial.println("Update end");
-      if (Update.isFinished())
+      int n = stream->read(chunk->data + chunk->length, (size_t)available < room ? available : room);
+      if (n > 0)
       {
-        Serial.println("Update is finished");
+        chunk->length += n;
+        received += n;
+        transferred += n;
+        lastData = millis();
+        reportJobProgress(received, checkpoint.size);
       }
     }
-    https.end();
+    else if (!stream->connected() || millis() - lastData > OTA_READ_TIMEOUT_MS)
+    {
+      streaming = false;
+    }
+    else
+    {
+      // Waiting for data: keep the MQTT session alive and handle what
+      // arrived (pushes for other jobs are turned away, see scheduleJob()).
+      mqttClient.loop();
+      delay(1);
+    }
+    if (received == checkpoint.size)
+    {
+      streaming = false;
+    }
+    // Full chunks go to the writer, and whatever was read when the stream ends.
+    if (chunk->length == OTA_BUFFER_SIZE || (!streaming && chunk->length > 0))
+    {
+      otaPipeline.submit(chunk);
+      xTaskNotifyGive(otaWriterTask);
+      chunk = NULL;
+      mqttClient.loop();
+    }
+  }
+
+  // An empty chunk stops the writer after everything before it is in flash.
+  while (chunk == NULL && (chunk = otaPipeline.acquire()) == NULL)
+  {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
   }
-  return 0;
-}
\ No newline at end of file
+  chunk->length = 0;
+  otaPipeline.submit(chunk);
+  xTaskNotifyGive(otaWriterTask);
+  while (!otaWriterFinished)
+  {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+  }
+  https.end();
+
+  uint32_t elapsed = millis() - started;
+  Serial.printf("OTA pipeline: %u bytes in %ums (%.2f MB/s), %u x %u byte buffers, "
+                "reader waited %ums for flash, writer waited %ums for data\n",
+                received - offset, elapsed, (received - offset) / 1048.576 / (elapsed ? elapsed : 1), OTA_BUFFER_COUNT,
+                OTA_BUFFER_SIZE, readerStallMs, otaWriterStallMs);
+  if (otaWriteFailed)
+  {
+    if (firmwareCompressed && gzipDecoder.error() != GzipSinkError)
+    {
+      Serial.printf("Firmware decompression failed: error %d after %u bytes\n", gzipDecoder.error(),
+                    gzipDecoder.bytesIn());
+      return DownloadFailed;
+    }
+    if (firmwareIsDelta && deltaPatch.error() != DeltaTargetError)
+    {
+      Serial.printf("Delta patch failed: error %d after %u bytes\n", deltaPatch.error(), deltaPatch.written());
+      return DownloadFailed;
+    }
+    Serial.printf("Flash write failed: %s\n", esp_err_to_name(otaWriter.error()));
+    return DownloadFailed;
+  }
+  if (downloadFinished())
+  {
+    return DownloadComplete;
+  }
+  if (!otaResumable())
+  {
+    Serial.printf("Download stopped after %u/%u bytes, starting over\n", received, checkpoint.size);
+    checkpoint.written = 0;
+    return DownloadInterrupted;
+  }
+  // Bytes after the last full sector are downloaded again.
+  checkpoint.written = otaWriter.committed();
+  saveOtaProgress(checkpoint.written);
+  return DownloadInterrupted;
+}
+
+// Runs on the digest computed while the image was written, so the partition
+// is not read again; a rejected image is never made bootable.
+bool verifyFirmware(const uint8_t digest[32])
+{
+  char hex[65];
+  for (int i = 0; i < 32; i++)
+  {
+    sprintf(hex + 2 * i, "%02x", digest[i]);
+  }
+  Serial.printf("Firmware SHA-256: %s\n", hex);
+  if (!firmwareSha256.isEmpty() && !firmwareSha256.equalsIgnoreCase(hex))
+  {
+    Serial.printf("Firmware rejected: job document expects SHA-256 %s\n", firmwareSha256.c_str());
+    return false;
+  }
+  if (firmwareSignature.isEmpty())
+  {
+    if (OTA_REQUIRE_SIGNATURE)
+    {
+      Serial.println("Firmware rejected: the job document has no firmwareSignature");
+      return false;
+    }
+    return true;
+  }
+#ifdef FIRMWARE_SIGNING_PUBLIC_KEY
+  static const char publicKey[] = FIRMWARE_SIGNING_PUBLIC_KEY;
+  unsigned char signature[512];
+  size_t signatureLength = 0;
+  mbedtls_pk_context key;
+  mbedtls_pk_init(&key);
+  int err = mbedtls_base64_decode(signature, sizeof(signature), &signatureLength,
+                                  (const unsigned char *)firmwareSignature.c_str(), firmwareSignature.length());
+  if (err == 0)
+  {
+    // The PEM length must include the terminating NUL.
+    err = mbedtls_pk_parse_public_key(&key, (const unsigned char *)publicKey, sizeof(publicKey));
+  }
+  if (err == 0)
+  {
+    err = mbedtls_pk_verify(&key, MBEDTLS_MD_SHA256, digest, 32, signature, signatureLength);
+  }
+  mbedtls_pk_free(&key);
+  if (err != 0)
+  {
+    Serial.printf("Firmware rejected: signature check failed (-0x%04x)\n", -err);
+    return false;
+  }
+  Serial.println("Firmware signature verified");
+#else
+  Serial.println("No FIRMWARE_SIGNING_PUBLIC_KEY configured, firmwareSignature not checked");
+#endif
+  return true;
+}
+
+// Programs the chunks filled by downloadFirmware() and saves the download
+// checkpoint as sectors reach flash. An empty chunk ends the task.
+void otaWriteTask(void *parameter)
+{
+  uint32_t stalled = 0;
+  for (;;)
+  {
+    OtaPipeline::Chunk *chunk = otaPipeline.next();
+    if (chunk == NULL)
+    {
+      uint32_t waitStarted = millis();
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      stalled += millis() - waitStarted;
+      continue;
+    }
+    bool last = chunk->length == 0;
+    if (!last && !otaWriteFailed && !writeDownload(chunk->data, chunk->length))
+    {
+      otaWriteFailed = true;
+    }
+    otaPipeline.release(chunk);
+    if (otaResumable() && !otaWriteFailed && otaWriter.committed() - otaSavedProgress >= OTA_CHECKPOINT_BYTES)
+    {
+      otaSavedProgress = otaWriter.committed();
+      saveOtaProgress(otaSavedProgress);
+    }
+    if (last)
+    {
+      otaWriterStallMs = stalled;
+      otaWriterFinished = true;
+      xTaskNotifyGive(otaReaderTask);
+      vTaskDelete(NULL);
+    }
+    xTaskNotifyGive(otaReaderTask);
+  }
+}
+
+// Downloaded bytes are inflated first when compressed, then go to the delta
+// patch or straight to flash.
+bool writeDownload(const uint8_t *data, size_t length)
+{
+  if (firmwareCompressed)
+  {
+    return gzipDecoder.write(data, length);
+  }
+  return writeFirmware(NULL, data, length);
+}
+
+bool writeFirmware(void *context, const uint8_t *data, size_t length)
+{
+  return firmwareIsDelta ? deltaPatch.write(data, length) : otaWriter.write(data, length);
+}
+
+bool downloadFinished()
+{
+  if (firmwareCompressed && !gzipDecoder.finished())
+  {
+    return false;
+  }
+  return firmwareIsDelta ? deltaPatch.finished() : otaWriter.received() == otaWriter.size();
+}
+
+// Patches and compressed streams can only be decoded from their first byte,
+// so only plain images continue from a checkpoint.
+bool otaResumable()
+{
+  return !firmwareIsDelta && !firmwareCompressed;
+}
+
+// The patch only applies to the image it was made from: the running image's
+// SHA-256 must match before anything is written.
+bool deltaHeader(void *context, const DeltaHeader &header)
+{
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  if (running == NULL || header.sourceSize > running->size)
+  {
+    Serial.printf("Delta patch needs a %u byte source image\n", header.sourceSize);
+    return false;
+  }
+  uint8_t buffer[1024];
+  uint8_t digest[32];
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  bool readOk = true;
+  for (uint32_t offset = 0; readOk && offset < header.sourceSize; offset += sizeof(buffer))
+  {
+    size_t n = header.sourceSize - offset < sizeof(buffer) ? header.sourceSize - offset : sizeof(buffer);
+    readOk = esp_partition_read(running, offset, buffer, n) == ESP_OK;
+    mbedtls_sha256_update(&sha, buffer, n);
+  }
+  mbedtls_sha256_finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+  if (!readOk || memcmp(digest, header.sourceSha256, sizeof(digest)) != 0)
+  {
+    Serial.println("Delta patch was made for a different firmware image");
+    return false;
+  }
+  Serial.printf("Applying delta patch: %u -> %u bytes\n", header.sourceSize, header.targetSize);
+  if (!otaWriter.begin(header.targetSize, 0))
+  {
+    Serial.printf("Cannot write a %u byte image: %s\n", header.targetSize, esp_err_to_name(otaWriter.error()));
+    return false;
+  }
+  return true;
+}
+
+bool readRunningImage(void *context, uint32_t offset, uint8_t *buffer, size_t length)
+{
+  return esp_partition_read(esp_ota_get_running_partition(), offset, buffer, length) == ESP_OK;
+}
+
+bool writeDeltaOutput(void *context, const uint8_t *data, size_t length)
+{
+  return otaWriter.write(data, length);
+}
+
+OtaCheckpoint loadOtaCheckpoint()
+{
+  OtaCheckpoint checkpoint = {"", "", 0, 0, 0};
+  Preferences preferences;
+  if (preferences.begin("ota", true))
+  {
+    checkpoint.jobId = preferences.getString("job", "");
+    checkpoint.etag = preferences.getString("etag", "");
+    checkpoint.partition = preferences.getUInt("partition", 0);
+    checkpoint.size = preferences.getUInt("size", 0);
+    checkpoint.written = preferences.getUInt("written", 0);
+    preferences.end();
+  }
+  return checkpoint;
+}
+
+void saveOtaCheckpoint(const OtaCheckpoint &checkpoint)
+{
+  Preferences preferences;
+  preferences.begin("ota", false);
+  preferences.putString("job", checkpoint.jobId);
+  preferences.putString("etag", checkpoint.etag);
+  preferences.putUInt("partition", checkpoint.partition);
+  preferences.putUInt("size", checkpoint.size);
+  preferences.putUInt("written", checkpoint.written);
+  preferences.end();
+}
+
+void saveOtaProgress(uint32_t written)
+{
+  Preferences preferences;
+  preferences.begin("ota", false);
+  preferences.putUInt("written", written);
+  preferences.end();
+}
+
+void clearOtaCheckpoint()
+{
+  Preferences preferences;
+  preferences.begin("ota", false);
+  preferences.clear();
+  preferences.end();
+}
+
+void reportLoopStats()
+{
+  static uint32_t windowStarted = 0;
+  uint32_t elapsed = millis() - windowStarted;
+  if (LOOP_STATS_INTERVAL_MS == 0 || elapsed < LOOP_STATS_INTERVAL_MS)
+  {
+    return;
+  }
+  Serial.printf("Loop: %u ticks, p50=%uus p95=%uus p99=%uus max=%uus, %u publishes (%.2f/s), free heap=%u (min %u)\n",
+                loopStats.ticks(), loopStats.percentileUs(50), loopStats.percentileUs(95), loopStats.percentileUs(99),
+                loopStats.maxUs(), loopStats.publishes(), loopStats.publishes() * 1000.0 / elapsed, ESP.getFreeHeap(),
+                ESP.getMinFreeHeap());
+  loopStats.reset();
+  windowStarted = millis();
+}
+
+void reportTls(const char *label, const SecureClient &client)
+{
+#if TLS_SESSION_RESUMPTION
+  const TlsStats &stats = client.stats();
+  uint32_t full = stats.handshakes - stats.resumed;
+  if (client.lastError() != 0)
+  {
+    Serial.printf("%s TLS handshake failed: -0x%04x\n", label, -client.lastError());
+  }
+  Serial.printf("%s TLS: last handshake %ums, %u/%u resumed, avg full=%ums resumed=%ums, %u failed\n", label,
+                stats.lastHandshakeMs, stats.resumed, stats.handshakes, full ? stats.fullHandshakeMs / full : 0,
+                stats.resumed ? stats.resumedHandshakeMs / stats.resumed : 0, stats.failures);
+#endif
+}
@@ -0,0 +1,197 @@
+#include <Arduino.h>
+#include <M5Core2.h>
+#include <MQTTClient.h>
+#include <WiFi.h>
+#include <HTTPClient.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+#include <LoopBench.h>
+#include <unity.h>
+
+// Runs the whole sketch (src/main.cpp, see [env:native_loop]) against the
+// fakes, calling loop() as the Arduino loop task would, with the broker
+// playing AWS IoT Jobs and the HTTP fake serving the firmware image.
+//
+//   pio test -e native_loop -v
+
+void setup();
+void loop();
+extern String JOBS_TOPIC;
+
+const uint32_t REPLY_MS = 100;
+const size_t IMAGE_SIZE = 512 * 1024;
+// Roughly an M5Stack Core2 on a good access point.
+const uint32_t DOWNLOAD_BYTES_PER_SECOND = 1000 * 1000;
+const FakeFlashTiming FLASH_TIMING = {10000, 250, 0};
+
+static std::string image;
+static std::string imageSha256;
+static bool restarted = false;
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+static void makeImage()
+{
+  FakeHeapUncounted fixture;
+  image.resize(IMAGE_SIZE);
+  for (size_t i = 0; i < image.size(); i++)
+  {
+    image[i] = (char)(esp_random() >> 24);
+  }
+  image[0] = (char)0xe9; // checked by esp_ota_set_boot_partition()
+  unsigned char digest[32];
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  mbedtls_sha256_update(&sha, (const unsigned char *)image.data(), image.size());
+  mbedtls_sha256_finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+  char hex[65];
+  for (int i = 0; i < 32; i++)
+  {
+    sprintf(hex + 2 * i, "%02x", digest[i]);
+  }
+  imageSha256 = hex;
+}
+
+static std::string execution(const char *jobId)
+{
+  return std::string("{\"execution\":{\"jobId\":\"") + jobId +
+         "\",\"status\":\"QUEUED\",\"jobDocument\":{\"operation\":\"firmwareUpdate\",\"firmwareId\":\"v2.0.0\","
+         "\"firmwareUrl\":\"https://firmware.native/v2.0.0.bin\",\"firmwareSha256\":\"" +
+         imageSha256 + "\"}}}";
+}
+
+static void serveJobs()
+{
+  std::string jobs = JOBS_TOPIC.c_str();
+  // Nothing queued: describe requests get an empty reply.
+  fakeBroker.respond(jobs + "/$next/get", [jobs](FakeBroker &broker, const FakeMessage &message)
+                     { broker.send(jobs + "/$next/get/accepted", "{\"timestamp\":1700000000}", REPLY_MS); });
+  fakeBroker.respond(jobs + "/+/update", [jobs](FakeBroker &broker, const FakeMessage &message)
+                     { broker.send(message.topic + "/accepted", "{\"timestamp\":1700000000}", REPLY_MS); });
+  fakeHttpServe([](const FakeHttpRequest &request)
+                {
+                  FakeHttpResponse response;
+                  response.headers["ETag"] = "\"" + imageSha256.substr(0, 16) + "\"";
+                  response.body = image;
+                  response.bytesPerSecond = DOWNLOAD_BYTES_PER_SECOND;
+                  return response; });
+}
+
+static void loopTask()
+{
+  try
+  {
+    loop();
+  }
+  catch (const EspRestart &)
+  {
+    restarted = true;
+  }
+}
+
+// The longest loop() call in the scenario, in ms.
+static uint32_t worstLoopMs = 0;
+
+static void timedLoopTask()
+{
+  unsigned long started = micros();
+  loopTask();
+  uint32_t ms = (micros() - started) / 1000;
+  worstLoopMs = ms > worstLoopMs ? ms : worstLoopMs;
+}
+
+static void pressA()
+{
+  M5.BtnA.fakeRelease();
+  loopTask();
+}
+
+void test_idle_connected()
+{
+  LoopBench bench("device-updates/idle");
+  TEST_ASSERT_TRUE(bench.runUntil(10000, loopTask, [&bench]() { return bench.logged("no job to execute"); }));
+  bench.run(5000, loopTask);
+  bench.report();
+}
+
+void test_describe_presses()
+{
+  LoopBench bench("device-updates/describe-presses");
+  size_t before = fakeBroker.published(std::string(JOBS_TOPIC.c_str()) + "/$next/get").size();
+  bench.run(5000, pressA);
+  bench.run(1000, loopTask);
+  bench.report();
+  TEST_ASSERT_GREATER_THAN(before, fakeBroker.published(std::string(JOBS_TOPIC.c_str()) + "/$next/get").size());
+}
+
+// The broker refuses connections, then every TLS handshake times out: the
+// connect task takes the handshakes and CONNACK waits, loop() keeps ticking.
+// Once reconnected, onMqttConnected() publishes a describe request from
+// loop() like BtnA does; the connection's own ticks stay short.
+void test_broker_and_tls_outage()
+{
+  LoopBench bench("device-updates/broker-and-tls-outage");
+  worstLoopMs = 0;
+  FakeBrokerSettings refusing;
+  refusing.connackMs = REPLY_MS;
+  refusing.accepting = false;
+  fakeBroker.configure(refusing);
+  fakeBroker.dropConnections();
+  bench.run(3000, timedLoopTask);
+  fakeBroker.configure(FakeBrokerSettings());
+  FakeNetworkSettings slow;
+  slow.tlsHandshakeMs = 6000; // past TLS_HANDSHAKE_TIMEOUT_S
+  fakeNetworkConfigure(slow);
+  bench.run(6000, timedLoopTask);
+  fakeNetworkConfigure(FakeNetworkSettings());
+  TEST_ASSERT_TRUE(bench.runUntil(15000, loopTask, [&bench]() { return bench.logged("Connected to MQTT broker"); }));
+  bench.report();
+
+  const std::string &log = bench.log();
+  unsigned reconnectMs, maxMs, failed, worstTickMs;
+  TEST_ASSERT_EQUAL(4, sscanf(log.c_str() + log.rfind("Connected to MQTT broker"),
+                              "Connected to MQTT broker (reconnect=%ums, max=%ums, failed attempts=%u, worst tick=%ums)",
+                              &reconnectMs, &maxMs, &failed, &worstTickMs));
+  printf("BENCH device-updates outage: %u failed attempts, reconnected after %u ms, worst connection tick %u ms, "
+         "worst loop() %u ms\n",
+         failed, reconnectMs, worstTickMs, worstLoopMs);
+  TEST_ASSERT_TRUE(failed > 0);
+  TEST_ASSERT_LESS_THAN(10, worstTickMs);
+  // loop() itself waits 10 ms (delay(10) for the MQTT client).
+  TEST_ASSERT_LESS_THAN(10 + 10, worstLoopMs);
+}
+
+void test_firmware_update()
+{
+  LoopBench bench("device-updates/firmware-update");
+  fakeFlashTiming(FLASH_TIMING);
+  fakeBroker.send(std::string(JOBS_TOPIC.c_str()) + "/notify-next", execution("job-bench-1"));
+  TEST_ASSERT_TRUE(bench.runUntil(30000, loopTask, []() { return restarted; }));
+  bench.report();
+  TEST_ASSERT_TRUE(bench.logged("Update is finished"));
+  TEST_ASSERT_EQUAL(IMAGE_SIZE, fakeHttpStats().bytesReceived);
+  printf("%s", bench.log().substr(bench.log().find("OTA pipeline:")).c_str());
+}
+
+int main(int argc, char **argv)
+{
+  makeImage();
+  serveJobs();
+  setup();
+  UNITY_BEGIN();
+  RUN_TEST(test_idle_connected);
+  RUN_TEST(test_describe_presses);
+  RUN_TEST(test_broker_and_tls_outage);
+  RUN_TEST(test_firmware_update);
+  int failures = UNITY_END();
+  fakeStopTasks();
+  return failures;
+}
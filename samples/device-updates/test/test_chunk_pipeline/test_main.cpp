@@ -0,0 +1,331 @@
+#include <Arduino.h>
+#include <ChunkPipeline.h>
+#include <FakeRtos.h>
+#include <mbedtls/sha256.h>
+#include <OtaWriter.h>
+#include <string.h>
+#include <string>
+#include <unity.h>
+
+// ChunkPipeline hand-over rules, and the download-to-flash pipeline of
+// downloadFirmware() and otaWriteTask() against reading and writing in turn
+// (Update.writeStream()), with a paced network on one side and slow flash on
+// the other. Reports MB/s, how long each side waited for the other, and what
+// the number and size of the buffers change.
+//
+//   pio test -e native -f test_chunk_pipeline -v
+
+const size_t IMAGE_SIZE = 256 * 1024;
+// A home Wi-Fi download, and lwIP's default TCP receive window: the sender
+// stops once that much is waiting to be read.
+const uint32_t NETWORK_BYTES_PER_SECOND = 1000 * 1000;
+const size_t TCP_WINDOW = 5744;
+// The reader's own time per KB read: TLS record decryption and the copy out
+// of lwIP. It is a sleep here, as if the writer task had the other core.
+const uint32_t READ_US_PER_KB = 1000;
+// Sector erase and page program rates of the ESP32's SPI NOR flash.
+const FakeFlashTiming FLASH_TIMING = {10000, 250, 0};
+
+static std::string image;
+
+void setUp()
+{
+  fakeFlashReset();
+  fakeFlashTiming(FLASH_TIMING);
+}
+
+void tearDown()
+{
+}
+
+static void test_chunks_arrive_in_order()
+{
+  ChunkPipeline<3, 8> pipeline;
+  TEST_ASSERT_TRUE(pipeline.idle());
+  TEST_ASSERT_NULL(pipeline.next());
+  ChunkPipeline<3, 8>::Chunk *taken[3];
+  for (int i = 0; i < 3; i++)
+  {
+    taken[i] = pipeline.acquire();
+    TEST_ASSERT_NOT_NULL(taken[i]);
+    taken[i]->length = i + 1;
+    pipeline.submit(taken[i]);
+  }
+  // Every chunk is with the consumer.
+  TEST_ASSERT_NULL(pipeline.acquire());
+  TEST_ASSERT_FALSE(pipeline.idle());
+  for (int i = 0; i < 3; i++)
+  {
+    ChunkPipeline<3, 8>::Chunk *chunk = pipeline.next();
+    TEST_ASSERT_EQUAL_PTR(taken[i], chunk);
+    TEST_ASSERT_EQUAL(i + 1, chunk->length);
+    pipeline.release(chunk);
+  }
+  TEST_ASSERT_NULL(pipeline.next());
+  TEST_ASSERT_TRUE(pipeline.idle());
+}
+
+// The download: bytes arrive at NETWORK_BYTES_PER_SECOND while fewer than
+// TCP_WINDOW are waiting to be read, and reading them costs READ_US_PER_KB.
+// The window overlaps the network with flash writes by itself; what reading
+// and writing in turn cannot overlap is the reader's work.
+class SlowNetwork
+{
+public:
+  SlowNetwork() : lastUs(micros()) {}
+
+  size_t available()
+  {
+    unsigned long now = micros();
+    buffered += (now - lastUs) * (double)NETWORK_BYTES_PER_SECOND / 1e6;
+    lastUs = now;
+    double limit = (double)(TCP_WINDOW < image.size() - delivered ? TCP_WINDOW : image.size() - delivered);
+    buffered = buffered < limit ? buffered : limit;
+    return (size_t)buffered;
+  }
+
+  size_t read(uint8_t *destination, size_t size)
+  {
+    size_t n = available() < size ? available() : size;
+    memcpy(destination, image.data() + delivered, n);
+    delivered += n;
+    buffered -= n;
+    delayMicroseconds(n * READ_US_PER_KB / 1024);
+    return n;
+  }
+
+  bool done() const { return delivered == image.size(); }
+
+private:
+  unsigned long lastUs;
+  double buffered = 0;
+  size_t delivered = 0;
+};
+
+struct Result
+{
+  unsigned long elapsedUs = 0;
+  unsigned long readerStallUs = 0; // waiting for a free buffer
+  unsigned long writerStallUs = 0; // waiting for a full one
+};
+
+static void expectImageWritten(OtaWriter &writer)
+{
+  uint8_t expected[32];
+  uint8_t actual[32];
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  mbedtls_sha256_update(&sha, (const uint8_t *)image.data(), image.size());
+  mbedtls_sha256_finish(&sha, expected);
+  mbedtls_sha256_free(&sha);
+  TEST_ASSERT_TRUE(writer.complete(actual));
+  TEST_ASSERT_EQUAL_MEMORY(expected, actual, 32);
+}
+
+// Update.writeStream(): read a sector's worth, write it, read the next.
+static Result runInTurn()
+{
+  Result result;
+  SlowNetwork network;
+  OtaWriter writer;
+  TEST_ASSERT_TRUE(writer.begin(image.size(), 0));
+  static uint8_t buffer[OtaWriter::SECTOR_SIZE];
+  size_t length = 0;
+  unsigned long started = micros();
+  while (!network.done() || length > 0)
+  {
+    if (network.available() > 0 && length < sizeof(buffer))
+    {
+      length += network.read(buffer + length, sizeof(buffer) - length);
+    }
+    else if (length == sizeof(buffer) || network.done())
+    {
+      TEST_ASSERT_TRUE(writer.write(buffer, length));
+      length = 0;
+    }
+    else
+    {
+      delay(1);
+    }
+  }
+  result.elapsedUs = micros() - started;
+  expectImageWritten(writer);
+  return result;
+}
+
+template <size_t Count, size_t Size>
+struct PipelineRun
+{
+  typedef ChunkPipeline<Count, Size> Pipeline;
+
+  static Pipeline pipeline;
+  static OtaWriter writer;
+  static TaskHandle_t readerTask;
+  static volatile bool writerFinished;
+  static unsigned long writerStallUs;
+
+  // otaWriteTask(): an empty chunk ends it.
+  static void writeTask(void *parameter)
+  {
+    unsigned long stalled = 0;
+    for (;;)
+    {
+      typename Pipeline::Chunk *chunk = pipeline.next();
+      if (chunk == nullptr)
+      {
+        unsigned long waitStarted = micros();
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        stalled += micros() - waitStarted;
+        continue;
+      }
+      bool last = chunk->length == 0;
+      if (!last)
+      {
+        writer.write(chunk->data, chunk->length);
+      }
+      pipeline.release(chunk);
+      if (last)
+      {
+        writerStallUs = stalled;
+        writerFinished = true;
+        xTaskNotifyGive(readerTask);
+        vTaskDelete(NULL);
+      }
+      xTaskNotifyGive(readerTask);
+    }
+  }
+
+  // downloadFirmware(): fills chunks as the network delivers.
+  static Result run()
+  {
+    Result result;
+    SlowNetwork network;
+    TEST_ASSERT_TRUE(writer.begin(image.size(), 0));
+    readerTask = xTaskGetCurrentTaskHandle();
+    writerFinished = false;
+    TaskHandle_t writerTask;
+    xTaskCreatePinnedToCore(writeTask, "ota-write", 6144, NULL, 1, &writerTask, 0);
+
+    unsigned long started = micros();
+    typename Pipeline::Chunk *chunk = nullptr;
+    while (!network.done())
+    {
+      if (chunk == nullptr)
+      {
+        chunk = pipeline.acquire();
+        if (chunk == nullptr)
+        {
+          unsigned long waitStarted = micros();
+          ulTaskNotifyTake(pdTRUE, 100);
+          result.readerStallUs += micros() - waitStarted;
+          continue;
+        }
+        chunk->length = 0;
+      }
+      if (network.available() > 0)
+      {
+        chunk->length += network.read(chunk->data + chunk->length, Size - chunk->length);
+      }
+      else
+      {
+        delay(1);
+      }
+      if (chunk->length == Size || (network.done() && chunk->length > 0))
+      {
+        pipeline.submit(chunk);
+        xTaskNotifyGive(writerTask);
+        chunk = nullptr;
+      }
+    }
+    while (chunk == nullptr && (chunk = pipeline.acquire()) == nullptr)
+    {
+      ulTaskNotifyTake(pdTRUE, 100);
+    }
+    chunk->length = 0;
+    pipeline.submit(chunk);
+    xTaskNotifyGive(writerTask);
+    while (!writerFinished)
+    {
+      ulTaskNotifyTake(pdTRUE, 100);
+    }
+    result.elapsedUs = micros() - started;
+    result.writerStallUs = writerStallUs;
+    TEST_ASSERT_TRUE(pipeline.idle());
+    expectImageWritten(writer);
+    return result;
+  }
+};
+
+template <size_t Count, size_t Size>
+ChunkPipeline<Count, Size> PipelineRun<Count, Size>::pipeline;
+template <size_t Count, size_t Size>
+OtaWriter PipelineRun<Count, Size>::writer;
+template <size_t Count, size_t Size>
+TaskHandle_t PipelineRun<Count, Size>::readerTask;
+template <size_t Count, size_t Size>
+volatile bool PipelineRun<Count, Size>::writerFinished;
+template <size_t Count, size_t Size>
+unsigned long PipelineRun<Count, Size>::writerStallUs;
+
+static double megabytesPerSecond(const Result &result)
+{
+  return image.size() / (double)result.elapsedUs;
+}
+
+static void report(const char *name, const Result &result)
+{
+  printf("BENCH %-26s %5.3f MB/s (%4lu ms), reader waited %4lu ms for flash, writer waited %4lu ms for data\n",
+         name, megabytesPerSecond(result), result.elapsedUs / 1000, result.readerStallUs / 1000,
+         result.writerStallUs / 1000);
+}
+
+template <size_t Count, size_t Size>
+static double bench()
+{
+  fakeFlashReset();
+  Result result = PipelineRun<Count, Size>::run();
+  char name[32];
+  snprintf(name, sizeof(name), "pipeline %u x %5u bytes", (unsigned)Count, (unsigned)Size);
+  report(name, result);
+  return megabytesPerSecond(result);
+}
+
+static void test_pipeline_against_reading_and_writing_in_turn()
+{
+  printf("BENCH %u KB image, network %u KB/s with a %u byte window, reading %u us/KB, flash erase %u us/sector "
+         "and program %u us/KB\n",
+         (unsigned)(IMAGE_SIZE / 1024), NETWORK_BYTES_PER_SECOND / 1000, (unsigned)TCP_WINDOW, READ_US_PER_KB,
+         FLASH_TIMING.eraseSectorUs, FLASH_TIMING.writeKbUs);
+  Result inTurn = runInTurn();
+  report("read, then write (4096)", inTurn);
+
+  double single = bench<1, 4096>();
+  double sketch = bench<2, 4096>();
+  bench<2, 1024>();
+  bench<2, 16384>();
+  bench<4, 1024>();
+  bench<4, 4096>();
+  bench<8, 4096>();
+
+  // One buffer cannot overlap anything; two already keep the network busy
+  // while a sector is erased and programmed.
+  TEST_ASSERT_TRUE(single < megabytesPerSecond(inTurn) * 1.2);
+  TEST_ASSERT_TRUE(sketch > megabytesPerSecond(inTurn) * 1.3);
+}
+
+int main(int argc, char **argv)
+{
+  image.resize(IMAGE_SIZE);
+  uint32_t state = 0x2545f491;
+  for (char &c : image)
+  {
+    state = state * 1664525 + 1013904223;
+    c = (char)(state >> 24);
+  }
+  UNITY_BEGIN();
+  RUN_TEST(test_chunks_arrive_in_order);
+  RUN_TEST(test_pipeline_against_reading_and_writing_in_turn);
+  fakeStopTasks();
+  return UNITY_END();
+}
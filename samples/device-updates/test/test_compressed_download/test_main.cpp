@@ -0,0 +1,213 @@
+#include <Arduino.h>
+#include <WiFi.h>
+#include <HTTPClient.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+#include <string>
+#include <zlib.h>
+#include <unity.h>
+
+// downloadAndApply() from the sketch (src/main.cpp, see [env:native_loop])
+// with a gzip image (firmwareCompression "gzip"): inflated into flash, the
+// job document's firmwareSize checked, and download time against the plain
+// image on a paced link.
+//
+//   pio test -e native_loop -f test_compressed_download -v
+
+int downloadAndApply(String url);
+void clearOtaCheckpoint();
+extern String jobId;
+extern String firmwareSha256;
+extern bool firmwareCompressed;
+extern uint32_t firmwareSize;
+
+const size_t IMAGE_SIZE = 512 * 1024;
+const uint32_t DOWNLOAD_BYTES_PER_SECOND = 1000 * 1000;
+const FakeFlashTiming FLASH_TIMING = {10000, 250, 0};
+
+static std::string image;
+static std::string compressed;
+static const std::string *served = &image;
+static uint32_t bytesPerSecond = 0;
+
+void setUp()
+{
+  fakeHttpReset();
+  fakeFlashReset();
+  fakeFlashTiming(FakeFlashTiming());
+  clearOtaCheckpoint();
+  firmwareCompressed = true;
+  firmwareSize = IMAGE_SIZE;
+  served = &compressed;
+  bytesPerSecond = 0;
+  Serial.takeOutput();
+}
+
+void tearDown()
+{
+  firmwareCompressed = false;
+  firmwareSize = 0;
+}
+
+// Instruction words from a small set, 0xFF padding and strings: about half
+// its size once compressed, like a real image.
+static void makeImage()
+{
+  FakeHeapUncounted fixture;
+  uint32_t state = 0x2545f491;
+  while (image.size() < IMAGE_SIZE)
+  {
+    state = state * 1664525 + 1013904223;
+    if (state >> 28 < 11)
+    {
+      for (int i = 0; i < 16; i++)
+      {
+        state = state * 1664525 + 1013904223;
+        uint32_t word = (0x00400000 + ((state >> 24) & 0x3f) * 0x01000000) | ((state >> 8) & 0x0fff);
+        image.append((const char *)&word, 4);
+      }
+    }
+    else if (state >> 28 < 13)
+    {
+      image.append(64 + (state & 0xff), (char)0xff);
+    }
+    else
+    {
+      image += "MQTT connect failed, rc=%d";
+      image += '\0';
+    }
+  }
+  image.resize(IMAGE_SIZE);
+  image[0] = (char)0xe9; // checked by esp_ota_set_boot_partition()
+
+  unsigned char digest[32];
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  mbedtls_sha256_update(&sha, (const unsigned char *)image.data(), image.size());
+  mbedtls_sha256_finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+  char hex[65];
+  for (int i = 0; i < 32; i++)
+  {
+    sprintf(hex + 2 * i, "%02x", digest[i]);
+  }
+  firmwareSha256 = hex;
+
+  // As `yarn firmwareCompress` does: level 9, memLevel 9, windowBits 13.
+  z_stream z = {};
+  deflateInit2(&z, 9, Z_DEFLATED, 16 + 13, 9, Z_DEFAULT_STRATEGY);
+  compressed.resize(deflateBound(&z, image.size()));
+  z.next_in = (Bytef *)image.data();
+  z.avail_in = image.size();
+  z.next_out = (Bytef *)&compressed[0];
+  z.avail_out = compressed.size();
+  deflate(&z, Z_FINISH);
+  compressed.resize(z.total_out);
+  deflateEnd(&z);
+}
+
+static void serve()
+{
+  fakeHttpServe(
+      [](const FakeHttpRequest &request)
+      {
+        FakeHttpResponse response;
+        response.headers["ETag"] = "\"" + std::string(firmwareSha256.c_str(), 16) + "\"";
+        response.body = *served;
+        response.bytesPerSecond = bytesPerSecond;
+        return response;
+      });
+}
+
+static void test_compressed_image_is_inflated_into_flash()
+{
+  serve();
+  jobId = "job-gzip";
+  TEST_ASSERT_EQUAL(0, downloadAndApply("https://firmware.native/v2.0.0.bin.gz"));
+  TEST_ASSERT_TRUE(fakeFlashContents(esp_ota_get_boot_partition(), image.size()) == image);
+  TEST_ASSERT_EQUAL(compressed.size(), fakeHttpStats().bytesReceived);
+  std::string log = Serial.takeOutput();
+  TEST_ASSERT_TRUE(log.find("Inflated to " + std::to_string(IMAGE_SIZE) + " bytes") != std::string::npos);
+}
+
+static void test_compressed_image_without_size_is_rejected()
+{
+  serve();
+  firmwareSize = 0;
+  jobId = "job-gzip-no-size";
+  TEST_ASSERT_EQUAL(1, downloadAndApply("https://firmware.native/v2.0.0.bin.gz"));
+  // Rejected before anything is downloaded.
+  TEST_ASSERT_EQUAL(0, fakeHttpStats().requests);
+  std::string log = Serial.takeOutput();
+  TEST_ASSERT_TRUE(log.find("needs firmwareSize") != std::string::npos);
+}
+
+static void test_compressed_image_of_the_wrong_size_fails()
+{
+  serve();
+  jobId = "job-gzip-short";
+  firmwareSize = IMAGE_SIZE - 1;
+  TEST_ASSERT_EQUAL(1, downloadAndApply("https://firmware.native/v2.0.0.bin.gz"));
+  firmwareSize = IMAGE_SIZE + 1;
+  jobId = "job-gzip-long";
+  TEST_ASSERT_EQUAL(1, downloadAndApply("https://firmware.native/v2.0.0.bin.gz"));
+  TEST_ASSERT_TRUE(esp_ota_get_boot_partition() == esp_ota_get_running_partition());
+}
+
+// Milliseconds for a whole downloadAndApply().
+static unsigned long timedDownload(bool gzip, const FakeFlashTiming &timing)
+{
+  fakeFlashReset();
+  fakeFlashTiming(timing);
+  clearOtaCheckpoint();
+  firmwareCompressed = gzip;
+  served = gzip ? &compressed : &image;
+  bytesPerSecond = DOWNLOAD_BYTES_PER_SECOND;
+  serve();
+  jobId = gzip ? "job-bench-gzip" : "job-bench-full";
+  unsigned long started = millis();
+  TEST_ASSERT_EQUAL(0, downloadAndApply("https://firmware.native/v2.0.0.bin"));
+  return millis() - started;
+}
+
+static void test_download_time_against_the_plain_image()
+{
+  const FakeFlashTiming instant;
+  printf("BENCH %u KB image, %u KB gzip (%.1f%%), link %u KB/s\n", (unsigned)(IMAGE_SIZE / 1024),
+         (unsigned)(compressed.size() / 1024), 100.0 * compressed.size() / IMAGE_SIZE,
+         DOWNLOAD_BYTES_PER_SECOND / 1000);
+  unsigned long plainMs = timedDownload(false, instant);
+  unsigned long gzipMs = timedDownload(true, instant);
+  printf("BENCH instant flash:        plain %4lu ms, gzip %4lu ms (%.2f MB/s of image)\n", plainMs, gzipMs,
+         IMAGE_SIZE / 1000.0 / gzipMs);
+  TEST_ASSERT_TRUE(gzipMs < plainMs * 3 / 4);
+  unsigned long plainFlashMs = timedDownload(false, FLASH_TIMING);
+  unsigned long gzipFlashMs = timedDownload(true, FLASH_TIMING);
+  printf("BENCH flash %u us/sector erase, %u us/KB: plain %4lu ms, gzip %4lu ms (%.2f MB/s of image)\n",
+         FLASH_TIMING.eraseSectorUs, FLASH_TIMING.writeKbUs, plainFlashMs, gzipFlashMs,
+         IMAGE_SIZE / 1000.0 / gzipFlashMs);
+}
+
+int main(int argc, char **argv)
+{
+  FakeNetworkSettings network;
+  network.joinMs = 0;
+  network.tlsHandshakeMs = 0;
+  fakeNetworkConfigure(network);
+  WiFi.begin("native", "native");
+  while (WiFi.status() != WL_CONNECTED)
+  {
+    delay(1);
+  }
+  makeImage();
+  UNITY_BEGIN();
+  RUN_TEST(test_compressed_image_is_inflated_into_flash);
+  RUN_TEST(test_compressed_image_without_size_is_rejected);
+  RUN_TEST(test_compressed_image_of_the_wrong_size_fails);
+  RUN_TEST(test_download_time_against_the_plain_image);
+  int failures = UNITY_END();
+  fakeStopTasks();
+  return failures;
+}
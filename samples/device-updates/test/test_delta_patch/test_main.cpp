@@ -0,0 +1,353 @@
+#include <Arduino.h>
+#include <DeltaPatch.h>
+#include <mbedtls/sha256.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <unity.h>
+
+// Patches made by `yarn firmwareDelta` (samples/firmwareDelta.ts) applied
+// with DeltaPatch, fed in pieces as a download would, and compared with the
+// new image; then the same patches truncated and corrupted. Needs Node and
+// `yarn install` at the repository root.
+//
+//   pio test -e native -f test_delta_patch -v
+
+// Run from the project directory, as `pio test` does.
+#ifndef FIRMWARE_DELTA_COMMAND
+#define FIRMWARE_DELTA_COMMAND "yarn --silent --cwd ../.. firmwareDelta"
+#endif
+
+const size_t IMAGE_SIZE = 256 * 1024;
+const int CORRUPTION_TRIALS = 500;
+
+static std::string oldImage;
+static std::string newImage;
+static std::string patch; // oldImage -> newImage
+static char basePath[64];
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+static std::string sha256(const std::string &data)
+{
+  uint8_t digest[32];
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  mbedtls_sha256_update(&sha, (const uint8_t *)data.data(), data.size());
+  mbedtls_sha256_finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+  return std::string((const char *)digest, sizeof(digest));
+}
+
+static std::string randomBytes(size_t size, uint32_t seed)
+{
+  std::string data(size, '\0');
+  for (char &c : data)
+  {
+    seed = seed * 1664525 + 1013904223;
+    c = (char)(seed >> 24);
+  }
+  return data;
+}
+
+static void writeFile(const std::string &path, const std::string &data)
+{
+  FILE *file = fopen(path.c_str(), "wb");
+  TEST_ASSERT_NOT_NULL(file);
+  fwrite(data.data(), 1, data.size(), file);
+  fclose(file);
+}
+
+static std::string readFile(const std::string &path)
+{
+  std::string data;
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == nullptr)
+  {
+    return data;
+  }
+  char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+  {
+    data.append(buffer, n);
+  }
+  fclose(file);
+  return data;
+}
+
+// Runs the generator on two images.
+static std::string makePatch(const std::string &from, const std::string &to)
+{
+  std::string oldPath = std::string(basePath) + ".old";
+  std::string newPath = std::string(basePath) + ".new";
+  std::string patchPath = std::string(basePath) + ".patch";
+  writeFile(oldPath, from);
+  writeFile(newPath, to);
+  remove(patchPath.c_str());
+  std::string command = std::string(FIRMWARE_DELTA_COMMAND) + " --old=" + oldPath + " --new=" + newPath +
+                        " --out=" + patchPath + " > /dev/null";
+  int status = system(command.c_str());
+  std::string made = readFile(patchPath);
+  remove(oldPath.c_str());
+  remove(newPath.c_str());
+  remove(patchPath.c_str());
+  if (status != 0 || made.empty())
+  {
+    TEST_FAIL_MESSAGE("`" FIRMWARE_DELTA_COMMAND "` failed; run `yarn install` at the repository root");
+  }
+  return made;
+}
+
+// The sketch's callbacks, against a source image in RAM: the header must
+// name this source, and reads and writes must stay in range.
+struct Applied
+{
+  const std::string *source;
+  std::string target;
+  uint32_t targetSize = 0;
+  bool outOfRange = false;
+  bool finished = false;
+  DeltaError error = DeltaOk;
+};
+
+static bool checkHeader(void *context, const DeltaHeader &header)
+{
+  Applied *applied = (Applied *)context;
+  applied->targetSize = header.targetSize;
+  return header.sourceSize == applied->source->size() &&
+         memcmp(header.sourceSha256, sha256(*applied->source).data(), 32) == 0;
+}
+
+static bool readSource(void *context, uint32_t offset, uint8_t *buffer, size_t length)
+{
+  Applied *applied = (Applied *)context;
+  if (offset > applied->source->size() || length > applied->source->size() - offset)
+  {
+    applied->outOfRange = true;
+    return false;
+  }
+  memcpy(buffer, applied->source->data() + offset, length);
+  return true;
+}
+
+static bool writeTarget(void *context, const uint8_t *data, size_t length)
+{
+  Applied *applied = (Applied *)context;
+  applied->target.append((const char *)data, length);
+  applied->outOfRange |= applied->target.size() > applied->targetSize;
+  return true;
+}
+
+// Applies `patchData` to `source` in pieces of `pieceSize` bytes.
+static Applied apply(const std::string &source, const std::string &patchData, size_t pieceSize)
+{
+  Applied applied;
+  applied.source = &source;
+  DeltaPatch delta(checkHeader, readSource, writeTarget, &applied);
+  const uint8_t *data = (const uint8_t *)patchData.data();
+  for (size_t offset = 0; offset < patchData.size(); offset += pieceSize)
+  {
+    size_t n = patchData.size() - offset < pieceSize ? patchData.size() - offset : pieceSize;
+    if (!delta.write(data + offset, n))
+    {
+      break;
+    }
+  }
+  applied.finished = delta.finished();
+  applied.error = delta.error();
+  TEST_ASSERT_EQUAL(applied.target.size(), delta.written());
+  return applied;
+}
+
+// A firmware build after a small change: a constant, a new function, a
+// removed one, relocated pointers in between, and a longer tail.
+static std::string edited(const std::string &image)
+{
+  std::string next = image;
+  next[1000] ^= 0x5A;
+  next.erase(120000, 2000);
+  next.insert(50000, randomBytes(300, 7));
+  for (size_t offset = 60000; offset < 80000; offset += 256)
+  {
+    next[offset] += 0x2C;
+  }
+  next += randomBytes(1000, 9);
+  return next;
+}
+
+static void test_round_trip()
+{
+  patch = makePatch(oldImage, newImage);
+  const size_t pieces[] = {1, 7, 512, 1460, patch.size()};
+  for (size_t pieceSize : pieces)
+  {
+    Applied applied = apply(oldImage, patch, pieceSize);
+    TEST_ASSERT_EQUAL(DeltaOk, applied.error);
+    TEST_ASSERT_TRUE(applied.finished);
+    TEST_ASSERT_FALSE(applied.outOfRange);
+    TEST_ASSERT_TRUE(applied.target == newImage);
+  }
+
+  unsigned long best = ~0UL;
+  for (int i = 0; i < 5; i++)
+  {
+    unsigned long started = micros();
+    apply(oldImage, patch, 1460);
+    unsigned long elapsed = micros() - started;
+    best = elapsed < best ? elapsed : best;
+  }
+  printf("BENCH %u-byte image, small change: %u-byte patch (%.1f%% of the image), applied at %.0f MB/s "
+         "in 1460-byte pieces (source hash included)\n",
+         (unsigned)newImage.size(), (unsigned)patch.size(), 100.0 * patch.size() / newImage.size(),
+         newImage.size() / (double)best);
+  TEST_ASSERT_TRUE(patch.size() < newImage.size() / 20);
+}
+
+static void test_identical_and_unrelated_images()
+{
+  std::string same = makePatch(oldImage, oldImage);
+  TEST_ASSERT_LESS_THAN(DeltaPatch::HEADER_SIZE + 16, same.size());
+  Applied applied = apply(oldImage, same, 1460);
+  TEST_ASSERT_TRUE(applied.finished);
+  TEST_ASSERT_TRUE(applied.target == oldImage);
+
+  // Nothing in common: all INSERT, a little larger than the image.
+  std::string other = randomBytes(IMAGE_SIZE / 4, 99);
+  std::string unrelated = makePatch(oldImage, other);
+  TEST_ASSERT_LESS_THAN(other.size() + DeltaPatch::HEADER_SIZE + 64, unrelated.size());
+  applied = apply(oldImage, unrelated, 1460);
+  TEST_ASSERT_TRUE(applied.finished);
+  TEST_ASSERT_TRUE(applied.target == other);
+  printf("BENCH identical images: %u-byte patch; unrelated %u-byte image: %u-byte patch\n", (unsigned)same.size(),
+         (unsigned)other.size(), (unsigned)unrelated.size());
+}
+
+// A download that stops early: nothing is wrong yet, but the patch is not
+// finished, and what was written is the start of the new image.
+static void test_truncated_patch()
+{
+  for (size_t length = 0; length < patch.size(); length += length < 64 ? 1 : patch.size() / 300)
+  {
+    Applied applied = apply(oldImage, patch.substr(0, length), 1460);
+    TEST_ASSERT_EQUAL(DeltaOk, applied.error);
+    TEST_ASSERT_FALSE(applied.finished);
+    TEST_ASSERT_FALSE(applied.outOfRange);
+    TEST_ASSERT_TRUE(applied.target == newImage.substr(0, applied.target.size()));
+  }
+  // Only END missing.
+  Applied applied = apply(oldImage, patch.substr(0, patch.size() - 1), 1460);
+  TEST_ASSERT_FALSE(applied.finished);
+  TEST_ASSERT_TRUE(applied.target == newImage);
+}
+
+static std::string varint(uint32_t value)
+{
+  std::string bytes;
+  for (; value >= 0x80; value >>= 7)
+  {
+    bytes += (char)(0x80 | (value & 0x7f));
+  }
+  return bytes + (char)value;
+}
+
+static void expectError(DeltaError expected, const std::string &patchData)
+{
+  Applied applied = apply(oldImage, patchData, 1460);
+  TEST_ASSERT_EQUAL(expected, applied.error);
+  TEST_ASSERT_FALSE(applied.finished);
+  TEST_ASSERT_FALSE(applied.outOfRange);
+}
+
+static void test_corrupt_header()
+{
+  std::string bad = patch;
+  bad[0] = 'X';
+  expectError(DeltaBadHeader, bad);
+  bad = patch;
+  bad[4] = 2; // version
+  expectError(DeltaBadHeader, bad);
+  bad = patch;
+  bad[16] ^= 1; // source SHA-256: a patch for another running image
+  expectError(DeltaRejected, bad);
+  bad = patch;
+  bad[8] += 1; // source size
+  expectError(DeltaRejected, bad);
+  bad = patch;
+  bad[13] -= 1; // target size 256 bytes short
+  expectError(DeltaOutOfRange, bad);
+  bad = patch;
+  bad[13] += 1; // target size 256 bytes long: END comes too early
+  expectError(DeltaOutOfRange, bad);
+}
+
+static void test_corrupt_operations()
+{
+  const size_t first = DeltaPatch::HEADER_SIZE;
+  std::string header = patch.substr(0, first);
+  expectError(DeltaBadOperation, header + '\x07');
+  expectError(DeltaOutOfRange, header + '\x00');
+  // A varint longer than 32 bits.
+  expectError(DeltaBadOperation, header + std::string("\x02\xff\xff\xff\xff\x7f", 6));
+  // COPY past the end of the source.
+  expectError(DeltaOutOfRange, header + '\x01' + varint(oldImage.size() - 10) + varint(32));
+  // Bytes after END.
+  Applied applied = apply(oldImage, patch + '\x00', 1460);
+  TEST_ASSERT_EQUAL(DeltaTrailingData, applied.error);
+}
+
+// Random byte flips past the header. DeltaPatch either stops with an error
+// or finishes with the right length; it never reads outside the source or
+// writes past the target. A finished but wrong image is what firmwareSha256
+// is checked for.
+static void test_random_corruption()
+{
+  uint32_t seed = 12345;
+  int failed = 0;
+  int wrongImage = 0;
+  for (int trial = 0; trial < CORRUPTION_TRIALS; trial++)
+  {
+    seed = seed * 1664525 + 1013904223;
+    size_t offset = DeltaPatch::HEADER_SIZE + (seed >> 8) % (patch.size() - DeltaPatch::HEADER_SIZE);
+    std::string bad = patch;
+    bad[offset] ^= (char)(1 << (seed & 7));
+    Applied applied = apply(oldImage, bad, 1460);
+    TEST_ASSERT_FALSE(applied.outOfRange);
+    if (applied.finished)
+    {
+      TEST_ASSERT_EQUAL(newImage.size(), applied.target.size());
+      wrongImage += applied.target == newImage ? 0 : 1;
+    }
+    else
+    {
+      failed++;
+    }
+  }
+  printf("BENCH %d single-bit corruptions: %d stopped by DeltaPatch, %d finished with a wrong image "
+         "(caught by firmwareSha256), %d harmless\n",
+         CORRUPTION_TRIALS, failed, wrongImage, CORRUPTION_TRIALS - failed - wrongImage);
+}
+
+int main(int argc, char **argv)
+{
+  snprintf(basePath, sizeof(basePath), "/tmp/test-delta-%d", (int)getpid());
+  oldImage = randomBytes(IMAGE_SIZE, 0x2545f491);
+  newImage = edited(oldImage);
+  UNITY_BEGIN();
+  RUN_TEST(test_round_trip);
+  RUN_TEST(test_identical_and_unrelated_images);
+  RUN_TEST(test_truncated_patch);
+  RUN_TEST(test_corrupt_header);
+  RUN_TEST(test_corrupt_operations);
+  RUN_TEST(test_random_corruption);
+  return UNITY_END();
+}
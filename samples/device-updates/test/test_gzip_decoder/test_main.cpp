@@ -0,0 +1,241 @@
+#include <Arduino.h>
+#include <GzipDecoder.h>
+#include <string.h>
+#include <string>
+#include <zlib.h>
+#include <unity.h>
+
+// GzipDecoder against zlib: streams compressed the way `yarn firmwareCompress`
+// does (zlib level 9, memLevel 9) inflated in download-sized pieces, broken
+// streams, and decompression MB/s next to zlib's inflate().
+//
+//   pio test -e native -f test_gzip_decoder -v
+
+const size_t IMAGE_SIZE = 1024 * 1024;
+const int ROUNDS = 5;
+
+static std::string image;
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+// Something with the redundancy of a firmware image: instruction words
+// from a small set with varying operands, runs of 0xFF padding, and string
+// tables.
+static std::string firmwareLike(size_t size)
+{
+  static const char *strings[] = {"WiFi connected", "MQTT connect failed, rc=%d", "Downloading firmware from %s",
+                                  "E (%u) esp_image: Checksum failed", "nvs_flash_init", "heap_caps_malloc"};
+  std::string data;
+  uint32_t state = 0x2545f491;
+  while (data.size() < size)
+  {
+    state = state * 1664525 + 1013904223;
+    uint32_t kind = state >> 28;
+    if (kind < 11)
+    {
+      for (int i = 0; i < 16; i++)
+      {
+        state = state * 1664525 + 1013904223;
+        uint32_t word = (0x00400000 + ((state >> 24) & 0x3f) * 0x01000000) | ((state >> 8) & 0x0fff);
+        data.append((const char *)&word, 4);
+      }
+    }
+    else if (kind < 13)
+    {
+      data.append(64 + (state & 0xff), (char)0xff);
+    }
+    else
+    {
+      data += strings[(state >> 8) % 6];
+      data += '\0';
+    }
+  }
+  data.resize(size);
+  return data;
+}
+
+static std::string gzip(const std::string &data, int windowBits)
+{
+  z_stream z = {};
+  TEST_ASSERT_EQUAL(Z_OK, deflateInit2(&z, 9, Z_DEFLATED, 16 + windowBits, 9, Z_DEFAULT_STRATEGY));
+  std::string out(deflateBound(&z, data.size()), '\0');
+  z.next_in = (Bytef *)data.data();
+  z.avail_in = data.size();
+  z.next_out = (Bytef *)&out[0];
+  z.avail_out = out.size();
+  TEST_ASSERT_EQUAL(Z_STREAM_END, deflate(&z, Z_FINISH));
+  out.resize(z.total_out);
+  deflateEnd(&z);
+  return out;
+}
+
+static bool append(void *context, const uint8_t *data, size_t length)
+{
+  ((std::string *)context)->append((const char *)data, length);
+  return true;
+}
+
+struct Inflated
+{
+  std::string data;
+  bool finished;
+  GzipError error;
+};
+
+static Inflated inflateInPieces(const std::string &compressed, size_t pieceSize)
+{
+  Inflated inflated;
+  GzipDecoder decoder(append, &inflated.data);
+  const uint8_t *data = (const uint8_t *)compressed.data();
+  for (size_t offset = 0; offset < compressed.size(); offset += pieceSize)
+  {
+    size_t n = compressed.size() - offset < pieceSize ? compressed.size() - offset : pieceSize;
+    if (!decoder.write(data + offset, n))
+    {
+      break;
+    }
+  }
+  inflated.finished = decoder.finished();
+  inflated.error = decoder.error();
+  return inflated;
+}
+
+static void test_round_trip()
+{
+  std::string compressed = gzip(image, 13);
+  const size_t pieces[] = {1, 7, 1460, 4096, compressed.size()};
+  for (size_t pieceSize : pieces)
+  {
+    Inflated inflated = inflateInPieces(compressed, pieceSize);
+    TEST_ASSERT_EQUAL(GzipOk, inflated.error);
+    TEST_ASSERT_TRUE(inflated.finished);
+    TEST_ASSERT_TRUE(inflated.data == image);
+  }
+  // A stream of nothing, and stored blocks (level 0).
+  Inflated inflated = inflateInPieces(gzip(std::string(), 13), 1460);
+  TEST_ASSERT_TRUE(inflated.finished);
+  TEST_ASSERT_EQUAL(0, inflated.data.size());
+  z_stream z = {};
+  TEST_ASSERT_EQUAL(Z_OK, deflateInit2(&z, 0, Z_DEFLATED, 16 + 13, 9, Z_DEFAULT_STRATEGY));
+  std::string stored(deflateBound(&z, 100000), '\0');
+  z.next_in = (Bytef *)image.data();
+  z.avail_in = 100000;
+  z.next_out = (Bytef *)&stored[0];
+  z.avail_out = stored.size();
+  TEST_ASSERT_EQUAL(Z_STREAM_END, deflate(&z, Z_FINISH));
+  stored.resize(z.total_out);
+  deflateEnd(&z);
+  inflated = inflateInPieces(stored, 1460);
+  TEST_ASSERT_TRUE(inflated.finished);
+  TEST_ASSERT_TRUE(inflated.data == image.substr(0, 100000));
+}
+
+static void test_broken_streams()
+{
+  std::string compressed = gzip(image.substr(0, 200000), 13);
+  // Cut short: no error yet, not finished.
+  Inflated inflated = inflateInPieces(compressed.substr(0, compressed.size() / 2), 1460);
+  TEST_ASSERT_EQUAL(GzipOk, inflated.error);
+  TEST_ASSERT_FALSE(inflated.finished);
+  TEST_ASSERT_TRUE(inflated.data == image.substr(0, inflated.data.size()));
+
+  std::string bad = compressed;
+  bad[0] = 0;
+  TEST_ASSERT_EQUAL(GzipBadHeader, inflateInPieces(bad, 1460).error);
+  bad = compressed;
+  bad[bad.size() - 8] ^= 1; // CRC-32
+  TEST_ASSERT_EQUAL(GzipBadTrailer, inflateInPieces(bad, 1460).error);
+  bad = compressed;
+  bad[bad.size() - 1] ^= 1; // size
+  TEST_ASSERT_EQUAL(GzipBadTrailer, inflateInPieces(bad, 1460).error);
+  TEST_ASSERT_EQUAL(GzipTrailingData, inflateInPieces(compressed + "x", 1460).error);
+
+  // Matches further back than the decoder's window.
+  std::string far = image.substr(0, 4 * GZIP_INFLATE_WINDOW);
+  far += far;
+  TEST_ASSERT_EQUAL(GzipWindowTooSmall, inflateInPieces(gzip(far, 15), 1460).error);
+}
+
+// Best of ROUNDS, in microseconds.
+template <typename Run>
+static unsigned long bestOf(Run run)
+{
+  unsigned long best = ~0UL;
+  for (int i = 0; i < ROUNDS; i++)
+  {
+    unsigned long started = micros();
+    run();
+    unsigned long elapsed = micros() - started;
+    best = elapsed < best ? elapsed : best;
+  }
+  return best;
+}
+
+static void test_decompression_speed()
+{
+  printf("BENCH %u KB firmware-like image, decoder window %u bytes\n", (unsigned)(image.size() / 1024),
+         (unsigned)GZIP_INFLATE_WINDOW);
+  for (int windowBits = 9; windowBits <= 13; windowBits++)
+  {
+    std::string compressed = gzip(image, windowBits);
+    static std::string sink;
+    sink.reserve(image.size());
+    unsigned long decoderUs = bestOf(
+        [&]()
+        {
+          sink.clear();
+          GzipDecoder decoder(append, &sink);
+          const uint8_t *data = (const uint8_t *)compressed.data();
+          for (size_t offset = 0; offset < compressed.size(); offset += 1460)
+          {
+            size_t n = compressed.size() - offset < 1460 ? compressed.size() - offset : 1460;
+            decoder.write(data + offset, n);
+          }
+          TEST_ASSERT_TRUE(decoder.finished());
+        });
+    TEST_ASSERT_TRUE(sink == image);
+    unsigned long zlibUs = bestOf(
+        [&]()
+        {
+          static uint8_t out[4096];
+          z_stream z = {};
+          inflateInit2(&z, 16 + windowBits);
+          z.next_in = (Bytef *)compressed.data();
+          int status = Z_OK;
+          size_t fed = 0;
+          while (status == Z_OK)
+          {
+            if (z.avail_in == 0)
+            {
+              z.avail_in = compressed.size() - fed < 1460 ? compressed.size() - fed : 1460;
+              fed += z.avail_in;
+            }
+            z.next_out = out;
+            z.avail_out = sizeof(out);
+            status = inflate(&z, Z_NO_FLUSH);
+          }
+          TEST_ASSERT_EQUAL(Z_STREAM_END, status);
+          inflateEnd(&z);
+        });
+    printf("BENCH windowBits %2d: compressed to %6u bytes (%4.1f%%), GzipDecoder %5.1f MB/s out "
+           "(%4.1f MB/s in), zlib inflate %5.1f MB/s out\n",
+           windowBits, (unsigned)compressed.size(), 100.0 * compressed.size() / image.size(),
+           image.size() / (double)decoderUs, compressed.size() / (double)decoderUs, image.size() / (double)zlibUs);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  image = firmwareLike(IMAGE_SIZE);
+  UNITY_BEGIN();
+  RUN_TEST(test_round_trip);
+  RUN_TEST(test_broken_streams);
+  RUN_TEST(test_decompression_speed);
+  return UNITY_END();
+}
@@ -0,0 +1,147 @@
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <unity.h>
+
+// scheduleJob() from the sketch (src/main.cpp, see [env:native_loop]) on job
+// executions from 300 bytes up to what fits the MQTT read buffer: parse time
+// and peak heap against parsing the whole document into the
+// DynamicJsonDocument(2048) it used before.
+//
+//   pio test -e native_loop -f test_job_parse -v
+
+void scheduleJob(const char *source, char *payload, int length);
+
+const int ROUNDS = 200;
+const size_t SIZES[] = {300, 1024, 2048, 3072, 3900};
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+// A notify-next execution whose job document carries a file manifest (and
+// release notes) besides the fields the sketch uses, grown to `size` bytes.
+static std::string execution(size_t size)
+{
+  std::string head = "{\"timestamp\":1700000000,\"execution\":{\"jobId\":\"job-parse\",\"status\":\"QUEUED\","
+                     "\"queuedAt\":1700000000,\"lastUpdatedAt\":1700000000,\"versionNumber\":1,"
+                     "\"executionNumber\":1,\"jobDocument\":{\"operation\":\"firmwareUpdate\","
+                     "\"firmwareId\":\"v2.0.0\",\"firmwareUrl\":\"https://firmware.native/v2.0.0.bin\","
+                     "\"firmwareSha256\":\"9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08\","
+                     "\"releaseNotes\":\"Fixes and improvements\",\"manifest\":[";
+  std::string tail = "]}}}";
+  std::string manifest;
+  for (int i = 0; head.size() + manifest.size() + tail.size() < size; i++)
+  {
+    char entry[160];
+    snprintf(entry, sizeof(entry), "%s{\"file\":\"part-%d.bin\",\"offset\":%d,\"sha256\":\"%064x\"}",
+             i == 0 ? "" : ",", i, i * 4096, i);
+    manifest += entry;
+  }
+  return head + manifest + tail;
+}
+
+struct Parse
+{
+  bool ok;
+  const char *error;
+  double us;
+  size_t peakHeap;
+  size_t memory; // JSON memory
+};
+
+// Runs `parse` on a fresh copy of the payload (ArduinoJson parses in place)
+// ROUNDS times; the copy lives in the MQTT read buffer, so is not counted.
+template <typename ParseOnce>
+static Parse measure(const std::string &payload, ParseOnce parseOnce)
+{
+  static std::vector<char> buffer;
+  {
+    FakeHeapUncounted readBuffer;
+    buffer.resize(payload.size() + 1);
+  }
+  Parse parse = {};
+  for (int round = 0; round < ROUNDS; round++)
+  {
+    memcpy(buffer.data(), payload.c_str(), payload.size() + 1);
+    fakeResetMinFreeHeap();
+    uint32_t freeBefore = ESP.getFreeHeap();
+    parseOnce(buffer.data(), (int)payload.size(), parse);
+    size_t peak = freeBefore - ESP.getMinFreeHeap();
+    parse.peakHeap = peak > parse.peakHeap ? peak : parse.peakHeap;
+  }
+  parse.us /= ROUNDS;
+  return parse;
+}
+
+// scheduleJob() logs its own parse time and JSON memory.
+static void sketchParse(char *payload, int length, Parse &parse)
+{
+  Serial.takeOutput();
+  scheduleJob("notify-next", payload, length);
+  std::string log = Serial.takeOutput();
+  size_t at = log.find("Parsed ");
+  unsigned long us = 0;
+  unsigned memory = 0;
+  parse.ok = at != std::string::npos &&
+             sscanf(log.c_str() + at, "Parsed %*d byte notify-next message in %luus (%u bytes", &us, &memory) == 2;
+  parse.error = parse.ok ? "Ok" : "error";
+  parse.us += us;
+  parse.memory = memory;
+}
+
+// The parse scheduleJob() did before: the whole execution, in a 2 KB pool.
+static void wholeDocumentParse(char *payload, int length, Parse &parse)
+{
+  uint32_t started = micros();
+  DynamicJsonDocument doc(2048);
+  DeserializationError err = deserializeJson(doc, payload, length);
+  const char *jobId = doc["execution"]["jobId"];
+  const char *firmwareUrl = doc["execution"]["jobDocument"]["firmwareUrl"];
+  parse.us += micros() - started;
+  parse.ok = !err && jobId != NULL && firmwareUrl != NULL;
+  parse.error = err.c_str();
+  parse.memory = doc.memoryUsage();
+}
+
+static void test_parse_across_document_sizes()
+{
+  // The first job is scheduled; the ones after it are parsed the same way
+  // and turned away, which keeps job state out of the heap figures.
+  std::string first = execution(SIZES[0]);
+  scheduleJob("notify-next", &first[0], first.size());
+
+  printf("BENCH job execution  whole document, DynamicJsonDocument(2048)   filtered, scheduleJob()\n");
+  for (size_t size : SIZES)
+  {
+    std::string payload = execution(size);
+    Parse whole = measure(payload, wholeDocumentParse);
+    Parse filtered = measure(payload, sketchParse);
+    printf("BENCH %5u bytes      %-9s %6.1f us, heap %5u B, %4u B JSON   %-5s %6.1f us, heap %3u B, %3u B JSON\n",
+           (unsigned)payload.size(), whole.error, whole.us, (unsigned)whole.peakHeap, (unsigned)whole.memory,
+           filtered.error, filtered.us, (unsigned)filtered.peakHeap, (unsigned)filtered.memory);
+    TEST_ASSERT_TRUE(filtered.ok);
+    TEST_ASSERT_TRUE(filtered.memory <= 256);
+    TEST_ASSERT_EQUAL(0, filtered.peakHeap);
+    TEST_ASSERT_TRUE(whole.peakHeap >= 2048);
+  }
+  // Past about 2 KB of manifest the old pool ran out.
+  std::string largest = execution(SIZES[sizeof(SIZES) / sizeof(SIZES[0]) - 1]);
+  TEST_ASSERT_FALSE(measure(largest, wholeDocumentParse).ok);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_parse_across_document_sizes);
+  int failures = UNITY_END();
+  fakeStopTasks();
+  return failures;
+}
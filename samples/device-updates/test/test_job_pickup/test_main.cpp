@@ -0,0 +1,227 @@
+#include <Arduino.h>
+#include <M5Core2.h>
+#include <MQTTClient.h>
+#include <HTTPClient.h>
+#include <WiFi.h>
+#include <algorithm>
+#include <vector>
+#include <unity.h>
+
+// Job pickup latency of the whole sketch (src/main.cpp, see
+// [env:native_loop]): from the broker sending notify-next, or BtnA asking for
+// the next job, to the firmware GET, with the broker stand-in scripted as AWS
+// IoT Jobs and timing the TLS handshake, CONNACK and SUBACKs. And the MQTT
+// session through a download longer than its keep-alive.
+//
+//   pio test -e native_loop -f test_job_pickup -v
+
+void setup();
+void loop();
+extern String JOBS_TOPIC;
+extern MQTTClient mqttClient;
+
+const int RUNS = 5;
+// An ESP32 handshake with AWS IoT, and its CONNACK/SUBACK/PUBACK round trip.
+const uint32_t TLS_HANDSHAKE_MS = 1000;
+const uint32_t BROKER_MS = 50;
+const size_t LONG_IMAGE_SIZE = 200 * 1024;
+const uint32_t SLOW_BYTES_PER_SECOND = 25 * 1000;
+
+static unsigned long requestedAt = 0;
+static std::string queuedJob;  // what a describe ($next/get) returns
+static std::string served;     // the firmware image, 404 when empty
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+static std::string execution(const std::string &jobId)
+{
+  return "{\"execution\":{\"jobId\":\"" + jobId +
+         "\",\"status\":\"QUEUED\",\"jobDocument\":{\"operation\":\"firmwareUpdate\",\"firmwareId\":\"v2.0.0\","
+         "\"firmwareUrl\":\"https://firmware.native/v2.0.0.bin\",\"firmwareSha256\":\"00\"}}}";
+}
+
+template <typename Done>
+static bool loopUntil(uint32_t ms, Done done)
+{
+  unsigned long until = millis() + ms;
+  while (!done() && (long)(millis() - until) < 0)
+  {
+    loop();
+  }
+  return done();
+}
+
+static bool jobEnded(const std::string &jobId)
+{
+  for (const FakeMessage &message : fakeBroker.published(std::string(JOBS_TOPIC.c_str()) + "/" + jobId + "/update"))
+  {
+    if (message.payload.find("FAILED") != std::string::npos)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+struct Pickup
+{
+  unsigned long medianMs;
+  unsigned long worstMs;
+  uint32_t reconnects;
+};
+
+enum Trigger
+{
+  ReconnectToSubscribe,
+  Push,
+  Describe,
+};
+
+// Hands RUNS jobs to the sketch one after the other. The firmware GET gets
+// a 404, so each job ends right after its download starts.
+static Pickup pickUp(const char *name, Trigger trigger)
+{
+  std::vector<unsigned long> latencies;
+  uint32_t connectsBefore = fakeBroker.connects();
+  for (int run = 0; run < RUNS; run++)
+  {
+    std::string jobId = std::string("job-") + name + "-" + std::to_string(run);
+    // A refused SUBACK sends the sketch down its reconnect path: what
+    // StartUpdate did for every job before it subscribed on the open session.
+    fakeBroker.refuseSubscribes(trigger == ReconnectToSubscribe ? 1 : 0);
+    requestedAt = 0;
+    unsigned long sentAt = millis();
+    if (trigger == Describe)
+    {
+      queuedJob = jobId;
+      M5.BtnA.fakeRelease();
+    }
+    else
+    {
+      fakeBroker.send(std::string(JOBS_TOPIC.c_str()) + "/notify-next", execution(jobId));
+    }
+    TEST_ASSERT_TRUE(loopUntil(10000, []() { return requestedAt != 0; }));
+    latencies.push_back(requestedAt - sentAt);
+    queuedJob.clear();
+    TEST_ASSERT_TRUE(loopUntil(5000, [&]() { return jobEnded(jobId); }));
+  }
+  std::sort(latencies.begin(), latencies.end());
+  return {latencies[RUNS / 2], latencies.back(), fakeBroker.connects() - connectsBefore};
+}
+
+static void test_connects()
+{
+  std::string log;
+  TEST_ASSERT_TRUE(loopUntil(10000,
+                             [&log]()
+                             {
+                               log += Serial.takeOutput();
+                               return log.find("no job to execute") != std::string::npos;
+                             }));
+}
+
+static void test_notify_to_download_latency()
+{
+  Pickup before = pickUp("reconnect", ReconnectToSubscribe);
+  Pickup after = pickUp("subscribe", Push);
+  Pickup describe = pickUp("describe", Describe);
+  printf("BENCH job to firmware GET, TLS handshake %u ms, broker round trip %u ms:\n", TLS_HANDSHAKE_MS, BROKER_MS);
+  printf("BENCH   notify-next, reconnect to subscribe (before): median %4lu ms, worst %4lu ms, %u reconnects for %d "
+         "jobs\n",
+         before.medianMs, before.worstMs, before.reconnects, RUNS);
+  printf("BENCH   notify-next, subscribe on the session (after): median %4lu ms, worst %4lu ms, %u reconnects for %d "
+         "jobs\n",
+         after.medianMs, after.worstMs, after.reconnects, RUNS);
+  printf("BENCH   BtnA describe, from the press:                 median %4lu ms, worst %4lu ms, %u reconnects for %d "
+         "jobs\n",
+         describe.medianMs, describe.worstMs, describe.reconnects, RUNS);
+  printf("BENCH   (all include the firmware server's TLS handshake before the GET)\n");
+  TEST_ASSERT_EQUAL(RUNS, before.reconnects);
+  TEST_ASSERT_EQUAL(0, after.reconnects);
+  TEST_ASSERT_EQUAL(0, describe.reconnects);
+  TEST_ASSERT_TRUE(after.medianMs + TLS_HANDSHAKE_MS <= before.medianMs + BROKER_MS);
+  // The describe costs a round trip to the broker on top of the push.
+  TEST_ASSERT_TRUE(after.medianMs + BROKER_MS <= describe.medianMs);
+}
+
+// A download longer than one and a half keep-alive periods, with progress
+// reports further apart than that: only the MQTT loop in the download keeps
+// the session, and a job pushed meanwhile is seen (and turned away).
+static void test_session_survives_a_long_download()
+{
+  mqttClient.setKeepAlive(2);
+  served.assign(LONG_IMAGE_SIZE, (char)0x5a);
+  uint32_t connectsBefore = fakeBroker.connects();
+  std::string topic = std::string(JOBS_TOPIC.c_str()) + "/notify-next";
+  unsigned long started = millis();
+  fakeBroker.send(topic, execution("job-long"));
+  fakeBroker.send(topic, execution("job-other"), 4000);
+  std::string log;
+  TEST_ASSERT_TRUE(loopUntil(30000,
+                             [&log]()
+                             {
+                               log += Serial.takeOutput();
+                               return jobEnded("job-long");
+                             }));
+  unsigned long elapsedMs = millis() - started;
+  size_t reports = 0;
+  for (const FakeMessage &message : fakeBroker.published(std::string(JOBS_TOPIC.c_str()) + "/job-long/update"))
+  {
+    reports += message.qos == 0 ? 1 : 0;
+  }
+  printf("BENCH %u KB at %u KB/s with a 2 s keep-alive: job done in %lu ms, %u progress reports, %u reconnects\n",
+         (unsigned)(LONG_IMAGE_SIZE / 1024), SLOW_BYTES_PER_SECOND / 1000, elapsedMs, (unsigned)reports,
+         fakeBroker.connects() - connectsBefore);
+  mqttClient.setKeepAlive(10);
+  served.clear();
+  TEST_ASSERT_EQUAL(0, fakeBroker.connects() - connectsBefore);
+  size_t ignored = log.find("ignoring jobId=job-other");
+  TEST_ASSERT_TRUE(ignored != std::string::npos);
+  TEST_ASSERT_TRUE(ignored < log.find("OTA pipeline:"));
+  // Coalesced: one report per JOB_PROGRESS_INTERVAL_MS, not one per read.
+  TEST_ASSERT_TRUE(reports <= elapsedMs / 5000 + 1);
+}
+
+int main(int argc, char **argv)
+{
+  FakeNetworkSettings network;
+  network.joinMs = 0;
+  network.tlsHandshakeMs = TLS_HANDSHAKE_MS;
+  fakeNetworkConfigure(network);
+  FakeBrokerSettings broker;
+  broker.connackMs = BROKER_MS;
+  broker.pubackMs = BROKER_MS;
+  fakeBroker.configure(broker);
+  std::string jobs = JOBS_TOPIC.c_str();
+  fakeBroker.respond(jobs + "/$next/get", [jobs](FakeBroker &broker, const FakeMessage &message)
+                     {
+                       std::string reply = queuedJob.empty() ? "{\"timestamp\":1700000000}" : execution(queuedJob);
+                       broker.send(jobs + "/$next/get/accepted", reply, BROKER_MS);
+                     });
+  fakeBroker.respond(jobs + "/+/update", [](FakeBroker &broker, const FakeMessage &message)
+                     { broker.send(message.topic + "/accepted", "{\"timestamp\":1700000000}", BROKER_MS); });
+  fakeHttpServe(
+      [](const FakeHttpRequest &request)
+      {
+        requestedAt = millis();
+        FakeHttpResponse response;
+        response.status = served.empty() ? 404 : 200;
+        response.body = served;
+        response.bytesPerSecond = SLOW_BYTES_PER_SECOND;
+        return response;
+      });
+  setup();
+  UNITY_BEGIN();
+  RUN_TEST(test_connects);
+  RUN_TEST(test_notify_to_download_latency);
+  RUN_TEST(test_session_survives_a_long_download);
+  int failures = UNITY_END();
+  fakeStopTasks();
+  return failures;
+}
@@ -0,0 +1,166 @@
+#include <Arduino.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <unity.h>
+
+// Runs `yarn otaFleetSim` (samples/otaFleetSim.ts) with small fleets and
+// checks its report: every job accounted for, broker traffic that matches
+// the device-updates job flow message for message, interrupted downloads
+// resumed, and the firmware server's connection limit respected. Needs Node
+// and `yarn install` at the repository root.
+//
+//   pio test -e native -f test_ota_fleet_sim -v
+
+// Run from the project directory, as `pio test` does.
+#ifndef OTA_FLEET_SIM_COMMAND
+#define OTA_FLEET_SIM_COMMAND "yarn --silent --cwd ../.. otaFleetSim"
+#endif
+
+const int DEVICES = 50;
+// 64 KB at 256 KB/s: a quarter of a second per download.
+const char *SMALL_FLEET = " --devices=50 --firmwareSize=65536 --bandwidth=262144 --connectSpreadMs=200";
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+struct SimReport
+{
+  int succeeded = -1;
+  int failed = -1;
+  int retried = -1;
+  int messages = -1;
+  std::map<std::string, int> kinds; // broker messages by kind
+  int requests = -1;
+  int rejected = -1;
+  int concurrencyPeak = -1;
+  int serverConnections = -1;
+  std::string text;
+
+  int kind(const char *name) const
+  {
+    auto found = kinds.find(name);
+    return found == kinds.end() ? 0 : found->second;
+  }
+};
+
+static SimReport simulate(const std::string &flags)
+{
+  SimReport report;
+  std::string command = std::string(OTA_FLEET_SIM_COMMAND) + flags;
+  FILE *sim = popen(command.c_str(), "r");
+  TEST_ASSERT_NOT_NULL(sim);
+  char line[1024];
+  while (fgets(line, sizeof(line), sim) != NULL)
+  {
+    report.text += line;
+    float mean;
+    sscanf(line, "Jobs: %d succeeded, %d failed, %d needed a job retry", &report.succeeded, &report.failed,
+           &report.retried);
+    sscanf(line, "Downloads: %d requests, %d rejected with 503, concurrency %f mean / %d peak (limit %d)",
+           &report.requests, &report.rejected, &mean, &report.concurrencyPeak, &report.serverConnections);
+    if (sscanf(line, "Broker: %d messages", &report.messages) == 1)
+    {
+      // ... (describe=500 describe-accepted=500 ...)
+      const char *counts = strchr(line, '(');
+      char name[32];
+      int count, used;
+      while (counts != NULL && sscanf(counts + 1, "%31[a-z-]=%d%n", name, &count, &used) == 2)
+      {
+        report.kinds[name] = count;
+        counts += used + 1;
+      }
+    }
+  }
+  if (pclose(sim) != 0 || report.succeeded < 0 || report.requests < 0 || report.kinds.empty())
+  {
+    printf("%s", report.text.c_str());
+    TEST_FAIL_MESSAGE("`" OTA_FLEET_SIM_COMMAND "` failed; run `yarn install` at the repository root");
+  }
+  return report;
+}
+
+// What holds for any run: each device asks once on connect, and every
+// pickup (the first push and each job retry) is one subscribe, IN_PROGRESS
+// and a final status, each answered.
+static void checkAccounting(const SimReport &report)
+{
+  TEST_ASSERT_EQUAL(DEVICES, report.succeeded + report.failed);
+  TEST_ASSERT_EQUAL(DEVICES, report.kind("describe"));
+  TEST_ASSERT_EQUAL(DEVICES, report.kind("describe-accepted"));
+  int pickups = report.kind("notify-next");
+  TEST_ASSERT_EQUAL(pickups, report.kind("subscribe"));
+  TEST_ASSERT_EQUAL(2 * pickups, report.kind("update"));
+  TEST_ASSERT_EQUAL(report.kind("update") + report.kind("progress"), report.kind("update-accepted"));
+  TEST_ASSERT_EQUAL(0, report.kind("update-rejected"));
+  int total = 0;
+  for (const auto &kind : report.kinds)
+  {
+    total += kind.second;
+  }
+  TEST_ASSERT_EQUAL(report.messages, total);
+  TEST_ASSERT_TRUE(report.requests >= pickups);
+  TEST_ASSERT_TRUE(report.concurrencyPeak <= report.serverConnections);
+}
+
+static void test_clean_rollout()
+{
+  SimReport report = simulate(std::string(SMALL_FLEET) + " --dropRate=0 --serverConnections=100");
+  checkAccounting(report);
+  TEST_ASSERT_EQUAL(DEVICES, report.succeeded);
+  TEST_ASSERT_EQUAL(0, report.retried);
+  // One push, one GET and eight messages per device.
+  TEST_ASSERT_EQUAL(DEVICES, report.kind("notify-next"));
+  TEST_ASSERT_EQUAL(DEVICES, report.requests);
+  TEST_ASSERT_EQUAL(0, report.rejected);
+  TEST_ASSERT_EQUAL(8 * DEVICES, report.messages);
+}
+
+// Half the downloads are cut off somewhere: they resume (more requests),
+// and within OTA_MAX_REQUESTS nearly every job still succeeds first time.
+static void test_dropped_downloads_resume()
+{
+  SimReport report = simulate(std::string(SMALL_FLEET) + " --dropRate=0.5 --backoffMs=10 --maxBackoffMs=50");
+  checkAccounting(report);
+  TEST_ASSERT_EQUAL(DEVICES, report.succeeded);
+  // About 1.5 each: a cut in the last 16 KB write still completes.
+  TEST_ASSERT_TRUE(report.requests > DEVICES * 11 / 10);
+  TEST_ASSERT_TRUE(report.requests <= DEVICES * 10);
+}
+
+// Fifty devices at once against five download slots: 503s fail jobs, which
+// are queued again; spreading the rollout over five seconds avoids most of it.
+static void test_server_limit_and_rollout_spread()
+{
+  SimReport burst = simulate(std::string(SMALL_FLEET) + " --dropRate=0 --serverConnections=5 --rolloutMs=0");
+  checkAccounting(burst);
+  TEST_ASSERT_TRUE(burst.rejected > 0);
+  TEST_ASSERT_TRUE(burst.retried > 0);
+  // Nothing is interrupted: one GET per pickup, and every pickup that did
+  // not end the job with SUCCEEDED was turned away.
+  TEST_ASSERT_EQUAL(burst.kind("notify-next"), burst.requests);
+  TEST_ASSERT_EQUAL(burst.requests - burst.succeeded, burst.rejected);
+
+  SimReport spread = simulate(std::string(SMALL_FLEET) + " --dropRate=0 --serverConnections=5 --rolloutMs=5000");
+  checkAccounting(spread);
+  printf("BENCH %d devices, 5 download slots: rollout at once %d requests, %d rejected, %d job retries, %d "
+         "failed; over 5 s %d requests, %d rejected, %d job retries, %d failed\n",
+         DEVICES, burst.requests, burst.rejected, burst.retried, burst.failed, spread.requests, spread.rejected,
+         spread.retried, spread.failed);
+  TEST_ASSERT_TRUE(spread.rejected < burst.rejected);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_clean_rollout);
+  RUN_TEST(test_dropped_downloads_resume);
+  RUN_TEST(test_server_limit_and_rollout_spread);
+  return UNITY_END();
+}
@@ -0,0 +1,232 @@
+#include <Arduino.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+#include <OtaWriter.h>
+#include <string.h>
+#include <string>
+#include <unity.h>
+
+// OtaWriter digests and resume, and what hashing each sector on its way to
+// flash costs per MB next to the flash writes themselves and to the read-back
+// pass it replaces.
+//
+//   pio test -e native -f test_ota_writer -v
+
+const size_t IMAGE_SIZE = 4 * 1024 * 1024 + 1000;
+// What an HTTP read hands to write() in downloadFirmware().
+const size_t CHUNK_SIZE = 1460;
+const int ROUNDS = 5;
+
+static std::string image;
+
+void setUp()
+{
+  fakeFlashReset();
+  fakeFlashTiming(FakeFlashTiming());
+}
+
+void tearDown()
+{
+}
+
+static void sha256(const uint8_t *data, size_t length, uint8_t digest[32])
+{
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  mbedtls_sha256_update(&sha, data, length);
+  mbedtls_sha256_finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+}
+
+// Writes image[from, to) in CHUNK_SIZE pieces.
+static void writeRange(OtaWriter &writer, size_t from, size_t to)
+{
+  const uint8_t *data = (const uint8_t *)image.data();
+  for (size_t offset = from; offset < to; offset += CHUNK_SIZE)
+  {
+    size_t n = to - offset < CHUNK_SIZE ? to - offset : CHUNK_SIZE;
+    TEST_ASSERT_TRUE(writer.write(data + offset, n));
+  }
+}
+
+static void expectImageDigest(OtaWriter &writer)
+{
+  uint8_t expected[32];
+  uint8_t actual[32];
+  sha256((const uint8_t *)image.data(), image.size(), expected);
+  TEST_ASSERT_TRUE(writer.complete(actual));
+  TEST_ASSERT_EQUAL_MEMORY(expected, actual, 32);
+  std::string written = fakeFlashContents(esp_ota_get_next_update_partition(nullptr), image.size());
+  TEST_ASSERT_TRUE(written == image);
+}
+
+static void test_digest_is_the_image_sha256()
+{
+  OtaWriter writer;
+  TEST_ASSERT_TRUE(writer.begin(image.size(), 0));
+  writeRange(writer, 0, image.size());
+  expectImageDigest(writer);
+  const esp_partition_t *target = esp_ota_get_next_update_partition(nullptr);
+  TEST_ASSERT_TRUE(writer.activate());
+  TEST_ASSERT_EQUAL_PTR(target, esp_ota_get_boot_partition());
+}
+
+static void test_digest_after_a_dropped_connection()
+{
+  OtaWriter writer;
+  TEST_ASSERT_TRUE(writer.begin(image.size(), 0));
+  writeRange(writer, 0, 1000 * 1000);
+  // The partial sector in RAM is lost; the download goes on from committed().
+  size_t resumeAt = writer.committed();
+  TEST_ASSERT_EQUAL(0, resumeAt % OtaWriter::SECTOR_SIZE);
+  FakeFlashStats before = fakeFlashStats();
+  TEST_ASSERT_TRUE(writer.begin(image.size(), resumeAt));
+  TEST_ASSERT_EQUAL(before.reads, fakeFlashStats().reads);
+  writeRange(writer, resumeAt, image.size());
+  expectImageDigest(writer);
+}
+
+static void test_digest_after_a_reboot()
+{
+  {
+    OtaWriter writer;
+    TEST_ASSERT_TRUE(writer.begin(image.size(), 0));
+    writeRange(writer, 0, 2 * 1000 * 1000);
+  }
+  // A new writer, as after a reboot, rebuilds the hash from flash.
+  size_t resumeAt = 2 * 1000 * 1000 / OtaWriter::SECTOR_SIZE * OtaWriter::SECTOR_SIZE;
+  OtaWriter writer;
+  TEST_ASSERT_TRUE(writer.begin(image.size(), resumeAt));
+  TEST_ASSERT_EQUAL(resumeAt / OtaWriter::SECTOR_SIZE, fakeFlashStats().reads);
+  writeRange(writer, resumeAt, image.size());
+  expectImageDigest(writer);
+}
+
+static void test_rejects_bad_sizes()
+{
+  OtaWriter writer;
+  TEST_ASSERT_FALSE(writer.begin(0, 0));
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, writer.error());
+  TEST_ASSERT_FALSE(writer.begin(image.size(), 100));
+  TEST_ASSERT_FALSE(writer.begin(esp_ota_get_next_update_partition(nullptr)->size + 1, 0));
+
+  TEST_ASSERT_TRUE(writer.begin(10, 0));
+  uint8_t data[11] = {};
+  TEST_ASSERT_FALSE(writer.write(data, sizeof(data)));
+  uint8_t digest[32];
+  TEST_ASSERT_FALSE(writer.complete(digest));
+  TEST_ASSERT_FALSE(writer.activate());
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, writer.error());
+}
+
+// Best of ROUNDS, in ms per MB of image.
+template <typename Run>
+static double msPerMb(Run run)
+{
+  unsigned long best = ~0UL;
+  for (int i = 0; i < ROUNDS; i++)
+  {
+    fakeFlashReset();
+    unsigned long started = micros();
+    run();
+    unsigned long elapsed = micros() - started;
+    best = elapsed < best ? elapsed : best;
+  }
+  return best / 1000.0 / (image.size() / 1e6);
+}
+
+static void test_hashing_overhead()
+{
+  const esp_partition_t *partition = esp_ota_get_next_update_partition(nullptr);
+  const uint8_t *data = (const uint8_t *)image.data();
+  static uint8_t sector[OtaWriter::SECTOR_SIZE];
+
+  // Erase and write sector by sector, as OtaWriter does, without the hash.
+  double flashOnly = msPerMb(
+      [&]()
+      {
+        for (size_t offset = 0; offset < image.size(); offset += sizeof(sector))
+        {
+          size_t n = image.size() - offset < sizeof(sector) ? image.size() - offset : sizeof(sector);
+          memcpy(sector, data + offset, n);
+          esp_partition_erase_range(partition, offset, sizeof(sector));
+          esp_partition_write(partition, offset, sector, (n + 15) & ~(size_t)15);
+        }
+      });
+  double writer = msPerMb(
+      [&]()
+      {
+        OtaWriter ota;
+        ota.begin(image.size(), 0);
+        writeRange(ota, 0, image.size());
+        uint8_t digest[32];
+        ota.complete(digest);
+      });
+  double hashOnly = msPerMb(
+      [&]()
+      {
+        uint8_t digest[32];
+        sha256(data, image.size(), digest);
+      });
+  // The alternative: write without hashing, then read the partition back.
+  double readBack = msPerMb(
+      [&]()
+      {
+        mbedtls_sha256_context sha;
+        mbedtls_sha256_init(&sha);
+        mbedtls_sha256_starts(&sha, 0);
+        for (size_t offset = 0; offset < image.size(); offset += sizeof(sector))
+        {
+          size_t n = image.size() - offset < sizeof(sector) ? image.size() - offset : sizeof(sector);
+          esp_partition_read(partition, offset, sector, n);
+          mbedtls_sha256_update(&sha, sector, n);
+        }
+        uint8_t digest[32];
+        mbedtls_sha256_finish(&sha, digest);
+        mbedtls_sha256_free(&sha);
+      });
+
+  printf("BENCH per MB, instant flash: erase+write %.2f ms, OtaWriter (erase+write+SHA-256) %.2f ms, "
+         "SHA-256 alone %.2f ms, read-back pass (read+SHA-256) %.2f ms\n",
+         flashOnly, writer, hashOnly, readBack);
+  printf("BENCH inline hashing adds %.2f ms/MB; a read-back pass would add %.2f ms/MB\n", writer - flashOnly,
+         readBack);
+  TEST_ASSERT_TRUE(writer - flashOnly < readBack * 1.5);
+
+  // Against flash time: the erase and program rates of the ESP32's SPI NOR.
+  FakeFlashTiming timing;
+  timing.eraseSectorUs = 10000;
+  timing.writeKbUs = 250;
+  fakeFlashTiming(timing);
+  fakeFlashReset();
+  OtaWriter ota;
+  const size_t oneMb = 256 * OtaWriter::SECTOR_SIZE;
+  TEST_ASSERT_TRUE(ota.begin(oneMb, 0));
+  unsigned long started = micros();
+  writeRange(ota, 0, oneMb);
+  double flashMs = (micros() - started) / 1000.0;
+  printf("BENCH per MB, erase %u us/sector and program %u us/KB: %.0f ms in flash calls, hashing %.2f ms "
+         "(%.2f%%)\n",
+         timing.eraseSectorUs, timing.writeKbUs, flashMs, hashOnly, hashOnly * 100 / flashMs);
+}
+
+int main(int argc, char **argv)
+{
+  image.resize(IMAGE_SIZE);
+  uint32_t state = 0x12345678;
+  for (char &c : image)
+  {
+    state = state * 1664525 + 1013904223;
+    c = (char)(state >> 24);
+  }
+  image[0] = (char)0xE9; // the app image magic byte activate() checks for
+  UNITY_BEGIN();
+  RUN_TEST(test_digest_is_the_image_sha256);
+  RUN_TEST(test_digest_after_a_dropped_connection);
+  RUN_TEST(test_digest_after_a_reboot);
+  RUN_TEST(test_rejects_bad_sizes);
+  RUN_TEST(test_hashing_overhead);
+  return UNITY_END();
+}
@@ -0,0 +1,239 @@
+#include <Arduino.h>
+#include <WiFi.h>
+#include <HTTPClient.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+#include <random>
+#include <unity.h>
+
+// downloadAndApply() from the sketch (src/main.cpp, see [env:native_loop])
+// against an HTTP server whose link drops at random offsets: with Range
+// requests the download continues from the last checkpoint, without them
+// (a server that ignores Range) it starts again from byte zero. Reports the
+// bytes each needs for the same drops. A response without a Content-Length
+// fails the download instead of writing an image of unknown size.
+//
+//   pio test -e native_loop -f test_resumable_download -v
+
+int downloadAndApply(String url);
+void clearOtaCheckpoint();
+extern String jobId;
+extern String firmwareSha256;
+
+const size_t IMAGE_SIZE = 512 * 1024;
+const int RUNS = 8;          // link seeds per scenario
+const int MAX_REQUESTS = 10; // OTA_MAX_REQUESTS
+
+static std::string image;
+static std::string etag;
+
+// The link: it drops whenever the bytes sent so far pass the next cut.
+// Cuts are exponentially spaced, `meanBytes` apart on average.
+static std::mt19937 random32;
+static std::exponential_distribution<double> gap;
+static uint64_t nextCut = 0;
+static bool rangeSupported = true;
+static uint32_t requests = 0;
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+static void makeImage()
+{
+  FakeHeapUncounted fixture;
+  std::mt19937 bytes(42);
+  image.resize(IMAGE_SIZE);
+  for (char &c : image)
+  {
+    c = (char)bytes();
+  }
+  image[0] = (char)0xe9; // checked by esp_ota_set_boot_partition()
+  unsigned char digest[32];
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  mbedtls_sha256_update(&sha, (const unsigned char *)image.data(), image.size());
+  mbedtls_sha256_finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+  char hex[65];
+  for (int i = 0; i < 32; i++)
+  {
+    sprintf(hex + 2 * i, "%02x", digest[i]);
+  }
+  firmwareSha256 = hex;
+  etag = "\"" + std::string(hex, 16) + "\"";
+}
+
+static FakeHttpResponse serveImage(const FakeHttpRequest &request)
+{
+  requests++;
+  FakeHttpResponse response;
+  response.headers["ETag"] = etag;
+  size_t first = 0;
+  auto range = request.headers.find("Range");
+  auto ifRange = request.headers.find("If-Range");
+  if (rangeSupported && range != request.headers.end() &&
+      (ifRange == request.headers.end() || ifRange->second == etag) &&
+      sscanf(range->second.c_str(), "bytes=%zu-", &first) == 1 && first < image.size())
+  {
+    response.status = HTTP_CODE_PARTIAL_CONTENT;
+    response.headers["Content-Range"] =
+        "bytes " + std::to_string(first) + "-" + std::to_string(image.size() - 1) + "/" + std::to_string(image.size());
+  }
+  else
+  {
+    first = 0;
+  }
+  response.body = image.substr(first);
+  uint64_t sent = fakeHttpStats().bytesReceived;
+  while (nextCut <= sent)
+  {
+    nextCut += (uint64_t)gap(random32) + 1;
+  }
+  response.dropAfter = nextCut - sent;
+  return response;
+}
+
+struct Outcome
+{
+  uint64_t bytes;
+  uint32_t requests;
+  bool completed;
+};
+
+static Outcome download(bool withRange, double meanBytes, uint32_t seed)
+{
+  rangeSupported = withRange;
+  random32.seed(seed);
+  gap = std::exponential_distribution<double>(1.0 / meanBytes);
+  nextCut = 0;
+  fakeHttpReset();
+  fakeHttpServe(serveImage);
+  requests = 0;
+  clearOtaCheckpoint();
+  jobId = "job-" + String(seed);
+  bool completed = downloadAndApply("https://firmware.native/v2.0.0.bin") == 0;
+  if (completed)
+  {
+    const esp_partition_t *target = esp_ota_get_boot_partition();
+    TEST_ASSERT_TRUE(fakeFlashContents(target, image.size()) == image);
+  }
+  return {fakeHttpStats().bytesReceived, requests, completed};
+}
+
+static void test_resumes_after_a_reboot()
+{
+  // The link goes down for good after 300 KB: the attempt gives up but
+  // keeps its checkpoint, and the next attempt (after a reboot, or when the
+  // job comes back) continues from it.
+  rangeSupported = true;
+  fakeHttpReset();
+  clearOtaCheckpoint();
+  jobId = "job-reboot";
+  nextCut = 300 * 1024;
+  gap = std::exponential_distribution<double>(1.0 / 1e12);
+  fakeHttpServe(
+      [](const FakeHttpRequest &request)
+      {
+        FakeHttpResponse response = serveImage(request);
+        if (fakeHttpStats().bytesReceived >= 300 * 1024)
+        {
+          response.dropAfter = 0;
+        }
+        return response;
+      });
+  TEST_ASSERT_EQUAL(1, downloadAndApply("https://firmware.native/v2.0.0.bin"));
+  uint64_t firstAttempt = fakeHttpStats().bytesReceived;
+
+  fakeHttpServe(serveImage);
+  Serial.takeOutput();
+  TEST_ASSERT_EQUAL(0, downloadAndApply("https://firmware.native/v2.0.0.bin"));
+  TEST_ASSERT_TRUE(Serial.takeOutput().find("Resuming firmware download at") != std::string::npos);
+  uint64_t total = fakeHttpStats().bytesReceived;
+  // Only the bytes after the last saved checkpoint are fetched twice.
+  TEST_ASSERT_LESS_OR_EQUAL(IMAGE_SIZE + 64 * 1024, total);
+  printf("BENCH link lost after %u KB, the next attempt fetched %u KB: %u KB in all for a %u KB image\n",
+         (unsigned)(firstAttempt / 1024), (unsigned)((total - firstAttempt) / 1024), (unsigned)(total / 1024),
+         (unsigned)(IMAGE_SIZE / 1024));
+}
+
+static void test_response_without_content_length()
+{
+  fakeHttpReset();
+  fakeHttpServe([](const FakeHttpRequest &request)
+                {
+                  requests++;
+                  FakeHttpResponse response;
+                  response.headers["ETag"] = etag;
+                  response.body = image;
+                  response.contentLength = false;
+                  return response; });
+  requests = 0;
+  clearOtaCheckpoint();
+  jobId = "job-no-length";
+  Serial.takeOutput();
+  TEST_ASSERT_NOT_EQUAL(0, downloadAndApply("https://firmware.native/v2.0.0.bin"));
+  std::string log = Serial.takeOutput();
+  TEST_ASSERT_TRUE(log.find("without Content-Length") != std::string::npos);
+  TEST_ASSERT_TRUE(log.find("Writing update") == std::string::npos);
+  TEST_ASSERT_EQUAL(1, requests);
+}
+
+static void test_range_against_restart_from_zero()
+{
+  const double means[] = {4.0 * IMAGE_SIZE, 1.0 * IMAGE_SIZE, IMAGE_SIZE / 2.0, IMAGE_SIZE / 4.0};
+  for (double mean : means)
+  {
+    uint64_t bytes[2] = {0, 0};
+    uint32_t requestCount[2] = {0, 0};
+    int completed[2] = {0, 0};
+    for (int withRange = 1; withRange >= 0; withRange--)
+    {
+      for (int run = 0; run < RUNS; run++)
+      {
+        Outcome outcome = download(withRange, mean, 1000 + run);
+        bytes[withRange] += outcome.bytes;
+        requestCount[withRange] += outcome.requests;
+        completed[withRange] += outcome.completed;
+      }
+    }
+    printf("BENCH link drops every %4u KB on average: Range %5.0f KB, %4.1f requests, %d/%d done; "
+           "from zero %5.0f KB, %4.1f requests, %d/%d done (%u KB image, %d requests at most)\n",
+           (unsigned)(mean / 1024), bytes[1] / 1024.0 / RUNS, (double)requestCount[1] / RUNS, completed[1], RUNS,
+           bytes[0] / 1024.0 / RUNS, (double)requestCount[0] / RUNS, completed[0], RUNS, (unsigned)(IMAGE_SIZE / 1024),
+           MAX_REQUESTS);
+    TEST_ASSERT_EQUAL(RUNS, completed[1]);
+    TEST_ASSERT_TRUE(completed[0] <= completed[1]);
+    if (completed[0] == RUNS)
+    {
+      TEST_ASSERT_TRUE(bytes[1] <= bytes[0]);
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  FakeNetworkSettings network;
+  network.joinMs = 0;
+  network.tlsHandshakeMs = 0;
+  fakeNetworkConfigure(network);
+  WiFi.begin("native", "native");
+  while (WiFi.status() != WL_CONNECTED)
+  {
+    delay(1);
+  }
+  makeImage();
+  UNITY_BEGIN();
+  RUN_TEST(test_resumes_after_a_reboot);
+  RUN_TEST(test_response_without_content_length);
+  RUN_TEST(test_range_against_restart_from_zero);
+  int failures = UNITY_END();
+  fakeStopTasks();
+  return failures;
+}
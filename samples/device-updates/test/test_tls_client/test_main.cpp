@@ -0,0 +1,376 @@
+#include <atomic>
+#include <string>
+#include <thread>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <Arduino.h>
+#include <WiFi.h>
+#include <TlsClient.h>
+#include <mbedtls/bignum.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/rsa.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/ssl_cache.h>
+#include <mbedtls/ssl_ticket.h>
+#include <mbedtls/x509_crt.h>
+#include <unity.h>
+
+// TlsClient against a local mbedtls server over real sockets: mutual TLS with
+// an RSA-2048 identity like an AWS IoT device certificate, and a server that
+// resumes by session ID, by ticket, or not at all.
+//
+//   pio test -e native -f test_tls_client -v
+
+const int CONNECTS = 10;
+
+static std::string identityCert;
+static std::string identityKey;
+static std::string otherCert; // a CA that did not sign the server's
+
+static int randomBytes(void *context, unsigned char *output, size_t length)
+{
+  esp_fill_random(output, length);
+  return 0;
+}
+
+// A self-signed certificate for "localhost", used as CA, server and client
+// certificate alike.
+static void makeIdentity(std::string &certPem, std::string &keyPem)
+{
+  mbedtls_pk_context key;
+  mbedtls_pk_init(&key);
+  TEST_ASSERT_EQUAL(0, mbedtls_pk_setup(&key, mbedtls_pk_info_from_type(MBEDTLS_PK_RSA)));
+  TEST_ASSERT_EQUAL(0, mbedtls_rsa_gen_key(mbedtls_pk_rsa(key), randomBytes, NULL, 2048, 65537));
+
+  mbedtls_mpi serial;
+  mbedtls_mpi_init(&serial);
+  mbedtls_mpi_lset(&serial, 1);
+  mbedtls_x509write_cert cert;
+  mbedtls_x509write_crt_init(&cert);
+  mbedtls_x509write_crt_set_version(&cert, MBEDTLS_X509_CRT_VERSION_3);
+  mbedtls_x509write_crt_set_md_alg(&cert, MBEDTLS_MD_SHA256);
+  mbedtls_x509write_crt_set_subject_key(&cert, &key);
+  mbedtls_x509write_crt_set_issuer_key(&cert, &key);
+  TEST_ASSERT_EQUAL(0, mbedtls_x509write_crt_set_serial(&cert, &serial));
+  TEST_ASSERT_EQUAL(0, mbedtls_x509write_crt_set_subject_name(&cert, "CN=localhost"));
+  TEST_ASSERT_EQUAL(0, mbedtls_x509write_crt_set_issuer_name(&cert, "CN=localhost"));
+  TEST_ASSERT_EQUAL(0, mbedtls_x509write_crt_set_validity(&cert, "20240101000000", "20340101000000"));
+  TEST_ASSERT_EQUAL(0, mbedtls_x509write_crt_set_basic_constraints(&cert, 1, -1));
+
+  unsigned char pem[4096];
+  TEST_ASSERT_EQUAL(0, mbedtls_x509write_crt_pem(&cert, pem, sizeof(pem), randomBytes, NULL));
+  certPem = (const char *)pem;
+  TEST_ASSERT_EQUAL(0, mbedtls_pk_write_key_pem(&key, pem, sizeof(pem)));
+  keyPem = (const char *)pem;
+
+  mbedtls_x509write_crt_free(&cert);
+  mbedtls_mpi_free(&serial);
+  mbedtls_pk_free(&key);
+}
+
+// Accepts one connection at a time on 127.0.0.1, requires the client
+// certificate, echoes the first record and closes.
+class LocalTlsServer
+{
+public:
+  void start(bool sessionCache, bool tickets, uint16_t wantedPort = 0)
+  {
+    mbedtls_net_init(&listener);
+    mbedtls_ssl_init(&ssl);
+    mbedtls_ssl_config_init(&config);
+    mbedtls_x509_crt_init(&cert);
+    mbedtls_pk_init(&key);
+    mbedtls_ssl_cache_init(&cache);
+    mbedtls_ssl_ticket_init(&ticket);
+
+    TEST_ASSERT_EQUAL(0, mbedtls_x509_crt_parse(&cert, (const unsigned char *)identityCert.c_str(),
+                                                identityCert.size() + 1));
+#if MBEDTLS_VERSION_MAJOR >= 3
+    TEST_ASSERT_EQUAL(0, mbedtls_pk_parse_key(&key, (const unsigned char *)identityKey.c_str(),
+                                              identityKey.size() + 1, NULL, 0, randomBytes, NULL));
+#else
+    TEST_ASSERT_EQUAL(0, mbedtls_pk_parse_key(&key, (const unsigned char *)identityKey.c_str(),
+                                              identityKey.size() + 1, NULL, 0));
+#endif
+    TEST_ASSERT_EQUAL(0, mbedtls_ssl_config_defaults(&config, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                                     MBEDTLS_SSL_PRESET_DEFAULT));
+#if MBEDTLS_VERSION_MAJOR >= 3
+    // TLS 1.3 tickets arrive after the handshake; the device side speaks 1.2.
+    mbedtls_ssl_conf_max_tls_version(&config, MBEDTLS_SSL_VERSION_TLS1_2);
+#endif
+    mbedtls_ssl_conf_rng(&config, randomBytes, NULL);
+    mbedtls_ssl_conf_authmode(&config, MBEDTLS_SSL_VERIFY_REQUIRED);
+    mbedtls_ssl_conf_ca_chain(&config, &cert, NULL);
+    TEST_ASSERT_EQUAL(0, mbedtls_ssl_conf_own_cert(&config, &cert, &key));
+    if (sessionCache)
+    {
+      mbedtls_ssl_conf_session_cache(&config, &cache, mbedtls_ssl_cache_get, mbedtls_ssl_cache_set);
+    }
+    if (tickets)
+    {
+      TEST_ASSERT_EQUAL(0, mbedtls_ssl_ticket_setup(&ticket, randomBytes, NULL, MBEDTLS_CIPHER_AES_256_GCM, 86400));
+      mbedtls_ssl_conf_session_tickets_cb(&config, mbedtls_ssl_ticket_write, mbedtls_ssl_ticket_parse, &ticket);
+    }
+    TEST_ASSERT_EQUAL(0, mbedtls_ssl_setup(&ssl, &config));
+
+    char portText[8];
+    snprintf(portText, sizeof(portText), "%u", wantedPort);
+    TEST_ASSERT_EQUAL(0, mbedtls_net_bind(&listener, "127.0.0.1", portText, MBEDTLS_NET_PROTO_TCP));
+    sockaddr_in address;
+    socklen_t length = sizeof(address);
+    getsockname(listener.fd, (sockaddr *)&address, &length);
+    port = ntohs(address.sin_port);
+
+    handshakes = 0;
+    running = true;
+    thread = std::thread(&LocalTlsServer::serve, this);
+  }
+
+  void stop()
+  {
+    running = false;
+    // Wakes the blocking accept().
+    int wake = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    connect(wake, (sockaddr *)&address, sizeof(address));
+    thread.join();
+    close(wake);
+
+    mbedtls_net_free(&listener);
+    mbedtls_ssl_free(&ssl);
+    mbedtls_ssl_config_free(&config);
+    mbedtls_x509_crt_free(&cert);
+    mbedtls_pk_free(&key);
+    mbedtls_ssl_cache_free(&cache);
+    mbedtls_ssl_ticket_free(&ticket);
+  }
+
+  uint16_t port = 0;
+  std::atomic<uint32_t> handshakes;
+
+private:
+  void serve()
+  {
+    while (running)
+    {
+      mbedtls_net_context connection;
+      mbedtls_net_init(&connection);
+      if (mbedtls_net_accept(&listener, &connection, NULL, 0, NULL) != 0 || !running)
+      {
+        mbedtls_net_free(&connection);
+        continue;
+      }
+      mbedtls_ssl_session_reset(&ssl);
+      mbedtls_ssl_set_bio(&ssl, &connection, mbedtls_net_send, mbedtls_net_recv, NULL);
+      if (mbedtls_ssl_handshake(&ssl) == 0)
+      {
+        handshakes++;
+        unsigned char buffer[64];
+        int n = mbedtls_ssl_read(&ssl, buffer, sizeof(buffer));
+        if (n > 0)
+        {
+          mbedtls_ssl_write(&ssl, buffer, n);
+        }
+        mbedtls_ssl_close_notify(&ssl);
+      }
+      mbedtls_net_free(&connection);
+    }
+  }
+
+  std::atomic<bool> running;
+  std::thread thread;
+  mbedtls_net_context listener;
+  mbedtls_ssl_context ssl;
+  mbedtls_ssl_config config;
+  mbedtls_x509_crt cert;
+  mbedtls_pk_context key;
+  mbedtls_ssl_cache_context cache;
+  mbedtls_ssl_ticket_context ticket;
+};
+
+static LocalTlsServer server;
+
+void setUp()
+{
+  if (identityCert.empty())
+  {
+    std::string unusedKey;
+    makeIdentity(identityCert, identityKey);
+    makeIdentity(otherCert, unusedKey);
+  }
+  TlsClient::clearSessions();
+}
+
+void tearDown()
+{
+}
+
+// Connects, has "ping" echoed, and returns the connect time in microseconds
+// (TCP connect and handshake).
+static unsigned long connectAndEcho(TlsClient &client)
+{
+  unsigned long started = micros();
+  TEST_ASSERT_TRUE_MESSAGE(client.connect("localhost", server.port), "handshake failed");
+  unsigned long elapsed = micros() - started;
+
+  TEST_ASSERT_EQUAL(4, client.write((const uint8_t *)"ping", 4));
+  char reply[5] = {};
+  size_t received = 0;
+  unsigned long waited = millis();
+  while (received < 4 && millis() - waited < 2000)
+  {
+    int n = client.read((uint8_t *)reply + received, 4 - received);
+    if (n > 0)
+    {
+      received += n;
+    }
+    else
+    {
+      delay(1);
+    }
+  }
+  TEST_ASSERT_EQUAL_STRING("ping", reply);
+  client.stop();
+  return elapsed;
+}
+
+static TlsClient *identified()
+{
+  TlsClient *client = new TlsClient();
+  client->setCACert(identityCert.c_str());
+  client->setCertificate(identityCert.c_str());
+  client->setPrivateKey(identityKey.c_str());
+  return client;
+}
+
+static void report(const char *server, const TlsClient &client, unsigned long fullUs, unsigned long resumedUs)
+{
+  const TlsStats &stats = client.stats();
+  uint32_t full = stats.handshakes - stats.resumed;
+  printf("BENCH %s: %u handshakes, %u resumed (%.0f%%), full avg %.1f ms (%u ms by TlsStats), "
+         "resumed avg %.1f ms (%u ms by TlsStats)\n",
+         server, stats.handshakes, stats.resumed, 100.0 * stats.resumed / stats.handshakes,
+         full ? fullUs / 1000.0 / full : 0.0, full ? stats.fullHandshakeMs / full : 0,
+         stats.resumed ? resumedUs / 1000.0 / stats.resumed : 0.0,
+         stats.resumed ? stats.resumedHandshakeMs / stats.resumed : 0);
+}
+
+// Runs CONNECTS connections, splitting the measured time between full and
+// resumed handshakes as TlsClient counted them.
+static void connectRepeatedly(TlsClient &client, unsigned long &fullUs, unsigned long &resumedUs)
+{
+  fullUs = 0;
+  resumedUs = 0;
+  for (int i = 0; i < CONNECTS; i++)
+  {
+    uint32_t resumedBefore = client.stats().resumed;
+    unsigned long elapsed = connectAndEcho(client);
+    (client.stats().resumed > resumedBefore ? resumedUs : fullUs) += elapsed;
+  }
+}
+
+static void test_session_id_resumes()
+{
+  server.start(true, false);
+  TlsClient *client = identified();
+  unsigned long fullUs, resumedUs;
+  connectRepeatedly(*client, fullUs, resumedUs);
+  report("session ID cache", *client, fullUs, resumedUs);
+
+  TEST_ASSERT_EQUAL(CONNECTS, client->stats().handshakes);
+  TEST_ASSERT_EQUAL(CONNECTS - 1, client->stats().resumed);
+  TEST_ASSERT_EQUAL(0, client->stats().failures);
+  TEST_ASSERT_EQUAL(CONNECTS, server.handshakes.load());
+  TEST_ASSERT_LESS_THAN(fullUs, resumedUs / (CONNECTS - 1));
+  delete client;
+  server.stop();
+}
+
+static void test_ticket_resumes()
+{
+  server.start(false, true);
+  TlsClient *client = identified();
+  unsigned long fullUs, resumedUs;
+  connectRepeatedly(*client, fullUs, resumedUs);
+  report("session tickets", *client, fullUs, resumedUs);
+
+  TEST_ASSERT_EQUAL(CONNECTS, client->stats().handshakes);
+  TEST_ASSERT_EQUAL(CONNECTS - 1, client->stats().resumed);
+  TEST_ASSERT_EQUAL(0, client->stats().failures);
+  delete client;
+  server.stop();
+}
+
+static void test_no_resumption_is_full_every_time()
+{
+  server.start(false, false);
+  TlsClient *client = identified();
+  unsigned long fullUs, resumedUs;
+  connectRepeatedly(*client, fullUs, resumedUs);
+  report("no resumption", *client, fullUs, resumedUs);
+
+  TEST_ASSERT_EQUAL(CONNECTS, client->stats().handshakes);
+  TEST_ASSERT_EQUAL(0, client->stats().resumed);
+  TEST_ASSERT_EQUAL(0, client->stats().failures);
+  delete client;
+  server.stop();
+}
+
+static void test_restarted_server_falls_back_to_full()
+{
+  server.start(true, false);
+  uint16_t port = server.port;
+  TlsClient *client = identified();
+  connectAndEcho(*client);
+  connectAndEcho(*client);
+  TEST_ASSERT_EQUAL(1, client->stats().resumed);
+
+  // Same host and port, empty session cache: the offered session is refused.
+  server.stop();
+  server.start(true, false, port);
+  connectAndEcho(*client);
+  TEST_ASSERT_EQUAL(3, client->stats().handshakes);
+  TEST_ASSERT_EQUAL(1, client->stats().resumed);
+  TEST_ASSERT_EQUAL(0, client->stats().failures);
+
+  // The new session is the one kept.
+  connectAndEcho(*client);
+  TEST_ASSERT_EQUAL(2, client->stats().resumed);
+  delete client;
+  server.stop();
+}
+
+static void test_untrusted_server_fails()
+{
+  server.start(true, false);
+  TlsClient *client = identified();
+  client->setCACert(otherCert.c_str());
+  TEST_ASSERT_FALSE(client->connect("localhost", server.port));
+  TEST_ASSERT_EQUAL(1, client->stats().failures);
+  TEST_ASSERT_EQUAL(0, client->stats().handshakes);
+  TEST_ASSERT_NOT_EQUAL(0, client->lastError());
+  delete client;
+  server.stop();
+}
+
+int main(int argc, char **argv)
+{
+  FakeNetworkSettings network;
+  network.joinMs = 0;
+  fakeNetworkConfigure(network);
+  WiFi.begin("native", "native");
+
+  UNITY_BEGIN();
+  RUN_TEST(test_session_id_resumes);
+  RUN_TEST(test_ticket_resumes);
+  RUN_TEST(test_no_resumption_is_full_every_time);
+  RUN_TEST(test_restarted_server_falls_back_to_full);
+  RUN_TEST(test_untrusted_server_fails);
+  return UNITY_END();
+}
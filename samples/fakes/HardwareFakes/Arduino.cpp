@@ -0,0 +1,516 @@
+#include "Arduino.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+
+HardwareSerial Serial;
+EspClass ESP;
+
+static const std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+unsigned long millis()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count();
+}
+
+unsigned long micros()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count();
+}
+
+void delay(uint32_t ms)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(uint32_t us)
+{
+  std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+void yield()
+{
+  std::this_thread::yield();
+}
+
+// Seeded the same way every run, so a failing test fails again.
+static std::mutex randomLock;
+static std::mt19937 generator(1);
+
+long random(long max)
+{
+  return max > 0 ? random(0, max) : 0;
+}
+
+long random(long min, long max)
+{
+  if (max <= min)
+  {
+    return min;
+  }
+  std::lock_guard<std::mutex> lock(randomLock);
+  return min + (long)(generator() % (unsigned long)(max - min));
+}
+
+void randomSeed(unsigned long seed)
+{
+  std::lock_guard<std::mutex> lock(randomLock);
+  generator.seed(seed);
+}
+
+uint32_t esp_random()
+{
+  std::lock_guard<std::mutex> lock(randomLock);
+  return generator();
+}
+
+void esp_fill_random(void *buffer, size_t length)
+{
+  uint8_t *bytes = (uint8_t *)buffer;
+  std::lock_guard<std::mutex> lock(randomLock);
+  for (size_t i = 0; i < length; i++)
+  {
+    bytes[i] = generator();
+  }
+}
+
+size_t Print::printf(const char *format, ...)
+{
+  char small[64];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(small, sizeof(small), format, args);
+  va_end(args);
+  if (length < 0)
+  {
+    return 0;
+  }
+  if ((size_t)length < sizeof(small))
+  {
+    return write((const uint8_t *)small, length);
+  }
+  char *large = (char *)malloc(length + 1);
+  if (large == nullptr)
+  {
+    return 0;
+  }
+  va_start(args, format);
+  vsnprintf(large, length + 1, format, args);
+  va_end(args);
+  size_t written = write((const uint8_t *)large, length);
+  free(large);
+  return written;
+}
+
+int Stream::timedRead()
+{
+  unsigned long start = millis();
+  do
+  {
+    int c = read();
+    if (c >= 0)
+    {
+      return c;
+    }
+    delay(1);
+  } while (millis() - start < timeout);
+  return -1;
+}
+
+size_t Stream::readBytes(char *buffer, size_t length)
+{
+  size_t count = 0;
+  while (count < length)
+  {
+    int c = timedRead();
+    if (c < 0)
+    {
+      break;
+    }
+    buffer[count++] = (char)c;
+  }
+  return count;
+}
+
+String Stream::readString()
+{
+  String text;
+  for (int c = timedRead(); c >= 0; c = timedRead())
+  {
+    text += (char)c;
+  }
+  return text;
+}
+
+String Stream::readStringUntil(char terminator)
+{
+  String text;
+  for (int c = timedRead(); c >= 0 && c != terminator; c = timedRead())
+  {
+    text += (char)c;
+  }
+  return text;
+}
+
+static std::mutex serialLock;
+static std::string serialOutput;
+static bool serialEcho = getenv("FAKE_SERIAL") != nullptr && strcmp(getenv("FAKE_SERIAL"), "1") == 0;
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+  FakeHeapUncounted wire; // what has been sent is off the device
+  std::lock_guard<std::mutex> lock(serialLock);
+  serialOutput.append((const char *)buffer, size);
+  if (serialEcho)
+  {
+    fwrite(buffer, 1, size, stdout);
+    fflush(stdout);
+  }
+  return size;
+}
+
+std::string HardwareSerial::takeOutput()
+{
+  std::lock_guard<std::mutex> lock(serialLock);
+  std::string output;
+  output.swap(serialOutput);
+  return output;
+}
+
+void HardwareSerial::echo(bool enabled)
+{
+  std::lock_guard<std::mutex> lock(serialLock);
+  serialEcho = enabled;
+}
+
+// Heap counting: malloc and friends are replaced (glibc allows that) and
+// pass through to glibc, adding up the usable size of each block.
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+#include <errno.h>
+#include <malloc.h>
+#include <unistd.h>
+
+extern "C"
+{
+  void *__libc_malloc(size_t size);
+  void *__libc_calloc(size_t count, size_t size);
+  void *__libc_realloc(void *pointer, size_t size);
+  void *__libc_memalign(size_t alignment, size_t size);
+  void __libc_free(void *pointer);
+}
+
+static std::atomic<size_t> heapInUse(0);
+static std::atomic<size_t> heapPeak(0);
+static std::atomic<uint64_t> heapAllocations(0);
+
+// Uncounted blocks, in an open addressing table outside the heap (a
+// std::set would allocate from inside malloc).
+static const size_t UNCOUNTED_SLOTS = 1 << 16;
+static void *const EMPTIED = (void *)1;
+static thread_local int uncountedScopes = 0;
+static std::mutex uncountedLock;
+static std::atomic<size_t> uncountedBlocks(0);
+static size_t uncountedUsed = 0; // slots holding a block or EMPTIED
+static void *uncounted[UNCOUNTED_SLOTS];
+static void *uncountedScratch[UNCOUNTED_SLOTS];
+
+static size_t slotOf(void *pointer)
+{
+  return (((uintptr_t)pointer >> 4) * 2654435761u) & (UNCOUNTED_SLOTS - 1);
+}
+
+static bool insertUncounted(void *pointer)
+{
+  for (size_t i = slotOf(pointer), n = 0; n < UNCOUNTED_SLOTS; i = (i + 1) & (UNCOUNTED_SLOTS - 1), n++)
+  {
+    if (uncounted[i] == nullptr)
+    {
+      uncounted[i] = pointer;
+      uncountedUsed++;
+      return true;
+    }
+  }
+  return false;
+}
+
+// False when the table is full; the block is counted then.
+static bool rememberUncounted(void *pointer)
+{
+  std::lock_guard<std::mutex> lock(uncountedLock);
+  if (uncountedUsed >= UNCOUNTED_SLOTS / 4 * 3)
+  {
+    // Mostly EMPTIED slots by now: put the live blocks back without them.
+    size_t live = 0;
+    for (size_t i = 0; i < UNCOUNTED_SLOTS; i++)
+    {
+      if (uncounted[i] != nullptr && uncounted[i] != EMPTIED)
+      {
+        uncountedScratch[live++] = uncounted[i];
+      }
+      uncounted[i] = nullptr;
+    }
+    uncountedUsed = 0;
+    for (size_t i = 0; i < live; i++)
+    {
+      insertUncounted(uncountedScratch[i]);
+    }
+    if (uncountedUsed >= UNCOUNTED_SLOTS / 4 * 3)
+    {
+      return false;
+    }
+  }
+  insertUncounted(pointer);
+  uncountedBlocks++;
+  return true;
+}
+
+// True if the block was uncounted, which it no longer is.
+static bool forgetUncounted(void *pointer)
+{
+  if (uncountedBlocks == 0)
+  {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(uncountedLock);
+  for (size_t i = slotOf(pointer), n = 0; n < UNCOUNTED_SLOTS && uncounted[i] != nullptr;
+       i = (i + 1) & (UNCOUNTED_SLOTS - 1), n++)
+  {
+    if (uncounted[i] == pointer)
+    {
+      uncounted[i] = EMPTIED;
+      uncountedBlocks--;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void *counted(void *pointer)
+{
+  if (pointer != nullptr && uncountedScopes > 0 && rememberUncounted(pointer))
+  {
+    return pointer;
+  }
+  if (pointer != nullptr)
+  {
+    size_t inUse = heapInUse += malloc_usable_size(pointer);
+    size_t peak = heapPeak.load(std::memory_order_relaxed);
+    while (inUse > peak && !heapPeak.compare_exchange_weak(peak, inUse))
+    {
+    }
+    heapAllocations++;
+  }
+  return pointer;
+}
+
+extern "C" void *malloc(size_t size)
+{
+  return counted(__libc_malloc(size));
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+  return counted(__libc_calloc(count, size));
+}
+
+extern "C" void *realloc(void *pointer, size_t size)
+{
+  if (pointer != nullptr && forgetUncounted(pointer))
+  {
+    // Stays uncounted wherever it moves.
+    void *moved = __libc_realloc(pointer, size);
+    void *kept = moved != nullptr ? moved : pointer;
+    if (kept != nullptr && (moved != nullptr || size > 0))
+    {
+      uncountedScopes++;
+      counted(kept);
+      uncountedScopes--;
+    }
+    return moved;
+  }
+  if (pointer != nullptr)
+  {
+    heapInUse -= malloc_usable_size(pointer);
+  }
+  void *moved = __libc_realloc(pointer, size);
+  if (moved == nullptr && pointer != nullptr && size > 0)
+  {
+    heapInUse += malloc_usable_size(pointer); // still allocated
+    return nullptr;
+  }
+  return counted(moved);
+}
+
+extern "C" void free(void *pointer)
+{
+  if (pointer != nullptr && !forgetUncounted(pointer))
+  {
+    heapInUse -= malloc_usable_size(pointer);
+  }
+  __libc_free(pointer);
+}
+
+extern "C" void *memalign(size_t alignment, size_t size)
+{
+  return counted(__libc_memalign(alignment, size));
+}
+
+extern "C" void *aligned_alloc(size_t alignment, size_t size)
+{
+  return counted(__libc_memalign(alignment, size));
+}
+
+extern "C" int posix_memalign(void **pointer, size_t alignment, size_t size)
+{
+  *pointer = counted(__libc_memalign(alignment, size));
+  return *pointer != nullptr ? 0 : ENOMEM;
+}
+
+extern "C" void *valloc(size_t size)
+{
+  return counted(__libc_memalign(sysconf(_SC_PAGESIZE), size));
+}
+
+extern "C" void *pvalloc(size_t size)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  return counted(__libc_memalign(page, (size + page - 1) / page * page));
+}
+
+size_t fakeHeapInUse()
+{
+  return heapInUse;
+}
+
+uint64_t fakeHeapAllocations()
+{
+  return heapAllocations;
+}
+
+void fakeResetMinFreeHeap()
+{
+  heapPeak = heapInUse.load();
+}
+
+static size_t heapPeakInUse()
+{
+  return heapPeak;
+}
+
+FakeHeapUncounted::FakeHeapUncounted()
+{
+  uncountedScopes++;
+}
+
+FakeHeapUncounted::~FakeHeapUncounted()
+{
+  uncountedScopes--;
+}
+#else
+size_t fakeHeapInUse()
+{
+  return 0;
+}
+
+uint64_t fakeHeapAllocations()
+{
+  return 0;
+}
+
+void fakeResetMinFreeHeap()
+{
+}
+
+static size_t heapPeakInUse()
+{
+  return 0;
+}
+
+FakeHeapUncounted::FakeHeapUncounted()
+{
+}
+
+FakeHeapUncounted::~FakeHeapUncounted()
+{
+}
+#endif
+
+// What the C++ runtime allocated before the sketch's globals; not counted.
+static const size_t heapAtStart = fakeHeapInUse();
+
+static uint32_t freeHeapWith(size_t inUse)
+{
+  size_t used = inUse > heapAtStart ? inUse - heapAtStart : 0;
+  return used < FAKE_HEAP_SIZE ? FAKE_HEAP_SIZE - used : 0;
+}
+
+uint32_t EspClass::getHeapSize()
+{
+  return FAKE_HEAP_SIZE;
+}
+
+uint32_t EspClass::getFreeHeap()
+{
+  return freeHeapWith(fakeHeapInUse());
+}
+
+uint32_t EspClass::getMinFreeHeap()
+{
+  return freeHeapWith(heapPeakInUse());
+}
+
+void EspClass::restart()
+{
+  throw EspRestart();
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+  switch (code)
+  {
+  case ESP_OK:
+    return "ESP_OK";
+  case ESP_FAIL:
+    return "ESP_FAIL";
+  case ESP_ERR_NO_MEM:
+    return "ESP_ERR_NO_MEM";
+  case ESP_ERR_INVALID_ARG:
+    return "ESP_ERR_INVALID_ARG";
+  case ESP_ERR_INVALID_STATE:
+    return "ESP_ERR_INVALID_STATE";
+  case ESP_ERR_INVALID_SIZE:
+    return "ESP_ERR_INVALID_SIZE";
+  case ESP_ERR_NOT_FOUND:
+    return "ESP_ERR_NOT_FOUND";
+  case ESP_ERR_NOT_SUPPORTED:
+    return "ESP_ERR_NOT_SUPPORTED";
+  case ESP_ERR_TIMEOUT:
+    return "ESP_ERR_TIMEOUT";
+  case ESP_ERR_NVS_NOT_INITIALIZED:
+    return "ESP_ERR_NVS_NOT_INITIALIZED";
+  case ESP_ERR_NVS_NOT_FOUND:
+    return "ESP_ERR_NVS_NOT_FOUND";
+  case ESP_ERR_NVS_TYPE_MISMATCH:
+    return "ESP_ERR_NVS_TYPE_MISMATCH";
+  case ESP_ERR_NVS_READ_ONLY:
+    return "ESP_ERR_NVS_READ_ONLY";
+  case ESP_ERR_NVS_NOT_ENOUGH_SPACE:
+    return "ESP_ERR_NVS_NOT_ENOUGH_SPACE";
+  case ESP_ERR_NVS_INVALID_NAME:
+    return "ESP_ERR_NVS_INVALID_NAME";
+  case ESP_ERR_NVS_INVALID_HANDLE:
+    return "ESP_ERR_NVS_INVALID_HANDLE";
+  case ESP_ERR_NVS_KEY_TOO_LONG:
+    return "ESP_ERR_NVS_KEY_TOO_LONG";
+  case ESP_ERR_NVS_INVALID_LENGTH:
+    return "ESP_ERR_NVS_INVALID_LENGTH";
+  case ESP_ERR_OTA_VALIDATE_FAILED:
+    return "ESP_ERR_OTA_VALIDATE_FAILED";
+  default:
+    return "UNKNOWN ERROR";
+  }
+}
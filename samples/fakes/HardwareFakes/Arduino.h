@@ -0,0 +1,84 @@
+#pragma once
+
+// Host stand-ins for the parts of the Arduino ESP32 core the samples use, for
+// the native PlatformIO environment. Time is real (a steady clock), so code
+// that waits on millis() behaves as on the device, and the heap figures are
+// the sketch's own allocations counted against a device-sized heap.
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "FakeRtos.h"
+#include "HardwareSerial.h"
+#include "WString.h"
+#include "esp_err.h"
+
+using std::max;
+using std::min;
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define PROGMEM
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void yield();
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+uint32_t esp_random();
+void esp_fill_random(void *buffer, size_t length);
+
+// Thrown by ESP.restart(); the test decides what a reboot means.
+struct EspRestart
+{
+};
+
+// The heap the free-heap figures are counted against: an ESP32's internal
+// DRAM as the samples see it after Wi-Fi starts.
+#ifndef FAKE_HEAP_SIZE
+#define FAKE_HEAP_SIZE (200 * 1024)
+#endif
+
+class EspClass
+{
+public:
+  uint32_t getHeapSize();
+  uint32_t getFreeHeap();
+  uint32_t getMinFreeHeap();
+  uint32_t getMaxAllocHeap() { return getFreeHeap(); }
+  [[noreturn]] void restart();
+};
+
+extern EspClass ESP;
+
+// Test side. Heap counting needs glibc and is off under the sanitizers, which
+// replace malloc themselves; then these are all 0.
+size_t fakeHeapInUse();
+uint64_t fakeHeapAllocations(); // malloc/new calls so far
+// Starts getMinFreeHeap() again from the current free heap.
+void fakeResetMinFreeHeap();
+
+// While one exists, blocks allocated on its thread are left out of the heap
+// figures, also when freed later. The fakes use it for what lives on the far
+// side of the network (broker state, HTTP bodies), tests for their fixtures.
+class FakeHeapUncounted
+{
+public:
+  FakeHeapUncounted();
+  ~FakeHeapUncounted();
+  FakeHeapUncounted(const FakeHeapUncounted &) = delete;
+  FakeHeapUncounted &operator=(const FakeHeapUncounted &) = delete;
+};
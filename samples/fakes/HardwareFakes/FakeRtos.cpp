@@ -0,0 +1,159 @@
+#include "FakeRtos.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+struct FakeTask
+{
+  std::string name;
+  std::thread thread;
+  std::mutex lock;
+  std::condition_variable notified;
+  uint32_t notifications = 0;
+  bool stopping = false;
+  bool ended = false;
+};
+
+// Thrown through a task's stack to end it.
+struct FakeTaskExit
+{
+};
+
+// Tasks are never freed, so a handle stays usable after its task ends.
+static std::mutex tasksLock;
+static std::deque<FakeTask> tasks;
+static FakeTask mainTask;
+static thread_local FakeTask *currentTask = &mainTask;
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stackSize, void *parameter,
+                                   UBaseType_t priority, TaskHandle_t *created, BaseType_t core)
+{
+  FakeTask *entry;
+  {
+    std::lock_guard<std::mutex> lock(tasksLock);
+    tasks.emplace_back();
+    entry = &tasks.back();
+    entry->name = name ? name : "";
+  }
+  if (created != nullptr)
+  {
+    *created = entry;
+  }
+  entry->thread = std::thread([entry, task, parameter]() {
+    currentTask = entry;
+    try
+    {
+      task(parameter);
+    }
+    catch (const FakeTaskExit &)
+    {
+    }
+    std::lock_guard<std::mutex> lock(entry->lock);
+    entry->ended = true;
+  });
+  return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stackSize, void *parameter,
+                       UBaseType_t priority, TaskHandle_t *created)
+{
+  return xTaskCreatePinnedToCore(task, name, stackSize, parameter, priority, created, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+  if (task == nullptr || task == currentTask)
+  {
+    if (currentTask == &mainTask)
+    {
+      return; // the test's own thread
+    }
+    throw FakeTaskExit();
+  }
+  std::lock_guard<std::mutex> lock(task->lock);
+  task->stopping = true;
+  task->notified.notify_all();
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+  FakeTask *self = currentTask;
+  std::unique_lock<std::mutex> lock(self->lock);
+  self->notified.wait_for(lock, std::chrono::milliseconds(ticks), [self]() { return self->stopping; });
+  if (self->stopping && self != &mainTask)
+  {
+    throw FakeTaskExit();
+  }
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+  return currentTask;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+  std::lock_guard<std::mutex> lock(task->lock);
+  task->notifications++;
+  task->notified.notify_all();
+  return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks)
+{
+  FakeTask *self = currentTask;
+  std::unique_lock<std::mutex> lock(self->lock);
+  auto ready = [self]() { return self->notifications > 0 || self->stopping; };
+  if (ticks == portMAX_DELAY)
+  {
+    self->notified.wait(lock, ready);
+  }
+  else
+  {
+    self->notified.wait_for(lock, std::chrono::milliseconds(ticks), ready);
+  }
+  if (self->stopping && self != &mainTask)
+  {
+    throw FakeTaskExit();
+  }
+  uint32_t count = self->notifications;
+  if (count > 0)
+  {
+    self->notifications = clearOnExit ? 0 : count - 1;
+  }
+  return count;
+}
+
+void fakeStopTasks()
+{
+  std::lock_guard<std::mutex> tasksGuard(tasksLock);
+  for (FakeTask &task : tasks)
+  {
+    std::lock_guard<std::mutex> lock(task.lock);
+    task.stopping = true;
+    task.notified.notify_all();
+  }
+  for (FakeTask &task : tasks)
+  {
+    if (task.thread.joinable())
+    {
+      task.thread.join();
+    }
+  }
+}
+
+int fakeRunningTasks()
+{
+  std::lock_guard<std::mutex> tasksGuard(tasksLock);
+  int running = 0;
+  for (FakeTask &task : tasks)
+  {
+    std::lock_guard<std::mutex> lock(task.lock);
+    running += task.ended ? 0 : 1;
+  }
+  return running;
+}
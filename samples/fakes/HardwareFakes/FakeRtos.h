@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+// The FreeRTOS task calls the samples make, with a thread per task. Priorities
+// and cores are ignored, and ticks are milliseconds.
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef void (*TaskFunction_t)(void *);
+typedef struct FakeTask *TaskHandle_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdFAIL 0
+#define pdPASS 1
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define tskIDLE_PRIORITY 0
+#define tskNO_AFFINITY 0x7fffffff
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stackSize, void *parameter,
+                                   UBaseType_t priority, TaskHandle_t *created, BaseType_t core);
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stackSize, void *parameter,
+                       UBaseType_t priority, TaskHandle_t *created);
+// NULL ends the calling task: it does not return.
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TaskHandle_t xTaskGetCurrentTaskHandle();
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks);
+
+// Test side. Asks every task to end, which each does at its next
+// vTaskDelay() or ulTaskNotifyTake(), and waits for them.
+void fakeStopTasks();
+// Tasks created and not yet ended.
+int fakeRunningTasks();
@@ -0,0 +1,252 @@
+#include "HTTPClient.h"
+
+#include <memory>
+#include <mutex>
+#include <strings.h>
+#include "WiFi.h"
+
+static std::mutex serverLock;
+static FakeHttpHandler handler;
+static FakeHttpStats stats;
+
+void fakeHttpServe(FakeHttpHandler serve)
+{
+  std::lock_guard<std::mutex> lock(serverLock);
+  handler = serve;
+}
+
+FakeHttpStats fakeHttpStats()
+{
+  std::lock_guard<std::mutex> lock(serverLock);
+  return stats;
+}
+
+void fakeHttpReset()
+{
+  std::lock_guard<std::mutex> lock(serverLock);
+  handler = nullptr;
+  stats = FakeHttpStats();
+}
+
+FakeHttpStream::FakeHttpStream(const FakeHttpResponse &response)
+    : body(response.body), end(response.dropAfter < response.body.size() ? response.dropAfter : response.body.size()),
+      bytesPerSecond(response.bytesPerSecond), started(millis()), generation(fakeNetworkGeneration())
+{
+}
+
+size_t FakeHttpStream::limit()
+{
+  if (bytesPerSecond == 0)
+  {
+    return end;
+  }
+  uint64_t arrived = (uint64_t)(millis() - started) * bytesPerSecond / 1000;
+  return arrived < end ? arrived : end;
+}
+
+int FakeHttpStream::available()
+{
+  return connected() ? limit() - position : 0;
+}
+
+int FakeHttpStream::read()
+{
+  uint8_t value;
+  return read(&value, 1) == 1 ? value : -1;
+}
+
+int FakeHttpStream::read(uint8_t *buffer, size_t length)
+{
+  size_t n = available();
+  if (n == 0)
+  {
+    return -1;
+  }
+  n = n < length ? n : length;
+  memcpy(buffer, body.data() + position, n);
+  position += n;
+  std::lock_guard<std::mutex> lock(serverLock);
+  stats.bytesReceived += n;
+  return n;
+}
+
+int FakeHttpStream::peek()
+{
+  return available() > 0 ? (uint8_t)body[position] : -1;
+}
+
+uint8_t FakeHttpStream::connected()
+{
+  if (closed || generation != fakeNetworkGeneration() || !fakeNetworkIsUp())
+  {
+    return 0;
+  }
+  // A cut connection closes once what came before the cut has been read.
+  return position < end || end == body.size();
+}
+
+bool HTTPClient::begin(WiFiClient &client, const String &url)
+{
+  end();
+  this->client = &client;
+  this->url = url.c_str();
+  return true;
+}
+
+bool HTTPClient::begin(const String &url)
+{
+  end();
+  this->url = url.c_str();
+  return true;
+}
+
+void HTTPClient::end()
+{
+  stream.reset();
+  if (client != nullptr)
+  {
+    client->stop();
+  }
+  client = nullptr;
+  requestHeaders.clear();
+  responseHeaders.clear();
+  size = -1;
+}
+
+void HTTPClient::addHeader(const String &name, const String &value)
+{
+  requestHeaders[name.c_str()] = value.c_str();
+}
+
+void HTTPClient::collectHeaders(const char *names[], const size_t count)
+{
+  wantedHeaders.assign(names, names + count);
+}
+
+String HTTPClient::header(const char *name)
+{
+  for (const auto &entry : responseHeaders)
+  {
+    if (strcasecmp(entry.first.c_str(), name) == 0)
+    {
+      return String(entry.second);
+    }
+  }
+  return String();
+}
+
+int HTTPClient::sendRequest(const char *method, Stream *body, size_t size)
+{
+  // The device's send buffer; what has been read into it is on the wire.
+  std::unique_ptr<uint8_t[]> buffer(new uint8_t[HTTP_TCP_BUFFER_SIZE]);
+  std::string payload;
+  while (body != nullptr && payload.size() < size)
+  {
+    size_t wanted = size - payload.size();
+    size_t n = body->readBytes(buffer.get(), wanted < HTTP_TCP_BUFFER_SIZE ? wanted : HTTP_TCP_BUFFER_SIZE);
+    if (n == 0)
+    {
+      return HTTPC_ERROR_SEND_PAYLOAD_FAILED;
+    }
+    FakeHeapUncounted wire;
+    payload.append((const char *)buffer.get(), n);
+  }
+  buffer.reset();
+  return sendRequest(method, (const uint8_t *)payload.data(), payload.size());
+}
+
+int HTTPClient::sendRequest(const char *method, const uint8_t *payload, size_t size)
+{
+  stream.reset();
+  responseHeaders.clear();
+  this->size = -1;
+  if (client != nullptr && !client->connected())
+  {
+    // Host and port do not matter to the fakes.
+    client->connect("fake-http-server", 443);
+  }
+  if ((client != nullptr && !client->connected()) || !fakeNetworkIsUp())
+  {
+    return HTTPC_ERROR_CONNECTION_REFUSED;
+  }
+  uint32_t uplink = fakeNetworkSettings().uplinkBytesPerSecond;
+  if (uplink > 0)
+  {
+    delay((uint64_t)size * 1000 / uplink);
+  }
+
+  // The request as the server got it, the response and its body are the
+  // server's memory, not the sketch's.
+  FakeHeapUncounted serverSide;
+  FakeHttpRequest request;
+  request.method = method;
+  request.url = url;
+  request.headers = requestHeaders;
+  request.body.assign((const char *)payload, size);
+  FakeHttpHandler serve;
+  {
+    std::lock_guard<std::mutex> lock(serverLock);
+    stats.requests++;
+    stats.bytesSent += size;
+    serve = handler;
+  }
+  if (!serve)
+  {
+    return HTTPC_ERROR_CONNECTION_REFUSED;
+  }
+  FakeHttpResponse response = serve(request);
+
+  for (const std::string &name : wantedHeaders)
+  {
+    for (const auto &entry : response.headers)
+    {
+      if (strcasecmp(entry.first.c_str(), name.c_str()) == 0)
+      {
+        responseHeaders[name] = entry.second;
+      }
+    }
+  }
+  this->size = response.contentLength ? (int)response.body.size() : -1;
+  stream.reset(new FakeHttpStream(response));
+  return response.status;
+}
+
+String HTTPClient::getString()
+{
+  String text;
+  unsigned long started = millis();
+  while (stream && (int)text.length() < size && millis() - started < timeoutMs)
+  {
+    int c = stream->read();
+    if (c < 0)
+    {
+      if (!stream->connected())
+      {
+        break;
+      }
+      delay(1);
+      continue;
+    }
+    text += (char)c;
+  }
+  return text;
+}
+
+String HTTPClient::errorToString(int error)
+{
+  switch (error)
+  {
+  case HTTPC_ERROR_CONNECTION_REFUSED:
+    return "connection refused";
+  case HTTPC_ERROR_SEND_PAYLOAD_FAILED:
+    return "send payload failed";
+  case HTTPC_ERROR_NOT_CONNECTED:
+    return "not connected";
+  case HTTPC_ERROR_CONNECTION_LOST:
+    return "connection lost";
+  case HTTPC_ERROR_READ_TIMEOUT:
+    return "read Timeout";
+  default:
+    return String();
+  }
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Arduino.h"
+#include "WiFiClient.h"
+
+typedef enum
+{
+  HTTP_CODE_OK = 200,
+  HTTP_CODE_NO_CONTENT = 204,
+  HTTP_CODE_PARTIAL_CONTENT = 206,
+  HTTP_CODE_MOVED_PERMANENTLY = 301,
+  HTTP_CODE_FOUND = 302,
+  HTTP_CODE_NOT_MODIFIED = 304,
+  HTTP_CODE_BAD_REQUEST = 400,
+  HTTP_CODE_UNAUTHORIZED = 401,
+  HTTP_CODE_FORBIDDEN = 403,
+  HTTP_CODE_NOT_FOUND = 404,
+  HTTP_CODE_PRECONDITION_FAILED = 412,
+  HTTP_CODE_REQUESTED_RANGE_NOT_SATISFIABLE = 416,
+  HTTP_CODE_INTERNAL_SERVER_ERROR = 500,
+  HTTP_CODE_SERVICE_UNAVAILABLE = 503
+} t_http_codes;
+
+// HTTPClient sends a stream body through a heap buffer of this size.
+#define HTTP_TCP_BUFFER_SIZE (1460)
+
+#define HTTPC_ERROR_CONNECTION_REFUSED (-1)
+#define HTTPC_ERROR_SEND_PAYLOAD_FAILED (-3)
+#define HTTPC_ERROR_NOT_CONNECTED (-4)
+#define HTTPC_ERROR_CONNECTION_LOST (-5)
+#define HTTPC_ERROR_NO_STREAM (-6)
+#define HTTPC_ERROR_READ_TIMEOUT (-11)
+
+// Test side: the server every HTTPClient talks to, whatever the URL.
+struct FakeHttpRequest
+{
+  std::string method;
+  std::string url;
+  std::map<std::string, std::string> headers; // names as sent
+  std::string body;
+};
+
+struct FakeHttpResponse
+{
+  int status = HTTP_CODE_OK;
+  std::map<std::string, std::string> headers;
+  std::string body;
+  // The connection drops after this many body bytes.
+  size_t dropAfter = (size_t)-1;
+  // The body arrives at this rate; 0 is all at once.
+  uint32_t bytesPerSecond = 0;
+  // False sends no Content-Length (getSize() is -1), as a chunked response or
+  // one that ends with the connection does.
+  bool contentLength = true;
+};
+
+typedef std::function<FakeHttpResponse(const FakeHttpRequest &request)> FakeHttpHandler;
+
+struct FakeHttpStats
+{
+  uint32_t requests = 0;
+  uint64_t bytesSent = 0;     // request bodies
+  uint64_t bytesReceived = 0; // response bodies, as far as they were read
+};
+
+void fakeHttpServe(FakeHttpHandler handler);
+FakeHttpStats fakeHttpStats();
+void fakeHttpReset();
+
+// The response body as the sketch reads it, paced and cut as configured.
+class FakeHttpStream : public WiFiClient
+{
+public:
+  FakeHttpStream(const FakeHttpResponse &response);
+
+  int available() override;
+  int read() override;
+  int read(uint8_t *buffer, size_t length) override;
+  int peek() override;
+  size_t write(const uint8_t *data, size_t length) override { return 0; }
+  using WiFiClient::write;
+  void stop() override { closed = true; }
+  uint8_t connected() override;
+
+private:
+  size_t limit(); // bytes that may have arrived by now
+
+  std::string body;
+  size_t end;
+  uint32_t bytesPerSecond;
+  unsigned long started;
+  size_t position = 0;
+  bool closed = false;
+  uint32_t generation;
+};
+
+// arduino-esp32's HTTPClient for one request at a time. The connection goes
+// through the WiFiClient given to begin(), so its handshake is paid for, and
+// the request goes to the handler given to fakeHttpServe().
+class HTTPClient
+{
+public:
+  ~HTTPClient() { end(); }
+
+  bool begin(WiFiClient &client, const String &url);
+  bool begin(const String &url);
+  void end();
+  void setTimeout(uint16_t timeoutMs) { this->timeoutMs = timeoutMs; }
+  void setReuse(bool reuse) {}
+  void addHeader(const String &name, const String &value);
+  void collectHeaders(const char *names[], const size_t count);
+  String header(const char *name);
+
+  int GET() { return sendRequest("GET", (const uint8_t *)nullptr, 0); }
+  int PUT(const String &payload) { return sendRequest("PUT", (const uint8_t *)payload.c_str(), payload.length()); }
+  int PUT(uint8_t *payload, size_t size) { return sendRequest("PUT", payload, size); }
+  int POST(const String &payload) { return sendRequest("POST", (const uint8_t *)payload.c_str(), payload.length()); }
+  int POST(uint8_t *payload, size_t size) { return sendRequest("POST", payload, size); }
+  int sendRequest(const char *method, const String &payload)
+  {
+    return sendRequest(method, (const uint8_t *)payload.c_str(), payload.length());
+  }
+  int sendRequest(const char *method, uint8_t *payload, size_t size)
+  {
+    return sendRequest(method, (const uint8_t *)payload, size);
+  }
+  int sendRequest(const char *method, Stream *stream, size_t size);
+
+  int getSize() { return size; }
+  WiFiClient *getStreamPtr() { return stream.get(); }
+  WiFiClient &getStream() { return *stream; }
+  String getString();
+  static String errorToString(int error);
+
+private:
+  int sendRequest(const char *method, const uint8_t *payload, size_t size);
+
+  WiFiClient *client = nullptr;
+  std::string url;
+  std::map<std::string, std::string> requestHeaders;
+  std::vector<std::string> wantedHeaders;
+  std::map<std::string, std::string> responseHeaders;
+  std::unique_ptr<FakeHttpStream> stream;
+  int size = -1;
+  uint16_t timeoutMs = 5000;
+};
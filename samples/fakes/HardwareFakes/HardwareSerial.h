@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+#include "Stream.h"
+
+// Keeps everything written, for tests to read back; FAKE_SERIAL=1 in the
+// environment also copies it to stdout. Safe to write from several tasks.
+class HardwareSerial : public Stream
+{
+public:
+  void begin(unsigned long baud) {}
+  void end() {}
+  operator bool() const { return true; }
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) override;
+  using Print::write;
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+
+  // Everything written since the last takeOutput().
+  std::string takeOutput();
+  void echo(bool enabled);
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include "WString.h"
+
+class IPAddress
+{
+public:
+  IPAddress() : IPAddress(0, 0, 0, 0) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : bytes{a, b, c, d} {}
+  // In network byte order, as lwIP keeps it.
+  IPAddress(uint32_t address) { memcpy(bytes, &address, 4); }
+
+  operator uint32_t() const
+  {
+    uint32_t address;
+    memcpy(&address, bytes, 4);
+    return address;
+  }
+  uint8_t operator[](int index) const { return bytes[index]; }
+  bool operator==(const IPAddress &other) const { return memcmp(bytes, other.bytes, 4) == 0; }
+  bool fromString(const char *text)
+  {
+    unsigned a, b, c, d;
+    char extra;
+    if (sscanf(text, "%u.%u.%u.%u%c", &a, &b, &c, &d, &extra) != 4 || a > 255 || b > 255 || c > 255 || d > 255)
+    {
+      return false;
+    }
+    *this = IPAddress(a, b, c, d);
+    return true;
+  }
+  String toString() const
+  {
+    char text[16];
+    snprintf(text, sizeof(text), "%u.%u.%u.%u", bytes[0], bytes[1], bytes[2], bytes[3]);
+    return String(text);
+  }
+
+private:
+  uint8_t bytes[4];
+};
@@ -0,0 +1,50 @@
+#include "M5Core2.h"
+
+#include <mutex>
+
+M5Core2 M5;
+
+// The sketches draw from loop() and the network task.
+static std::mutex lcdLock;
+
+size_t FakeLcd::write(uint8_t c)
+{
+  std::lock_guard<std::mutex> lock(lcdLock);
+  shown += (char)c;
+  if (c == '\n')
+  {
+    cursorX = 0;
+    cursorY += 8 * textSize;
+  }
+  else if (c != '\r')
+  {
+    cursorX += 6 * textSize;
+  }
+  return 1;
+}
+
+void FakeLcd::fillScreen(uint32_t color)
+{
+  std::lock_guard<std::mutex> lock(lcdLock);
+  shown.clear();
+}
+
+void FakeLcd::setCursor(int16_t x, int16_t y)
+{
+  std::lock_guard<std::mutex> lock(lcdLock);
+  cursorX = x;
+  cursorY = y;
+}
+
+std::string FakeLcd::text()
+{
+  std::lock_guard<std::mutex> lock(lcdLock);
+  return shown;
+}
+
+void M5Core2::update()
+{
+  BtnA.update();
+  BtnB.update();
+  BtnC.update();
+}
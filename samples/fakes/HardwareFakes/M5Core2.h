@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include "Arduino.h"
+
+// The parts of M5Core2 the samples use. The screen keeps what is printed on
+// it, and a test presses the buttons with fakeRelease()/fakeHold(), which
+// take effect at the next M5.update(), like a touch read there.
+class Button
+{
+public:
+  explicit Button(const char *name) : name(name) {}
+
+  bool wasReleased() { return released; }
+  bool wasPressed() { return released; }
+  bool isPressed() { return held; }
+  bool pressedFor(uint32_t ms) { return held; }
+  bool pressedFor(uint32_t ms, uint32_t continuousMs) { return held; }
+  const char *label() { return name; }
+
+  // Test side.
+  void fakeRelease() { releasePending = true; }
+  void fakeHold(bool down) { held = down; }
+  void update()
+  {
+    released = releasePending;
+    releasePending = false;
+  }
+
+private:
+  const char *name;
+  bool released = false;
+  bool releasePending = false;
+  bool held = false;
+};
+
+class FakeLcd : public Print
+{
+public:
+  size_t write(uint8_t c) override;
+  using Print::write;
+  void clearDisplay() { fillScreen(0); }
+  void fillScreen(uint32_t color);
+  void setTextSize(uint8_t size) { textSize = size; }
+  void setTextColor(uint16_t color) {}
+  void setTextColor(uint16_t color, uint16_t background) {}
+  void setCursor(int16_t x, int16_t y);
+  int16_t getCursorX() { return cursorX; }
+  int16_t getCursorY() { return cursorY; }
+
+  // Test side: everything printed since the screen was last cleared.
+  std::string text();
+
+private:
+  std::string shown;
+  uint8_t textSize = 1;
+  int16_t cursorX = 0;
+  int16_t cursorY = 0;
+};
+
+class M5Core2
+{
+public:
+  void begin(bool lcd = true, bool sd = true, bool serial = true, bool i2c = false) {}
+  void update();
+
+  FakeLcd Lcd;
+  Button BtnA{"BtnA"};
+  Button BtnB{"BtnB"};
+  Button BtnC{"BtnC"};
+};
+
+extern M5Core2 M5;
+#define m5 M5
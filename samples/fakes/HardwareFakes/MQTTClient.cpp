@@ -0,0 +1,444 @@
+#include "MQTTClient.h"
+
+#include <map>
+#include <mutex>
+#include <set>
+
+FakeBroker fakeBroker;
+
+struct PendingMessage
+{
+  std::string topic;
+  std::string payload;
+  unsigned long dueMs;
+};
+
+// Subscriptions are kept per client ID, so a session that is not clean keeps
+// them across reconnects, and its messages wait for it.
+static std::mutex brokerLock;
+static FakeBrokerSettings brokerSettings;
+static std::vector<std::pair<std::string, FakeBroker::Responder>> responders;
+static std::vector<FakeMessage> publishedMessages;
+static std::vector<PendingMessage> pending;
+static std::map<std::string, std::set<std::string>> subscribed;
+static std::map<uint32_t, std::string> sessions; // open ones, to client ID
+static std::map<uint32_t, unsigned long> lastHeard; // session to millis() of its last packet
+static uint32_t lastSession = 0;
+static uint32_t connectCount = 0;
+static uint32_t subscribesToRefuse = 0;
+
+static bool anySubscribed(const std::string &topic)
+{
+  for (const auto &client : subscribed)
+  {
+    for (const std::string &filter : client.second)
+    {
+      if (FakeBroker::matches(filter, topic))
+      {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// A session that is gone takes the client down with it.
+static bool sessionOpen(uint32_t session)
+{
+  return session != 0 && sessions.count(session) > 0;
+}
+
+MQTTClient::MQTTClient(int readBufferSize, int writeBufferSize)
+    : readBuffer(readBufferSize), writeBufferSize(writeBufferSize)
+{
+}
+
+MQTTClient::~MQTTClient()
+{
+  std::lock_guard<std::mutex> lock(brokerLock);
+  sessions.erase(session);
+}
+
+void MQTTClient::begin(const char hostname[], int port, Client &client)
+{
+  host = hostname;
+  this->port = port;
+  transport = &client;
+}
+
+bool MQTTClient::connect(const char clientId[], bool skip)
+{
+  if (connected())
+  {
+    disconnect();
+  }
+  if (transport == nullptr)
+  {
+    return fail(LWMQTT_NETWORK_FAILED_CONNECT);
+  }
+  if (!skip && !transport->connect(host.c_str(), port))
+  {
+    return fail(LWMQTT_NETWORK_FAILED_CONNECT);
+  }
+  if (!transport->connected())
+  {
+    return fail(LWMQTT_NETWORK_FAILED_CONNECT);
+  }
+  FakeBrokerSettings settings = fakeBroker.settings();
+  delay(settings.connackMs);
+  if (!settings.accepting || !transport->connected())
+  {
+    return fail(LWMQTT_CONNECTION_DENIED);
+  }
+
+  FakeHeapUncounted brokerSide;
+  std::lock_guard<std::mutex> lock(brokerLock);
+  this->clientId = clientId;
+  if (cleanSession)
+  {
+    subscribed.erase(this->clientId);
+  }
+  session = ++lastSession;
+  sessions[session] = this->clientId;
+  lastHeard[session] = millis();
+  connectCount++;
+  error = LWMQTT_SUCCESS;
+  return true;
+}
+
+bool MQTTClient::publish(const char topic[], const char payload[], int length, bool retained, int qos)
+{
+  if (!connected())
+  {
+    error = LWMQTT_NETWORK_FAILED_WRITE;
+    return false;
+  }
+  heard();
+  // Fixed header, length, topic length and topic, packet ID, payload.
+  size_t size = 5 + 2 + strlen(topic) + (qos > 0 ? 2 : 0) + length;
+  if (size > writeBufferSize)
+  {
+    return fail(LWMQTT_BUFFER_TOO_SHORT);
+  }
+
+  // The broker's copy of the message, and whatever its responders allocate.
+  FakeHeapUncounted brokerSide;
+  FakeMessage message = {topic, std::string(payload, length), qos, millis()};
+  std::vector<FakeBroker::Responder> matching;
+  {
+    std::lock_guard<std::mutex> lock(brokerLock);
+    publishedMessages.push_back(message);
+    for (const auto &responder : responders)
+    {
+      if (FakeBroker::matches(responder.first, message.topic))
+      {
+        matching.push_back(responder.second);
+      }
+    }
+  }
+  for (const FakeBroker::Responder &responder : matching)
+  {
+    responder(fakeBroker, message);
+  }
+  if (qos > 0)
+  {
+    delay(fakeBroker.settings().pubackMs);
+    if (!connected())
+    {
+      return fail(LWMQTT_NETWORK_TIMEOUT);
+    }
+  }
+  return true;
+}
+
+bool MQTTClient::subscribe(const char topic[], int qos)
+{
+  if (!connected())
+  {
+    error = LWMQTT_NETWORK_FAILED_WRITE;
+    return false;
+  }
+  heard();
+  delay(fakeBroker.settings().connackMs);
+  FakeHeapUncounted brokerSide;
+  std::lock_guard<std::mutex> lock(brokerLock);
+  if (!sessionOpen(session))
+  {
+    return false;
+  }
+  if (subscribesToRefuse > 0)
+  {
+    subscribesToRefuse--;
+    error = LWMQTT_FAILED_SUBSCRIPTION;
+    return false;
+  }
+  subscribed[clientId].insert(topic);
+  return true;
+}
+
+bool MQTTClient::unsubscribe(const char topic[])
+{
+  if (!connected())
+  {
+    error = LWMQTT_NETWORK_FAILED_WRITE;
+    return false;
+  }
+  heard();
+  delay(fakeBroker.settings().connackMs);
+  std::lock_guard<std::mutex> lock(brokerLock);
+  subscribed[clientId].erase(topic);
+  return true;
+}
+
+bool MQTTClient::loop()
+{
+  if (!connected())
+  {
+    return false;
+  }
+  heard();
+  // One at a time, so a callback may publish or subscribe.
+  for (;;)
+  {
+    std::string topic;
+    std::string payload;
+    {
+      FakeHeapUncounted brokerSide;
+      std::lock_guard<std::mutex> lock(brokerLock);
+      unsigned long now = millis();
+      auto due = pending.end();
+      for (auto message = pending.begin(); message != pending.end();)
+      {
+        if ((long)(now - message->dueMs) < 0)
+        {
+          ++message;
+          continue;
+        }
+        if (!anySubscribed(message->topic))
+        {
+          message = pending.erase(message); // nobody to deliver it to
+          continue;
+        }
+        bool wanted = false;
+        for (const std::string &filter : subscribed[clientId])
+        {
+          wanted = wanted || FakeBroker::matches(filter, message->topic);
+        }
+        if (wanted)
+        {
+          due = message;
+          break;
+        }
+        ++message;
+      }
+      if (due == pending.end())
+      {
+        return true;
+      }
+      topic = due->topic;
+      payload = due->payload;
+      pending.erase(due);
+    }
+    if (!deliver(topic, payload))
+    {
+      return false;
+    }
+  }
+}
+
+bool MQTTClient::deliver(const std::string &topic, const std::string &payload)
+{
+  size_t size = 5 + 2 + topic.size() + payload.size();
+  if (size > readBuffer.size())
+  {
+    return fail(LWMQTT_BUFFER_TOO_SHORT);
+  }
+  // Topic and payload are NUL terminated in the read buffer, as in lwmqtt.
+  char *topicCopy = readBuffer.data();
+  char *payloadCopy = topicCopy + topic.size() + 1;
+  memcpy(topicCopy, topic.c_str(), topic.size() + 1);
+  memcpy(payloadCopy, payload.data(), payload.size());
+  payloadCopy[payload.size()] = '\0';
+  if (advancedCallback != nullptr)
+  {
+    advancedCallback(this, topicCopy, payloadCopy, payload.size());
+  }
+  else if (simpleCallback != nullptr)
+  {
+    String topicString(topicCopy);
+    String payloadString(payloadCopy, payload.size());
+    simpleCallback(topicString, payloadString);
+  }
+  return true;
+}
+
+bool MQTTClient::connected()
+{
+  if (session == 0)
+  {
+    return false;
+  }
+  bool open;
+  {
+    std::lock_guard<std::mutex> lock(brokerLock);
+    open = sessionOpen(session);
+    if (open && keepAliveMs > 0 && millis() - lastHeard[session] > keepAliveMs * 3 / 2)
+    {
+      sessions.erase(session); // the broker gave up on a silent client
+      open = false;
+    }
+  }
+  if (!open || transport == nullptr || !transport->connected())
+  {
+    disconnect();
+    return false;
+  }
+  return true;
+}
+
+void MQTTClient::heard()
+{
+  std::lock_guard<std::mutex> lock(brokerLock);
+  lastHeard[session] = millis();
+}
+
+bool MQTTClient::disconnect()
+{
+  std::lock_guard<std::mutex> lock(brokerLock);
+  bool wasOpen = sessionOpen(session);
+  sessions.erase(session);
+  lastHeard.erase(session);
+  session = 0;
+  return wasOpen;
+}
+
+bool MQTTClient::fail(lwmqtt_err_t cause)
+{
+  error = cause;
+  disconnect();
+  if (transport != nullptr)
+  {
+    transport->stop();
+  }
+  return false;
+}
+
+void FakeBroker::configure(const FakeBrokerSettings &settings)
+{
+  std::lock_guard<std::mutex> lock(brokerLock);
+  brokerSettings = settings;
+}
+
+FakeBrokerSettings FakeBroker::settings()
+{
+  std::lock_guard<std::mutex> lock(brokerLock);
+  return brokerSettings;
+}
+
+void FakeBroker::respond(const std::string &filter, Responder responder)
+{
+  std::lock_guard<std::mutex> lock(brokerLock);
+  responders.push_back({filter, responder});
+}
+
+void FakeBroker::send(const std::string &topic, const std::string &payload, uint32_t delayMs)
+{
+  FakeHeapUncounted brokerSide;
+  std::lock_guard<std::mutex> lock(brokerLock);
+  if (delayMs == 0 && !anySubscribed(topic))
+  {
+    return; // nobody to deliver it to
+  }
+  pending.push_back({topic, payload, millis() + delayMs});
+}
+
+void FakeBroker::dropConnections()
+{
+  std::lock_guard<std::mutex> lock(brokerLock);
+  sessions.clear();
+}
+
+void FakeBroker::refuseSubscribes(uint32_t count)
+{
+  std::lock_guard<std::mutex> lock(brokerLock);
+  subscribesToRefuse = count;
+}
+
+void FakeBroker::reset()
+{
+  std::lock_guard<std::mutex> lock(brokerLock);
+  brokerSettings = FakeBrokerSettings();
+  subscribesToRefuse = 0;
+  responders.clear();
+  publishedMessages.clear();
+  pending.clear();
+  subscribed.clear();
+  sessions.clear();
+  connectCount = 0;
+}
+
+std::vector<FakeMessage> FakeBroker::published()
+{
+  std::lock_guard<std::mutex> lock(brokerLock);
+  return publishedMessages;
+}
+
+std::vector<FakeMessage> FakeBroker::published(const std::string &filter)
+{
+  std::lock_guard<std::mutex> lock(brokerLock);
+  std::vector<FakeMessage> found;
+  for (const FakeMessage &message : publishedMessages)
+  {
+    if (matches(filter, message.topic))
+    {
+      found.push_back(message);
+    }
+  }
+  return found;
+}
+
+std::vector<std::string> FakeBroker::subscriptions()
+{
+  std::lock_guard<std::mutex> lock(brokerLock);
+  std::vector<std::string> filters;
+  for (const auto &client : subscribed)
+  {
+    filters.insert(filters.end(), client.second.begin(), client.second.end());
+  }
+  return filters;
+}
+
+uint32_t FakeBroker::connects()
+{
+  std::lock_guard<std::mutex> lock(brokerLock);
+  return connectCount;
+}
+
+bool FakeBroker::matches(const std::string &filter, const std::string &topic)
+{
+  size_t f = 0;
+  size_t t = 0;
+  while (f < filter.size())
+  {
+    if (filter[f] == '#')
+    {
+      return true;
+    }
+    if (filter[f] == '+')
+    {
+      while (t < topic.size() && topic[t] != '/')
+      {
+        t++;
+      }
+      f++;
+      continue;
+    }
+    if (t >= topic.size() || filter[f] != topic[t])
+    {
+      return false;
+    }
+    f++;
+    t++;
+  }
+  return t == topic.size();
+}
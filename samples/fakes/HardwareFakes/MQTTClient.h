@@ -0,0 +1,142 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "Arduino.h"
+#include "Client.h"
+
+// 256dpi/MQTT's MQTTClient, talking to FakeBroker in the same process instead
+// of over its Client. It keeps the library's blocking behaviour: connect()
+// waits for the CONNACK, subscribe() for the SUBACK, and a QoS 1 publish for
+// its PUBACK. A message larger than the read buffer drops the connection, and
+// so does a client that sends nothing (loop() stands for its PINGREQ) for one
+// and a half keep-alive periods.
+
+typedef enum
+{
+  LWMQTT_SUCCESS = 0,
+  LWMQTT_BUFFER_TOO_SHORT = -1,
+  LWMQTT_NETWORK_FAILED_CONNECT = -3,
+  LWMQTT_NETWORK_TIMEOUT = -4,
+  LWMQTT_NETWORK_FAILED_WRITE = -6,
+  LWMQTT_CONNECTION_DENIED = -10,
+  LWMQTT_FAILED_SUBSCRIPTION = -11,
+} lwmqtt_err_t;
+
+class MQTTClient;
+typedef void (*MQTTClientCallbackSimple)(String &topic, String &payload);
+typedef void (*MQTTClientCallbackAdvanced)(MQTTClient *client, char topic[], char bytes[], int length);
+
+class MQTTClient
+{
+public:
+  explicit MQTTClient(int bufferSize = 128) : MQTTClient(bufferSize, bufferSize) {}
+  MQTTClient(int readBufferSize, int writeBufferSize);
+  ~MQTTClient();
+
+  void begin(Client &client) { transport = &client; }
+  void begin(const char hostname[], Client &client) { begin(hostname, 1883, client); }
+  void begin(const char hostname[], int port, Client &client);
+  void onMessage(MQTTClientCallbackSimple callback) { simpleCallback = callback; }
+  void onMessageAdvanced(MQTTClientCallbackAdvanced callback) { advancedCallback = callback; }
+  void setCleanSession(bool clean) { cleanSession = clean; }
+  void setKeepAlive(int seconds) { keepAliveMs = seconds * 1000; }
+  void setTimeout(int ms) { timeoutMs = ms; }
+
+  bool connect(const char clientId[], bool skip = false);
+  bool connect(const char clientId[], const char username[], bool skip = false) { return connect(clientId, skip); }
+  bool publish(const String &topic, const String &payload) { return publish(topic.c_str(), payload, false, 0); }
+  bool publish(const String &topic, const String &payload, bool retained, int qos)
+  {
+    return publish(topic.c_str(), payload.c_str(), payload.length(), retained, qos);
+  }
+  bool publish(const char topic[], const String &payload) { return publish(topic, payload, false, 0); }
+  bool publish(const char topic[], const String &payload, bool retained, int qos)
+  {
+    return publish(topic, payload.c_str(), payload.length(), retained, qos);
+  }
+  bool publish(const char topic[], const char payload[]) { return publish(topic, payload, false, 0); }
+  bool publish(const char topic[], const char payload[], bool retained, int qos)
+  {
+    return publish(topic, payload, strlen(payload), retained, qos);
+  }
+  bool publish(const char topic[], const char payload[], int length) { return publish(topic, payload, length, false, 0); }
+  bool publish(const char topic[], const char payload[], int length, bool retained, int qos);
+  bool subscribe(const String &topic) { return subscribe(topic.c_str(), 0); }
+  bool subscribe(const String &topic, int qos) { return subscribe(topic.c_str(), qos); }
+  bool subscribe(const char topic[]) { return subscribe(topic, 0); }
+  bool subscribe(const char topic[], int qos);
+  bool unsubscribe(const String &topic) { return unsubscribe(topic.c_str()); }
+  bool unsubscribe(const char topic[]);
+  // Delivers the messages that are due.
+  bool loop();
+  bool connected();
+  bool disconnect();
+  lwmqtt_err_t lastError() { return error; }
+
+private:
+  bool deliver(const std::string &topic, const std::string &payload);
+  bool fail(lwmqtt_err_t cause);
+  void heard();
+
+  Client *transport = nullptr;
+  std::string host;
+  int port = 1883;
+  std::vector<char> readBuffer;
+  size_t writeBufferSize;
+  MQTTClientCallbackSimple simpleCallback = nullptr;
+  MQTTClientCallbackAdvanced advancedCallback = nullptr;
+  bool cleanSession = true;
+  int timeoutMs = 1000;
+  uint32_t keepAliveMs = 10000;
+  std::string clientId;
+  uint32_t session = 0; // FakeBroker connection, 0 when not connected
+  lwmqtt_err_t error = LWMQTT_SUCCESS;
+};
+
+// Test side: the broker the MQTTClients connect to.
+struct FakeMessage
+{
+  std::string topic;
+  std::string payload;
+  int qos;
+  unsigned long atMs; // millis() when the broker got it
+};
+
+struct FakeBrokerSettings
+{
+  uint32_t connackMs = 20; // also SUBACK and UNSUBACK
+  uint32_t pubackMs = 20;  // a QoS 1 publish blocks this long
+  bool accepting = true;   // false refuses connections
+};
+
+class FakeBroker
+{
+public:
+  // Called, outside the broker's lock, for every message a device publishes
+  // to a topic matching `filter` (MQTT wildcards), e.g. to answer it.
+  typedef std::function<void(FakeBroker &broker, const FakeMessage &message)> Responder;
+
+  void configure(const FakeBrokerSettings &settings);
+  FakeBrokerSettings settings();
+  void respond(const std::string &filter, Responder responder);
+  // Sends a message to the devices subscribed to `topic` when it is due;
+  // until then subscribe() still counts.
+  void send(const std::string &topic, const std::string &payload, uint32_t delayMs = 0);
+  // Ends every session, as a broker restart would.
+  void dropConnections();
+  // Answers the next `count` SUBSCRIBEs with a failure return code, as when
+  // the device policy does not allow the topic.
+  void refuseSubscribes(uint32_t count);
+  // Forgets the messages, responders, subscriptions and settings.
+  void reset();
+
+  std::vector<FakeMessage> published();
+  std::vector<FakeMessage> published(const std::string &filter);
+  std::vector<std::string> subscriptions();
+  uint32_t connects();
+  static bool matches(const std::string &filter, const std::string &topic);
+};
+
+extern FakeBroker fakeBroker;
@@ -0,0 +1,117 @@
+#include "Preferences.h"
+
+#include <vector>
+
+bool Preferences::begin(const char *name, bool readOnly, const char *partitionLabel)
+{
+  if (started)
+  {
+    return false;
+  }
+  this->readOnly = readOnly;
+  started = nvs_open(name, readOnly ? NVS_READONLY : NVS_READWRITE, &handle) == ESP_OK;
+  return started;
+}
+
+void Preferences::end()
+{
+  if (started)
+  {
+    nvs_close(handle);
+  }
+  started = false;
+}
+
+bool Preferences::wrote(esp_err_t err)
+{
+  return err == ESP_OK && nvs_commit(handle) == ESP_OK;
+}
+
+bool Preferences::clear()
+{
+  return started && !readOnly && wrote(nvs_erase_all(handle));
+}
+
+bool Preferences::remove(const char *key)
+{
+  return started && !readOnly && wrote(nvs_erase_key(handle, key));
+}
+
+bool Preferences::isKey(const char *key)
+{
+  if (!started)
+  {
+    return false;
+  }
+  uint8_t u8;
+  int32_t i32;
+  uint32_t u32;
+  size_t length;
+  return nvs_get_u8(handle, key, &u8) == ESP_OK || nvs_get_i32(handle, key, &i32) == ESP_OK ||
+         nvs_get_u32(handle, key, &u32) == ESP_OK || nvs_get_str(handle, key, nullptr, &length) == ESP_OK;
+}
+
+size_t Preferences::putUChar(const char *key, uint8_t value)
+{
+  return started && !readOnly && wrote(nvs_set_u8(handle, key, value)) ? 1 : 0;
+}
+
+size_t Preferences::putInt(const char *key, int32_t value)
+{
+  return started && !readOnly && wrote(nvs_set_i32(handle, key, value)) ? 4 : 0;
+}
+
+size_t Preferences::putUInt(const char *key, uint32_t value)
+{
+  return started && !readOnly && wrote(nvs_set_u32(handle, key, value)) ? 4 : 0;
+}
+
+size_t Preferences::putString(const char *key, const char *value)
+{
+  return started && !readOnly && wrote(nvs_set_str(handle, key, value)) ? strlen(value) : 0;
+}
+
+uint8_t Preferences::getUChar(const char *key, uint8_t defaultValue)
+{
+  uint8_t value = defaultValue;
+  if (started)
+  {
+    nvs_get_u8(handle, key, &value);
+  }
+  return value;
+}
+
+int32_t Preferences::getInt(const char *key, int32_t defaultValue)
+{
+  int32_t value = defaultValue;
+  if (started)
+  {
+    nvs_get_i32(handle, key, &value);
+  }
+  return value;
+}
+
+uint32_t Preferences::getUInt(const char *key, uint32_t defaultValue)
+{
+  uint32_t value = defaultValue;
+  if (started)
+  {
+    nvs_get_u32(handle, key, &value);
+  }
+  return value;
+}
+
+String Preferences::getString(const char *key, const String &defaultValue)
+{
+  size_t length = 0;
+  if (!started || nvs_get_str(handle, key, nullptr, &length) != ESP_OK)
+  {
+    return defaultValue;
+  }
+  std::vector<char> value(length);
+  if (nvs_get_str(handle, key, value.data(), &length) != ESP_OK)
+  {
+    return defaultValue;
+  }
+  return String(value.data());
+}
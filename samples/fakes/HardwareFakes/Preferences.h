@@ -0,0 +1,43 @@
+#pragma once
+
+#include "Arduino.h"
+#include "nvs.h"
+
+// arduino-esp32's Preferences, which is NVS underneath: it goes through the
+// NVS fake, so it persists, reboots and loses power the same way. Each put
+// commits, as the real one does.
+class Preferences
+{
+public:
+  ~Preferences() { end(); }
+
+  bool begin(const char *name, bool readOnly = false, const char *partitionLabel = nullptr);
+  void end();
+  bool clear();
+  bool remove(const char *key);
+  bool isKey(const char *key);
+
+  size_t putBool(const char *key, bool value) { return putUChar(key, value ? 1 : 0); }
+  size_t putUChar(const char *key, uint8_t value);
+  size_t putInt(const char *key, int32_t value);
+  size_t putUInt(const char *key, uint32_t value);
+  size_t putLong(const char *key, int32_t value) { return putInt(key, value); }
+  size_t putULong(const char *key, uint32_t value) { return putUInt(key, value); }
+  size_t putString(const char *key, const char *value);
+  size_t putString(const char *key, const String &value) { return putString(key, value.c_str()); }
+
+  bool getBool(const char *key, bool defaultValue = false) { return getUChar(key, defaultValue ? 1 : 0) != 0; }
+  uint8_t getUChar(const char *key, uint8_t defaultValue = 0);
+  int32_t getInt(const char *key, int32_t defaultValue = 0);
+  uint32_t getUInt(const char *key, uint32_t defaultValue = 0);
+  int32_t getLong(const char *key, int32_t defaultValue = 0) { return getInt(key, defaultValue); }
+  uint32_t getULong(const char *key, uint32_t defaultValue = 0) { return getUInt(key, defaultValue); }
+  String getString(const char *key, const String &defaultValue = String());
+
+private:
+  bool wrote(esp_err_t err);
+
+  nvs_handle_t handle = 0;
+  bool started = false;
+  bool readOnly = false;
+};
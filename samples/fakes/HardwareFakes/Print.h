@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "WString.h"
+
+class Print
+{
+public:
+  virtual ~Print() {}
+
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size)
+  {
+    size_t n = 0;
+    while (size-- > 0 && write(*buffer++) == 1)
+    {
+      n++;
+    }
+    return n;
+  }
+  size_t write(const char *text) { return text ? write((const uint8_t *)text, strlen(text)) : 0; }
+  size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+  virtual void flush() {}
+
+  // Formats into a 64-byte stack buffer, and a heap one when that is too
+  // small, like the ESP32 core.
+  size_t printf(const char *format, ...);
+
+  size_t print(const String &text) { return write(text.c_str(), text.length()); }
+  size_t print(const char *text) { return write(text); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char n, int base = 10) { return print(String((unsigned int)n, base)); }
+  size_t print(int n, int base = 10) { return print(String(n, base)); }
+  size_t print(unsigned int n, int base = 10) { return print(String(n, base)); }
+  size_t print(long n, int base = 10) { return print(String(n, base)); }
+  size_t print(unsigned long n, int base = 10) { return print(String(n, base)); }
+  size_t print(long long n, int base = 10) { return print(String(n, base)); }
+  size_t print(unsigned long long n, int base = 10) { return print(String(n, base)); }
+  size_t print(double n, int digits = 2) { return print(String(n, digits)); }
+
+  size_t println() { return write("\r\n"); }
+  template <typename T>
+  size_t println(const T &value)
+  {
+    size_t n = print(value);
+    return n + println();
+  }
+  template <typename T>
+  size_t println(const T &value, int format)
+  {
+    size_t n = print(value, format);
+    return n + println();
+  }
+};
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "Arduino.h"
+
+// The samples reach SPIFFS through stdio paths, which on the host are plain
+// files; there is nothing to mount.
+class SPIFFSFS
+{
+public:
+  bool begin(bool formatOnFail = false, const char *basePath = "/spiffs", uint8_t maxOpenFiles = 10,
+             const char *partitionLabel = nullptr)
+  {
+    return true;
+  }
+  void end() {}
+  size_t totalBytes() { return 0x360000; }
+};
+
+extern SPIFFSFS SPIFFS;
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "Print.h"
+
+class Stream : public Print
+{
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+
+  void setTimeout(unsigned long timeoutMs) { timeout = timeoutMs; }
+  unsigned long getTimeout() const { return timeout; }
+
+  // Waits up to the timeout for each byte, like the Arduino core.
+  size_t readBytes(char *buffer, size_t length);
+  size_t readBytes(uint8_t *buffer, size_t length) { return readBytes((char *)buffer, length); }
+  String readString();
+  String readStringUntil(char terminator);
+
+protected:
+  int timedRead();
+
+  unsigned long timeout = 1000;
+};
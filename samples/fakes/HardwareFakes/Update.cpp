@@ -0,0 +1,150 @@
+#include "Update.h"
+
+UpdateClass Update;
+
+bool UpdateClass::begin(size_t size)
+{
+  if (partition != nullptr || size == 0)
+  {
+    error = UPDATE_ERROR_BAD_ARGUMENT;
+    return false;
+  }
+  const esp_partition_t *next = esp_ota_get_next_update_partition(nullptr);
+  if (next == nullptr)
+  {
+    error = UPDATE_ERROR_NO_PARTITION;
+    return false;
+  }
+  if (size == UPDATE_SIZE_UNKNOWN)
+  {
+    size = next->size;
+  }
+  if (size > next->size)
+  {
+    error = UPDATE_ERROR_SIZE;
+    return false;
+  }
+  partition = next;
+  this->size = size;
+  written = 0;
+  buffered = 0;
+  error = UPDATE_ERROR_OK;
+  return true;
+}
+
+bool UpdateClass::flush()
+{
+  size_t offset = written - buffered;
+  if (esp_partition_erase_range(partition, offset, sizeof(sector)) != ESP_OK)
+  {
+    error = UPDATE_ERROR_ERASE;
+    return false;
+  }
+  if (esp_partition_write(partition, offset, sector, buffered) != ESP_OK)
+  {
+    error = UPDATE_ERROR_WRITE;
+    return false;
+  }
+  buffered = 0;
+  return true;
+}
+
+size_t UpdateClass::write(uint8_t *data, size_t length)
+{
+  if (partition == nullptr || hasError())
+  {
+    return 0;
+  }
+  if (length > remaining())
+  {
+    error = UPDATE_ERROR_SPACE;
+    return 0;
+  }
+  size_t done = 0;
+  while (done < length)
+  {
+    size_t n = min(length - done, sizeof(sector) - buffered);
+    memcpy(sector + buffered, data + done, n);
+    buffered += n;
+    written += n;
+    done += n;
+    if ((buffered == sizeof(sector) || written == size) && !flush())
+    {
+      return done - n;
+    }
+  }
+  return done;
+}
+
+size_t UpdateClass::writeStream(Stream &data)
+{
+  uint8_t chunk[512];
+  size_t total = 0;
+  while (remaining() > 0 && !hasError())
+  {
+    size_t n = data.readBytes(chunk, min(sizeof(chunk), remaining()));
+    if (n == 0 || write(chunk, n) != n)
+    {
+      break;
+    }
+    total += n;
+  }
+  return total;
+}
+
+bool UpdateClass::end(bool evenIfRemaining)
+{
+  if (partition == nullptr || hasError())
+  {
+    return false;
+  }
+  if (!isFinished() && !evenIfRemaining)
+  {
+    error = UPDATE_ERROR_ABORT;
+    abort();
+    return false;
+  }
+  if (buffered > 0 && !flush())
+  {
+    return false;
+  }
+  bool activated = esp_ota_set_boot_partition(partition) == ESP_OK;
+  error = activated ? UPDATE_ERROR_OK : UPDATE_ERROR_ACTIVATE;
+  partition = nullptr;
+  return activated;
+}
+
+void UpdateClass::abort()
+{
+  partition = nullptr;
+  buffered = 0;
+  if (error == UPDATE_ERROR_OK)
+  {
+    error = UPDATE_ERROR_ABORT;
+  }
+}
+
+const char *UpdateClass::errorString()
+{
+  switch (error)
+  {
+  case UPDATE_ERROR_OK:
+    return "No Error";
+  case UPDATE_ERROR_WRITE:
+    return "Flash Write Failed";
+  case UPDATE_ERROR_ERASE:
+    return "Flash Erase Failed";
+  case UPDATE_ERROR_SPACE:
+    return "Not Enough Space";
+  case UPDATE_ERROR_SIZE:
+    return "Bad Size Given";
+  case UPDATE_ERROR_ACTIVATE:
+    return "Could Not Activate The Firmware";
+  case UPDATE_ERROR_NO_PARTITION:
+    return "Partition Could Not be Found";
+  case UPDATE_ERROR_BAD_ARGUMENT:
+    return "Bad Argument";
+  default:
+    return "Aborted";
+  }
+}
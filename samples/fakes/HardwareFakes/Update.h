@@ -0,0 +1,49 @@
+#pragma once
+
+#include "Arduino.h"
+#include "esp_ota_ops.h"
+
+#define UPDATE_SIZE_UNKNOWN 0xFFFFFFFF
+#define UPDATE_ERROR_OK 0
+#define UPDATE_ERROR_WRITE 1
+#define UPDATE_ERROR_ERASE 2
+#define UPDATE_ERROR_SPACE 4
+#define UPDATE_ERROR_SIZE 5
+#define UPDATE_ERROR_ACTIVATE 8
+#define UPDATE_ERROR_NO_PARTITION 9
+#define UPDATE_ERROR_BAD_ARGUMENT 10
+#define UPDATE_ERROR_ABORT 11
+
+// arduino-esp32's Update on the flash fake: it gathers writes into 4 KB
+// sectors and erases and programs one sector at a time, as the real class
+// does, then switches the boot partition in end().
+class UpdateClass
+{
+public:
+  bool begin(size_t size = UPDATE_SIZE_UNKNOWN);
+  size_t write(uint8_t *data, size_t length);
+  size_t writeStream(Stream &data);
+  bool end(bool evenIfRemaining = false);
+  void abort();
+
+  bool isRunning() { return partition != nullptr; }
+  bool isFinished() { return written == size; }
+  bool hasError() { return error != UPDATE_ERROR_OK; }
+  uint8_t getError() { return error; }
+  size_t progress() { return written; }
+  size_t remaining() { return size - written; }
+  const char *errorString();
+  void printError(Print &out) { out.printf("ERROR[%u]: %s\n", error, errorString()); }
+
+private:
+  bool flush();
+
+  const esp_partition_t *partition = nullptr;
+  size_t size = 0;
+  size_t written = 0;
+  uint8_t sector[4096];
+  size_t buffered = 0;
+  uint8_t error = UPDATE_ERROR_OK;
+};
+
+extern UpdateClass Update;
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
+
+// Arduino's String over std::string, with the members the samples and
+// ArduinoJson use.
+class String
+{
+public:
+  String(const char *text = "") : value(text ? text : "") {}
+  String(const char *text, size_t length) : value(text, length) {}
+  String(const std::string &text) : value(text) {}
+  explicit String(char c) : value(1, c) {}
+  explicit String(int n, unsigned char base = 10) : value(format((long long)n, base)) {}
+  explicit String(unsigned int n, unsigned char base = 10) : value(formatUnsigned(n, base)) {}
+  explicit String(long n, unsigned char base = 10) : value(format((long long)n, base)) {}
+  explicit String(unsigned long n, unsigned char base = 10) : value(formatUnsigned(n, base)) {}
+  explicit String(long long n, unsigned char base = 10) : value(format(n, base)) {}
+  explicit String(unsigned long long n, unsigned char base = 10) : value(formatUnsigned(n, base)) {}
+  explicit String(double n, unsigned int decimals = 2)
+  {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%.*f", (int)decimals, n);
+    value = buffer;
+  }
+
+  const char *c_str() const { return value.c_str(); }
+  size_t length() const { return value.size(); }
+  bool isEmpty() const { return value.empty(); }
+  bool reserve(size_t size)
+  {
+    value.reserve(size);
+    return true;
+  }
+  char charAt(size_t index) const { return index < value.size() ? value[index] : 0; }
+  char operator[](size_t index) const { return charAt(index); }
+  char &operator[](size_t index) { return value[index]; }
+  const std::string &str() const { return value; }
+
+  bool concat(const String &other)
+  {
+    value += other.value;
+    return true;
+  }
+  bool concat(const char *text)
+  {
+    value += text ? text : "";
+    return true;
+  }
+  bool concat(const char *text, size_t length)
+  {
+    value.append(text, length);
+    return true;
+  }
+  bool concat(char c)
+  {
+    value += c;
+    return true;
+  }
+  bool concat(int n) { return concat(String(n)); }
+  bool concat(unsigned int n) { return concat(String(n)); }
+  bool concat(long n) { return concat(String(n)); }
+  bool concat(unsigned long n) { return concat(String(n)); }
+  bool concat(double n) { return concat(String(n)); }
+  template <typename T>
+  String &operator+=(const T &other)
+  {
+    concat(other);
+    return *this;
+  }
+
+  bool equals(const String &other) const { return value == other.value; }
+  bool equals(const char *text) const { return value == (text ? text : ""); }
+  bool equalsIgnoreCase(const String &other) const { return strcasecmp(c_str(), other.c_str()) == 0; }
+  bool startsWith(const String &prefix) const { return value.compare(0, prefix.length(), prefix.value) == 0; }
+  bool endsWith(const String &suffix) const
+  {
+    return suffix.length() <= length() && value.compare(length() - suffix.length(), suffix.length(), suffix.value) == 0;
+  }
+  int indexOf(char c, size_t from = 0) const { return position(value.find(c, from)); }
+  int indexOf(const String &text, size_t from = 0) const { return position(value.find(text.value, from)); }
+  int lastIndexOf(char c) const { return position(value.rfind(c)); }
+  int lastIndexOf(const String &text) const { return position(value.rfind(text.value)); }
+  String substring(size_t from) const { return from < value.size() ? String(value.substr(from)) : String(); }
+  String substring(size_t from, size_t to) const
+  {
+    if (from > to)
+    {
+      size_t swap = from;
+      from = to;
+      to = swap;
+    }
+    return from < value.size() ? String(value.substr(from, to - from)) : String();
+  }
+  void replace(const String &find, const String &with)
+  {
+    if (find.isEmpty())
+    {
+      return;
+    }
+    for (size_t at = value.find(find.value); at != std::string::npos; at = value.find(find.value, at + with.length()))
+    {
+      value.replace(at, find.length(), with.value);
+    }
+  }
+  void remove(size_t index) { value.erase(index < value.size() ? index : value.size()); }
+  void remove(size_t index, size_t count) { value.erase(index < value.size() ? index : value.size(), count); }
+  void toLowerCase()
+  {
+    for (char &c : value)
+    {
+      c = tolower((unsigned char)c);
+    }
+  }
+  void toUpperCase()
+  {
+    for (char &c : value)
+    {
+      c = toupper((unsigned char)c);
+    }
+  }
+  void trim()
+  {
+    size_t first = value.find_first_not_of(" \t\r\n");
+    size_t last = value.find_last_not_of(" \t\r\n");
+    value = first == std::string::npos ? "" : value.substr(first, last - first + 1);
+  }
+  long toInt() const { return atol(c_str()); }
+  float toFloat() const { return atof(c_str()); }
+  double toDouble() const { return atof(c_str()); }
+
+  friend bool operator==(const String &a, const String &b) { return a.value == b.value; }
+  friend bool operator==(const String &a, const char *b) { return a.equals(b); }
+  friend bool operator==(const char *a, const String &b) { return b.equals(a); }
+  friend bool operator!=(const String &a, const String &b) { return a.value != b.value; }
+  friend bool operator!=(const String &a, const char *b) { return !a.equals(b); }
+  friend bool operator!=(const char *a, const String &b) { return !b.equals(a); }
+  friend bool operator<(const String &a, const String &b) { return a.value < b.value; }
+
+private:
+  static std::string format(long long n, unsigned char base)
+  {
+    return n < 0 ? "-" + formatUnsigned(0ull - (unsigned long long)n, base) : formatUnsigned(n, base);
+  }
+  static std::string formatUnsigned(unsigned long long n, unsigned char base)
+  {
+    std::string digits;
+    do
+    {
+      digits.insert(digits.begin(), "0123456789abcdefghijklmnopqrstuvwxyz"[n % base]);
+      n /= base;
+    } while (n > 0);
+    return digits;
+  }
+  static int position(size_t at) { return at == std::string::npos ? -1 : (int)at; }
+
+  std::string value;
+};
+
+// What `"a" + String(b)` makes, as in the Arduino core.
+class StringSumHelper : public String
+{
+public:
+  StringSumHelper(const String &text) : String(text) {}
+  StringSumHelper(const char *text) : String(text) {}
+};
+
+inline StringSumHelper operator+(const String &a, const String &b)
+{
+  StringSumHelper sum(a);
+  sum.concat(b);
+  return sum;
+}
+inline StringSumHelper operator+(const String &a, const char *b)
+{
+  StringSumHelper sum(a);
+  sum.concat(b);
+  return sum;
+}
+inline StringSumHelper operator+(const char *a, const String &b)
+{
+  StringSumHelper sum(a);
+  sum.concat(b);
+  return sum;
+}
+inline StringSumHelper operator+(const String &a, char b)
+{
+  StringSumHelper sum(a);
+  sum.concat(b);
+  return sum;
+}
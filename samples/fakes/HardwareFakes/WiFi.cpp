@@ -0,0 +1,109 @@
+#include "WiFi.h"
+
+#include <arpa/inet.h>
+#include <mutex>
+#include <netdb.h>
+
+WiFiClass WiFi;
+
+static std::mutex networkLock;
+static FakeNetworkSettings settings;
+static bool networkUp = true;
+static uint32_t generation = 1;
+static bool joining = false;
+static unsigned long joinStarted = 0;
+
+wl_status_t WiFiClass::begin(const char *ssid, const char *password)
+{
+  std::lock_guard<std::mutex> lock(networkLock);
+  joining = true;
+  joinStarted = millis();
+  return WL_DISCONNECTED;
+}
+
+wl_status_t WiFiClass::status()
+{
+  std::lock_guard<std::mutex> lock(networkLock);
+  if (!joining)
+  {
+    return WL_IDLE_STATUS;
+  }
+  if (!networkUp)
+  {
+    return WL_CONNECTION_LOST;
+  }
+  return millis() - joinStarted >= settings.joinMs ? WL_CONNECTED : WL_DISCONNECTED;
+}
+
+bool WiFiClass::disconnect(bool wifiOff)
+{
+  std::lock_guard<std::mutex> lock(networkLock);
+  joining = false;
+  return true;
+}
+
+IPAddress WiFiClass::localIP()
+{
+  return status() == WL_CONNECTED ? IPAddress(192, 168, 1, 10) : IPAddress();
+}
+
+int WiFiClass::hostByName(const char *host, IPAddress &ip)
+{
+  if (ip.fromString(host))
+  {
+    return 1;
+  }
+  if (strcmp(host, "localhost") == 0)
+  {
+    ip = IPAddress(127, 0, 0, 1);
+    return 1;
+  }
+  addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  addrinfo *found = nullptr;
+  if (getaddrinfo(host, nullptr, &hints, &found) != 0 || found == nullptr)
+  {
+    return 0;
+  }
+  ip = IPAddress((uint32_t)((sockaddr_in *)found->ai_addr)->sin_addr.s_addr);
+  freeaddrinfo(found);
+  return 1;
+}
+
+void fakeNetworkConfigure(const FakeNetworkSettings &changed)
+{
+  std::lock_guard<std::mutex> lock(networkLock);
+  settings = changed;
+}
+
+FakeNetworkSettings fakeNetworkSettings()
+{
+  std::lock_guard<std::mutex> lock(networkLock);
+  return settings;
+}
+
+void fakeNetworkUp(bool up)
+{
+  std::lock_guard<std::mutex> lock(networkLock);
+  if (networkUp && !up)
+  {
+    generation++;
+  }
+  if (!networkUp && up)
+  {
+    joinStarted = millis(); // the station joins again
+  }
+  networkUp = up;
+}
+
+bool fakeNetworkIsUp()
+{
+  std::lock_guard<std::mutex> lock(networkLock);
+  return networkUp;
+}
+
+uint32_t fakeNetworkGeneration()
+{
+  std::lock_guard<std::mutex> lock(networkLock);
+  return generation;
+}
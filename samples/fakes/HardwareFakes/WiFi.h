@@ -0,0 +1,48 @@
+#pragma once
+
+#include "Arduino.h"
+#include "IPAddress.h"
+#include "WiFiClient.h"
+
+typedef enum
+{
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_CONNECTION_LOST = 5,
+  WL_DISCONNECTED = 6
+} wl_status_t;
+
+// A station that joins any network joinMs (see below) after begin(), while
+// the test has the network up.
+class WiFiClass
+{
+public:
+  wl_status_t begin(const char *ssid, const char *password = nullptr);
+  wl_status_t status();
+  bool disconnect(bool wifiOff = false);
+  bool isConnected() { return status() == WL_CONNECTED; }
+  IPAddress localIP();
+  // Dotted quads, "localhost", and otherwise the host's resolver.
+  int hostByName(const char *host, IPAddress &ip);
+};
+
+extern WiFiClass WiFi;
+
+// Test side: the network as the fakes see it. Taking it down drops the
+// station, and every connection made through WiFiClientSecure or HTTPClient.
+struct FakeNetworkSettings
+{
+  uint32_t joinMs = 50;              // WiFi.begin() to WL_CONNECTED
+  uint32_t tlsHandshakeMs = 300;     // each WiFiClientSecure::connect()
+  uint32_t uplinkBytesPerSecond = 0; // HTTP request bodies; 0 is all at once
+};
+
+void fakeNetworkConfigure(const FakeNetworkSettings &settings);
+FakeNetworkSettings fakeNetworkSettings();
+void fakeNetworkUp(bool up);
+bool fakeNetworkIsUp();
+// Changes whenever the network goes down; a connection made in an earlier
+// generation is gone.
+uint32_t fakeNetworkGeneration();
@@ -0,0 +1,151 @@
+#include "WiFiClient.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "WiFi.h"
+
+int WiFiClient::connect(IPAddress ip, uint16_t port, int32_t timeout)
+{
+  stop();
+  socket = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (socket < 0)
+  {
+    return 0;
+  }
+  fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+  int one = 1;
+  setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = (uint32_t)ip;
+  if (::connect(socket, (sockaddr *)&address, sizeof(address)) != 0 && errno != EINPROGRESS)
+  {
+    stop();
+    return 0;
+  }
+  pollfd ready = {socket, POLLOUT, 0};
+  int error = 0;
+  socklen_t length = sizeof(error);
+  if (poll(&ready, 1, timeout) != 1 || getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0)
+  {
+    stop();
+    return 0;
+  }
+  return 1;
+}
+
+int WiFiClient::connect(const char *host, uint16_t port, int32_t timeout)
+{
+  IPAddress ip;
+  return WiFi.hostByName(host, ip) ? connect(ip, port, timeout) : 0;
+}
+
+size_t WiFiClient::write(const uint8_t *data, size_t length)
+{
+  size_t written = 0;
+  while (socket >= 0 && written < length)
+  {
+    ssize_t n = send(socket, data + written, length - written, MSG_NOSIGNAL);
+    if (n > 0)
+    {
+      written += n;
+    }
+    else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      pollfd ready = {socket, POLLOUT, 0};
+      poll(&ready, 1, 100);
+    }
+    else
+    {
+      stop();
+    }
+  }
+  return written;
+}
+
+int WiFiClient::available()
+{
+  if (socket < 0)
+  {
+    return peeked >= 0 ? 1 : 0;
+  }
+  int pending = 0;
+  ioctl(socket, FIONREAD, &pending);
+  return pending + (peeked >= 0 ? 1 : 0);
+}
+
+int WiFiClient::read()
+{
+  uint8_t value;
+  return read(&value, 1) == 1 ? value : -1;
+}
+
+int WiFiClient::read(uint8_t *buffer, size_t length)
+{
+  if (length == 0)
+  {
+    return 0;
+  }
+  size_t offset = 0;
+  if (peeked >= 0)
+  {
+    buffer[offset++] = peeked;
+    peeked = -1;
+  }
+  if (socket < 0 || offset == length)
+  {
+    return offset > 0 ? (int)offset : -1;
+  }
+  ssize_t n = recv(socket, buffer + offset, length - offset, MSG_DONTWAIT);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+  {
+    stop(); // closed by the peer
+  }
+  return n > 0 ? (int)(offset + n) : (offset > 0 ? (int)offset : -1);
+}
+
+int WiFiClient::peek()
+{
+  if (peeked < 0)
+  {
+    uint8_t value;
+    if (read(&value, 1) == 1)
+    {
+      peeked = value;
+    }
+  }
+  return peeked;
+}
+
+void WiFiClient::stop()
+{
+  if (socket >= 0)
+  {
+    close(socket);
+    socket = -1;
+  }
+}
+
+uint8_t WiFiClient::connected()
+{
+  if (socket < 0)
+  {
+    return peeked >= 0;
+  }
+  uint8_t probe;
+  ssize_t n = recv(socket, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+  {
+    // Closed, but unread data is still readable.
+    return available() > 0;
+  }
+  return 1;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "Arduino.h"
+#include "Client.h"
+
+// A TCP client on a host socket, so TlsClient can be tested against a local
+// server. Reads never block; connect() takes its timeout in milliseconds.
+class WiFiClient : public Client
+{
+public:
+  WiFiClient() {}
+  ~WiFiClient() { stop(); }
+  WiFiClient(const WiFiClient &) = delete;
+  WiFiClient &operator=(const WiFiClient &) = delete;
+
+  int connect(IPAddress ip, uint16_t port) override { return connect(ip, port, 3000); }
+  virtual int connect(IPAddress ip, uint16_t port, int32_t timeout);
+  int connect(const char *host, uint16_t port) override { return connect(host, port, 3000); }
+  virtual int connect(const char *host, uint16_t port, int32_t timeout);
+  size_t write(uint8_t data) override { return write(&data, 1); }
+  size_t write(const uint8_t *data, size_t length) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+  int read(uint8_t *buffer, size_t length) override;
+  int peek() override;
+  void flush() override {}
+  void stop() override;
+  uint8_t connected() override;
+  operator bool() override { return connected(); }
+  int fd() const { return socket; }
+
+private:
+  int socket = -1;
+  int peeked = -1;
+};
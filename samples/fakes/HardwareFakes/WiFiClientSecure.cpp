@@ -0,0 +1,37 @@
+#include "WiFiClientSecure.h"
+
+#include <atomic>
+
+static std::atomic<uint32_t> handshakeCount(0);
+
+int WiFiClientSecure::connect(const char *host, uint16_t port, int32_t timeout)
+{
+  stop();
+  uint32_t handshakeMs = fakeNetworkSettings().tlsHandshakeMs;
+  if (WiFi.status() != WL_CONNECTED)
+  {
+    failed = true;
+    return 0;
+  }
+  // The handshake is CPU and round trips; past the timeout it fails.
+  delay(handshakeMs < handshakeTimeoutS * 1000 ? handshakeMs : handshakeTimeoutS * 1000);
+  failed = handshakeMs >= handshakeTimeoutS * 1000 || !fakeNetworkIsUp();
+  if (failed)
+  {
+    return 0;
+  }
+  handshakeCount++;
+  generation = fakeNetworkGeneration();
+  return 1;
+}
+
+int WiFiClientSecure::lastError(char *buffer, const size_t size)
+{
+  snprintf(buffer, size, "%s", failed ? "handshake failed" : "");
+  return failed ? -1 : 0;
+}
+
+uint32_t WiFiClientSecure::handshakes()
+{
+  return handshakeCount;
+}
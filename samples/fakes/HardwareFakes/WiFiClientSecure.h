@@ -0,0 +1,39 @@
+#pragma once
+
+#include "WiFi.h"
+
+// A TLS connection that is only simulated: connect() takes the configured
+// handshake time and succeeds while the network is up, and the connection
+// lasts until stop() or the network goes down. MQTTClient and HTTPClient
+// (the fakes) only ask it whether it is connected; no bytes go through it.
+class WiFiClientSecure : public WiFiClient
+{
+public:
+  void setCACert(const char *rootCA) {}
+  void setCertificate(const char *clientCertificate) {}
+  void setPrivateKey(const char *privateKey) {}
+  void setInsecure() {}
+  void setHandshakeTimeout(unsigned long seconds) { handshakeTimeoutS = seconds; }
+  int lastError(char *buffer, const size_t size);
+
+  int connect(IPAddress ip, uint16_t port) override { return connect(ip.toString().c_str(), port, 0); }
+  int connect(IPAddress ip, uint16_t port, int32_t timeout) override { return connect(ip.toString().c_str(), port, timeout); }
+  int connect(const char *host, uint16_t port) override { return connect(host, port, 0); }
+  int connect(const char *host, uint16_t port, int32_t timeout) override;
+  size_t write(const uint8_t *data, size_t length) override { return connected() ? length : 0; }
+  using WiFiClient::write;
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int read(uint8_t *buffer, size_t length) override { return -1; }
+  int peek() override { return -1; }
+  void stop() override { generation = 0; }
+  uint8_t connected() override { return generation != 0 && generation == fakeNetworkGeneration() && fakeNetworkIsUp(); }
+
+  // Test side: handshakes run by all WiFiClientSecures so far.
+  static uint32_t handshakes();
+
+private:
+  unsigned long handshakeTimeoutS = 120;
+  uint32_t generation = 0; // fakeNetworkGeneration() when connected
+  bool failed = false;
+};
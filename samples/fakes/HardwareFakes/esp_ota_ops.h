@@ -0,0 +1,13 @@
+#pragma once
+
+#include "esp_partition.h"
+
+typedef uint32_t esp_ota_handle_t;
+
+// Boots from app0 (ota_0) until esp_ota_set_boot_partition() selects app1.
+const esp_partition_t *esp_ota_get_running_partition();
+const esp_partition_t *esp_ota_get_boot_partition();
+// The app partition that is not running.
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start);
+// Checks the image magic byte, as the real one checks the image.
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition);
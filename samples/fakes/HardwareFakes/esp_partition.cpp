@@ -0,0 +1,204 @@
+#include "esp_partition.h"
+
+#include <string.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Arduino.h"
+#include "esp_ota_ops.h"
+
+static const size_t SECTOR_SIZE = 4096;
+
+static esp_partition_t partitions[] = {
+    {ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, 0x9000, 0x6000, "nvs", false},
+    {ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_OTA, 0xf000, 0x2000, "otadata", false},
+    {ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, 0x20000, 0x639000, "app0", false},
+    {ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, 0x660000, 0x639000, "app1", false},
+    {ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, 0xca0000, 0x360000, "spiffs", false},
+    {ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS_KEYS, 0x1000000, 0x1000, "nvs_key", true},
+};
+static const size_t PARTITION_COUNT = sizeof(partitions) / sizeof(partitions[0]);
+
+static std::mutex flashLock;
+static std::vector<uint8_t> contents[PARTITION_COUNT]; // allocated on first use
+static FakeFlashTiming timing;
+static FakeFlashStats stats;
+static const esp_partition_t *bootPartition = &partitions[2];
+
+static std::vector<uint8_t> *storage(const esp_partition_t *partition)
+{
+  size_t index = partition - partitions;
+  if (index >= PARTITION_COUNT)
+  {
+    return nullptr;
+  }
+  if (contents[index].empty())
+  {
+    FakeHeapUncounted flash;
+    contents[index].assign(partition->size, 0xff);
+  }
+  return &contents[index];
+}
+
+static void charge(uint64_t us)
+{
+  if (us > 0)
+  {
+    stats.busyUs += us;
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+  }
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                 const char *label)
+{
+  for (const esp_partition_t &partition : partitions)
+  {
+    if ((type == ESP_PARTITION_TYPE_ANY || partition.type == type) &&
+        (subtype == ESP_PARTITION_SUBTYPE_ANY || partition.subtype == subtype) &&
+        (label == nullptr || strcmp(partition.label, label) == 0))
+    {
+      return &partition;
+    }
+  }
+  return nullptr;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t offset, void *destination, size_t size)
+{
+  std::unique_lock<std::mutex> lock(flashLock);
+  std::vector<uint8_t> *flash = partition ? storage(partition) : nullptr;
+  if (flash == nullptr)
+  {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (offset > flash->size() || size > flash->size() - offset)
+  {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  memcpy(destination, flash->data() + offset, size);
+  stats.reads++;
+  uint64_t cost = timing.callUs;
+  lock.unlock();
+  charge(cost);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t offset, const void *source, size_t size)
+{
+  std::unique_lock<std::mutex> lock(flashLock);
+  std::vector<uint8_t> *flash = partition ? storage(partition) : nullptr;
+  if (flash == nullptr)
+  {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (offset > flash->size() || size > flash->size() - offset)
+  {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  const uint8_t *bytes = (const uint8_t *)source;
+  for (size_t i = 0; i < size; i++)
+  {
+    (*flash)[offset + i] &= bytes[i]; // programming only clears bits
+  }
+  stats.writes++;
+  stats.bytesWritten += size;
+  uint64_t cost = timing.callUs + (uint64_t)timing.writeKbUs * size / 1024;
+  lock.unlock();
+  charge(cost);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+  std::unique_lock<std::mutex> lock(flashLock);
+  std::vector<uint8_t> *flash = partition ? storage(partition) : nullptr;
+  if (flash == nullptr)
+  {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (offset % SECTOR_SIZE != 0 || size % SECTOR_SIZE != 0)
+  {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (offset > flash->size() || size > flash->size() - offset)
+  {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  memset(flash->data() + offset, 0xff, size);
+  stats.erases += size / SECTOR_SIZE;
+  uint64_t cost = timing.callUs + (uint64_t)timing.eraseSectorUs * (size / SECTOR_SIZE);
+  lock.unlock();
+  charge(cost);
+  return ESP_OK;
+}
+
+const esp_partition_t *esp_ota_get_running_partition()
+{
+  return &partitions[2];
+}
+
+const esp_partition_t *esp_ota_get_boot_partition()
+{
+  std::lock_guard<std::mutex> lock(flashLock);
+  return bootPartition;
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start)
+{
+  return &partitions[3];
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition)
+{
+  std::lock_guard<std::mutex> lock(flashLock);
+  std::vector<uint8_t> *flash = partition ? storage(partition) : nullptr;
+  if (flash == nullptr || partition->type != ESP_PARTITION_TYPE_APP)
+  {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if ((*flash)[0] != 0xe9)
+  {
+    return ESP_ERR_OTA_VALIDATE_FAILED;
+  }
+  bootPartition = partition;
+  return ESP_OK;
+}
+
+void fakeFlashTiming(const FakeFlashTiming &changed)
+{
+  std::lock_guard<std::mutex> lock(flashLock);
+  timing = changed;
+}
+
+FakeFlashStats fakeFlashStats()
+{
+  std::lock_guard<std::mutex> lock(flashLock);
+  return stats;
+}
+
+void fakeFlashReset()
+{
+  std::lock_guard<std::mutex> lock(flashLock);
+  for (std::vector<uint8_t> &flash : contents)
+  {
+    flash.clear();
+  }
+  stats = FakeFlashStats();
+  bootPartition = &partitions[2];
+}
+
+void fakeFlashLoad(const esp_partition_t *partition, const std::string &data)
+{
+  std::lock_guard<std::mutex> lock(flashLock);
+  std::vector<uint8_t> *flash = storage(partition);
+  memcpy(flash->data(), data.data(), data.size() < flash->size() ? data.size() : flash->size());
+}
+
+std::string fakeFlashContents(const esp_partition_t *partition, size_t size)
+{
+  std::lock_guard<std::mutex> lock(flashLock);
+  std::vector<uint8_t> *flash = storage(partition);
+  return std::string((const char *)flash->data(), size < flash->size() ? size : flash->size());
+}
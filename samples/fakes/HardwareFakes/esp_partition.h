@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include "esp_err.h"
+
+typedef enum
+{
+  ESP_PARTITION_TYPE_APP = 0x00,
+  ESP_PARTITION_TYPE_DATA = 0x01,
+  ESP_PARTITION_TYPE_ANY = 0xff
+} esp_partition_type_t;
+
+typedef enum
+{
+  ESP_PARTITION_SUBTYPE_APP_OTA_0 = 0x10,
+  ESP_PARTITION_SUBTYPE_APP_OTA_1 = 0x11,
+  ESP_PARTITION_SUBTYPE_DATA_OTA = 0x00,
+  ESP_PARTITION_SUBTYPE_DATA_NVS = 0x02,
+  ESP_PARTITION_SUBTYPE_DATA_NVS_KEYS = 0x04,
+  ESP_PARTITION_SUBTYPE_DATA_SPIFFS = 0x82,
+  ESP_PARTITION_SUBTYPE_ANY = 0xff
+} esp_partition_subtype_t;
+
+typedef struct
+{
+  esp_partition_type_t type;
+  esp_partition_subtype_t subtype;
+  uint32_t address;
+  uint32_t size;
+  char label[17];
+  bool encrypted;
+} esp_partition_t;
+
+// In RAM, with the samples' custom_partitions.csv layout. Flash rules apply:
+// erases are whole 4 KB sectors, and a write only clears bits.
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                 const char *label);
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t offset, void *destination, size_t size);
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t offset, const void *source, size_t size);
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size);
+
+// Test side. Flash timing, charged as a delay in each call; all 0 (instant)
+// by default.
+struct FakeFlashTiming
+{
+  uint32_t eraseSectorUs = 0; // per 4 KB sector
+  uint32_t writeKbUs = 0;     // per KB programmed
+  uint32_t callUs = 0;        // per read, write or erase call
+};
+
+struct FakeFlashStats
+{
+  uint32_t erases = 0; // sectors
+  uint32_t writes = 0; // calls
+  uint64_t bytesWritten = 0;
+  uint32_t reads = 0;
+  uint64_t busyUs = 0; // delay charged so far
+};
+
+void fakeFlashTiming(const FakeFlashTiming &timing);
+FakeFlashStats fakeFlashStats();
+// Erases every partition and clears the stats.
+void fakeFlashReset();
+// Fills a partition from offset 0, e.g. the running image.
+void fakeFlashLoad(const esp_partition_t *partition, const std::string &data);
+std::string fakeFlashContents(const esp_partition_t *partition, size_t size);
@@ -0,0 +1,565 @@
+#include "nvs.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+#include "Arduino.h"
+#include "nvs_flash.h"
+
+enum ValueType : char
+{
+  U8 = 'b',
+  I32 = 'i',
+  U32 = 'u',
+  Str = 's'
+};
+
+struct Value
+{
+  ValueType type;
+  std::string bytes;
+};
+
+struct OpenHandle
+{
+  std::string space;
+  bool writable;
+};
+
+typedef std::map<std::string, std::map<std::string, Value>> Store;
+
+// The store is flash, so none of it counts as the sketch's heap (each entry
+// point below says so with a FakeHeapUncounted).
+
+static std::mutex nvsLock;
+static Store store;
+static std::string storePath;
+static std::map<nvs_handle_t, OpenHandle> handles;
+static nvs_handle_t lastHandle = 0;
+static FakeNvsStats stats;
+static FakeNvsTiming timing;
+static bool cutArmed = false;
+static uint32_t writesBeforeCut = 0;
+static bool powerCut = false;
+static const uint32_t ENTRIES_PER_PAGE = 126;
+static const uint32_t ENTRY_SIZE = 32;
+static uint32_t partitionPages = 6;
+
+static void charge(uint32_t us)
+{
+  if (us > 0)
+  {
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+  }
+}
+
+static std::string toHex(const std::string &bytes)
+{
+  static const char digits[] = "0123456789abcdef";
+  std::string hex;
+  for (unsigned char c : bytes)
+  {
+    hex += digits[c >> 4];
+    hex += digits[c & 15];
+  }
+  return hex;
+}
+
+static std::string fromHex(const char *hex)
+{
+  std::string bytes;
+  unsigned value;
+  while (hex[0] != '\0' && hex[1] != '\0' && sscanf(hex, "%2x", &value) == 1)
+  {
+    bytes += (char)value;
+    hex += 2;
+  }
+  return bytes;
+}
+
+static void load()
+{
+  FakeHeapUncounted flash;
+  store.clear();
+  FILE *file = storePath.empty() ? nullptr : fopen(storePath.c_str(), "r");
+  if (file == nullptr)
+  {
+    return;
+  }
+  char space[NVS_KEY_NAME_MAX_SIZE + 1];
+  char key[NVS_KEY_NAME_MAX_SIZE + 1];
+  char type;
+  static char hex[2 * 4096 + 1];
+  while (fscanf(file, "%16s %16s %c %8192s", space, key, &type, hex) == 4)
+  {
+    store[space][key] = {(ValueType)type, fromHex(hex[0] == '-' ? "" : hex)};
+  }
+  fclose(file);
+}
+
+// Each change rewrites the file and renames it into place, so it lands whole
+// or not at all.
+static bool save()
+{
+  if (storePath.empty())
+  {
+    return true;
+  }
+  std::string temporary = storePath + ".tmp";
+  FILE *file = fopen(temporary.c_str(), "w");
+  if (file == nullptr)
+  {
+    return false;
+  }
+  for (const auto &space : store)
+  {
+    for (const auto &entry : space.second)
+    {
+      std::string hex = toHex(entry.second.bytes);
+      fprintf(file, "%s %s %c %s\n", space.first.c_str(), entry.first.c_str(), entry.second.type,
+              hex.empty() ? "-" : hex.c_str());
+    }
+  }
+  bool ok = fclose(file) == 0;
+  return ok && rename(temporary.c_str(), storePath.c_str()) == 0;
+}
+
+static uint32_t entriesOf(const Value &value)
+{
+  if (value.type != Str)
+  {
+    return 1;
+  }
+  return 1 + (value.bytes.size() + 1 + ENTRY_SIZE - 1) / ENTRY_SIZE;
+}
+
+static uint32_t totalEntries()
+{
+  return partitionPages * ENTRIES_PER_PAGE;
+}
+
+static uint32_t usedEntries()
+{
+  uint32_t used = 0;
+  for (const auto &space : store)
+  {
+    used++;
+    for (const auto &entry : space.second)
+    {
+      used += entriesOf(entry.second);
+    }
+  }
+  return used;
+}
+
+// Whether `value` can be written next to what is stored now (the old item
+// under the same key is only erased after it), keeping a page free.
+static bool roomFor(const std::string &space, const Value &value)
+{
+  uint32_t needed = usedEntries() + entriesOf(value) + (store.count(space) == 0 ? 1 : 0);
+  if (needed + ENTRIES_PER_PAGE > totalEntries())
+  {
+    return false;
+  }
+  if (totalEntries() - needed < stats.minFreeEntries)
+  {
+    stats.minFreeEntries = totalEntries() - needed;
+  }
+  return true;
+}
+
+// Counts down to a power cut; false once the power is gone.
+static bool powered()
+{
+  if (cutArmed && writesBeforeCut-- == 0)
+  {
+    cutArmed = false;
+    powerCut = true;
+  }
+  return !powerCut;
+}
+
+static esp_err_t find(nvs_handle_t handle, const char *key, OpenHandle **open)
+{
+  auto found = handles.find(handle);
+  if (found == handles.end())
+  {
+    return ESP_ERR_NVS_INVALID_HANDLE;
+  }
+  if (key != nullptr && strlen(key) >= NVS_KEY_NAME_MAX_SIZE)
+  {
+    return ESP_ERR_NVS_KEY_TOO_LONG;
+  }
+  *open = &found->second;
+  return ESP_OK;
+}
+
+static esp_err_t get(nvs_handle_t handle, const char *key, ValueType type, std::string *bytes)
+{
+  FakeHeapUncounted flash;
+  std::unique_lock<std::mutex> lock(nvsLock);
+  OpenHandle *open;
+  esp_err_t err = find(handle, key, &open);
+  if (err != ESP_OK)
+  {
+    return err;
+  }
+  stats.reads++;
+  uint32_t cost = timing.readUs;
+  auto space = store.find(open->space);
+  if (space == store.end() || space->second.count(key) == 0)
+  {
+    err = ESP_ERR_NVS_NOT_FOUND;
+  }
+  else if (space->second[key].type != type)
+  {
+    err = ESP_ERR_NVS_TYPE_MISMATCH;
+  }
+  else
+  {
+    *bytes = space->second[key].bytes;
+  }
+  lock.unlock();
+  charge(cost);
+  return err;
+}
+
+static esp_err_t set(nvs_handle_t handle, const char *key, ValueType type, const std::string &bytes)
+{
+  FakeHeapUncounted flash;
+  std::unique_lock<std::mutex> lock(nvsLock);
+  OpenHandle *open;
+  esp_err_t err = find(handle, key, &open);
+  if (err != ESP_OK)
+  {
+    return err;
+  }
+  if (!open->writable)
+  {
+    return ESP_ERR_NVS_READ_ONLY;
+  }
+  if (!roomFor(open->space, {type, bytes}))
+  {
+    return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+  }
+  if (!powered())
+  {
+    return ESP_FAIL;
+  }
+  Store before = store;
+  store[open->space][key] = {type, bytes};
+  if (!save())
+  {
+    store = before;
+    return ESP_FAIL;
+  }
+  stats.writes++;
+  uint32_t cost = timing.writeUs;
+  lock.unlock();
+  charge(cost);
+  return ESP_OK;
+}
+
+static std::string raw(const void *value, size_t size)
+{
+  return std::string((const char *)value, size);
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle)
+{
+  FakeHeapUncounted flash;
+  std::lock_guard<std::mutex> lock(nvsLock);
+  if (strlen(name) >= NVS_KEY_NAME_MAX_SIZE)
+  {
+    return ESP_ERR_NVS_KEY_TOO_LONG;
+  }
+  if (mode == NVS_READONLY && store.count(name) == 0)
+  {
+    return ESP_ERR_NVS_NOT_FOUND;
+  }
+  *handle = ++lastHandle;
+  handles[*handle] = {name, mode == NVS_READWRITE};
+  return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+  std::lock_guard<std::mutex> lock(nvsLock);
+  handles.erase(handle);
+}
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char *key, char *value, size_t *length)
+{
+  FakeHeapUncounted flash;
+  std::string bytes;
+  esp_err_t err = get(handle, key, Str, &bytes);
+  if (err != ESP_OK)
+  {
+    return err;
+  }
+  if (value == nullptr)
+  {
+    *length = bytes.size() + 1;
+    return ESP_OK;
+  }
+  if (*length < bytes.size() + 1)
+  {
+    return ESP_ERR_NVS_INVALID_LENGTH;
+  }
+  memcpy(value, bytes.c_str(), bytes.size() + 1);
+  *length = bytes.size() + 1;
+  return ESP_OK;
+}
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char *key, const char *value)
+{
+  FakeHeapUncounted flash;
+  if (strlen(value) >= 4000)
+  {
+    return ESP_ERR_NVS_VALUE_TOO_LONG;
+  }
+  return set(handle, key, Str, value);
+}
+
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *value)
+{
+  FakeHeapUncounted flash;
+  std::string bytes;
+  esp_err_t err = get(handle, key, U8, &bytes);
+  if (err == ESP_OK)
+  {
+    memcpy(value, bytes.data(), sizeof(*value));
+  }
+  return err;
+}
+
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value)
+{
+  FakeHeapUncounted flash;
+  return set(handle, key, U8, raw(&value, sizeof(value)));
+}
+
+esp_err_t nvs_get_i32(nvs_handle_t handle, const char *key, int32_t *value)
+{
+  FakeHeapUncounted flash;
+  std::string bytes;
+  esp_err_t err = get(handle, key, I32, &bytes);
+  if (err == ESP_OK)
+  {
+    memcpy(value, bytes.data(), sizeof(*value));
+  }
+  return err;
+}
+
+esp_err_t nvs_set_i32(nvs_handle_t handle, const char *key, int32_t value)
+{
+  FakeHeapUncounted flash;
+  return set(handle, key, I32, raw(&value, sizeof(value)));
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *value)
+{
+  FakeHeapUncounted flash;
+  std::string bytes;
+  esp_err_t err = get(handle, key, U32, &bytes);
+  if (err == ESP_OK)
+  {
+    memcpy(value, bytes.data(), sizeof(*value));
+  }
+  return err;
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value)
+{
+  FakeHeapUncounted flash;
+  return set(handle, key, U32, raw(&value, sizeof(value)));
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+  FakeHeapUncounted flash;
+  std::unique_lock<std::mutex> lock(nvsLock);
+  OpenHandle *open;
+  esp_err_t err = find(handle, key, &open);
+  if (err != ESP_OK)
+  {
+    return err;
+  }
+  if (!open->writable)
+  {
+    return ESP_ERR_NVS_READ_ONLY;
+  }
+  auto space = store.find(open->space);
+  if (space == store.end() || space->second.count(key) == 0)
+  {
+    return ESP_ERR_NVS_NOT_FOUND;
+  }
+  if (!powered())
+  {
+    return ESP_FAIL;
+  }
+  Store before = store;
+  space->second.erase(key);
+  if (!save())
+  {
+    store = before;
+    return ESP_FAIL;
+  }
+  stats.erases++;
+  uint32_t cost = timing.writeUs;
+  lock.unlock();
+  charge(cost);
+  return ESP_OK;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle)
+{
+  FakeHeapUncounted flash;
+  std::lock_guard<std::mutex> lock(nvsLock);
+  OpenHandle *open;
+  esp_err_t err = find(handle, nullptr, &open);
+  if (err != ESP_OK)
+  {
+    return err;
+  }
+  if (!open->writable)
+  {
+    return ESP_ERR_NVS_READ_ONLY;
+  }
+  if (!powered())
+  {
+    return ESP_FAIL;
+  }
+  store.erase(open->space);
+  stats.erases++;
+  return save() ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+  std::lock_guard<std::mutex> lock(nvsLock);
+  OpenHandle *open;
+  esp_err_t err = find(handle, nullptr, &open);
+  if (err != ESP_OK)
+  {
+    return err;
+  }
+  stats.commits++;
+  return powerCut ? ESP_FAIL : ESP_OK;
+}
+
+esp_err_t nvs_get_stats(const char *part_name, nvs_stats_t *nvs_stats)
+{
+  if (nvs_stats == nullptr)
+  {
+    return ESP_ERR_INVALID_ARG;
+  }
+  std::lock_guard<std::mutex> lock(nvsLock);
+  nvs_stats->used_entries = usedEntries();
+  nvs_stats->free_entries = totalEntries() - nvs_stats->used_entries;
+  nvs_stats->total_entries = totalEntries();
+  nvs_stats->namespace_count = store.size();
+  return ESP_OK;
+}
+
+esp_err_t nvs_flash_init()
+{
+  return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase()
+{
+  FakeHeapUncounted flash;
+  std::lock_guard<std::mutex> lock(nvsLock);
+  store.clear();
+  return save() ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t nvs_flash_read_security_cfg(const esp_partition_t *partition, nvs_sec_cfg_t *cfg)
+{
+  if (partition == nullptr || cfg == nullptr)
+  {
+    return ESP_ERR_INVALID_ARG;
+  }
+  memset(cfg, 0, sizeof(*cfg));
+  return ESP_OK;
+}
+
+esp_err_t nvs_flash_secure_init(nvs_sec_cfg_t *cfg)
+{
+  return cfg != nullptr ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+void fakeNvsUseFile(const std::string &path)
+{
+  FakeHeapUncounted flash;
+  std::lock_guard<std::mutex> lock(nvsLock);
+  storePath = path;
+  load();
+}
+
+void fakeNvsReset()
+{
+  FakeHeapUncounted flash;
+  std::lock_guard<std::mutex> lock(nvsLock);
+  store.clear();
+  save();
+  handles.clear();
+  stats = FakeNvsStats();
+  stats.minFreeEntries = totalEntries();
+  cutArmed = false;
+  powerCut = false;
+}
+
+void fakeNvsPartitionPages(uint32_t pages)
+{
+  std::lock_guard<std::mutex> lock(nvsLock);
+  partitionPages = pages;
+}
+
+void fakeNvsResetMinFreeEntries()
+{
+  std::lock_guard<std::mutex> lock(nvsLock);
+  stats.minFreeEntries = totalEntries() - usedEntries();
+}
+
+void fakeNvsTiming(const FakeNvsTiming &changed)
+{
+  std::lock_guard<std::mutex> lock(nvsLock);
+  timing = changed;
+}
+
+FakeNvsStats fakeNvsStats()
+{
+  std::lock_guard<std::mutex> lock(nvsLock);
+  return stats;
+}
+
+void fakeNvsPowerCutAfter(uint32_t writes)
+{
+  std::lock_guard<std::mutex> lock(nvsLock);
+  cutArmed = true;
+  writesBeforeCut = writes;
+}
+
+bool fakeNvsPowerIsCut()
+{
+  std::lock_guard<std::mutex> lock(nvsLock);
+  return powerCut;
+}
+
+void fakeNvsReboot()
+{
+  FakeHeapUncounted flash;
+  std::lock_guard<std::mutex> lock(nvsLock);
+  handles.clear();
+  cutArmed = false;
+  powerCut = false;
+  if (!storePath.empty())
+  {
+    load();
+  }
+}
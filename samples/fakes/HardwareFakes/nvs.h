@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include "esp_err.h"
+
+typedef uint32_t nvs_handle_t;
+typedef nvs_handle_t nvs_handle;
+
+typedef enum
+{
+  NVS_READONLY,
+  NVS_READWRITE
+} nvs_open_mode_t;
+
+#define NVS_KEY_NAME_MAX_SIZE 16
+#define ESP_ERR_NVS_VALUE_TOO_LONG (ESP_ERR_NVS_BASE + 0x0e)
+
+typedef struct
+{
+  size_t used_entries;
+  size_t free_entries;
+  size_t total_entries;
+  size_t namespace_count;
+} nvs_stats_t;
+
+// NVS as the samples use it, kept in RAM and, when the test names a file, in
+// that file too. Like the real thing each set or erase reaches storage on its
+// own, atomically, in the order it was made; nvs_commit() adds nothing. The
+// Arduino core has initialised the default partition before setup().
+//
+// Space is counted in 32-byte entries, 126 to a 4 KB page: one per namespace
+// and per integer, and a header plus the bytes (NUL included) for a string.
+// A set writes the new item before the old one is erased, and fails with
+// ESP_ERR_NVS_NOT_ENOUGH_SPACE when that would leave less than the page NVS
+// keeps empty for garbage collection. Erased entries are free again at once,
+// as if garbage collection had run, and items never need to move to another
+// page to fit: the count is a lower bound on what the device needs.
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle);
+void nvs_close(nvs_handle_t handle);
+esp_err_t nvs_get_str(nvs_handle_t handle, const char *key, char *value, size_t *length);
+esp_err_t nvs_set_str(nvs_handle_t handle, const char *key, const char *value);
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *value);
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value);
+esp_err_t nvs_get_i32(nvs_handle_t handle, const char *key, int32_t *value);
+esp_err_t nvs_set_i32(nvs_handle_t handle, const char *key, int32_t value);
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *value);
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value);
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key);
+esp_err_t nvs_erase_all(nvs_handle_t handle);
+esp_err_t nvs_commit(nvs_handle_t handle);
+// `part_name` is ignored: there is one partition.
+esp_err_t nvs_get_stats(const char *part_name, nvs_stats_t *nvs_stats);
+
+// Test side.
+struct FakeNvsStats
+{
+  uint32_t reads = 0;
+  uint32_t writes = 0; // sets
+  uint32_t erases = 0;
+  uint32_t commits = 0;
+  // The fewest free entries since fakeNvsReset() or fakeNvsResetMinFreeEntries(),
+  // counting both copies of an item while it is overwritten.
+  uint32_t minFreeEntries = 0;
+};
+
+struct FakeNvsTiming
+{
+  uint32_t readUs = 0;
+  uint32_t writeUs = 0; // per set or erase
+};
+
+// Keeps the store in `path` from now on (loading what is there), or only in
+// RAM with an empty path.
+void fakeNvsUseFile(const std::string &path);
+// Empties the store (and its file) and clears the stats and any power cut.
+void fakeNvsReset();
+// The size of the partition, 0x6000 (6 pages) by default as in the samples'
+// custom_partitions.csv. Kept by fakeNvsReset().
+void fakeNvsPartitionPages(uint32_t pages);
+void fakeNvsResetMinFreeEntries();
+void fakeNvsTiming(const FakeNvsTiming &timing);
+FakeNvsStats fakeNvsStats();
+// After `writes` more sets or erases, the power goes: that one and everything
+// after it fails without reaching storage, until fakeNvsReboot().
+void fakeNvsPowerCutAfter(uint32_t writes);
+bool fakeNvsPowerIsCut();
+// Power back on: open handles are gone and the store is what reached
+// storage (the file, when there is one).
+void fakeNvsReboot();
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "esp_partition.h"
+#include "nvs.h"
+
+#define NVS_KEY_SIZE 32
+
+typedef struct
+{
+  uint8_t eky[NVS_KEY_SIZE];
+  uint8_t tky[NVS_KEY_SIZE];
+} nvs_sec_cfg_t;
+
+esp_err_t nvs_flash_init();
+esp_err_t nvs_flash_erase();
+// Encryption is not emulated: the keys are read and ignored.
+esp_err_t nvs_flash_read_security_cfg(const esp_partition_t *partition, nvs_sec_cfg_t *cfg);
+esp_err_t nvs_flash_secure_init(nvs_sec_cfg_t *cfg);
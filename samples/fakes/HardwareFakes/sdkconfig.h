@@ -0,0 +1,3 @@
+#pragma once
+
+// Nothing is configured on the host.
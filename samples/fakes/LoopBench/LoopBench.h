@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stdio.h>
+#include <string>
+#include <Arduino.h>
+
+// Collects what a sketch logs while a benchmark scenario runs, and sums up its
+// "Loop:" reports (see reportLoopStats() in the sketches, logged every
+// LOOP_STATS_INTERVAL_MS): the worst window's percentiles, the publish rate
+// over the scenario, and the lowest free heap. A report window that straddles
+// two scenarios counts for the one during which it is logged. Heap figures are
+// the sketch's own (see FAKE_HEAP_SIZE), the fakes' far side left out.
+class LoopBench
+{
+public:
+  explicit LoopBench(const char *scenario)
+      : scenario(scenario), started(millis()), allocationsAtStart(fakeHeapAllocations())
+  {
+    Serial.takeOutput();
+    fakeResetMinFreeHeap();
+  }
+
+  // Calls `step` (e.g. the sketch's loop()) until `ms` have passed.
+  template <typename Step>
+  void run(uint32_t ms, Step step)
+  {
+    unsigned long until = millis() + ms;
+    while ((long)(millis() - until) < 0)
+    {
+      step();
+    }
+    collect();
+  }
+
+  // Waits up to `ms` for `done`, calling `step` meanwhile; false on timeout.
+  template <typename Step, typename Done>
+  bool runUntil(uint32_t ms, Step step, Done done)
+  {
+    unsigned long until = millis() + ms;
+    while (!done() && (long)(millis() - until) < 0)
+    {
+      step();
+    }
+    collect();
+    return done();
+  }
+
+  // Everything logged since the scenario started.
+  const std::string &log()
+  {
+    collect();
+    return output;
+  }
+  bool logged(const char *text) { return log().find(text) != std::string::npos; }
+
+  uint32_t publishes() const { return publishCount; }
+
+  void report()
+  {
+    collect();
+    unsigned long elapsed = millis() - started;
+    uint32_t lowest = minFreeHeap < ESP.getMinFreeHeap() ? minFreeHeap : ESP.getMinFreeHeap();
+    printf("BENCH %s: %.1fs, %u windows, %u ticks, worst p50=%uus p95=%uus p99=%uus max=%uus, "
+           "%u publishes (%.2f/s), heap used=%u (peak %u), %llu allocations\n",
+           scenario, elapsed / 1000.0, windows, ticks, p50, p95, p99, maxUs, publishCount,
+           publishCount * 1000.0 / (elapsed ? elapsed : 1), ESP.getHeapSize() - ESP.getFreeHeap(),
+           ESP.getHeapSize() - lowest, (unsigned long long)(fakeHeapAllocations() - allocationsAtStart));
+  }
+
+private:
+  void collect()
+  {
+    FakeHeapUncounted bench;
+    std::string text = Serial.takeOutput();
+    output += text;
+    size_t start = 0;
+    while ((start = text.find("Loop: ", start)) != std::string::npos)
+    {
+      unsigned t, a, b, c, m, p, f, mf;
+      float rate;
+      if (sscanf(text.c_str() + start, "Loop: %u ticks, p50=%uus p95=%uus p99=%uus max=%uus, %u publishes (%f/s), "
+                                       "free heap=%u (min %u)",
+                 &t, &a, &b, &c, &m, &p, &rate, &f, &mf) == 9)
+      {
+        windows++;
+        ticks += t;
+        p50 = a > p50 ? a : p50;
+        p95 = b > p95 ? b : p95;
+        p99 = c > p99 ? c : p99;
+        maxUs = m > maxUs ? m : maxUs;
+        publishCount += p;
+        minFreeHeap = mf < minFreeHeap ? mf : minFreeHeap;
+      }
+      start++;
+    }
+  }
+
+  const char *scenario;
+  unsigned long started;
+  uint64_t allocationsAtStart;
+  std::string output;
+  uint32_t windows = 0;
+  uint32_t ticks = 0;
+  uint32_t p50 = 0;
+  uint32_t p95 = 0;
+  uint32_t p99 = 0;
+  uint32_t maxUs = 0;
+  uint32_t publishCount = 0;
+  uint32_t minFreeHeap = UINT32_MAX;
+};
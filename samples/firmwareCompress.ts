@@ -0,0 +1,78 @@
+/*
+example:
+
+yarn firmwareCompress \
+  --in=<firmware.bin or a patch from yarn firmwareDelta> \
+  --out=<firmware.bin.gz> \
+  [--windowBits=13]
+
+Upload the compressed file and set `firmwareCompression: "gzip"`,
+`firmwareSize` and `firmwareSha256` (printed below) in the job document. For a
+delta patch, only `firmwareCompression` is needed: the size and SHA-256 of the
+new image come from `yarn firmwareDelta`.
+
+The device inflates the download while it is written, with a history of
+2^windowBits bytes: windowBits must not be larger than GZIP_INFLATE_WINDOW in
+the device build (8192 = 13 by default).
+*/
+import { createHash } from "crypto";
+import { readFileSync, writeFileSync } from "fs";
+import { parseArgs, ParseArgsConfig } from "util";
+import { gzipSync } from "zlib";
+import { z } from "zod";
+
+type Args = {
+  in: string;
+  out: string;
+  windowBits: number;
+};
+
+const compress = (data: Buffer, windowBits: number) =>
+  gzipSync(data, { level: 9, memLevel: 9, windowBits });
+
+const run = (args: Args) => {
+  const image = readFileSync(args.in);
+  const compressed = compress(image, args.windowBits);
+  writeFileSync(args.out, compressed);
+
+  console.log(`image: ${image.length} bytes`);
+  console.log(
+    `compressed: ${compressed.length} bytes (${((100 * compressed.length) / image.length).toFixed(1)}%)`
+  );
+  console.log(`firmwareSize: ${image.length}`);
+  console.log(`firmwareSha256: ${createHash("sha256").update(image).digest("hex")}`);
+
+  // What other device windows would give, to help pick GZIP_INFLATE_WINDOW.
+  for (let bits = 9; bits <= 15; bits++) {
+    const size = compress(image, bits).length;
+    console.log(
+      `  windowBits=${bits} (${1 << bits} byte window): ${size} bytes (${((100 * size) / image.length).toFixed(1)}%)`
+    );
+  }
+};
+
+const main = async () => {
+  const options: ParseArgsConfig["options"] = {
+    in: { type: "string" },
+    out: { type: "string" },
+    windowBits: { type: "string" },
+  };
+
+  const argSchema = z.object({
+    in: z.string(),
+    out: z.string(),
+    windowBits: z.coerce.number().int().min(9).max(15).default(13),
+  });
+
+  const { values } = parseArgs({ options, args: process.argv.slice(2) });
+  const args = argSchema.parse({
+    ...values,
+  });
+
+  run(args);
+};
+
+main().catch((err) => {
+  console.error(err);
+  process.exit(1);
+});
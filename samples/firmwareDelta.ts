@@ -0,0 +1,199 @@
+/*
+example:
+
+yarn firmwareDelta \
+  --old=<firmware.bin running on the devices> \
+  --new=<new firmware.bin> \
+  --out=<patch file>
+
+Upload the patch instead of the full image and set `firmwareFormat: "delta"`
+(and `firmwareSha256` of the new image) in the job document. Devices rebuild
+the new image from the patch and their running app partition, see
+samples/device-updates/lib/DeltaPatch.
+*/
+import { createHash } from "crypto";
+import { readFileSync, writeFileSync } from "fs";
+import { parseArgs, ParseArgsConfig } from "util";
+import { z } from "zod";
+
+const OP_END = 0x00;
+const OP_COPY = 0x01;
+const OP_INSERT = 0x02;
+const HEADER_SIZE = 48;
+
+// Matches are found through a hash of the next BLOCK bytes. A COPY costs up to
+// 11 bytes, so shorter matches are sent as literals.
+const BLOCK = 8;
+const MIN_COPY = 12;
+const HASH_BITS = 20;
+const MAX_CANDIDATES = 32;
+
+type Args = {
+  old: string;
+  new: string;
+  out: string;
+};
+
+class PatchWriter {
+  private chunks: Buffer[] = [];
+  private bytes: number[] = [];
+
+  byte(value: number) {
+    this.bytes.push(value);
+  }
+
+  varint(value: number) {
+    do {
+      let byte = value & 0x7f;
+      value = Math.floor(value / 128);
+      if (value > 0) {
+        byte |= 0x80;
+      }
+      this.bytes.push(byte);
+    } while (value > 0);
+  }
+
+  data(buffer: Buffer) {
+    this.flush();
+    this.chunks.push(buffer);
+  }
+
+  toBuffer(): Buffer {
+    this.flush();
+    return Buffer.concat(this.chunks);
+  }
+
+  private flush() {
+    if (this.bytes.length > 0) {
+      this.chunks.push(Buffer.from(this.bytes));
+      this.bytes = [];
+    }
+  }
+}
+
+function blockHash(buffer: Buffer, offset: number): number {
+  const a = buffer.readUInt32LE(offset);
+  const b = buffer.readUInt32LE(offset + 4);
+  return (Math.imul(a, 0x9e3779b1) ^ Math.imul(b ^ (a >>> 15), 0x85ebca6b)) >>> (32 - HASH_BITS);
+}
+
+function matchLength(source: Buffer, sourceOffset: number, target: Buffer, targetOffset: number): number {
+  let length = 0;
+  while (
+    sourceOffset + length < source.length &&
+    targetOffset + length < target.length &&
+    source[sourceOffset + length] === target[targetOffset + length]
+  ) {
+    length++;
+  }
+  return length;
+}
+
+function createPatch(source: Buffer, target: Buffer): Buffer {
+  // Chained hash index of every source position (as in zlib).
+  const head = new Int32Array(1 << HASH_BITS).fill(-1);
+  const previous = new Int32Array(Math.max(source.length, 1)).fill(-1);
+  for (let i = 0; i + BLOCK <= source.length; i++) {
+    const hash = blockHash(source, i);
+    previous[i] = head[hash];
+    head[hash] = i;
+  }
+
+  const header = Buffer.alloc(HEADER_SIZE);
+  header.write("LODP", 0, "ascii");
+  header[4] = 1;
+  header.writeUInt32LE(source.length, 8);
+  header.writeUInt32LE(target.length, 12);
+  createHash("sha256").update(source).digest().copy(header, 16);
+
+  const patch = new PatchWriter();
+  patch.data(header);
+
+  let literalStart = 0;
+  const flushLiteral = (end: number) => {
+    if (end > literalStart) {
+      patch.byte(OP_INSERT);
+      patch.varint(end - literalStart);
+      patch.data(target.subarray(literalStart, end));
+    }
+  };
+
+  // Unchanged code usually sits at the same shift as the previous match, so
+  // that alignment is tried before the hash candidates.
+  let shift = 0;
+  let i = 0;
+  while (i < target.length) {
+    let bestOffset = -1;
+    let bestLength = 0;
+    if (i + shift >= 0 && i + shift < source.length) {
+      bestOffset = i + shift;
+      bestLength = matchLength(source, bestOffset, target, i);
+    }
+    if (bestLength < MIN_COPY && i + BLOCK <= target.length) {
+      let candidate = head[blockHash(target, i)];
+      for (let n = 0; candidate >= 0 && n < MAX_CANDIDATES; n++) {
+        const length = matchLength(source, candidate, target, i);
+        if (length > bestLength) {
+          bestOffset = candidate;
+          bestLength = length;
+        }
+        candidate = previous[candidate];
+      }
+    }
+
+    if (bestLength >= MIN_COPY) {
+      flushLiteral(i);
+      patch.byte(OP_COPY);
+      patch.varint(bestOffset);
+      patch.varint(bestLength);
+      shift = bestOffset - i;
+      i += bestLength;
+      literalStart = i;
+    } else {
+      i++;
+    }
+  }
+  flushLiteral(target.length);
+  patch.byte(OP_END);
+  return patch.toBuffer();
+}
+
+const run = (args: Args) => {
+  const source = readFileSync(args.old);
+  const target = readFileSync(args.new);
+  const patch = createPatch(source, target);
+  writeFileSync(args.out, patch);
+
+  console.log(`old image: ${source.length} bytes`);
+  console.log(`new image: ${target.length} bytes`);
+  console.log(
+    `patch: ${patch.length} bytes (${((100 * patch.length) / target.length).toFixed(1)}% of the new image)`
+  );
+  console.log(`firmwareSha256: ${createHash("sha256").update(target).digest("hex")}`);
+};
+
+const main = async () => {
+  const options: ParseArgsConfig["options"] = {
+    old: { type: "string" },
+    new: { type: "string" },
+    out: { type: "string" },
+  };
+
+  const argSchema = z.object({
+    old: z.string(),
+    new: z.string(),
+    out: z.string(),
+  });
+
+  const { values } = parseArgs({ options, args: process.argv.slice(2) });
+  const args = argSchema.parse({
+    ...values,
+  });
+
+  run(args);
+};
+
+main().catch((err) => {
+  console.error(err);
+  process.exit(1);
+});
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <SpscQueue.h>
+
+// A fixed set of buffers handed back and forth between a producer task and a
+// consumer task, e.g. a network reader and a flash writer.
+//
+// The producer acquire()s an empty chunk, fills it and submit()s it; the
+// consumer takes it with next() and release()s it when done. With two or more
+// chunks, the producer fills one while the consumer works on another.
+// Nothing here blocks: acquire() and next() return nullptr when there is
+// nothing to take, and the caller decides how to wait. Only SpscQueue (and so
+// std::atomic) is used, so it runs the same on the ESP32 and on Linux.
+template <size_t Count, size_t Size>
+class ChunkPipeline
+{
+  static_assert(Count >= 1 && Count <= 128, "Count must be between 1 and 128");
+
+public:
+  struct Chunk
+  {
+    size_t length;
+    uint8_t data[Size];
+  };
+
+  ChunkPipeline()
+  {
+    for (size_t i = 0; i < Count; i++)
+    {
+      freeChunks.push(i);
+    }
+  }
+
+  // Producer side.
+  Chunk *acquire()
+  {
+    uint8_t index;
+    return freeChunks.pop(index) ? &chunks[index] : nullptr;
+  }
+  void submit(Chunk *chunk) { fullChunks.push(chunk - chunks); }
+  // True once the consumer has released every chunk.
+  bool idle() const { return freeChunks.size() == Count; }
+
+  // Consumer side.
+  Chunk *next()
+  {
+    uint8_t index;
+    return fullChunks.pop(index) ? &chunks[index] : nullptr;
+  }
+  void release(Chunk *chunk) { freeChunks.push(chunk - chunks); }
+
+private:
+  static constexpr size_t queueSize(size_t n, size_t size = 2) { return size >= n ? size : queueSize(n, size * 2); }
+
+  Chunk chunks[Count];
+  SpscQueue<uint8_t, queueSize(Count)> freeChunks; // consumer -> producer
+  SpscQueue<uint8_t, queueSize(Count)> fullChunks; // producer -> consumer
+};
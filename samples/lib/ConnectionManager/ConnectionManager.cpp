@@ -0,0 +1,180 @@
+#include "ConnectionManager.h"
+
+ConnectionManager::ConnectionManager(const ConnectionHooks &hooks, const ConnectionSettings &settings)
+    : hooks(hooks), settings(settings)
+{
+}
+
+void ConnectionManager::tick()
+{
+  uint32_t start = hooks.millis();
+  if (!started)
+  {
+    started = true;
+    disconnectedSince = start;
+  }
+  step(start);
+  uint32_t duration = hooks.millis() - start - onConnectedMs;
+  onConnectedMs = 0;
+  if (duration > stats.worstTickMs)
+  {
+    stats.worstTickMs = duration;
+  }
+}
+
+void ConnectionManager::reconnect()
+{
+  if (connecting())
+  {
+    // The socket is runConnect()'s until it is done; see step().
+    reconnectPending = true;
+    return;
+  }
+  hooks.disconnect();
+  started = true;
+  disconnectedSince = hooks.millis();
+  attempt = 0;
+  state = ConnectionIdle;
+}
+
+void ConnectionManager::runConnect()
+{
+  bool ok = hooks.tlsConnect() && hooks.mqttConnect();
+  backgroundConnect = ok ? BackgroundSucceeded : BackgroundFailed;
+}
+
+uint32_t ConnectionManager::backoffDelay(uint32_t attempt) const
+{
+  uint32_t shift = attempt < 16 ? attempt : 16;
+  uint64_t cap = (uint64_t)settings.backoffBaseMs << shift;
+  if (cap > settings.backoffMaxMs)
+  {
+    cap = settings.backoffMaxMs;
+  }
+  // "Full jitter": spread retries over the whole window.
+  return hooks.random((uint32_t)cap + 1);
+}
+
+void ConnectionManager::step(uint32_t now)
+{
+  switch (state)
+  {
+  case ConnectionIdle:
+  case Backoff:
+    if (state == Backoff && (int32_t)(now - retryAt) < 0)
+    {
+      return;
+    }
+    if (hooks.wifiConnected())
+    {
+      state = TlsConnecting;
+    }
+    else
+    {
+      hooks.wifiBegin();
+      state = WifiConnecting;
+    }
+    stateSince = now;
+    return;
+  case WifiConnecting:
+    if (hooks.wifiConnected())
+    {
+      state = TlsConnecting;
+      stateSince = now;
+    }
+    else if (now - stateSince > settings.wifiTimeoutMs)
+    {
+      fail(now);
+    }
+    return;
+  case TlsConnecting:
+    if (hooks.connectInBackground)
+    {
+      int result = backgroundConnect;
+      if (result == BackgroundRunning)
+      {
+        return;
+      }
+      if (result == BackgroundIdle)
+      {
+        if (!hooks.wifiConnected())
+        {
+          fail(now);
+          return;
+        }
+        backgroundConnect = BackgroundRunning;
+        hooks.connectInBackground();
+        return;
+      }
+      backgroundConnect = BackgroundIdle;
+      if (reconnectPending)
+      {
+        reconnectPending = false;
+        reconnect();
+        return;
+      }
+      if (result == BackgroundFailed)
+      {
+        fail(now);
+        return;
+      }
+      connectedNow();
+      return;
+    }
+    if (!hooks.wifiConnected() || !hooks.tlsConnect())
+    {
+      fail(now);
+      return;
+    }
+    state = MqttConnecting;
+    stateSince = now;
+    return;
+  case MqttConnecting:
+    if (!hooks.mqttConnect())
+    {
+      fail(now);
+      return;
+    }
+    connectedNow();
+    return;
+  case Connected:
+    if (hooks.mqttConnected())
+    {
+      return;
+    }
+    // Wait a jittered delay even before the first retry, otherwise every
+    // device dropped by the same broker outage comes back at the same time.
+    disconnectedSince = now;
+    hooks.disconnect();
+    retryAt = now + backoffDelay(attempt++);
+    state = Backoff;
+    return;
+  }
+}
+
+void ConnectionManager::connectedNow()
+{
+  state = Connected;
+  attempt = 0;
+  stats.connects++;
+  uint32_t now = hooks.millis();
+  stats.lastReconnectMs = now - disconnectedSince;
+  if (stats.lastReconnectMs > stats.maxReconnectMs)
+  {
+    stats.maxReconnectMs = stats.lastReconnectMs;
+  }
+  hooks.onConnected();
+  onConnectedMs = hooks.millis() - now;
+}
+
+void ConnectionManager::fail(uint32_t now)
+{
+  stats.failedAttempts++;
+  hooks.disconnect();
+  retryAt = now + backoffDelay(attempt);
+  if (attempt < 32)
+  {
+    attempt++;
+  }
+  state = Backoff;
+}
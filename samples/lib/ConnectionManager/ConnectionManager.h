@@ -0,0 +1,129 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+// Non-blocking Wi-Fi -> TLS -> MQTT connection state machine.
+//
+// Instead of spinning in `while (!connected) delay(...)`, the sketch calls
+// tick() once per loop(). Each call does at most one connection step and then
+// returns, so buttons and the display keep working while Wi-Fi is down and
+// between attempts. Two steps block for their duration: the TLS connect (TCP
+// and handshake) and the MQTT CONNECT, which waits for CONNACK. They run in
+// tick() unless the sketch hands them to another task (connectInBackground).
+// Failed attempts wait an exponentially growing, randomly jittered
+// delay so a fleet that lost the broker at the same time does not reconnect
+// at the same time.
+//
+// The class has no Arduino dependency; the sketch provides the actual network
+// calls through ConnectionHooks.
+struct ConnectionHooks
+{
+  void (*wifiBegin)();
+  bool (*wifiConnected)();
+  // Opens the TLS socket to the broker. Blocks for the TCP connect and the
+  // handshake, bounded by the client's handshake timeout.
+  bool (*tlsConnect)();
+  // Sends MQTT CONNECT over the already open socket. Blocks until CONNACK,
+  // bounded by the MQTT client's command timeout. Subscriptions that need no
+  // sketch state can be made here too, to run in the background with it.
+  bool (*mqttConnect)();
+  bool (*mqttConnected)();
+  // Called once per successful connection, e.g. to subscribe to topics.
+  void (*onConnected)();
+  // Closes the MQTT session and the socket before the next attempt.
+  void (*disconnect)();
+  uint32_t (*millis)();
+  // Returns a random number in [0, max).
+  uint32_t (*random)(uint32_t max);
+  // Optional. Asks another task to call runConnect(); tick() then returns at
+  // once until it is done. Nothing else may use the TLS socket or the MQTT
+  // client meanwhile (see connecting()).
+  void (*connectInBackground)();
+};
+
+struct ConnectionSettings
+{
+  uint32_t wifiTimeoutMs = 15000;
+  uint32_t backoffBaseMs = 500;
+  uint32_t backoffMaxMs = 60000;
+};
+
+struct ConnectionMetrics
+{
+  uint32_t connects = 0;
+  uint32_t failedAttempts = 0;
+  // Time from noticing the connection was lost (for the first connection,
+  // from the first tick()) to being connected again.
+  uint32_t lastReconnectMs = 0;
+  uint32_t maxReconnectMs = 0;
+  // Longest single tick() call, i.e. the worst loop stall we caused; a TLS
+  // handshake or a CONNACK wait unless they run in the background, never the
+  // time Wi-Fi takes to join. onConnected is the sketch's and not counted.
+  uint32_t worstTickMs = 0;
+};
+
+enum ConnectionState
+{
+  ConnectionIdle,
+  WifiConnecting,
+  TlsConnecting,
+  MqttConnecting,
+  Connected,
+  Backoff
+};
+
+class ConnectionManager
+{
+public:
+  ConnectionManager(const ConnectionHooks &hooks, const ConnectionSettings &settings = ConnectionSettings());
+
+  // Advances the state machine by at most one step.
+  void tick();
+
+  // Drops the current session and connects again on the next tick(),
+  // e.g. after the device credentials changed.
+  void reconnect();
+
+  // The TLS connect and MQTT CONNECT, for the task woken by
+  // connectInBackground.
+  void runConnect();
+
+  bool connected() const { return state == Connected; }
+  // True while runConnect() is, or is about to be, using the socket.
+  bool connecting() const { return backgroundConnect != BackgroundIdle; }
+  ConnectionState currentState() const { return state; }
+  const ConnectionMetrics &metrics() const { return stats; }
+
+  // The delay before retry number `attempt` (0 based): a random value in
+  // [0, min(backoffMaxMs, backoffBaseMs * 2^attempt)].
+  uint32_t backoffDelay(uint32_t attempt) const;
+
+private:
+  enum BackgroundConnect
+  {
+    BackgroundIdle,
+    BackgroundRunning,
+    BackgroundSucceeded,
+    BackgroundFailed
+  };
+
+  void step(uint32_t now);
+  void connectedNow();
+  void fail(uint32_t now);
+
+  ConnectionHooks hooks;
+  ConnectionSettings settings;
+  ConnectionMetrics stats;
+  ConnectionState state = ConnectionIdle;
+  uint32_t stateSince = 0;
+  bool started = false;
+  uint32_t disconnectedSince = 0;
+  uint32_t retryAt = 0;
+  uint32_t attempt = 0;
+  // Time the last tick() spent in hooks.onConnected().
+  uint32_t onConnectedMs = 0;
+  std::atomic<int> backgroundConnect{BackgroundIdle};
+  // reconnect() was called while runConnect() was running.
+  bool reconnectPending = false;
+};
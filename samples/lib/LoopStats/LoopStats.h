@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Loop tick durations and publish counts over a reporting window.
+//
+// Tick durations go into a fixed log-linear histogram (four buckets per power
+// of two, so percentiles are within 25%), which keeps record() constant time
+// and the memory use at about 500 bytes whatever the tick rate.
+class LoopStats
+{
+public:
+  LoopStats() { reset(); }
+
+  void record(uint32_t durationUs)
+  {
+    buckets[bucketOf(durationUs)]++;
+    count++;
+    if (durationUs > maxDuration)
+    {
+      maxDuration = durationUs;
+    }
+  }
+
+  // Records the time since the previous call; call at the top of a loop to
+  // measure its period, whichever way the previous iteration returned.
+  void tick(uint32_t nowUs)
+  {
+    if (ticking)
+    {
+      record(nowUs - lastTickUs);
+    }
+    ticking = true;
+    lastTickUs = nowUs;
+  }
+
+  void countPublish() { publishCount++; }
+
+  // Upper bound of the tick duration below which `percent` of the ticks fall.
+  uint32_t percentileUs(uint32_t percent) const
+  {
+    if (count == 0)
+    {
+      return 0;
+    }
+    uint64_t rank = ((uint64_t)count * percent + 99) / 100;
+    uint32_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++)
+    {
+      seen += buckets[i];
+      if (seen >= rank)
+      {
+        uint32_t upper = upperBound(i);
+        return upper < maxDuration ? upper : maxDuration;
+      }
+    }
+    return maxDuration;
+  }
+
+  uint32_t maxUs() const { return maxDuration; }
+  uint32_t ticks() const { return count; }
+  uint32_t publishes() const { return publishCount; }
+
+  // Starts a new window.
+  void reset()
+  {
+    memset(buckets, 0, sizeof(buckets));
+    count = 0;
+    maxDuration = 0;
+    publishCount = 0;
+  }
+
+private:
+  static const size_t BUCKETS = 124;
+
+  // Values below 4 get their own bucket; above that the two bits after the
+  // leading one select one of four buckets for that power of two.
+  static size_t bucketOf(uint32_t value)
+  {
+    if (value < 4)
+    {
+      return value;
+    }
+    uint32_t exponent = 31 - __builtin_clz(value);
+    return 4 * (exponent - 1) + ((value >> (exponent - 2)) & 3);
+  }
+
+  static uint32_t upperBound(size_t bucket)
+  {
+    if (bucket < 4)
+    {
+      return bucket;
+    }
+    uint32_t exponent = bucket / 4 + 1;
+    uint64_t lower = (uint64_t)(4 + bucket % 4) << (exponent - 2);
+    return (uint32_t)(lower + ((uint64_t)1 << (exponent - 2)) - 1);
+  }
+
+  uint32_t buckets[BUCKETS];
+  uint32_t count;
+  uint32_t maxDuration;
+  uint32_t publishCount;
+  uint32_t lastTickUs = 0;
+  bool ticking = false;
+};
@@ -0,0 +1,238 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Writes JSON directly into a fixed-size buffer, without a JsonDocument and
+// without touching the heap. Commas between members are inserted
+// automatically. If the buffer overflows, ok() returns false and the
+// (truncated) output must not be sent.
+template <size_t Capacity>
+class JsonWriter
+{
+public:
+  JsonWriter() { clear(); }
+
+  void clear()
+  {
+    len = 0;
+    depth = 0;
+    needComma = 0;
+    overflow = false;
+    buffer[0] = '\0';
+  }
+
+  JsonWriter &beginObject(const char *key = nullptr) { return open(key, '{'); }
+  JsonWriter &endObject() { return close('}'); }
+  JsonWriter &beginArray(const char *key = nullptr) { return open(key, '['); }
+  JsonWriter &endArray() { return close(']'); }
+
+  JsonWriter &value(const char *key, const char *text)
+  {
+    separator(key);
+    if (text == nullptr)
+    {
+      return raw("null", 4);
+    }
+    put('"');
+    for (const char *p = text; *p; p++)
+    {
+      escaped(*p);
+    }
+    put('"');
+    return *this;
+  }
+
+  JsonWriter &value(const char *key, long number)
+  {
+    separator(key);
+    // Enough for a 64-bit long (20 digits); the sign is written separately.
+    char digits[20];
+    size_t n = 0;
+    unsigned long magnitude = number < 0 ? 0UL - (unsigned long)number : (unsigned long)number;
+    do
+    {
+      digits[n++] = '0' + magnitude % 10;
+      magnitude /= 10;
+    } while (magnitude > 0);
+    if (number < 0)
+    {
+      put('-');
+    }
+    while (n > 0)
+    {
+      put(digits[--n]);
+    }
+    return *this;
+  }
+
+  JsonWriter &value(const char *key, int number) { return value(key, (long)number); }
+
+  JsonWriter &value(const char *key, bool flag)
+  {
+    separator(key);
+    return flag ? raw("true", 4) : raw("false", 5);
+  }
+
+  // Array element helpers.
+  JsonWriter &value(const char *text) { return value(nullptr, text); }
+  JsonWriter &value(long number) { return value(nullptr, number); }
+
+  const char *c_str() const { return buffer; }
+  size_t length() const { return len; }
+  bool ok() const { return !overflow && depth == 0; }
+
+private:
+  JsonWriter &open(const char *key, char bracket)
+  {
+    separator(key);
+    put(bracket);
+    depth++;
+    needComma &= ~(1UL << (depth & 31));
+    return *this;
+  }
+
+  JsonWriter &close(char bracket)
+  {
+    put(bracket);
+    if (depth > 0)
+    {
+      depth--;
+    }
+    return *this;
+  }
+
+  // Writes the comma (if any) and the key (if any) of the next member.
+  void separator(const char *key)
+  {
+    uint32_t bit = 1UL << (depth & 31);
+    if (needComma & bit)
+    {
+      put(',');
+    }
+    needComma |= bit;
+    if (key != nullptr)
+    {
+      put('"');
+      raw(key, strlen(key));
+      put('"');
+      put(':');
+    }
+  }
+
+  void escaped(char c)
+  {
+    static const char hex[] = "0123456789abcdef";
+    switch (c)
+    {
+    case '"':
+      raw("\\\"", 2);
+      break;
+    case '\\':
+      raw("\\\\", 2);
+      break;
+    case '\n':
+      raw("\\n", 2);
+      break;
+    case '\r':
+      raw("\\r", 2);
+      break;
+    case '\t':
+      raw("\\t", 2);
+      break;
+    default:
+      if ((unsigned char)c < 0x20)
+      {
+        char u[6] = {'\\', 'u', '0', '0', hex[(c >> 4) & 0xF], hex[c & 0xF]};
+        raw(u, 6);
+      }
+      else
+      {
+        put(c);
+      }
+    }
+  }
+
+  JsonWriter &raw(const char *text, size_t n)
+  {
+    if (overflow || len + n >= Capacity)
+    {
+      overflow = true;
+      return *this;
+    }
+    memcpy(buffer + len, text, n);
+    len += n;
+    buffer[len] = '\0';
+    return *this;
+  }
+
+  void put(char c)
+  {
+    if (overflow || len + 1 >= Capacity)
+    {
+      overflow = true;
+      return;
+    }
+    buffer[len++] = c;
+    buffer[len] = '\0';
+  }
+
+  char buffer[Capacity];
+  size_t len;
+  uint32_t depth;
+  uint32_t needComma; // one bit per nesting level
+  bool overflow;
+};
+
+// Payloads shared by the samples.
+
+// FHIRIngest observation, see the "Save a FHIR Observation" section of the README.
+// The optional correlation id is written first so it can be found again
+// without parsing the payload.
+template <size_t N>
+JsonWriter<N> &writeObservation(JsonWriter<N> &w, long value, const char *unit, const char *code,
+                                const char *system, const char *display, const char *correlationId = nullptr)
+{
+  w.beginObject();
+  if (correlationId)
+  {
+    w.value("correlationId", correlationId);
+  }
+  w.value("value", value);
+  w.value("unit", unit);
+  w.beginArray("coding").beginObject();
+  w.value("code", code).value("system", system).value("display", display);
+  w.endObject().endArray();
+  return w.endObject();
+}
+
+// $aws/things/<thing>/jobs/<jobId>/update
+template <size_t N>
+JsonWriter<N> &writeJobStatus(JsonWriter<N> &w, const char *jobId, const char *status)
+{
+  return w.beginObject().value("jobId", jobId).value("status", status).endObject();
+}
+
+// The same, with download progress in statusDetails (AWS IoT only accepts
+// string values there).
+template <size_t N>
+JsonWriter<N> &writeJobProgress(JsonWriter<N> &w, const char *jobId, const char *status, uint32_t bytesDownloaded,
+                                uint32_t bytesTotal)
+{
+  char downloaded[11];
+  char total[11];
+  snprintf(downloaded, sizeof(downloaded), "%lu", (unsigned long)bytesDownloaded);
+  snprintf(total, sizeof(total), "%lu", (unsigned long)bytesTotal);
+  w.beginObject().value("jobId", jobId).value("status", status);
+  w.beginObject("statusDetails").value("bytesDownloaded", downloaded).value("bytesTotal", total).endObject();
+  return w.endObject();
+}
+
+// $aws/things/<thing>/jobs/$next/get
+template <size_t N>
+JsonWriter<N> &writeDescribeExecution(JsonWriter<N> &w, const char *thingName)
+{
+  return w.beginObject().value("jobId", "$next").value("thingName", thingName).endObject();
+}
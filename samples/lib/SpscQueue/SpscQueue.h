@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lock-free single-producer/single-consumer ring buffer.
+//
+// Exactly one task may call push() and exactly one (other) task may call
+// pop(). Neither side ever blocks: when the ring is full push() returns false
+// and the rejection is counted, so the producer decides what to drop.
+// Only uses std::atomic, so it runs the same on the ESP32 and on Linux.
+template <typename T, size_t Capacity>
+class SpscQueue
+{
+  static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+  // Producer side.
+  bool push(const T &item)
+  {
+    size_t tail = writeIndex.load(std::memory_order_relaxed);
+    size_t used = tail - readIndex.load(std::memory_order_acquire);
+    if (used == Capacity)
+    {
+      rejectedCount.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    items[tail & (Capacity - 1)] = item;
+    writeIndex.store(tail + 1, std::memory_order_release);
+    if (used + 1 > highWaterMark.load(std::memory_order_relaxed))
+    {
+      highWaterMark.store(used + 1, std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  // Consumer side.
+  bool pop(T &item)
+  {
+    size_t head = readIndex.load(std::memory_order_relaxed);
+    if (head == writeIndex.load(std::memory_order_acquire))
+    {
+      return false;
+    }
+    item = items[head & (Capacity - 1)];
+    readIndex.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Approximate when called while the other side is running.
+  size_t size() const
+  {
+    return writeIndex.load(std::memory_order_acquire) - readIndex.load(std::memory_order_acquire);
+  }
+
+  // Backpressure accounting.
+  uint32_t rejected() const { return rejectedCount.load(std::memory_order_relaxed); }
+  size_t highWater() const { return highWaterMark.load(std::memory_order_relaxed); }
+
+private:
+  T items[Capacity];
+  // Indices grow without wrapping into the array; unsigned overflow is fine
+  // because only their difference is used.
+  alignas(32) std::atomic<size_t> writeIndex{0};
+  alignas(32) std::atomic<size_t> readIndex{0};
+  std::atomic<uint32_t> rejectedCount{0};
+  std::atomic<size_t> highWaterMark{0};
+};
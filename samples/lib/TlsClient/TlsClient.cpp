@@ -0,0 +1,403 @@
+#include "TlsClient.h"
+
+#include <Arduino.h>
+#include <string.h>
+#include <mbedtls/net_sockets.h>
+
+struct CachedSession
+{
+  bool valid;
+  char host[64];
+  uint16_t port;
+  uint32_t lastUsed;
+  mbedtls_ssl_session session;
+};
+
+static CachedSession sessions[TLS_SESSION_CACHE_SIZE];
+static uint32_t sessionClock = 0;
+
+static CachedSession *findSession(const char *host, uint16_t port)
+{
+  for (CachedSession &entry : sessions)
+  {
+    if (entry.valid && entry.port == port && strcmp(entry.host, host) == 0)
+    {
+      entry.lastUsed = ++sessionClock;
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+static void forgetSession(CachedSession *entry)
+{
+  if (entry->valid)
+  {
+    mbedtls_ssl_session_free(&entry->session);
+    entry->valid = false;
+  }
+}
+
+static void saveSession(CachedSession *entry, const char *host, uint16_t port, const mbedtls_ssl_context *ssl)
+{
+  if (entry == nullptr)
+  {
+    if (strlen(host) >= sizeof(entry->host))
+    {
+      return;
+    }
+    entry = &sessions[0];
+    for (CachedSession &candidate : sessions)
+    {
+      if (!candidate.valid || (entry->valid && candidate.lastUsed < entry->lastUsed))
+      {
+        entry = &candidate;
+      }
+    }
+  }
+  forgetSession(entry);
+  mbedtls_ssl_session_init(&entry->session);
+  if (mbedtls_ssl_get_session(ssl, &entry->session) != 0)
+  {
+    mbedtls_ssl_session_free(&entry->session);
+    return;
+  }
+  strcpy(entry->host, host);
+  entry->port = port;
+  entry->lastUsed = ++sessionClock;
+  entry->valid = true;
+}
+
+// The hardware RNG is a true RNG while the radio is on, which it is for TLS.
+static int randomBytes(void *context, unsigned char *output, size_t length)
+{
+  esp_fill_random(output, length);
+  return 0;
+}
+
+TlsClient::TlsClient()
+{
+}
+
+TlsClient::~TlsClient()
+{
+  stop();
+}
+
+void TlsClient::clearSessions()
+{
+  for (CachedSession &entry : sessions)
+  {
+    forgetSession(&entry);
+  }
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port)
+{
+  stop();
+  return socket.connect(ip, port) && startTls(ip.toString().c_str(), port);
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port, int32_t timeout)
+{
+  stop();
+  return socket.connect(ip, port, timeout) && startTls(ip.toString().c_str(), port);
+}
+
+int TlsClient::connect(const char *host, uint16_t port)
+{
+  stop();
+  return socket.connect(host, port) && startTls(host, port);
+}
+
+int TlsClient::connect(const char *host, uint16_t port, int32_t timeout)
+{
+  stop();
+  return socket.connect(host, port, timeout) && startTls(host, port);
+}
+
+bool TlsClient::startTls(const char *host, uint16_t port)
+{
+  mbedtls_ssl_init(&ssl);
+  mbedtls_ssl_config_init(&config);
+  mbedtls_x509_crt_init(&caChain);
+  mbedtls_x509_crt_init(&clientCertificate);
+  mbedtls_pk_init(&clientKey);
+  contextsReady = true;
+
+  // PEM lengths include the terminating NUL.
+  int err = caCert ? 0 : MBEDTLS_ERR_X509_BAD_INPUT_DATA;
+  if (err == 0)
+  {
+    err = mbedtls_ssl_config_defaults(&config, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                      MBEDTLS_SSL_PRESET_DEFAULT);
+  }
+  if (err == 0)
+  {
+    err = mbedtls_x509_crt_parse(&caChain, (const unsigned char *)caCert, strlen(caCert) + 1);
+  }
+  if (err == 0 && certificate && privateKey)
+  {
+    err = mbedtls_x509_crt_parse(&clientCertificate, (const unsigned char *)certificate, strlen(certificate) + 1);
+    if (err == 0)
+    {
+#if MBEDTLS_VERSION_MAJOR >= 3
+      err = mbedtls_pk_parse_key(&clientKey, (const unsigned char *)privateKey, strlen(privateKey) + 1, NULL, 0,
+                                 randomBytes, NULL);
+#else
+      err = mbedtls_pk_parse_key(&clientKey, (const unsigned char *)privateKey, strlen(privateKey) + 1, NULL, 0);
+#endif
+    }
+    if (err == 0)
+    {
+      err = mbedtls_ssl_conf_own_cert(&config, &clientCertificate, &clientKey);
+    }
+  }
+  if (err == 0)
+  {
+    mbedtls_ssl_conf_authmode(&config, MBEDTLS_SSL_VERIFY_REQUIRED);
+    mbedtls_ssl_conf_ca_chain(&config, &caChain, NULL);
+    mbedtls_ssl_conf_verify(&config, verify, this);
+    mbedtls_ssl_conf_rng(&config, randomBytes, NULL);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&config, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+    err = mbedtls_ssl_setup(&ssl, &config);
+  }
+  if (err == 0)
+  {
+    err = mbedtls_ssl_set_hostname(&ssl, host);
+  }
+
+  CachedSession *cached = findSession(host, port);
+  if (err == 0 && cached)
+  {
+    err = mbedtls_ssl_set_session(&ssl, &cached->session);
+  }
+
+  certificateVerified = false;
+  uint32_t started = millis();
+  if (err == 0)
+  {
+    mbedtls_ssl_set_bio(&ssl, this, send, receive, NULL);
+    while ((err = mbedtls_ssl_handshake(&ssl)) == MBEDTLS_ERR_SSL_WANT_READ || err == MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+      if (millis() - started > handshakeTimeoutMs)
+      {
+        err = MBEDTLS_ERR_SSL_TIMEOUT;
+        break;
+      }
+      delay(1);
+    }
+  }
+  uint32_t elapsed = millis() - started;
+
+  if (err != 0)
+  {
+    error = err;
+    tlsStats.failures++;
+    if (cached)
+    {
+      forgetSession(cached);
+    }
+    stop();
+    return false;
+  }
+
+  // Only a full handshake receives and verifies the server's certificate,
+  // whether the session was offered by ID or by ticket. The session fields
+  // that would tell directly are private in mbedtls 3.
+  bool resumed = cached && !certificateVerified;
+  saveSession(cached, host, port, &ssl);
+
+  error = 0;
+  secured = true;
+  tlsStats.handshakes++;
+  tlsStats.lastHandshakeMs = elapsed;
+  if (resumed)
+  {
+    tlsStats.resumed++;
+    tlsStats.resumedHandshakeMs += elapsed;
+  }
+  else
+  {
+    tlsStats.fullHandshakeMs += elapsed;
+  }
+  return true;
+}
+
+int TlsClient::verify(void *context, mbedtls_x509_crt *certificate, int depth, uint32_t *flags)
+{
+  // Called for each certificate in the chain; mbedtls still decides with
+  // `flags` whether the chain is trusted.
+  static_cast<TlsClient *>(context)->certificateVerified = true;
+  return 0;
+}
+
+size_t TlsClient::write(uint8_t data)
+{
+  return write(&data, 1);
+}
+
+size_t TlsClient::write(const uint8_t *data, size_t length)
+{
+  if (!secured)
+  {
+    return 0;
+  }
+  size_t written = 0;
+  uint32_t started = millis();
+  while (written < length)
+  {
+    int n = mbedtls_ssl_write(&ssl, data + written, length - written);
+    if (n > 0)
+    {
+      written += n;
+    }
+    else if ((n != MBEDTLS_ERR_SSL_WANT_WRITE && n != MBEDTLS_ERR_SSL_WANT_READ) ||
+             millis() - started > handshakeTimeoutMs)
+    {
+      stop();
+      break;
+    }
+    else
+    {
+      delay(1);
+    }
+  }
+  return written;
+}
+
+int TlsClient::available()
+{
+  if (!secured)
+  {
+    return 0;
+  }
+  int pending = peeked >= 0 ? 1 : 0;
+  if (mbedtls_ssl_get_bytes_avail(&ssl) == 0)
+  {
+    // Processes the next record, if one has arrived.
+    int err = mbedtls_ssl_read(&ssl, NULL, 0);
+    if (err < 0 && err != MBEDTLS_ERR_SSL_WANT_READ && err != MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+      stop();
+      return pending;
+    }
+  }
+  return pending + mbedtls_ssl_get_bytes_avail(&ssl);
+}
+
+int TlsClient::read()
+{
+  uint8_t value;
+  return read(&value, 1) == 1 ? value : -1;
+}
+
+int TlsClient::read(uint8_t *buffer, size_t length)
+{
+  if (!secured || length == 0)
+  {
+    return -1;
+  }
+  size_t offset = 0;
+  if (peeked >= 0)
+  {
+    buffer[offset++] = peeked;
+    peeked = -1;
+  }
+  if (offset == length)
+  {
+    return offset;
+  }
+  int n = mbedtls_ssl_read(&ssl, buffer + offset, length - offset);
+  if (n > 0)
+  {
+    return offset + n;
+  }
+  if (n != MBEDTLS_ERR_SSL_WANT_READ && n != MBEDTLS_ERR_SSL_WANT_WRITE)
+  {
+    stop(); // closed by the peer, or an error
+  }
+  return offset > 0 ? (int)offset : -1;
+}
+
+int TlsClient::peek()
+{
+  if (peeked < 0)
+  {
+    uint8_t value;
+    if (read(&value, 1) == 1)
+    {
+      peeked = value;
+    }
+  }
+  return peeked;
+}
+
+void TlsClient::flush()
+{
+  // WiFiClient::flush() would discard unread TLS records.
+}
+
+void TlsClient::stop()
+{
+  if (secured)
+  {
+    mbedtls_ssl_close_notify(&ssl);
+    secured = false;
+  }
+  freeContexts();
+  peeked = -1;
+  socket.stop();
+}
+
+uint8_t TlsClient::connected()
+{
+  if (!secured)
+  {
+    return 0;
+  }
+  if (peeked >= 0 || mbedtls_ssl_get_bytes_avail(&ssl) > 0)
+  {
+    return 1;
+  }
+  return socket.connected();
+}
+
+void TlsClient::freeContexts()
+{
+  if (!contextsReady)
+  {
+    return;
+  }
+  mbedtls_ssl_free(&ssl);
+  mbedtls_ssl_config_free(&config);
+  mbedtls_x509_crt_free(&caChain);
+  mbedtls_x509_crt_free(&clientCertificate);
+  mbedtls_pk_free(&clientKey);
+  contextsReady = false;
+}
+
+int TlsClient::send(void *context, const unsigned char *data, size_t length)
+{
+  TlsClient *client = static_cast<TlsClient *>(context);
+  if (!client->socket.connected())
+  {
+    return MBEDTLS_ERR_NET_CONN_RESET;
+  }
+  size_t n = client->socket.write(data, length);
+  return n > 0 ? (int)n : MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
+int TlsClient::receive(void *context, unsigned char *buffer, size_t length)
+{
+  TlsClient *client = static_cast<TlsClient *>(context);
+  int available = client->socket.available();
+  if (available <= 0)
+  {
+    return client->socket.connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_CONN_RESET;
+  }
+  int n = client->socket.read(buffer, length < (size_t)available ? length : available);
+  return n > 0 ? n : MBEDTLS_ERR_SSL_WANT_READ;
+}
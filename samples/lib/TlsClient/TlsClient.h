@@ -0,0 +1,97 @@
+#pragma once
+
+#include <WiFiClient.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/version.h>
+#include <mbedtls/x509_crt.h>
+
+// Sessions kept for resumption, shared by all TlsClients and keyed by host and
+// port. The least recently used one is replaced.
+#ifndef TLS_SESSION_CACHE_SIZE
+#define TLS_SESSION_CACHE_SIZE 2
+#endif
+
+struct TlsStats
+{
+  uint32_t handshakes = 0; // successful ones
+  uint32_t resumed = 0;    // of those, abbreviated with a cached session
+  uint32_t failures = 0;
+  uint32_t lastHandshakeMs = 0;
+  uint32_t fullHandshakeMs = 0;    // total, for the average
+  uint32_t resumedHandshakeMs = 0; // total, for the average
+};
+
+// A WiFiClientSecure replacement (same setters, and a WiFiClient, so
+// HTTPClient and MQTTClient take it) that resumes TLS sessions. The sketches
+// use it when built with TLS_SESSION_RESUMPTION=1.
+//
+// WiFiClientSecure runs a full handshake on every connect; with an RSA client
+// certificate that is seconds of CPU. After each handshake this client keeps
+// the server's session (ID or ticket), and offers it on the next connect to
+// the same host and port. A server that still knows the session skips the
+// certificate exchange and key agreement; one that does not falls back to a
+// full handshake. TCP goes through a WiFiClient member; the base class is
+// only the type HTTPClient expects, and is never connected itself.
+//
+// Sessions carry the client identity they were made with: call
+// clearSessions() after changing certificates. Connect from one task only.
+class TlsClient : public WiFiClient
+{
+public:
+  TlsClient();
+  ~TlsClient();
+
+  void setCACert(const char *rootCA) { caCert = rootCA; }
+  void setCertificate(const char *clientCertificate) { certificate = clientCertificate; }
+  void setPrivateKey(const char *key) { privateKey = key; }
+  void setHandshakeTimeout(unsigned long seconds) { handshakeTimeoutMs = seconds * 1000; }
+  static void clearSessions();
+
+  int connect(IPAddress ip, uint16_t port) override;
+  int connect(IPAddress ip, uint16_t port, int32_t timeout) override;
+  int connect(const char *host, uint16_t port) override;
+  int connect(const char *host, uint16_t port, int32_t timeout) override;
+  size_t write(uint8_t data) override;
+  size_t write(const uint8_t *data, size_t length) override;
+  int available() override;
+  int read() override;
+  int read(uint8_t *buffer, size_t length) override;
+  int peek() override;
+  void flush() override;
+  void stop() override;
+  uint8_t connected() override;
+  operator bool() { return connected(); }
+
+  const TlsStats &stats() const { return tlsStats; }
+  // mbedtls error of the last failed handshake, 0 if none.
+  int lastError() const { return error; }
+
+private:
+  bool startTls(const char *host, uint16_t port);
+  void freeContexts();
+  static int verify(void *context, mbedtls_x509_crt *certificate, int depth, uint32_t *flags);
+  static int send(void *context, const unsigned char *data, size_t length);
+  static int receive(void *context, unsigned char *buffer, size_t length);
+
+  const char *caCert = nullptr;
+  const char *certificate = nullptr;
+  const char *privateKey = nullptr;
+  uint32_t handshakeTimeoutMs = 120000;
+
+  WiFiClient socket;
+  bool contextsReady = false;
+  bool secured = false; // handshake done
+  // Set when the server's certificate chain is checked, which only a full
+  // handshake does; a resumed one skips the certificate exchange.
+  bool certificateVerified = false;
+  int peeked = -1;
+  int error = 0;
+  TlsStats tlsStats;
+
+  mbedtls_ssl_context ssl;
+  mbedtls_ssl_config config;
+  mbedtls_x509_crt caChain;
+  mbedtls_x509_crt clientCertificate;
+  mbedtls_pk_context clientKey;
+};
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Values matched by the `+`/`#` wildcards of a route, in pattern order.
+// They point into the received topic and are not NUL terminated.
+struct TopicParams
+{
+  static const size_t MAX = 4;
+  const char *values[MAX];
+  size_t lengths[MAX];
+  size_t count;
+};
+
+typedef void (*TopicHandler)(const char *topic, const TopicParams &params, char *payload, int length);
+
+// Maps MQTT topics to handlers.
+//
+// Routes are added once (at connect time). Patterns are copied into an
+// internal arena, so dispatch() does not allocate: exact topics are found by
+// binary search on their length and compared with memcmp(), and wildcard
+// patterns are pre-hashed and only compared in full when the hash of their
+// literal prefix matches. The topic is only hashed when no exact route
+// matches and there are wildcard routes.
+// ArenaSize is the room for all patterns, each with its NUL. It has no
+// default: topics built from a thing name or device ID are as long as that
+// ID, so each sketch sizes it for the longest ID it allows. add() returns
+// false when a route does not fit.
+template <size_t MaxRoutes, size_t ArenaSize>
+class TopicRouter
+{
+public:
+  // `pattern` may contain `+` (one level) and a trailing `#` (any levels).
+  bool add(const char *pattern, TopicHandler handler)
+  {
+    size_t length = strlen(pattern);
+    if (routeCount == MaxRoutes || arenaUsed + length + 1 > ArenaSize)
+    {
+      return false;
+    }
+    char *copy = arena + arenaUsed;
+    memcpy(copy, pattern, length + 1);
+    arenaUsed += length + 1;
+
+    Route route = {copy, handler, 0, length, 0, false};
+    // Hash the literal levels in front of the first wildcard.
+    uint32_t hash = FNV_OFFSET;
+    size_t levels = 0;
+    const char *p = copy;
+    while (true)
+    {
+      const char *end = strchr(p, '/');
+      size_t n = end ? (size_t)(end - p) : strlen(p);
+      if (n == 1 && (p[0] == '+' || p[0] == '#'))
+      {
+        route.wildcard = true;
+        break;
+      }
+      if (levels > 0)
+      {
+        hash = fnv(hash, '/');
+      }
+      for (size_t i = 0; i < n; i++)
+      {
+        hash = fnv(hash, p[i]);
+      }
+      levels++;
+      if (!end)
+      {
+        break;
+      }
+      p = end + 1;
+    }
+    route.hash = hash;
+    route.prefixLevels = levels;
+
+    // Keep exact routes sorted by length (insertion sort, done once),
+    // wildcard routes in the order they were added.
+    Route *list = route.wildcard ? wildcards : exact;
+    size_t &count = route.wildcard ? wildcardCount : exactCount;
+    size_t i = count;
+    while (!route.wildcard && i > 0 && list[i - 1].length > route.length)
+    {
+      list[i] = list[i - 1];
+      i--;
+    }
+    list[i] = route;
+    count++;
+    routeCount++;
+    return true;
+  }
+
+  void clear()
+  {
+    routeCount = exactCount = wildcardCount = arenaUsed = 0;
+  }
+
+  // Calls the handler of the first matching route (exact routes win).
+  // Returns false when no route matches.
+  bool dispatch(const char *topic, char *payload, int length) const
+  {
+    TopicParams params;
+    params.count = 0;
+
+    // Exact routes: binary search for the first route of this length.
+    size_t topicLength = strlen(topic);
+    size_t lo = 0, hi = exactCount;
+    while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (exact[mid].length < topicLength)
+      {
+        lo = mid + 1;
+      }
+      else
+      {
+        hi = mid;
+      }
+    }
+    for (; lo < exactCount && exact[lo].length == topicLength; lo++)
+    {
+      if (memcmp(exact[lo].pattern, topic, topicLength) == 0)
+      {
+        exact[lo].handler(topic, params, payload, length);
+        return true;
+      }
+    }
+    if (wildcardCount == 0)
+    {
+      return false;
+    }
+
+    // One pass over the topic: the hash at each level boundary.
+    uint32_t levelHash[MAX_LEVELS + 1];
+    size_t levels = 0;
+    uint32_t hash = FNV_OFFSET;
+    levelHash[0] = hash;
+    for (const char *p = topic; *p; p++)
+    {
+      if (*p == '/' && levels < MAX_LEVELS)
+      {
+        levelHash[++levels] = hash;
+      }
+      hash = fnv(hash, *p);
+    }
+    size_t topicLevels = levels + 1;
+    if (topicLevels <= MAX_LEVELS)
+    {
+      levelHash[topicLevels] = hash;
+    }
+
+    for (size_t i = 0; i < wildcardCount; i++)
+    {
+      const Route &route = wildcards[i];
+      if (route.prefixLevels > topicLevels || route.prefixLevels > MAX_LEVELS ||
+          levelHash[route.prefixLevels] != route.hash)
+      {
+        continue;
+      }
+      if (matches(route.pattern, topic, params))
+      {
+        route.handler(topic, params, payload, length);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  size_t size() const { return routeCount; }
+
+private:
+  static const uint32_t FNV_OFFSET = 2166136261u;
+  static const size_t MAX_LEVELS = 16;
+
+  struct Route
+  {
+    const char *pattern;
+    TopicHandler handler;
+    uint32_t hash; // of the literal prefix, for wildcard routes
+    size_t length;
+    size_t prefixLevels;
+    bool wildcard;
+  };
+
+  static uint32_t fnv(uint32_t hash, char c)
+  {
+    return (hash ^ (uint8_t)c) * 16777619u;
+  }
+
+  static bool matches(const char *pattern, const char *topic, TopicParams &params)
+  {
+    params.count = 0;
+    while (true)
+    {
+      if (pattern[0] == '#' && pattern[1] == '\0')
+      {
+        if (params.count < TopicParams::MAX)
+        {
+          params.values[params.count] = topic;
+          params.lengths[params.count++] = strlen(topic);
+        }
+        return true;
+      }
+      const char *topicEnd = strchr(topic, '/');
+      size_t topicLength = topicEnd ? (size_t)(topicEnd - topic) : strlen(topic);
+      const char *patternEnd = strchr(pattern, '/');
+      size_t patternLength = patternEnd ? (size_t)(patternEnd - pattern) : strlen(pattern);
+
+      if (patternLength == 1 && pattern[0] == '+')
+      {
+        if (params.count < TopicParams::MAX)
+        {
+          params.values[params.count] = topic;
+          params.lengths[params.count++] = topicLength;
+        }
+      }
+      else if (patternLength != topicLength || memcmp(pattern, topic, topicLength) != 0)
+      {
+        return false;
+      }
+
+      if (!patternEnd || !topicEnd)
+      {
+        // Both must end together ("a/#" also matches "a").
+        return !patternEnd && !topicEnd ? true : (patternEnd && strcmp(patternEnd, "/#") == 0);
+      }
+      pattern = patternEnd + 1;
+      topic = topicEnd + 1;
+    }
+  }
+
+  Route exact[MaxRoutes];
+  Route wildcards[MaxRoutes];
+  size_t routeCount = 0;
+  size_t exactCount = 0;
+  size_t wildcardCount = 0;
+  char arena[ArenaSize];
+  size_t arenaUsed = 0;
+};
@@ -0,0 +1,485 @@
+/*
+example:
+
+yarn nvsImages \
+  --template=samples/device-provisioning/src/nvs.csv \
+  --manifest=<devices.csv> \
+  --out=<directory> \
+  [--size=0x6000] \
+  [--workers=<number of CPUs>] \
+  [--keys=<nvs_keys.bin>] \
+  [--verify]
+
+Builds an encrypted NVS partition image and its nvs_key partition for every
+device in the manifest, like scripts/generate-nvs-data.sh does for one device
+(`nvs_partition_gen.py encrypt ... --keygen`, NVS format version 2). Each
+device gets its own random keys. The files are written to
+<out>/<device>/encrypted_nvs.bin and <out>/<device>/keys/nvs_keys.bin, so
+scripts/flash-nvs-data.sh can be run from <out>/<device>.
+
+The template is an nvs.csv: a namespace followed by `file` or `data` entries
+with `string` encoding. Template paths are relative to the sample directory
+(the parent of the template's directory), where scripts/generate-nvs-data.sh
+runs nvs_partition_gen.py. The manifest is a CSV with a `device` column and
+one column per template key to replace, e.g.
+
+device,cert,private_key
+core2-0001,0001/cert.pem,0001/private.key
+
+where each cell is the path of that device's file, relative to the manifest.
+
+With --keys every image is encrypted with that nvs_key partition instead, as
+`nvs_partition_gen.py encrypt ... --inputkey` does, so the output can be
+compared with the tool's byte for byte.
+
+Images are built on --workers threads. With --verify every image is decrypted
+and decoded again and compared with its inputs. The run ends with the
+throughput in images/s.
+*/
+import { createCipheriv, createDecipheriv, randomBytes } from "crypto";
+import { mkdirSync, readFileSync, writeFileSync } from "fs";
+import { cpus } from "os";
+import { dirname, join, resolve } from "path";
+import { parseArgs, ParseArgsConfig } from "util";
+import { isMainThread, parentPort, Worker, workerData } from "worker_threads";
+import { z } from "zod";
+
+type Args = {
+  template: string;
+  manifest: string;
+  out: string;
+  size: number;
+  workers: number;
+  keys?: string;
+  verify: boolean;
+};
+
+type TemplateRow =
+  | { type: "namespace"; key: string }
+  | { type: "string"; key: string; path?: string; value?: string };
+
+type Device = { device: string; files: Record<string, string> };
+
+type WorkerData = {
+  rows: TemplateRow[];
+  devices: Device[];
+  out: string;
+  size: number;
+  keys?: string;
+  verify: boolean;
+};
+
+// Layout of an NVS page, see components/nvs_flash in ESP-IDF.
+const PAGE_SIZE = 4096;
+const ENTRY_SIZE = 32;
+const BITMAP_OFFSET = 32;
+const FIRST_ENTRY_OFFSET = 64;
+const MAX_ENTRIES = 126;
+const PAGE_ACTIVE = 0xfffffffe;
+const PAGE_FULL = 0xfffffffc;
+const PAGE_VERSION2 = 0xfe;
+const TYPE_U8 = 0x01;
+const TYPE_STR = 0x21;
+const CHUNK_ANY = 0xff;
+const MAX_STRING_SIZE = 4000;
+const KEY_SIZE = 32;
+
+const CRC_TABLE = new Uint32Array(256).map((_, n) => {
+  let c = n;
+  for (let k = 0; k < 8; k++) {
+    c = c & 1 ? 0xedb88320 ^ (c >>> 1) : c >>> 1;
+  }
+  return c >>> 0;
+});
+
+// zlib.crc32(data, 0xFFFFFFFF) in nvs_partition_gen.py, esp_rom_crc32_le(0xffffffff, ...) on the device.
+const crc32 = (...parts: Buffer[]) => {
+  let c = 0;
+  for (const part of parts) {
+    for (const byte of part) {
+      c = CRC_TABLE[(c ^ byte) & 0xff] ^ (c >>> 8);
+    }
+  }
+  return (c ^ 0xffffffff) >>> 0;
+};
+
+// Entries are encrypted 32 bytes at a time with AES-256-XTS; the tweak is the
+// entry's offset in the partition, little endian.
+const xts = (encrypt: boolean, keys: Buffer, offset: number, data: Buffer) => {
+  const tweak = Buffer.alloc(16);
+  tweak.writeUInt32LE(offset);
+  if (encrypt) {
+    const cipher = createCipheriv("aes-256-xts", keys, tweak);
+    return Buffer.concat([cipher.update(data), cipher.final()]);
+  }
+  const decipher = createDecipheriv("aes-256-xts", keys, tweak);
+  return Buffer.concat([decipher.update(data), decipher.final()]);
+};
+
+const entryCrc = (entry: Buffer) => crc32(entry.subarray(0, 4), entry.subarray(8, 32));
+
+const pageHeaderCrc = (page: Buffer) => crc32(page.subarray(4, 28));
+
+const makeKeyPartition = () => {
+  const eky = randomBytes(KEY_SIZE);
+  let tky = randomBytes(KEY_SIZE);
+  while (eky.equals(tky)) {
+    tky = randomBytes(KEY_SIZE);
+  }
+  const partition = Buffer.alloc(PAGE_SIZE, 0xff);
+  eky.copy(partition, 0);
+  tky.copy(partition, KEY_SIZE);
+  partition.writeUInt32LE(crc32(eky, tky), 2 * KEY_SIZE);
+  return partition;
+};
+
+// Writes entries the way nvs_partition_gen.py lays them out, so the images are
+// byte for byte what it would produce with the same keys.
+class NvsImage {
+  readonly image: Buffer;
+  private readonly usablePages: number;
+  private page = 0;
+  private entry = 0;
+  private namespaces = 0;
+
+  constructor(size: number, private readonly keys: Buffer) {
+    this.image = Buffer.alloc(size, 0xff);
+    // The last page is left erased for NVS to move entries into.
+    this.usablePages = size / PAGE_SIZE - 1;
+    this.startPage();
+  }
+
+  namespace(name: string) {
+    const entry = this.header(0, TYPE_U8, 1, name);
+    entry.writeUInt8(++this.namespaces, 24);
+    entry.writeUInt32LE(entryCrc(entry), 4);
+    if (this.entry >= MAX_ENTRIES) {
+      this.nextPage();
+    }
+    this.write(entry);
+    return this.namespaces;
+  }
+
+  string(namespace: number, key: string, value: Buffer) {
+    const data = Buffer.concat([value, Buffer.from([0])]);
+    if (data.length > MAX_STRING_SIZE) {
+      throw new Error(`${key}: ${data.length} bytes is more than the ${MAX_STRING_SIZE} byte limit`);
+    }
+    const dataEntries = Math.ceil(data.length / ENTRY_SIZE);
+    const entry = this.header(namespace, TYPE_STR, dataEntries + 1, key);
+    entry.writeUInt16LE(data.length, 24);
+    entry.writeUInt32LE(crc32(data), 28);
+    entry.writeUInt32LE(entryCrc(entry), 4);
+    // A string does not span pages.
+    if (this.entry + dataEntries + 1 >= MAX_ENTRIES) {
+      this.nextPage();
+    }
+    const padded = Buffer.alloc(dataEntries * ENTRY_SIZE, 0xff);
+    data.copy(padded);
+    this.write(Buffer.concat([entry, padded]));
+  }
+
+  // Marks every page as full, including the unused ones, like the generator.
+  finish() {
+    while (this.page + 1 < this.usablePages) {
+      this.nextPage();
+    }
+    this.pageBuffer().writeUInt32LE(PAGE_FULL, 0);
+    return this.image;
+  }
+
+  private pageBuffer() {
+    return this.image.subarray(this.page * PAGE_SIZE, (this.page + 1) * PAGE_SIZE);
+  }
+
+  private startPage() {
+    const page = this.pageBuffer();
+    page.writeUInt32LE(PAGE_ACTIVE, 0);
+    page.writeUInt32LE(this.page, 4);
+    page.writeUInt8(PAGE_VERSION2, 8);
+    page.writeUInt32LE(pageHeaderCrc(page), 28);
+    this.entry = 0;
+  }
+
+  private nextPage() {
+    this.pageBuffer().writeUInt32LE(PAGE_FULL, 0);
+    if (this.page + 1 >= this.usablePages) {
+      throw new Error("The data does not fit: increase --size");
+    }
+    this.page++;
+    this.startPage();
+  }
+
+  private header(namespace: number, type: number, span: number, key: string) {
+    if (key.length > 15) {
+      throw new Error(`${key}: keys are at most 15 characters`);
+    }
+    const entry = Buffer.alloc(ENTRY_SIZE, 0xff);
+    entry[0] = namespace;
+    entry[1] = type;
+    entry[2] = span;
+    entry[3] = CHUNK_ANY;
+    entry.fill(0, 8, 24);
+    entry.write(key, 8, "ascii");
+    return entry;
+  }
+
+  private write(entries: Buffer) {
+    const page = this.pageBuffer();
+    for (let i = 0; i < entries.length; i += ENTRY_SIZE) {
+      const position = FIRST_ENTRY_OFFSET + this.entry * ENTRY_SIZE;
+      const plain = entries.subarray(i, i + ENTRY_SIZE);
+      xts(true, this.keys, this.page * PAGE_SIZE + position, plain).copy(page, position);
+      // Two bits per entry: 0b11 empty, 0b10 written.
+      const bit = this.entry * 2;
+      page[BITMAP_OFFSET + (bit >> 3)] &= ~(1 << (bit & 7));
+      this.entry++;
+    }
+  }
+}
+
+// The nvs_key partition nvs_flash_read_security_cfg() accepts.
+const checkKeyPartition = (keyPartition: Buffer) => {
+  const eky = keyPartition.subarray(0, KEY_SIZE);
+  const tky = keyPartition.subarray(KEY_SIZE, 2 * KEY_SIZE);
+  if (keyPartition.length < 2 * KEY_SIZE + 4 || keyPartition.readUInt32LE(2 * KEY_SIZE) !== crc32(eky, tky)) {
+    throw new Error("nvs_key partition CRC mismatch");
+  }
+  return keyPartition;
+};
+
+// Reads an image back into namespace -> key -> value, checking every CRC.
+const decodeImage = (image: Buffer, keyPartition: Buffer) => {
+  const keys = checkKeyPartition(keyPartition).subarray(0, 2 * KEY_SIZE);
+  const namespaces = new Map<number, string>();
+  const strings = new Map<string, Buffer>();
+
+  for (let offset = 0; offset < image.length; offset += PAGE_SIZE) {
+    const page = image.subarray(offset, offset + PAGE_SIZE);
+    if (page.readUInt32LE(0) === 0xffffffff) {
+      continue;
+    }
+    if (page.readUInt32LE(28) !== pageHeaderCrc(page)) {
+      throw new Error(`Page at ${offset}: header CRC mismatch`);
+    }
+    const read = (index: number) => {
+      const position = FIRST_ENTRY_OFFSET + index * ENTRY_SIZE;
+      return xts(false, keys, offset + position, page.subarray(position, position + ENTRY_SIZE));
+    };
+    for (let index = 0; index < MAX_ENTRIES; index++) {
+      const bit = index * 2;
+      if (((page[BITMAP_OFFSET + (bit >> 3)] >> (bit & 7)) & 3) !== 0b10) {
+        continue;
+      }
+      const entry = read(index);
+      if (entry.readUInt32LE(4) !== entryCrc(entry)) {
+        throw new Error(`Page at ${offset}, entry ${index}: CRC mismatch`);
+      }
+      const key = entry.toString("ascii", 8, 24).replace(/\0.*$/s, "");
+      if (entry[1] === TYPE_U8 && entry[0] === 0) {
+        namespaces.set(entry[24], key);
+      } else if (entry[1] === TYPE_STR) {
+        const span = entry[2];
+        const data = Buffer.concat(Array.from({ length: span - 1 }, (_, i) => read(index + 1 + i)));
+        const value = data.subarray(0, entry.readUInt16LE(24));
+        if (entry.readUInt32LE(28) !== crc32(value)) {
+          throw new Error(`${key}: data CRC mismatch`);
+        }
+        strings.set(`${entry[0]}/${key}`, value.subarray(0, value.length - 1));
+        index += span - 1;
+      } else {
+        throw new Error(`${key}: unexpected entry type 0x${entry[1].toString(16)}`);
+      }
+    }
+  }
+  return { namespaces, strings };
+};
+
+const buildDevice = (
+  rows: TemplateRow[],
+  device: Device,
+  size: number,
+  keys: Buffer | undefined,
+  verify: boolean
+) => {
+  const keyPartition = keys ?? makeKeyPartition();
+  const nvs = new NvsImage(size, keyPartition.subarray(0, 2 * KEY_SIZE));
+  const expected: [string, string, Buffer][] = [];
+  let namespace = 0;
+  let namespaceName = "";
+  for (const row of rows) {
+    if (row.type === "namespace") {
+      namespace = nvs.namespace(row.key);
+      namespaceName = row.key;
+      continue;
+    }
+    const path = device.files[row.key] ?? row.path;
+    const value = path !== undefined ? readFileSync(path) : Buffer.from(row.value ?? "");
+    nvs.string(namespace, row.key, value);
+    expected.push([namespaceName, row.key, value]);
+  }
+  const image = nvs.finish();
+
+  if (verify) {
+    const decoded = decodeImage(image, keyPartition);
+    const indexes = new Map([...decoded.namespaces].map(([index, name]): [string, number] => [name, index]));
+    for (const [namespaceName, key, value] of expected) {
+      const stored = decoded.strings.get(`${indexes.get(namespaceName)}/${key}`);
+      if (!stored || !stored.equals(value)) {
+        throw new Error(`${device.device}: ${namespaceName}/${key} does not decode to its input`);
+      }
+    }
+    if (decoded.strings.size !== expected.length) {
+      throw new Error(`${device.device}: image holds ${decoded.strings.size} values, expected ${expected.length}`);
+    }
+  }
+  return { image, keyPartition };
+};
+
+const runWorker = () => {
+  const data = workerData as WorkerData;
+  const keys = data.keys !== undefined ? checkKeyPartition(readFileSync(data.keys)) : undefined;
+  let bytes = 0;
+  for (const device of data.devices) {
+    const { image, keyPartition } = buildDevice(data.rows, device, data.size, keys, data.verify);
+    const directory = join(data.out, device.device);
+    mkdirSync(join(directory, "keys"), { recursive: true });
+    writeFileSync(join(directory, "encrypted_nvs.bin"), image);
+    writeFileSync(join(directory, "keys", "nvs_keys.bin"), keyPartition);
+    bytes += image.length + keyPartition.length;
+  }
+  parentPort?.postMessage({ images: data.devices.length, bytes });
+};
+
+const readCsv = (path: string) =>
+  readFileSync(path, "utf8")
+    .split(/\r?\n/)
+    .map((line) => line.trim())
+    .filter((line) => line !== "" && !line.startsWith("#"))
+    .map((line) => line.split(",").map((cell) => cell.trim()));
+
+const readTemplate = (path: string): TemplateRow[] => {
+  const [header, ...lines] = readCsv(path);
+  if (header.join(",") !== "key,type,encoding,value") {
+    throw new Error(`${path}: expected the header key,type,encoding,value`);
+  }
+  return lines.map(([key, type, encoding, value]): TemplateRow => {
+    if (type === "namespace") {
+      return { type, key };
+    }
+    if ((type !== "file" && type !== "data") || encoding !== "string") {
+      throw new Error(`${path}: ${key}: only namespace rows and string file/data rows are supported`);
+    }
+    return type === "file"
+      ? { type: "string", key, path: resolve(dirname(resolve(path)), "..", value) }
+      : { type: "string", key, value };
+  });
+};
+
+const readManifest = (path: string, rows: TemplateRow[]): Device[] => {
+  const [header, ...lines] = readCsv(path);
+  if (header[0] !== "device") {
+    throw new Error(`${path}: the first column must be device`);
+  }
+  const keys = header.slice(1);
+  for (const key of keys) {
+    if (!rows.some((row) => row.type === "string" && row.key === key)) {
+      throw new Error(`${path}: ${key} is not a string entry of the template`);
+    }
+  }
+  const base = dirname(resolve(path));
+  return lines.map(([device, ...cells]): Device => {
+    if (!/^[\w.-]+$/.test(device) || device === "." || device === "..") {
+      throw new Error(`${path}: ${device} cannot be used as a directory name`);
+    }
+    const files: Record<string, string> = {};
+    keys.forEach((key, i) => {
+      if (cells[i]) {
+        files[key] = resolve(base, cells[i]);
+      }
+    });
+    return { device, files };
+  });
+};
+
+const startWorker = (data: WorkerData) =>
+  new Promise<{ images: number; bytes: number }>((resolvePromise, reject) => {
+    // Under ts-node, workers have to load this file through ts-node too.
+    const worker = __filename.endsWith(".ts")
+      ? new Worker(`require("ts-node/register/transpile-only"); require(${JSON.stringify(__filename)});`, {
+          eval: true,
+          workerData: data,
+        })
+      : new Worker(__filename, { workerData: data });
+    worker.once("message", resolvePromise);
+    worker.once("error", reject);
+  });
+
+const run = async (args: Args) => {
+  const rows = readTemplate(args.template);
+  const devices = readManifest(args.manifest, rows);
+  if (args.keys !== undefined) {
+    checkKeyPartition(readFileSync(args.keys));
+  }
+  const workers = Math.max(1, Math.min(args.workers, devices.length));
+  const started = performance.now();
+
+  const shares: Device[][] = Array.from({ length: workers }, () => []);
+  devices.forEach((device, i) => shares[i % workers].push(device));
+  const results = await Promise.all(
+    shares.map((share) =>
+      startWorker({ rows, devices: share, out: args.out, size: args.size, keys: args.keys, verify: args.verify })
+    )
+  );
+
+  const seconds = (performance.now() - started) / 1000;
+  const images = results.reduce((sum, result) => sum + result.images, 0);
+  const bytes = results.reduce((sum, result) => sum + result.bytes, 0);
+  console.log(
+    `${images} images${args.verify ? " (verified)" : ""} in ${seconds.toFixed(2)}s on ${workers} workers: ` +
+      `${(images / seconds).toFixed(1)} images/s, ${(bytes / seconds / 1e6).toFixed(1)} MB/s`
+  );
+};
+
+const main = async () => {
+  const options: ParseArgsConfig["options"] = {
+    template: { type: "string" },
+    manifest: { type: "string" },
+    out: { type: "string" },
+    size: { type: "string" },
+    workers: { type: "string" },
+    keys: { type: "string" },
+    verify: { type: "boolean" },
+  };
+
+  const argSchema = z.object({
+    template: z.string(),
+    manifest: z.string(),
+    out: z.string(),
+    // Same rules as nvs_partition_gen.py: whole pages, at least three.
+    size: z
+      .string()
+      .default("0x6000")
+      .transform((size) => Number(size))
+      .refine((size) => size % PAGE_SIZE === 0 && size >= 3 * PAGE_SIZE, "size must be a multiple of 4096, >= 0x3000"),
+    workers: z.coerce.number().int().positive().default(cpus().length),
+    keys: z.string().optional(),
+    verify: z.boolean().default(false),
+  });
+
+  const { values } = parseArgs({ options, args: process.argv.slice(2) });
+  const args = argSchema.parse({
+    ...values,
+  });
+
+  await run(args);
+};
+
+if (isMainThread) {
+  main().catch((err) => {
+    console.error(err);
+    process.exit(1);
+  });
+} else {
+  runWorker();
+}
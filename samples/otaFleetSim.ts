@@ -0,0 +1,450 @@
+/*
+example:
+
+yarn otaFleetSim \
+  --devices=2000 \
+  --serverConnections=200 \
+  --jitter=0
+
+Runs the device-updates job flow for --devices simulated devices in one process:
+each connects, asks for its next job, picks up notify-next pushes, subscribes to
+its job topic, reports IN_PROGRESS (and download progress), downloads the image
+from a local HTTP server and reports SUCCEEDED or FAILED, with the same retry
+rules as samples/device-updates/src/main.cpp.
+
+MQTT and the AWS IoT Jobs service are stood in for by an in-process broker with
+--brokerLatencyMs per hop. The firmware server is a real HTTP server on
+localhost that streams at --bandwidth bytes/s per download, supports Range
+requests and answers 503 beyond --serverConnections concurrent downloads.
+Failed executions are queued again up to --jobRetries times, like a job retry
+config, which is where retry storms come from.
+
+Compare runs with different --backoffMs/--maxBackoffMs/--jitter/--rolloutMs to
+see their effect on broker message rates, download concurrency and completion
+times.
+*/
+import { Agent, createServer, get, IncomingMessage } from "http";
+import { AddressInfo } from "net";
+import { parseArgs, ParseArgsConfig } from "util";
+import { z } from "zod";
+
+type Args = {
+  devices: number;
+  firmwareSize: number;
+  bandwidth: number;
+  serverConnections: number;
+  brokerLatencyMs: number;
+  connectSpreadMs: number;
+  rolloutMs: number;
+  maxRequests: number;
+  backoffMs: number;
+  maxBackoffMs: number;
+  jitter: number;
+  dropRate: number;
+  jobRetries: number;
+  progressIntervalMs: number;
+};
+
+type Execution = {
+  jobId: string;
+  status: "QUEUED" | "IN_PROGRESS" | "SUCCEEDED" | "FAILED";
+  queuedAt: number;
+  notifiedAt: number; // last time it was queued
+  attempts: number;
+  jobDocument: { firmwareUrl: string };
+};
+
+const SECTOR_SIZE = 4096;
+
+const now = () => performance.now();
+const sleep = (ms: number) => new Promise((resolve) => setTimeout(resolve, ms));
+
+const percentile = (sorted: number[], p: number) =>
+  sorted.length === 0 ? 0 : sorted[Math.min(sorted.length - 1, Math.floor((p / 100) * sorted.length))];
+
+const summary = (values: number[]) => {
+  const sorted = [...values].sort((a, b) => a - b);
+  const format = (ms: number) => `${(ms / 1000).toFixed(2)}s`;
+  return `p50=${format(percentile(sorted, 50))} p90=${format(percentile(sorted, 90))} p99=${format(
+    percentile(sorted, 99)
+  )} max=${format(sorted[sorted.length - 1] ?? 0)}`;
+};
+
+// Message counts per second and per kind, in both directions.
+class Traffic {
+  private started = now();
+  private perSecond = new Map<number, number>();
+  readonly byKind = new Map<string, number>();
+
+  count(kind: string) {
+    const second = Math.floor((now() - this.started) / 1000);
+    this.perSecond.set(second, (this.perSecond.get(second) ?? 0) + 1);
+    this.byKind.set(kind, (this.byKind.get(kind) ?? 0) + 1);
+  }
+
+  rates() {
+    const counts = [...this.perSecond.values()];
+    const total = counts.reduce((sum, n) => sum + n, 0);
+    const seconds = Math.max(1, (now() - this.started) / 1000);
+    return { total, mean: total / seconds, peak: Math.max(0, ...counts) };
+  }
+}
+
+// The MQTT broker and the Jobs service, as seen from the devices.
+class Broker {
+  readonly traffic = new Traffic();
+  readonly executions = new Map<string, Execution>();
+  readonly completions: number[] = [];
+  readonly finished = new Set<string>();
+  onAllFinished = () => {};
+
+  constructor(private args: Args, private devices: Map<string, Device>) {}
+
+  queueJob(thing: string, execution: Execution) {
+    this.executions.set(thing, execution);
+    this.deliver(thing, "notify-next", { execution });
+  }
+
+  // Resolves when the SUBACK is back.
+  async subscribe(thing: string) {
+    this.traffic.count("subscribe");
+    await sleep(2 * this.args.brokerLatencyMs);
+  }
+
+  publish(thing: string, kind: string, message: Record<string, unknown>) {
+    this.traffic.count(kind);
+    setTimeout(() => this.handle(thing, kind, message), this.args.brokerLatencyMs);
+  }
+
+  private handle(thing: string, kind: string, message: Record<string, unknown>) {
+    const execution = this.executions.get(thing);
+    if (kind === "describe") {
+      const pending = execution && (execution.status === "QUEUED" || execution.status === "IN_PROGRESS");
+      this.deliver(thing, "describe-accepted", pending ? { execution } : {});
+      return;
+    }
+    if (kind !== "update" && kind !== "progress") {
+      return;
+    }
+    if (!execution || execution.jobId !== message.jobId) {
+      this.deliver(thing, "update-rejected", {});
+      return;
+    }
+    execution.status = message.status as Execution["status"];
+    this.deliver(thing, "update-accepted", {});
+    if (execution.status === "SUCCEEDED") {
+      this.finish(thing, execution);
+    } else if (execution.status === "FAILED") {
+      if (execution.attempts <= this.args.jobRetries) {
+        // Job retry config: the execution is queued (and pushed) again.
+        execution.status = "QUEUED";
+        execution.notifiedAt = now();
+        execution.attempts++;
+        this.deliver(thing, "notify-next", { execution });
+      } else {
+        this.finish(thing, execution);
+      }
+    }
+  }
+
+  private finish(thing: string, execution: Execution) {
+    this.completions.push(now() - execution.queuedAt);
+    this.finished.add(thing);
+    if (this.finished.size === this.devices.size) {
+      this.onAllFinished();
+    }
+  }
+
+  private deliver(thing: string, kind: string, message: Record<string, unknown>) {
+    this.traffic.count(kind);
+    setTimeout(() => this.devices.get(thing)?.onMessage(kind, message), this.args.brokerLatencyMs);
+  }
+}
+
+// Streams the image at a fixed rate per download, and counts how many run at once.
+class FirmwareServer {
+  active = 0;
+  rejected = 0;
+  private samples: number[] = [];
+  private sampler?: NodeJS.Timeout;
+  private server = createServer((req, res) => {
+    if (this.active >= this.args.serverConnections) {
+      this.rejected++;
+      res.writeHead(503);
+      res.end();
+      return;
+    }
+    const size = this.firmware.length;
+    const range = /^bytes=(\d+)-$/.exec(req.headers.range ?? "");
+    let offset = range ? Number(range[1]) : 0;
+    if (offset >= size) {
+      res.writeHead(416);
+      res.end();
+      return;
+    }
+    const headers = { "Content-Length": size - offset, ETag: '"sim"' };
+    if (range) {
+      res.writeHead(206, { ...headers, "Content-Range": `bytes ${offset}-${size - 1}/${size}` });
+    } else {
+      res.writeHead(200, headers);
+    }
+
+    this.active++;
+    const chunk = 16 * 1024;
+    const timer = setInterval(() => {
+      const end = Math.min(offset + chunk, size);
+      res.write(this.firmware.subarray(offset, end));
+      offset = end;
+      if (offset >= size) {
+        clearInterval(timer);
+        res.end();
+      }
+    }, (chunk * 1000) / this.args.bandwidth);
+    res.on("close", () => {
+      clearInterval(timer);
+      this.active--;
+    });
+  });
+
+  constructor(private args: Args, private firmware: Buffer) {}
+
+  async listen(): Promise<string> {
+    this.server.listen(0, "127.0.0.1");
+    await new Promise((resolve) => this.server.once("listening", resolve));
+    this.sampler = setInterval(() => this.samples.push(this.active), 100);
+    return `http://127.0.0.1:${(this.server.address() as AddressInfo).port}/firmware.bin`;
+  }
+
+  close() {
+    clearInterval(this.sampler);
+    this.server.close();
+  }
+
+  concurrency() {
+    const mean = this.samples.reduce((sum, n) => sum + n, 0) / Math.max(1, this.samples.length);
+    return { mean, peak: Math.max(0, ...this.samples) };
+  }
+}
+
+type DownloadResult = "complete" | "interrupted" | "failed";
+
+// One device, following the UpdateState machine of the device-updates sample.
+class Device {
+  private busy = false;
+  requests = 0;
+  pickupDelays: number[] = [];
+
+  constructor(
+    private thing: string,
+    private args: Args,
+    private broker: Broker,
+    private agent: Agent
+  ) {}
+
+  connect() {
+    this.broker.publish(this.thing, "describe", {});
+  }
+
+  onMessage(kind: string, message: Record<string, unknown>) {
+    const execution = message.execution as Execution | undefined;
+    if ((kind === "notify-next" || kind === "describe-accepted") && execution && !this.busy) {
+      this.busy = true;
+      this.pickupDelays.push(now() - execution.notifiedAt);
+      this.runJob(execution.jobId, execution.jobDocument.firmwareUrl).finally(() => (this.busy = false));
+    }
+  }
+
+  private async runJob(jobId: string, url: string) {
+    await this.broker.subscribe(this.thing);
+    this.broker.publish(this.thing, "update", { jobId, status: "IN_PROGRESS" });
+    const succeeded = await this.downloadAndApply(jobId, url);
+    this.broker.publish(this.thing, "update", { jobId, status: succeeded ? "SUCCEEDED" : "FAILED" });
+  }
+
+  private async downloadAndApply(jobId: string, url: string): Promise<boolean> {
+    let written = 0;
+    for (let request = 1; request <= this.args.maxRequests; request++) {
+      const result = await this.download(jobId, url, written);
+      if (result.outcome === "complete") {
+        return true;
+      }
+      if (result.outcome === "failed") {
+        return false;
+      }
+      // Only whole sectors are kept.
+      written = result.received - (result.received % SECTOR_SIZE);
+      await sleep(this.backoff(request));
+    }
+    return false;
+  }
+
+  private backoff(request: number) {
+    const delay = Math.min(request * this.args.backoffMs, this.args.maxBackoffMs);
+    return delay * (1 - this.args.jitter * Math.random());
+  }
+
+  private download(
+    jobId: string,
+    url: string,
+    offset: number
+  ): Promise<{ outcome: DownloadResult; received: number }> {
+    this.requests++;
+    const headers: Record<string, string> = offset > 0 ? { Range: `bytes=${offset}-`, "If-Range": '"sim"' } : {};
+    const dropAt =
+      Math.random() < this.args.dropRate
+        ? offset + Math.floor(Math.random() * (this.args.firmwareSize - offset))
+        : Infinity;
+
+    return new Promise((resolve) => {
+      let received = offset;
+      let reportedAt = now();
+      let settled = false;
+      const settle = (outcome: DownloadResult) => {
+        if (!settled) {
+          settled = true;
+          resolve({ outcome, received });
+        }
+      };
+      const request = get(url, { agent: this.agent, headers }, (res: IncomingMessage) => {
+        // Same mapping as downloadFirmware(): 200/206 stream, 416 restarts,
+        // anything else fails the job.
+        if (res.statusCode === 416) {
+          res.resume();
+          received = 0;
+          return settle("interrupted");
+        }
+        if (res.statusCode !== 200 && res.statusCode !== 206) {
+          res.resume();
+          return settle("failed");
+        }
+        if (res.statusCode === 200) {
+          received = 0;
+        }
+        res.on("data", (data: Buffer) => {
+          received += data.length;
+          if (now() - reportedAt >= this.args.progressIntervalMs && this.args.progressIntervalMs > 0) {
+            reportedAt = now();
+            this.broker.publish(this.thing, "progress", { jobId, status: "IN_PROGRESS" });
+          }
+          if (received >= dropAt) {
+            request.destroy();
+          }
+        });
+        res.on("end", () => settle(received >= this.args.firmwareSize ? "complete" : "interrupted"));
+        res.on("close", () => settle(received >= this.args.firmwareSize ? "complete" : "interrupted"));
+      });
+      request.on("error", () => settle("interrupted"));
+    });
+  }
+}
+
+const run = async (args: Args) => {
+  const firmware = Buffer.alloc(args.firmwareSize, 0xa5);
+  const server = new FirmwareServer(args, firmware);
+  const firmwareUrl = await server.listen();
+  const agent = new Agent({ keepAlive: false, maxSockets: Infinity });
+
+  const devices = new Map<string, Device>();
+  const broker = new Broker(args, devices);
+  for (let i = 0; i < args.devices; i++) {
+    const thing = `sim-${i}`;
+    devices.set(thing, new Device(thing, args, broker, agent));
+  }
+  const done = new Promise<void>((resolve) => (broker.onAllFinished = resolve));
+
+  const started = now();
+  console.log(`Simulating ${args.devices} devices, ${args.firmwareSize} byte image, rollout over ${args.rolloutMs}ms`);
+  for (const [thing, device] of devices) {
+    setTimeout(() => device.connect(), Math.random() * args.connectSpreadMs);
+    setTimeout(
+      () =>
+        broker.queueJob(thing, {
+          jobId: "sim-job",
+          status: "QUEUED",
+          queuedAt: now(),
+          notifiedAt: now(),
+          attempts: 1,
+          jobDocument: { firmwareUrl },
+        }),
+      args.connectSpreadMs + Math.random() * args.rolloutMs
+    );
+  }
+  await done;
+  server.close();
+  const elapsed = now() - started;
+
+  const executions = [...broker.executions.values()];
+  const succeeded = executions.filter((e) => e.status === "SUCCEEDED").length;
+  const retried = executions.filter((e) => e.attempts > 1).length;
+  const requests = [...devices.values()].reduce((sum, d) => sum + d.requests, 0);
+  const pickups = [...devices.values()].flatMap((d) => d.pickupDelays);
+  const traffic = broker.traffic.rates();
+  const concurrency = server.concurrency();
+
+  console.log(`Finished in ${(elapsed / 1000).toFixed(1)}s`);
+  console.log(`Jobs: ${succeeded} succeeded, ${executions.length - succeeded} failed, ${retried} needed a job retry`);
+  console.log(`Completion time (queued -> final status): ${summary(broker.completions)}`);
+  console.log(`Pickup delay (queued -> device starts): ${summary(pickups)}`);
+  console.log(
+    `Broker: ${traffic.total} messages, ${traffic.mean.toFixed(1)}/s mean, ${traffic.peak}/s peak (${[
+      ...broker.traffic.byKind,
+    ]
+      .map(([kind, n]) => `${kind}=${n}`)
+      .join(" ")})`
+  );
+  console.log(
+    `Downloads: ${requests} requests, ${server.rejected} rejected with 503, concurrency ${concurrency.mean.toFixed(
+      1
+    )} mean / ${concurrency.peak} peak (limit ${args.serverConnections})`
+  );
+};
+
+const main = async () => {
+  const options: ParseArgsConfig["options"] = {
+    devices: { type: "string" },
+    firmwareSize: { type: "string" },
+    bandwidth: { type: "string" },
+    serverConnections: { type: "string" },
+    brokerLatencyMs: { type: "string" },
+    connectSpreadMs: { type: "string" },
+    rolloutMs: { type: "string" },
+    maxRequests: { type: "string" },
+    backoffMs: { type: "string" },
+    maxBackoffMs: { type: "string" },
+    jitter: { type: "string" },
+    dropRate: { type: "string" },
+    jobRetries: { type: "string" },
+    progressIntervalMs: { type: "string" },
+  };
+
+  // Defaults follow the device sample: OTA_MAX_REQUESTS, the 1s..10s backoff
+  // without jitter, JOB_PROGRESS_INTERVAL_MS.
+  const argSchema = z.object({
+    devices: z.coerce.number().int().min(1).default(500),
+    firmwareSize: z.coerce.number().int().min(1).default(256 * 1024),
+    bandwidth: z.coerce.number().min(1).default(128 * 1024),
+    serverConnections: z.coerce.number().int().min(1).default(100),
+    brokerLatencyMs: z.coerce.number().min(0).default(20),
+    connectSpreadMs: z.coerce.number().min(0).default(1000),
+    rolloutMs: z.coerce.number().min(0).default(0),
+    maxRequests: z.coerce.number().int().min(1).default(10),
+    backoffMs: z.coerce.number().min(0).default(1000),
+    maxBackoffMs: z.coerce.number().min(0).default(10000),
+    jitter: z.coerce.number().min(0).max(1).default(0),
+    dropRate: z.coerce.number().min(0).max(1).default(0.05),
+    jobRetries: z.coerce.number().int().min(0).default(2),
+    progressIntervalMs: z.coerce.number().min(0).default(5000),
+  });
+
+  const { values } = parseArgs({ options, args: process.argv.slice(2) });
+  const args = argSchema.parse({
+    ...values,
+  });
+
+  await run(args);
+};
+
+main().catch((err) => {
+  console.error(err);
+  process.exit(1);
+});